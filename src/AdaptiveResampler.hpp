@@ -0,0 +1,296 @@
+// SPDX-FileCopyrightText: 2021-2024 Filipe Coelho <falktx@falktx.com>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#pragma once
+
+#include "zita-resampler/vresampler.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+// --------------------------------------------------------------------------------------------------------------------
+
+/**
+   A VResampler that is bypassed while the ratio stays close enough to 1, for clock-locked devices and
+   the initial buffering phase where no drift correction is happening.
+
+   While bypassed, input is only delayed by the filter group delay, so that latency stays the same.
+   Switching between bypass and resampling is done with a short linear crossfade between both paths.
+   When engaging, the resampler is primed with recent input, so both paths are already aligned.
+   When disengaging, the bypass delay is taken from the resampler position and the ratio is set to exactly 1,
+   so both paths stay within a fraction of a frame of each other.
+
+   Hysteresis is used to prevent constant switching, resampling starts when the ratio deviates from 1
+   by more than epsilon, and stops when it comes back within half of that.
+
+   A nominal ratio other than 1 (for devices running at a different sample rate than the host) disables the bypass,
+   the ratio given in setRatio is then relative to the nominal one.
+ */
+class AdaptiveResampler
+{
+public:
+    AdaptiveResampler() noexcept
+        : channels(0),
+          maxFrames(0),
+          filterDelay(0),
+          delay(0),
+          epsilon(0.0),
+          nominalRatio(1.0),
+          ratio(1.0),
+          fadeFrames(0),
+          fadePos(0),
+          state(kStateBypass),
+          history(nullptr) {}
+
+    ~AdaptiveResampler()
+    {
+        clear();
+    }
+
+    // ratio is output sample rate divided by input sample rate
+    // maxInputFrames is the maximum amount of input frames per process call
+    // epsilon of 0 disables the bypass
+    bool setup(const double outputInputRatio,
+               const uint8_t numChannels,
+               const uint32_t hlen,
+               const uint32_t maxInputFrames,
+               const double bypassEpsilon,
+               const uint32_t crossfadeFrames)
+    {
+        clear();
+
+        if (! resampler.setup(outputInputRatio, numChannels, hlen))
+            return false;
+
+        channels = numChannels;
+        maxFrames = maxInputFrames;
+        filterDelay = resampler.inpsize() / 2;
+        epsilon = outputInputRatio == 1.0 ? bypassEpsilon : 0.0;
+        nominalRatio = outputInputRatio;
+        fadeFrames = crossfadeFrames != 0 ? crossfadeFrames : 1;
+
+        // last 2 * delay frames of input, followed by the current input
+        history = new float*[channels];
+        for (uint8_t c=0; c<channels; ++c)
+            history[c] = new float[filterDelay * 2 + maxFrames]();
+
+        reset();
+        return true;
+    }
+
+    void clear()
+    {
+        if (history != nullptr)
+        {
+            for (uint8_t c=0; c<channels; ++c)
+                delete[] history[c];
+            delete[] history;
+            history = nullptr;
+        }
+
+        resampler.clear();
+        channels = 0;
+    }
+
+    void reset()
+    {
+        for (uint8_t c=0; c<channels; ++c)
+            std::memset(history[c], 0, sizeof(float) * filterDelay * 2);
+
+        delay = filterDelay;
+        ratio = 1.0;
+        fadePos = 0;
+
+        if (epsilon != 0.0)
+        {
+            state = kStateBypass;
+        }
+        else
+        {
+            state = kStateResampling;
+            resampler.reset();
+            resampler.set_rratio(1.0);
+        }
+    }
+
+    void setRatio(const double r) noexcept
+    {
+        ratio = r;
+
+        if (state == kStateResampling || state == kStateEngaging)
+            resampler.set_rratio(r);
+    }
+
+    bool isBypassed() const noexcept
+    {
+        return state == kStateBypass;
+    }
+
+    // delay introduced by the filter, in input frames, the same for both paths (give or take 1 frame after switching)
+    uint32_t getLatency() const noexcept
+    {
+        return filterDelay;
+    }
+
+    // how much space outputs need in process, for a given amount of input frames
+    uint32_t getMaxOutputFrames(const uint32_t frames) const noexcept
+    {
+        return static_cast<uint32_t>(frames * nominalRatio + 1) * 2;
+    }
+
+    // frames must not be more than maxInputFrames given in setup
+    // returns the amount of frames written into outputs, which must have space for getMaxOutputFrames(frames)
+    uint32_t process(float* const* const inputs, const uint32_t frames, float** const outputs)
+    {
+        const uint32_t histSize = filterDelay * 2;
+
+        for (uint8_t c=0; c<channels; ++c)
+            std::memcpy(history[c] + histSize, inputs[c], sizeof(float) * frames);
+
+        const double deviation = std::abs(ratio - 1.0);
+
+        switch (state)
+        {
+        case kStateBypass:
+            if (deviation > epsilon)
+                engage();
+            break;
+        case kStateResampling:
+            if (epsilon != 0.0 && deviation <= epsilon * 0.5)
+                disengage();
+            break;
+        case kStateEngaging:
+        case kStateDisengaging:
+            break;
+        }
+
+        uint32_t done;
+
+        if (state == kStateBypass)
+        {
+            for (uint8_t c=0; c<channels; ++c)
+                std::memcpy(outputs[c], history[c] + histSize - delay, sizeof(float) * frames);
+
+            done = frames;
+        }
+        else
+        {
+            const uint32_t maxOutput = getMaxOutputFrames(frames);
+
+            resampler.inp_count = frames;
+            resampler.out_count = maxOutput;
+            resampler.inp_data = inputs;
+            resampler.out_data = outputs;
+            resampler.process();
+
+            done = maxOutput - resampler.out_count;
+
+            if (state != kStateResampling)
+                crossfade(outputs, frames, done);
+        }
+
+        for (uint8_t c=0; c<channels; ++c)
+            std::memmove(history[c], history[c] + frames, sizeof(float) * histSize);
+
+        return done;
+    }
+
+private:
+    enum State {
+        kStateBypass,
+        kStateEngaging,
+        kStateResampling,
+        kStateDisengaging,
+    };
+
+    VResampler resampler;
+
+    uint8_t channels;
+    uint32_t maxFrames;
+    uint32_t filterDelay;
+    uint32_t delay;
+    double epsilon;
+    double nominalRatio;
+    double ratio;
+    uint32_t fadeFrames;
+    uint32_t fadePos;
+    State state;
+
+    float** history;
+
+    void engage()
+    {
+        // feed the resampler with the last 2 * filterDelay frames, so its next output matches the bypass path
+        // if the bypass delay drifted away from filterDelay, both paths are still continuous, just offset by a frame
+        float dummy[256];
+        float* dummies[256];
+        for (uint8_t c=0; c<channels; ++c)
+            dummies[c] = dummy + c;
+
+        resampler.reset();
+        resampler.set_rratio(1.0);
+        resampler.inp_count = filterDelay * 2;
+        resampler.out_count = 1;
+        resampler.inp_data = history;
+        resampler.out_data = dummies;
+        resampler.process();
+
+        resampler.set_rratio(ratio);
+        state = kStateEngaging;
+        fadePos = 0;
+    }
+
+    void disengage()
+    {
+        const long dist = std::lrint(resampler.inpdist());
+        delay = dist < 1 ? 1 : dist > filterDelay * 2 ? filterDelay * 2 : dist;
+
+        resampler.set_rratio(1.0);
+        state = kStateDisengaging;
+        fadePos = 0;
+    }
+
+    // mix the bypass path into the resampler output
+    // the resampler can output 1 frame more or less than its input, the bypass delay follows that to stay continuous
+    void crossfade(float** const outputs, const uint32_t inputFrames, const uint32_t outputFrames)
+    {
+        const bool engaging = state == kStateEngaging;
+        const float step = 1.f / fadeFrames;
+        const uint32_t offset = filterDelay * 2 - delay;
+        uint32_t i = 0;
+
+        for (; i < outputFrames && fadePos < fadeFrames; ++i, ++fadePos)
+        {
+            const float wet = engaging ? fadePos * step : 1.f - fadePos * step;
+
+            for (uint8_t c=0; c<channels; ++c)
+                outputs[c][i] = outputs[c][i] * wet + history[c][offset + i] * (1.f - wet);
+        }
+
+        if (fadePos >= fadeFrames && ! engaging)
+        {
+            for (; i < outputFrames; ++i)
+                for (uint8_t c=0; c<channels; ++c)
+                    outputs[c][i] = history[c][offset + i];
+        }
+
+        const int64_t newDelay = static_cast<int64_t>(delay) + inputFrames - outputFrames;
+        delay = newDelay < 1 ? 1 : newDelay > filterDelay * 2 ? filterDelay * 2 : newDelay;
+
+        if (fadePos < fadeFrames)
+            return;
+
+        if (engaging)
+        {
+            delay = filterDelay;
+            state = kStateResampling;
+        }
+        else
+        {
+            state = kStateBypass;
+        }
+    }
+};
+
+// --------------------------------------------------------------------------------------------------------------------
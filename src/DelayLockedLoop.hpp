@@ -0,0 +1,108 @@
+// SPDX-FileCopyrightText: 2021-2024 Filipe Coelho <falktx@falktx.com>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+
+// --------------------------------------------------------------------------------------------------------------------
+
+/**
+   A 2nd order delay-locked loop, filtering noisy (time, frame position) pairs into a smooth time-per-frame estimate.
+   Based on "Using a DLL to filter time" by Fons Adriaensen.
+
+   Positions do not need to advance by a fixed amount between updates, the loop gains are calculated from the time
+   elapsed on each update. A wide bandwidth is used right after reset for quick locking,
+   halving every kBandwidthHalvingTime seconds until reaching kLockedBandwidth.
+ */
+class DelayLockedLoop
+{
+public:
+    // loop bandwidth in Hz while locking and after
+    static constexpr const double kLockingBandwidth = 5.0;
+    static constexpr const double kLockedBandwidth = 0.1;
+    static constexpr const double kBandwidthHalvingTime = 0.2;
+
+    // how many seconds until the estimate is considered usable
+    static constexpr const double kLockTime = 0.5;
+
+    // timing errors above this many seconds are considered a discontinuity, resetting the loop
+    static constexpr const double kMaxError = 0.01;
+
+    void setup(const double sampleRate) noexcept
+    {
+        nominalFrameTime = 1.0 / sampleRate;
+        reset();
+    }
+
+    void reset() noexcept
+    {
+        frameTime = nominalFrameTime;
+        elapsed = 0.0;
+        valid = false;
+    }
+
+    // restart from a new time and position on the next update, keeping the current frame time estimate
+    void resync() noexcept
+    {
+        valid = false;
+    }
+
+    void update(const double time, const int64_t position) noexcept
+    {
+        if (! valid)
+        {
+            lastTime = time;
+            lastPosition = position;
+            valid = true;
+            return;
+        }
+
+        const double frames = static_cast<double>(position - lastPosition);
+
+        if (frames <= 0.0)
+            return;
+
+        const double predicted = lastTime + frames * frameTime;
+        const double error = time - predicted;
+
+        if (std::abs(error) > kMaxError)
+        {
+            reset();
+            update(time, position);
+            return;
+        }
+
+        const double step = frames * frameTime;
+        const double bandwidth = std::fmax(kLockedBandwidth,
+                                           kLockingBandwidth * std::pow(0.5, elapsed / kBandwidthHalvingTime));
+        const double omega = std::fmin(0.5, 2.0 * M_PI * bandwidth * step);
+
+        lastTime = predicted + M_SQRT2 * omega * error;
+        lastPosition = position;
+        frameTime += omega * omega * error / frames;
+        elapsed += step;
+    }
+
+    bool isLocked() const noexcept
+    {
+        return elapsed >= kLockTime;
+    }
+
+    // estimated duration of a single frame, in seconds
+    double getFrameTime() const noexcept
+    {
+        return frameTime;
+    }
+
+private:
+    double nominalFrameTime = 0.0;
+    double frameTime = 0.0;
+    double lastTime = 0.0;
+    double elapsed = 0.0;
+    int64_t lastPosition = 0;
+    bool valid = false;
+};
+
+// --------------------------------------------------------------------------------------------------------------------
@@ -19,11 +19,17 @@
 
 // #include "../DistrhoUtils.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <cstdarg>
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
 
 #include <sys/mman.h>
 
+#include "audio-log.hpp"
+
 /* Define unlikely */
 #ifdef __GNUC__
 # define unlikely(x) __builtin_expect(x,0)
@@ -46,17 +52,20 @@
 
 /**
    Print a string to stderr with newline (red color).
+   Goes through the real-time safe logger, as assertions can trigger from audio threads.
  */
 static inline
 void d_stderr2(const char* const fmt, ...) noexcept
 {
+    static AudioLogRateLimit limit;
+
     try {
         va_list args;
         va_start(args, fmt);
-        std::fprintf(stderr, "\x1b[31m");
-        std::vfprintf(stderr, fmt, args);
-        std::fprintf(stderr, "\x1b[0m\n");
+        char msg[AUDIO_BRIDGE_LOG_MESSAGE_SIZE];
+        std::vsnprintf(msg, sizeof(msg), fmt, args);
         va_end(args);
+        audioLogRateLimited(limit, kAudioLogError, "%s", msg);
     } catch (...) {}
 }
 
@@ -109,6 +118,15 @@ uint32_t d_nextPowerOf2(uint32_t size) noexcept
 // --------------------------------------------------------------------------------------------------------------------
 // AudioRingBuffer class
 
+/**
+   Single-producer, single-consumer audio ring buffer.
+
+   One thread calls write(), another calls read().
+   The write position (head) is only modified by the producer and the read position (tail) only by the consumer,
+   published with release semantics so the other side sees the audio data before the new position.
+   Emptying the buffer is requested with flush() and done by the consumer in applyFlush(), keeping that rule.
+   Both positions are kept on separate cache lines to avoid false sharing between the 2 threads.
+ */
 class AudioRingBuffer
 {
 public:
@@ -143,8 +161,10 @@ public:
 
         buffer.samples = p2samples;
         buffer.channels = numChannels;
-        buffer.head = buffer.tail = 0;
-        errorReading = errorWriting = false;
+        producer.head.store(0, std::memory_order_relaxed);
+        consumer.tail.store(0, std::memory_order_relaxed);
+        producer.error = consumer.error = false;
+        flushRequested.store(false, std::memory_order_relaxed);
 
         ::mlock(buffer.buf, sizeof(float*) * numChannels);
 
@@ -164,8 +184,10 @@ public:
         delete[] buffer.buf;
         buffer.buf  = nullptr;
 
-        buffer.samples = buffer.head = buffer.tail = 0;
+        buffer.samples = 0;
         buffer.channels = 0;
+        producer.head.store(0, std::memory_order_relaxed);
+        consumer.tail.store(0, std::memory_order_relaxed);
     }
 
     // ----------------------------------------------------------------------------------------------------------------
@@ -177,47 +199,74 @@ public:
 
     uint32_t getNumReadableSamples() const noexcept
     {
-        const uint32_t wrap = buffer.head >= buffer.tail ? 0 : buffer.samples;
+        const uint32_t head = producer.head.load(std::memory_order_acquire);
+        const uint32_t tail = consumer.tail.load(std::memory_order_acquire);
+        const uint32_t wrap = head >= tail ? 0 : buffer.samples;
 
-        return wrap + buffer.head - buffer.tail;
+        return wrap + head - tail;
     }
 
     uint32_t getNumWritableSamples() const noexcept
     {
-        const uint32_t wrap = buffer.tail > buffer.head ? 0 : buffer.samples;
+        const uint32_t head = producer.head.load(std::memory_order_acquire);
+        const uint32_t tail = consumer.tail.load(std::memory_order_acquire);
+        const uint32_t wrap = tail > head ? 0 : buffer.samples;
 
-        return wrap + buffer.tail - buffer.head - 1;
+        return wrap + tail - head - 1;
     }
 
     // ----------------------------------------------------------------------------------------------------------------
 
     /*
-     * Reset the ring buffer read and write positions, marking the buffer as empty.
-     * Requires a buffer struct tied to this class.
+     * Request the ring buffer to be emptied, can be called from either side.
+     * Only takes effect once the consumer calls applyFlush(), everything written until then is discarded.
      */
     void flush() noexcept
     {
-        buffer.head = buffer.tail = 0;
-        errorWriting = false;
+        flushRequested.store(true, std::memory_order_release);
+    }
+
+    /*
+     * Check if a flush was requested but not yet applied by the consumer.
+     * While true the readable sample count still includes data that is about to be discarded.
+     */
+    bool isFlushPending() const noexcept
+    {
+        return flushRequested.load(std::memory_order_acquire);
+    }
+
+    /*
+     * Empty the ring buffer if a flush was requested, by moving the read position up to the write one.
+     * Must only be called from the consumer side, returns true if the buffer was flushed.
+     */
+    bool applyFlush() noexcept
+    {
+        if (! flushRequested.load(std::memory_order_acquire) || ! flushRequested.exchange(false, std::memory_order_acq_rel))
+            return false;
+
+        consumer.tail.store(producer.head.load(std::memory_order_acquire), std::memory_order_release);
+        consumer.error = false;
+        return true;
     }
 
     // ----------------------------------------------------------------------------------------------------------------
 
     bool read(float* const* const buffers, const uint32_t samples) noexcept
     {
+        const uint32_t head = producer.head.load(std::memory_order_acquire);
+        const uint32_t tail = consumer.tail.load(std::memory_order_relaxed);
+
         // empty
-        if (buffer.head == buffer.tail)
+        if (head == tail)
             return false;
 
-        const uint32_t head = buffer.head;
-        const uint32_t tail = buffer.tail;
         const uint32_t wrap = head > tail ? 0 : buffer.samples;
 
         if (samples > wrap + head - tail)
         {
-            if (! errorReading)
+            if (! consumer.error)
             {
-                errorReading = true;
+                consumer.error = true;
                 d_stderr2("RingBuffer::tryRead(%p, %u): failed, not enough space", buffers, samples);
             }
             return false;
@@ -254,8 +303,8 @@ public:
                 readto = 0;
         }
 
-        buffer.tail = readto;
-        errorReading = false;
+        consumer.tail.store(readto, std::memory_order_release);
+        consumer.error = false;
         return true;
     }
 
@@ -265,15 +314,15 @@ public:
     {
         DISTRHO_SAFE_ASSERT_UINT2_RETURN(samples < buffer.samples, samples, buffer.samples, false);
 
-        const uint32_t head = buffer.head;
-        const uint32_t tail = buffer.tail;
+        const uint32_t head = producer.head.load(std::memory_order_relaxed);
+        const uint32_t tail = consumer.tail.load(std::memory_order_acquire);
         const uint32_t wrap = tail > head ? 0 : buffer.samples;
 
         if (samples >= wrap + tail - head)
         {
-            if (! errorWriting)
+            if (! producer.error)
             {
-                errorWriting = true;
+                producer.error = true;
                 d_stderr2("RingBuffer::tryWrite(%p, %u): failed, not enough space", buffers, samples);
             }
             return false;
@@ -310,28 +359,90 @@ public:
                 writeto = 0;
         }
 
-        buffer.head = writeto;
-        errorWriting = false;
+        producer.head.store(writeto, std::memory_order_release);
+        producer.error = false;
+        return true;
+    }
+
+    // ----------------------------------------------------------------------------------------------------------------
+
+    /*
+     * Discard samples from the read side, as if they were read.
+     * Must only be called from the consumer side.
+     */
+    bool skip(const uint32_t samples) noexcept
+    {
+        const uint32_t head = producer.head.load(std::memory_order_acquire);
+        const uint32_t tail = consumer.tail.load(std::memory_order_relaxed);
+        const uint32_t wrap = head >= tail ? 0 : buffer.samples;
+
+        if (samples > wrap + head - tail)
+            return false;
+
+        consumer.tail.store((tail + samples) & (buffer.samples - 1), std::memory_order_release);
+        return true;
+    }
+
+    /*
+     * Write silence, as if zeroed buffers were written.
+     * Must only be called from the producer side.
+     */
+    bool writeSilence(const uint32_t samples) noexcept
+    {
+        const uint32_t head = producer.head.load(std::memory_order_relaxed);
+        const uint32_t tail = consumer.tail.load(std::memory_order_acquire);
+        const uint32_t wrap = tail > head ? 0 : buffer.samples;
+
+        if (samples >= wrap + tail - head)
+            return false;
+
+        const uint32_t firstpart = std::min(samples, buffer.samples - head);
+
+        for (uint8_t c=0; c<buffer.channels; ++c)
+        {
+            std::memset(buffer.buf[c] + head, 0, firstpart * sizeof(float));
+            std::memset(buffer.buf[c], 0, (samples - firstpart) * sizeof(float));
+        }
+
+        producer.head.store((head + samples) & (buffer.samples - 1), std::memory_order_release);
         return true;
     }
 
     // ----------------------------------------------------------------------------------------------------------------
 
 private:
-    /** Buffer struct. */
+    static constexpr const size_t kCacheLineSize = 64;
+
+    /** Buffer struct, only modified while creating or deleting the buffer. */
     struct Buffer {
         uint32_t samples;
-        uint32_t head;
-        uint32_t tail;
         uint8_t channels;
         float** buf;
-    } buffer = { 0, 0, 0, 0, nullptr };
+    } buffer = { 0, 0, nullptr };
+
+    // explicit padding instead of alignas, as C++11 does not guarantee over-aligned heap allocations
+    char pad1[kCacheLineSize];
+
+    /** Producer side, write position and whether write errors have been printed to terminal. */
+    struct {
+        std::atomic<uint32_t> head;
+        bool error;
+    } producer = { {0}, false };
+
+    char pad2[kCacheLineSize];
+
+    /** Consumer side, read position and whether read errors have been printed to terminal. */
+    struct {
+        std::atomic<uint32_t> tail;
+        bool error;
+    } consumer = { {0}, false };
+
+    char pad3[kCacheLineSize];
 
-    /** Whether read errors have been printed to terminal. */
-    bool errorReading = false;
+    /** Pending flush() request, set by either side and cleared by the consumer. */
+    std::atomic<bool> flushRequested = {false};
 
-    /** Whether write errors have been printed to terminal. */
-    bool errorWriting = false;
+    char pad4[kCacheLineSize];
 
 private:
     AudioRingBuffer(AudioRingBuffer&) = delete;
@@ -0,0 +1,180 @@
+// SPDX-FileCopyrightText: 2021-2024 Filipe Coelho <falktx@falktx.com>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <unistd.h>
+
+// --------------------------------------------------------------------------------------------------------------------
+
+/**
+   A small pool of real-time worker threads, for splitting a block of work across CPU cores.
+
+   Each call to run executes a function once per index, index 0 on the calling thread and the others on the workers,
+   returning only after all of them are done, so it acts as a barrier per block.
+   Workers block on a semaphore between blocks, waking them up does not allocate or take locks.
+
+   Workers use SCHED_FIFO with the given priority when allowed to, falling back to regular scheduling otherwise,
+   and are pinned to CPUs 1, 2, 3 and so on (wrapping around), leaving CPU 0 for the calling thread if possible.
+ */
+class WorkerPool
+{
+public:
+    typedef void (*Function)(void* arg, uint32_t index);
+
+    WorkerPool() noexcept
+        : workers(nullptr),
+          numWorkers(0),
+          running(false),
+          func(nullptr),
+          arg(nullptr) {}
+
+    ~WorkerPool()
+    {
+        stop();
+    }
+
+    bool start(const uint32_t count, const int priority)
+    {
+        stop();
+
+        if (count == 0 || sem_init(&done, 0, 0) != 0)
+            return false;
+
+        const long numCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+
+        workers = new Worker[count];
+        running.store(true, std::memory_order_release);
+
+        for (; numWorkers < count; ++numWorkers)
+        {
+            Worker& worker(workers[numWorkers]);
+            worker.pool = this;
+            worker.index = numWorkers + 1;
+
+            if (sem_init(&worker.sem, 0, 0) != 0)
+                break;
+
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+            pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
+            pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+            sched_param sched = {};
+            sched.sched_priority = priority;
+            pthread_attr_setschedparam(&attr, &sched);
+
+            if (numCPUs > 1)
+            {
+                cpu_set_t cpuset;
+                CPU_ZERO(&cpuset);
+                CPU_SET(worker.index % numCPUs, &cpuset);
+                pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+            }
+
+            if (pthread_create(&worker.thread, &attr, threadRun, &worker) != 0)
+            {
+                pthread_attr_destroy(&attr);
+                pthread_attr_init(&attr);
+                if (pthread_create(&worker.thread, &attr, threadRun, &worker) != 0)
+                {
+                    pthread_attr_destroy(&attr);
+                    sem_destroy(&worker.sem);
+                    break;
+                }
+            }
+            pthread_attr_destroy(&attr);
+        }
+
+        if (numWorkers == count)
+            return true;
+
+        stop();
+        return false;
+    }
+
+    void stop()
+    {
+        if (workers == nullptr)
+            return;
+
+        running.store(false, std::memory_order_release);
+
+        for (uint32_t i = 0; i < numWorkers; ++i)
+        {
+            sem_post(&workers[i].sem);
+            pthread_join(workers[i].thread, nullptr);
+            sem_destroy(&workers[i].sem);
+        }
+
+        sem_destroy(&done);
+
+        delete[] workers;
+        workers = nullptr;
+        numWorkers = 0;
+    }
+
+    // how many indexes run will call the function with, including the one on the calling thread
+    uint32_t getNumThreads() const noexcept
+    {
+        return numWorkers + 1;
+    }
+
+    void run(const Function f, void* const a)
+    {
+        // sem_post and sem_wait synchronize memory, workers see these and the caller sees their results
+        func = f;
+        arg = a;
+
+        for (uint32_t i = 0; i < numWorkers; ++i)
+            sem_post(&workers[i].sem);
+
+        f(a, 0);
+
+        for (uint32_t i = 0; i < numWorkers; ++i)
+            while (sem_wait(&done) != 0) {}
+    }
+
+private:
+    struct Worker {
+        WorkerPool* pool;
+        pthread_t thread;
+        sem_t sem;
+        uint32_t index;
+    };
+
+    Worker* workers;
+    uint32_t numWorkers;
+    std::atomic<bool> running;
+    sem_t done;
+
+    Function func;
+    void* arg;
+
+    static void* threadRun(void* const ptr)
+    {
+        Worker* const worker = static_cast<Worker*>(ptr);
+        WorkerPool* const pool = worker->pool;
+
+        for (;;)
+        {
+            if (sem_wait(&worker->sem) != 0)
+                continue;
+
+            if (! pool->running.load(std::memory_order_acquire))
+                break;
+
+            pool->func(pool->arg, worker->index);
+            sem_post(&pool->done);
+        }
+
+        return nullptr;
+    }
+};
+
+// --------------------------------------------------------------------------------------------------------------------
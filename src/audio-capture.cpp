@@ -6,208 +6,299 @@
 
 #include <algorithm>
 
-static void* deviceCaptureThread(void* const  arg)
+// read from the device mmap area, converting directly into dev->buffers.f32 (or discarding if convert is null)
+// gain and xrun fade are applied during conversion, unless volume is null
+static snd_pcm_sframes_t deviceReadMmap(DeviceAudio* const dev,
+                                        const simd::Int2FloatFunc convert,
+                                        DeviceGain* const volume,
+                                        float** const ptrs,
+                                        const uint32_t maxFrames)
 {
-    DeviceAudio* const dev = static_cast<DeviceAudio*>(arg);
+    snd_pcm_sframes_t err;
+
+    // mmap access does not auto-start the stream
+    // in full-duplex mode playback starts both once it has queued enough silence, starting here would underrun it
+    if (dev->duplex == nullptr && dev->backend->state() == SND_PCM_STATE_PREPARED && (err = dev->backend->start()) < 0)
+        return err;
+
+    if ((err = dev->backend->availUpdate()) <= 0)
+        return err == 0 ? -EAGAIN : err;
 
-    const uint8_t hints = dev->hints;
     const uint8_t channels = dev->hwstatus.channels;
-    const uint16_t bufferSize = dev->bufferSize;
+    const snd_pcm_uframes_t total = std::min<snd_pcm_uframes_t>(err, maxFrames);
+    snd_pcm_uframes_t done = 0;
 
-    float** buffers = new float*[channels];
-    for (uint8_t c=0; c<channels; ++c)
-        buffers[c] = new float[bufferSize * 2 * AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MULT];
+    // the mmap area can wrap around, needing 2 iterations
+    while (done < total)
+    {
+        const snd_pcm_channel_area_t* areas;
+        snd_pcm_uframes_t offset;
+        snd_pcm_uframes_t frames = total - done;
 
-    simd::init();
+        if ((err = dev->backend->mmapBegin(&areas, &offset, &frames)) < 0)
+            return err;
 
-    // smooth initial volume to prevent clicks on start
-    ExponentialValueSmoother gain;
-    gain.setSampleRate(dev->sampleRate);
-    gain.setTimeConstant(0.5f);
+        if (convert != nullptr)
+        {
+            const float* const gains = volume != nullptr ? volume->process(frames) : nullptr;
 
-    VResampler* const resampler = new VResampler;
-    resampler->setup(1.0, channels, 8);
+            for (uint8_t c=0; c<channels; ++c)
+                ptrs[c] = dev->buffers.f32[c] + done;
+
+            if (dev->hints & kDeviceNonInterleaved)
+            {
+                // each channel is contiguous, float can be copied as-is when there is no gain to apply
+                for (uint8_t c=0; c<channels; ++c)
+                {
+                    if ((dev->hints & kDeviceSampleFloat) != 0 && gains == nullptr)
+                        std::memcpy(ptrs[c], getDeviceMmapPointer(areas[c], offset), sizeof(float) * frames);
+                    else
+                        convert(ptrs + c, getDeviceMmapPointer(areas[c], offset), gains, 1, frames);
+                }
+            }
+            else
+            {
+                convert(ptrs, getDeviceMmapPointer(areas[0], offset), gains, channels, frames);
+            }
+        }
+
+        if ((err = dev->backend->mmapCommit(offset, frames)) < 0)
+            return err;
+
+        if (static_cast<snd_pcm_uframes_t>(err) != frames)
+            return -EPIPE;
+
+        done += frames;
+    }
+
+    return done;
+}
+
+// capture side of a device thread, reading from the device and writing into the ringbuffer
+// process never blocks, it returns what to wait for instead, so that a single thread can also serve playback
+struct DeviceCapture {
+    DeviceAudio* const dev;
+    const uint8_t channels;
+    const uint32_t periodSize;
+    const simd::Int2FloatFunc convert;
+
+    // resampler output, in host frames
+    float** const buffers;
+    float** const ptrs;
+
+    // gain and xrun fade, applied during conversion before resampling
+    DeviceGain volume;
+
+    DelayLockedLoop dll;
+    int64_t transferred = 0;
 
-    snd_pcm_sframes_t err;
-    float xgain;
     double rbRatio = 0.0;
     bool enabled = true;
+    bool resyncing = false;
+    struct timespec xrunTime = {};
+
+    // incremented on every xrun recovery, so the other side can follow in full-duplex mode
+    uint32_t numResyncs = 0;
+
+    // resampler output not written into the ringbuffer yet
+    uint32_t pending = 0;
+
+    explicit DeviceCapture(DeviceAudio* const d)
+        : dev(d),
+          channels(d->hwstatus.channels),
+          periodSize(d->hwstatus.periodSize),
+          convert(d->convert.capture),
+          buffers(new float*[channels]),
+          ptrs(new float*[channels]),
+          volume(d->hwstatus.sampleRate, periodSize * AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MULT)
+    {
+        const uint32_t bufferFrames = dev->resamplers[0].getMaxOutputFrames(periodSize * AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MULT);
+
+        for (uint8_t c=0; c<channels; ++c)
+            buffers[c] = new float[bufferFrames];
+
+        dll.setup(dev->hwstatus.sampleRate);
+    }
+
+    ~DeviceCapture()
+    {
+        for (uint8_t c=0; c<channels; ++c)
+            delete[] buffers[c];
+        delete[] buffers;
+        delete[] ptrs;
+    }
 
-    auto restart = [&dev, &resampler, &gain, &enabled]()
+    void restart()
     {
         deviceFailInitHints(dev);
-        gain.setTargetValue(0.f);
-        gain.clearToTargetValue();
+        resyncing = false;
+        pending = 0;
+        volume.gain.setTargetValue(0.f);
+        volume.gain.clearToTargetValue();
         if (enabled)
-            gain.setTargetValue(1.f);
-    };
+            volume.gain.setTargetValue(1.f);
+    }
 
-    // wait for audio thread to post
+    // lightweight xrun recovery, keeping ringbuffer, resampler and clock-drift state
+    void resync()
     {
-        struct timespec ts;
-        clock_gettime(CLOCK_REALTIME, &ts);
-        ts.tv_sec += 15;
+        clock_gettime(CLOCK_MONOTONIC, &xrunTime);
+        resyncing = true;
+        ++numResyncs;
+        pending = 0;
 
-        if (sem_timedwait(&dev->sem, &ts) != 0)
-        {
-            printf("%08u | capture | audio thread failed to post\n", dev->frame);
-            goto end;
-        }
+        dll.resync();
+        transferred = 0;
+
+        // data captured during the xrun is lost, fill with silence to keep the same latency
+        const uint32_t target = getDeviceRingBufferTarget(dev);
+        const uint32_t readable = dev->ringbuffer->getNumReadableSamples();
+
+        if (readable < target)
+            dev->ringbuffer->writeSilence(std::min(target - readable, dev->ringbuffer->getNumWritableSamples()));
+
+        volume.fade.setTargetValue(0.f);
+        volume.fade.clearToTargetValue();
+        volume.fade.setTargetValue(1.f);
     }
 
-    while (dev->hwstatus.channels != 0)
+    DeviceWait process()
     {
         const uint32_t frame = dev->frame;
+        snd_pcm_sframes_t err;
 
-        if (dev->hints & kDeviceInitializing)
+        if (pending == 0)
         {
-            // read until alsa buffers are empty
-            bool started = false;
-            while ((err = snd_pcm_mmap_readi(dev->pcm, dev->buffers.raw, bufferSize * 2)) > 0)
-                started = true;
-
-            if (err == -EPIPE)
-            {
-                snd_pcm_prepare(dev->pcm);
-                // printf("%08u | capture | initial pipe error: %s\n", frame, snd_strerror(err));
-                // started = false;
-            }
-            else if (err != -EAGAIN)
+            if (dev->hints & kDeviceInitializing)
             {
-                printf("%08u | capture | initial read error: %s\n", frame, snd_strerror(err));
-                goto end;
-            }
+                // discard until alsa buffers are empty
+                bool started = false;
+                while ((err = deviceReadMmap(dev, nullptr, nullptr, ptrs, periodSize * 2)) > 0)
+                    started = true;
+
+                if (err == -EPIPE)
+                {
+                    dev->backend->prepare();
+                    // printf("%08u | capture | initial pipe error: %s\n", frame, snd_strerror(err));
+                    // started = false;
+                }
+                else if (err != -EAGAIN)
+                {
+                    AUDIO_LOG(kAudioLogError, "%08u | capture | initial read error: %s", frame, snd_strerror(err));
+                    return kDeviceWaitStop;
+                }
+
+                if (! started)
+                    return kDeviceWaitDevice;
 
-            if (started)
-            {
                 DEBUGPRINT("%08u | capture | can read data? removing kDeviceInitializing", frame);
                 restart();
                 dev->hints &= ~kDeviceInitializing;
             }
-            else
+
+            if (dev->hints & kDeviceStarting)
             {
-                deviceTimedWait(dev);
-                continue;
+                // check if device is running and has data to read
+                err = dev->backend->availUpdate();
+
+                switch (err)
+                {
+                case 0:
+                    return kDeviceWaitDevice;
+                case -EPIPE:
+                    DEBUGPRINT("%08u | capture | EPIPE while kDeviceStarting", frame);
+                    dev->backend->prepare();
+                    if (dev->duplex == nullptr)
+                        dev->backend->start();
+                    return kDeviceWaitDevice;
+                default:
+                    if (err < 0)
+                    {
+                        AUDIO_LOG(kAudioLogError, "%08u | capture | initial read error: %s", frame, snd_strerror(err));
+                        return kDeviceWaitStop;
+                    }
+                    DEBUGPRINT("%08u | capture | can read data, removing kDeviceStarting", frame);
+                    dev->hints &= ~kDeviceStarting;
+                    deviceResetClock(dev, dll);
+                    transferred = 0;
+                    break;
+                }
             }
-        }
-
-        if (dev->hints & kDeviceStarting)
-        {
-            // try reading a single sample to see if device is running
-            err = snd_pcm_mmap_readi(dev->pcm, dev->buffers.raw, 1);
 
-            switch (err)
+            if (enabled != dev->enabled)
             {
-            case 1:
-                DEBUGPRINT("%08u | capture | can read data, removing kDeviceStarting", frame);
-                dev->hints &= ~kDeviceStarting;
-                snd_pcm_rewind(dev->pcm, 1);
-                break;
-            case -EAGAIN:
-                deviceTimedWait(dev);
-                continue;
-            case -EPIPE:
-                DEBUGPRINT("%08u | capture | EPIPE while kDeviceStarting", frame);
-                snd_pcm_prepare(dev->pcm);
-                deviceTimedWait(dev);
-                continue;
-            default:
-                printf("%08u | capture | initial read error: %s\n", frame, snd_strerror(err));
-                goto end;
+                enabled = dev->enabled;
+                volume.gain.setTargetValue(enabled ? 1.f : 0.f);
             }
-        }
 
-        err = snd_pcm_mmap_readi(dev->pcm, dev->buffers.raw, bufferSize * AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MULT);
+            err = deviceReadMmap(dev, convert, &volume, ptrs, periodSize * AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MULT);
 
-        if (dev->hwstatus.channels == 0)
-            break;
+            if (dev->hwstatus.channels == 0)
+                return kDeviceWaitStop;
 
-        switch (err)
-        {
-        case -EPIPE:
-            snd_pcm_prepare(dev->pcm);
-            // fall-through
-        case -EAGAIN:
-            deviceTimedWait(dev);
-            continue;
-        case 0:
-            // deviceTimedWait(dev);
-            continue;
-        }
+            switch (err)
+            {
+            case -EPIPE:
+            case -ESTRPIPE:
+                DEBUGPRINT("%08u | capture | xrun, resyncing", frame);
+                err = xrun_recovery(dev->backend, err);
 
-        if (err < 0)
-        {
-            restart();
+                // still suspended, try again after a while
+                if (err == -EAGAIN)
+                    return kDeviceWaitHost;
 
-            /*
-            for (uint8_t c=0; c<channels; ++c)
-                dev->ringbuffer->clearData();
-            */
+                // stream could not be prepared again, start over
+                if (err < 0)
+                    restart();
+                else
+                    resync();
 
-            DEBUGPRINT("%08u | capture | Read error %s", frame, snd_strerror(err));
+                return kDeviceWaitNone;
+            case -EAGAIN:
+                return kDeviceWaitDevice;
+            case 0:
+                return kDeviceWaitNone;
+            }
 
-            // TODO offline recovery
-            if (xrun_recovery(dev->pcm, err) < 0)
+            if (err < 0)
             {
-                printf("%08u | capture | xrun_recovery error: %s\n", frame, snd_strerror(err));
-                goto end;
-            }
+                restart();
 
-            continue;
-        }
+                /*
+                for (uint8_t c=0; c<channels; ++c)
+                    dev->ringbuffer->clearData();
+                */
 
-        switch (hints & kDeviceSampleHints)
-        {
-        case kDeviceSample16:
-            int2float::s16(dev->buffers.f32, dev->buffers.raw, channels, err);
-            break;
-        case kDeviceSample24:
-            int2float::s24(dev->buffers.f32, dev->buffers.raw, channels, err);
-            break;
-        case kDeviceSample24LE3:
-            int2float::s24le3(dev->buffers.f32, dev->buffers.raw, channels, err);
-            break;
-        case kDeviceSample32:
-            int2float::s32(dev->buffers.f32, dev->buffers.raw, channels, err);
-            break;
-        }
+                DEBUGPRINT("%08u | capture | Read error %s", frame, snd_strerror(err));
 
-        if (enabled != dev->enabled)
-        {
-            enabled = dev->enabled;
-            gain.setTargetValue(enabled ? 1.f : 0.f);
-        }
+                // TODO offline recovery
+                if (xrun_recovery(dev->backend, err) < 0)
+                {
+                    AUDIO_LOG(kAudioLogError, "%08u | capture | xrun_recovery error: %s", frame, snd_strerror(err));
+                    return kDeviceWaitStop;
+                }
 
-        if (rbRatio != dev->rbRatio)
-        {
-            rbRatio = dev->rbRatio;
-            resampler->set_rratio(rbRatio);
-        }
+                return kDeviceWaitNone;
+            }
 
-        resampler->inp_count = err;
-        resampler->out_count = bufferSize * 2 * AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MULT;
-        resampler->inp_data = dev->buffers.f32;
-        resampler->out_data = buffers;
-        resampler->process();
+            transferred += err;
+            deviceUpdateClock(dev, dll, transferred);
 
-        uint32_t frames = bufferSize * 2 * AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MULT - resampler->out_count;
+            if (rbRatio != dev->rbRatio)
+            {
+                rbRatio = dev->rbRatio;
+                deviceSetResamplerRatio(dev, rbRatio);
+            }
 
-        for (uint16_t i=0; i<frames; ++i)
-        {
-            xgain = gain.next();
-            for (uint8_t c=0; c<channels; ++c)
-                buffers[c][i] *= xgain;
+            pending = deviceProcessChannels(dev, dev->buffers.f32, err, buffers);
         }
 
-        while (dev->hwstatus.channels != 0 && frames != 0)
+        while (dev->hwstatus.channels != 0 && pending != 0)
         {
-            const uint32_t rbavail = std::min<uint32_t>(frames, dev->ringbuffer->getNumWritableSamples());
+            const uint32_t rbavail = std::min<uint32_t>(pending, dev->ringbuffer->getNumWritableSamples());
 
             if (rbavail == 0)
-            {
-                deviceTimedWait(dev);
-                continue;
-            }
+                return kDeviceWaitHost;
 
             while (!dev->ringbuffer->write(buffers, rbavail))
             {
@@ -215,73 +306,109 @@ static void* deviceCaptureThread(void* const  arg)
                 sched_yield();
             }
 
+            if (resyncing)
+            {
+                resyncing = false;
+                deviceXrunRecovered(dev, xrunTime);
+            }
+
+            // data written before a pending flush will be discarded by the host, it does not count as buffered
             if ((dev->hints & kDeviceBuffering) != 0
-                && dev->ringbuffer->getNumReadableSamples() > bufferSize * AUDIO_BRIDGE_CAPTURE_LATENCY_BLOCKS)
+                && ! dev->ringbuffer->isFlushPending()
+                && dev->ringbuffer->getNumReadableSamples() > getDeviceRingBufferTarget(dev))
             {
                 DEBUGPRINT("%08u | capture | wrote enough data, removing kDeviceBuffering", frame);
                 dev->hints &= ~kDeviceBuffering;
             }
 
-            if (rbavail != frames)
+            if (rbavail != pending)
             {
-                DEBUGPRINT("%08u | capture | Incomplete write %u of %u", frame, rbavail, frames);
-
-                frames -= rbavail;
-
-                deviceTimedWait(dev);
-                continue;
+                DEBUGPRINT("%08u | capture | Incomplete write %u of %u", frame, rbavail, pending);
+                pending -= rbavail;
+                return kDeviceWaitHost;
             }
 
-            break;
+            pending = 0;
         }
+
+        return kDeviceWaitNone;
     }
+};
 
-end:
-    DEBUGPRINT("%08u | capture | audio thread closed", dev->frame);
+static void* deviceCaptureThread(void* const  arg)
+{
+    DeviceAudio* const dev = static_cast<DeviceAudio*>(arg);
+
+    simd::init();
+
+    {
+        DeviceCapture capture(dev);
 
-    delete resampler;
+        // wait for audio thread to post
+        if (deviceWaitForNotify(dev, 15000))
+        {
+            while (dev->hwstatus.channels != 0 && deviceWait(dev, capture.process())) {}
+        }
+        else
+        {
+            AUDIO_LOG(kAudioLogError, "%08u | capture | audio thread failed to post", dev->frame);
+        }
+    }
 
-    for (uint8_t c=0; c<channels; ++c)
-        delete[] buffers[c];
-    delete[] buffers;
+    DEBUGPRINT("%08u | capture | audio thread closed", dev->frame);
 
     dev->thread = 0;
     return nullptr;
 }
 
 static inline
-void clearCaptureBuffers(DeviceAudio* const dev, float* buffers[])
+void clearCaptureBuffers(DeviceAudio* const dev, float* buffers[], const uint16_t frames)
 {
-    const uint16_t bufferSize = dev->bufferSize;
-
     for (uint8_t c=0; c < dev->hwstatus.channels; ++c)
-        std::memset(buffers[c], 0, sizeof(float) * bufferSize);
+        std::memset(buffers[c], 0, sizeof(float) * frames);
 }
 
-static void runDeviceAudioCapture(DeviceAudio* const dev, float* buffers[], const uint32_t frame)
+static void runDeviceAudioCapture(DeviceAudio* const dev, float* buffers[], const uint16_t frames, const uint32_t frame)
 {
-    const uint16_t bufferSize = dev->bufferSize;
+    // capture thread waits on the device, only needs to know when the audio thread is running
+    if (dev->hints & kDeviceStarting)
+        deviceNotify(dev);
 
-    sem_post(&dev->sem);
+    // ringbuffer reset requested by either side, see deviceFailInitHints
+    dev->ringbuffer->applyFlush();
 
     if (dev->hints & kDeviceBuffering)
     {
-        clearCaptureBuffers(dev, buffers);
+        clearCaptureBuffers(dev, buffers, frames);
         dev->framesDone = 0;
         dev->rbRatio = 1.0;
         return;
     }
 
-    if (dev->ringbuffer->getNumReadableSamples() < bufferSize)
+    // adaptive latency target was raised, wait until there is enough data for it
+    if (dev->latency.refilling)
+    {
+        if (dev->ringbuffer->getNumReadableSamples() < getDeviceRingBufferTarget(dev) + frames)
+        {
+            clearCaptureBuffers(dev, buffers, frames);
+            return;
+        }
+
+        dev->latency.refilling = false;
+    }
+
+    if (dev->ringbuffer->getNumReadableSamples() < frames)
     {
         DEBUGPRINT("%08u | capture | buffer empty, adding kDeviceInitializing|kDeviceStarting|kDeviceBuffering", frame);
-        clearCaptureBuffers(dev, buffers);
+        clearCaptureBuffers(dev, buffers, frames);
+        deviceResetLatency(dev);
         deviceFailInitHints(dev);
         return;
     }
 
-    DISTRHO_SAFE_ASSERT_RETURN(dev->ringbuffer->read(buffers, bufferSize), clearCaptureBuffers(dev, buffers));
+    DISTRHO_SAFE_ASSERT_RETURN(dev->ringbuffer->read(buffers, frames), clearCaptureBuffers(dev, buffers, frames));
 
-    dev->framesDone += bufferSize;
-    setDeviceTimings(dev);
+    dev->framesDone += frames;
+    deviceUpdateLatency(dev, frames);
+    setDeviceTimings(dev, frames);
 }
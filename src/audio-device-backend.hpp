@@ -0,0 +1,143 @@
+// SPDX-FileCopyrightText: 2021-2024 Filipe Coelho <falktx@falktx.com>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#pragma once
+
+#include <alsa/asoundlib.h>
+#include <cerrno>
+#include <poll.h>
+
+#include "audio-device-discovery.hpp"
+
+// --------------------------------------------------------------------------------------------------------------------
+
+/**
+   Device I/O as used by the device threads, mirroring the subset of the ALSA PCM API we need.
+   Return values follow ALSA conventions, negative error codes on failure.
+
+   The regular implementation is AlsaDeviceBackend, a thin wrapper around a configured snd_pcm_t.
+   Other implementations (like a simulated soundcard) can be passed to initDeviceAudio for testing.
+ */
+class DeviceBackend
+{
+public:
+    virtual ~DeviceBackend() {}
+
+    virtual snd_pcm_state_t state() = 0;
+    virtual int prepare() = 0;
+    virtual int resume() = 0;
+    virtual int start() = 0;
+
+    virtual snd_pcm_sframes_t availUpdate() = 0;
+    virtual int htimestamp(snd_pcm_uframes_t* avail, snd_htimestamp_t* tstamp) = 0;
+
+    virtual int mmapBegin(const snd_pcm_channel_area_t** areas, snd_pcm_uframes_t* offset, snd_pcm_uframes_t* frames) = 0;
+    virtual snd_pcm_sframes_t mmapCommit(snd_pcm_uframes_t offset, snd_pcm_uframes_t frames) = 0;
+
+    virtual int pollDescriptorsCount() = 0;
+    virtual int pollDescriptors(struct pollfd* pfds, unsigned int space) = 0;
+    virtual int pollDescriptorsRevents(struct pollfd* pfds, unsigned int nfds, unsigned short* revents) = 0;
+
+    // wait on descriptors, the 1st one is the device eventfd and the rest come from pollDescriptors
+    virtual int poll(struct pollfd* pfds, unsigned int nfds, int timeout) = 0;
+
+    // link with another stream of the same implementation, so they start, stop and prepare together
+    virtual int link(DeviceBackend* other) = 0;
+};
+
+// --------------------------------------------------------------------------------------------------------------------
+
+class AlsaDeviceBackend : public DeviceBackend
+{
+    snd_pcm_t* const pcm;
+
+    // audio went through the device, closing it afterwards counts as a soundcard change for others waiting on it
+    bool streamed = false;
+
+public:
+    explicit AlsaDeviceBackend(snd_pcm_t* const handle) noexcept
+        : pcm(handle) {}
+
+    ~AlsaDeviceBackend() override
+    {
+        if (streamed)
+            snd_pcm_close(pcm);
+        else
+            closeSoundcardPcm(pcm);
+    }
+
+    snd_pcm_state_t state() override
+    {
+        return snd_pcm_state(pcm);
+    }
+
+    int prepare() override
+    {
+        return snd_pcm_prepare(pcm);
+    }
+
+    int resume() override
+    {
+        return snd_pcm_resume(pcm);
+    }
+
+    int start() override
+    {
+        return snd_pcm_start(pcm);
+    }
+
+    snd_pcm_sframes_t availUpdate() override
+    {
+        return snd_pcm_avail_update(pcm);
+    }
+
+    int htimestamp(snd_pcm_uframes_t* const avail, snd_htimestamp_t* const tstamp) override
+    {
+        return snd_pcm_htimestamp(pcm, avail, tstamp);
+    }
+
+    int mmapBegin(const snd_pcm_channel_area_t** const areas,
+                  snd_pcm_uframes_t* const offset,
+                  snd_pcm_uframes_t* const frames) override
+    {
+        return snd_pcm_mmap_begin(pcm, areas, offset, frames);
+    }
+
+    snd_pcm_sframes_t mmapCommit(const snd_pcm_uframes_t offset, const snd_pcm_uframes_t frames) override
+    {
+        const snd_pcm_sframes_t err = snd_pcm_mmap_commit(pcm, offset, frames);
+
+        if (err > 0)
+            streamed = true;
+
+        return err;
+    }
+
+    int pollDescriptorsCount() override
+    {
+        return snd_pcm_poll_descriptors_count(pcm);
+    }
+
+    int pollDescriptors(struct pollfd* const pfds, const unsigned int space) override
+    {
+        return snd_pcm_poll_descriptors(pcm, pfds, space);
+    }
+
+    int pollDescriptorsRevents(struct pollfd* const pfds, const unsigned int nfds, unsigned short* const revents) override
+    {
+        return snd_pcm_poll_descriptors_revents(pcm, pfds, nfds, revents);
+    }
+
+    int poll(struct pollfd* const pfds, const unsigned int nfds, const int timeout) override
+    {
+        return ::poll(pfds, nfds, timeout);
+    }
+
+    int link(DeviceBackend* const other) override
+    {
+        AlsaDeviceBackend* const alsa = dynamic_cast<AlsaDeviceBackend*>(other);
+        return alsa != nullptr ? snd_pcm_link(pcm, alsa->pcm) : -EINVAL;
+    }
+};
+
+// --------------------------------------------------------------------------------------------------------------------
@@ -2,12 +2,15 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later
 
 #include "audio-device-discovery.hpp"
+#include "audio-device-hotplug.hpp"
 
 //#define ALSA_PCM_NEW_HW_PARAMS_API
 //#define ALSA_PCM_NEW_SW_PARAMS_API
 #include <alsa/asoundlib.h>
+#include <algorithm>
 #include <map>
 #include <cstring>
+#include <pthread.h>
 
 #define DEBUGPRINT(...) printf(__VA_ARGS__); puts("");
 
@@ -23,94 +26,184 @@ static int nextPowerOfTwo(int size) noexcept
     return ++size;
 }
 
-static bool fillDeviceProperties(snd_pcm_t* const pcm,
-                                 const bool isOutput,
-                                 const unsigned sampleRate,
-                                 DeviceProperties& props)
+// rates to check besides the one given for probing
+static constexpr const unsigned kCommonRates[] = { 22050, 32000, 44100, 48000, 88200, 96000, 176400, 192000 };
+
+static uint64_t getFormatMask(const snd_pcm_format_mask_t* const formatMask)
+{
+    uint64_t formats = 0;
+
+    for (int format = 0; format <= SND_PCM_FORMAT_LAST; ++format)
+    {
+        if (snd_pcm_format_mask_test(formatMask, static_cast<snd_pcm_format_t>(format)))
+            formats |= UINT64_C(1) << format;
+    }
+
+    return formats;
+}
+
+bool getDeviceCapabilities(snd_pcm_t* const pcm,
+                           const snd_pcm_hw_params_t* const constraints,
+                           const unsigned sampleRate,
+                           DeviceCapabilities& caps)
 {
+    caps = DeviceCapabilities();
+
     snd_pcm_hw_params_t* params;
     snd_pcm_hw_params_alloca(&params);
+    snd_pcm_hw_params_copy(params, constraints);
+
+    // access and formats come from the refined masks, no need to ask the driver for each one
+    snd_pcm_access_mask_t* accessMask;
+    snd_pcm_access_mask_alloca(&accessMask);
 
-    if (snd_pcm_hw_params_any(pcm, params) >= 0)
+    if (snd_pcm_hw_params_get_access_mask(params, accessMask) == 0)
     {
-        if (snd_pcm_hw_params_test_rate(pcm, params, sampleRate, 0) != 0)
+        for (int access = 0; access <= SND_PCM_ACCESS_LAST; ++access)
         {
-            DEBUGPRINT("snd_pcm_hw_params_test_rate fail");
-            return false;
+            if (snd_pcm_access_mask_test(accessMask, static_cast<snd_pcm_access_t>(access)))
+                caps.access |= 1u << access;
         }
+    }
 
-        int dir = 0;
-        snd_pcm_uframes_t minSize = 0, maxSize = 0;
-        snd_pcm_hw_params_get_period_size_min(params, &minSize, &dir);
-        snd_pcm_hw_params_get_period_size_max(params, &maxSize, &dir);
-
-        minSize = std::max(nextPowerOfTwo(minSize), 32);
-        maxSize = std::min(maxSize, 8192LU);
+    snd_pcm_format_mask_t* formatMask;
+    snd_pcm_format_mask_alloca(&formatMask);
+    snd_pcm_hw_params_get_format_mask(params, formatMask);
 
-        std::vector<unsigned> bufsizes;
-        std::map<unsigned,bool> used;
+    caps.formats = getFormatMask(formatMask);
 
-        for (snd_pcm_uframes_t s = minSize; s <= maxSize; s = nextPowerOfTwo(s+1))
-        {
-            if (snd_pcm_hw_params_test_period_size(pcm, params, minSize, dir) == 0)
-            {
-                if (used.count(s) == 0)
-                {
-                    used[s] = true;
-                    bufsizes.push_back(s);
-                }
-            }
+    // refine a copy with each mmap access mode, formats can depend on it
+    snd_pcm_hw_params_t* accessParams;
+    snd_pcm_hw_params_alloca(&accessParams);
 
-            // do not go above 4096
-            if (s == 4096)
-                break;
-        }
+    if (caps.access & (1u << SND_PCM_ACCESS_MMAP_INTERLEAVED))
+    {
+        snd_pcm_hw_params_copy(accessParams, params);
 
-        if (bufsizes.empty())
+        if (snd_pcm_hw_params_set_access(pcm, accessParams, SND_PCM_ACCESS_MMAP_INTERLEAVED) == 0)
         {
-            DEBUGPRINT("bufsizes.empty() fail");
-            return false;
+            snd_pcm_hw_params_get_format_mask(accessParams, formatMask);
+            caps.interleavedFormats = getFormatMask(formatMask);
         }
+    }
 
-        if (props.bufsizes.empty())
-        {
-            DEBUGPRINT("props.bufsizes assign");
-            props.bufsizes = bufsizes;
-        }
-        // FIXME
-        else if (props.bufsizes != bufsizes)
+    if (caps.access & (1u << SND_PCM_ACCESS_MMAP_NONINTERLEAVED))
+    {
+        snd_pcm_hw_params_copy(accessParams, params);
+
+        if (snd_pcm_hw_params_set_access(pcm, accessParams, SND_PCM_ACCESS_MMAP_NONINTERLEAVED) == 0)
         {
-            DEBUGPRINT("props.bufsizes != bufsizes fail | %u %u", props.bufsizes[0], bufsizes[0]);
-            return false;
+            snd_pcm_hw_params_get_format_mask(accessParams, formatMask);
+            caps.nonInterleavedFormats = getFormatMask(formatMask);
         }
+    }
 
-        unsigned maxChans, minChans;
-        snd_pcm_hw_params_get_channels_max(params, &maxChans);
-        snd_pcm_hw_params_get_channels_min(params, &minChans);
+    int dir = 0;
+    snd_pcm_hw_params_get_channels_min(params, &caps.minChans);
+    snd_pcm_hw_params_get_channels_max(params, &caps.maxChans);
+    snd_pcm_hw_params_get_rate_min(params, &caps.minRate, &dir);
+    snd_pcm_hw_params_get_rate_max(params, &caps.maxRate, &dir);
+    snd_pcm_hw_params_get_periods_min(params, &caps.minPeriods, &dir);
+    snd_pcm_hw_params_get_periods_max(params, &caps.maxPeriods, &dir);
 
-        // put some sane limits
-        maxChans = std::min(maxChans, 32U);
-        minChans = std::min(minChans, maxChans);
+    for (const unsigned rate : kCommonRates)
+    {
+        if (rate >= caps.minRate && rate <= caps.maxRate && snd_pcm_hw_params_test_rate(pcm, params, rate, 0) == 0)
+            caps.rates.push_back(rate);
+    }
 
-        if (isOutput)
-        {
-            props.minChansOut = minChans;
-            props.maxChansOut = maxChans;
-        }
-        else
-        {
-            props.minChansIn = minChans;
-            props.maxChansIn = maxChans;
-        }
+    if (sampleRate != 0
+        && std::find(caps.rates.begin(), caps.rates.end(), sampleRate) == caps.rates.end()
+        && snd_pcm_hw_params_test_rate(pcm, params, sampleRate, 0) == 0)
+    {
+        caps.rates.insert(std::upper_bound(caps.rates.begin(), caps.rates.end(), sampleRate), sampleRate);
+    }
 
-        return true;
+    // period sizes depend on the rate
+    if (sampleRate != 0)
+        snd_pcm_hw_params_set_rate(pcm, params, sampleRate, 0);
+
+    snd_pcm_uframes_t minSize = 0, maxSize = 0;
+    snd_pcm_hw_params_get_period_size_min(params, &minSize, &dir);
+    snd_pcm_hw_params_get_period_size_max(params, &maxSize, &dir);
+    caps.minPeriodSize = minSize;
+    caps.maxPeriodSize = maxSize;
+
+    // do not go above 4096
+    minSize = std::max(nextPowerOfTwo(minSize), 32);
+    maxSize = std::min(maxSize, 4096LU);
+
+    for (snd_pcm_uframes_t s = minSize; s <= maxSize; s *= 2)
+    {
+        if (snd_pcm_hw_params_test_period_size(pcm, params, s, 0) == 0)
+            caps.periodSizes.push_back(s);
     }
-    else
+
+    return caps.access != 0 && caps.formats != 0 && caps.maxChans != 0;
+}
+
+static bool fillDeviceProperties(snd_pcm_t* const pcm,
+                                 const bool isOutput,
+                                 const unsigned sampleRate,
+                                 DeviceProperties& props)
+{
+    snd_pcm_hw_params_t* params;
+    snd_pcm_hw_params_alloca(&params);
+
+    if (snd_pcm_hw_params_any(pcm, params) < 0)
     {
         DEBUGPRINT("snd_pcm_hw_params_any fail");
+        return false;
     }
 
-    return false;
+    DeviceCapabilities& caps(isOutput ? props.playback : props.capture);
+
+    if (! getDeviceCapabilities(pcm, params, sampleRate, caps))
+    {
+        DEBUGPRINT("getDeviceCapabilities fail");
+        return false;
+    }
+
+    if (std::find(caps.rates.begin(), caps.rates.end(), sampleRate) == caps.rates.end())
+    {
+        DEBUGPRINT("snd_pcm_hw_params_test_rate fail");
+        return false;
+    }
+
+    if (caps.periodSizes.empty())
+    {
+        DEBUGPRINT("bufsizes.empty() fail");
+        return false;
+    }
+
+    if (props.bufsizes.empty())
+    {
+        DEBUGPRINT("props.bufsizes assign");
+        props.bufsizes = caps.periodSizes;
+    }
+    // FIXME
+    else if (props.bufsizes != caps.periodSizes)
+    {
+        DEBUGPRINT("props.bufsizes != bufsizes fail | %u %u", props.bufsizes[0], caps.periodSizes[0]);
+        return false;
+    }
+
+    // put some sane limits
+    const unsigned maxChans = std::min(caps.maxChans, 32U);
+    const unsigned minChans = std::min(caps.minChans, maxChans);
+
+    if (isOutput)
+    {
+        props.minChansOut = minChans;
+        props.maxChansOut = maxChans;
+    }
+    else
+    {
+        props.minChansIn = minChans;
+        props.maxChansIn = maxChans;
+    }
+
+    return true;
 }
 
 static bool isdigit(const char* const s)
@@ -129,134 +222,212 @@ static bool isdigit(const char* const s)
     return false;
 }
 
-bool enumerateSoundcards(std::vector<DeviceID>& inputs, std::vector<DeviceID>& outputs)
+// probe a single card, appending its PCM devices
+static void probeSoundcard(const int card, std::vector<DeviceID>& inputs, std::vector<DeviceID>& outputs)
 {
     snd_ctl_t* ctl = nullptr;
     snd_ctl_card_info_t* cardinfo = nullptr;
     snd_ctl_card_info_alloca(&cardinfo);
 
-    int card = -1;
     char hwcard[32] = {};
     char reserve[32] = {};
 
-    while (inputs.size() + outputs.size() <= 64)
+    std::snprintf(hwcard, sizeof(hwcard) - 1, "hw:%i", card);
+
+    if (snd_ctl_open(&ctl, hwcard, SND_CTL_NONBLOCK) < 0)
+        return;
+
+    if (snd_ctl_card_info(ctl, cardinfo) >= 0)
     {
-        if (snd_card_next(&card) != 0 || card < 0)
-            break;
+        const char* cardId = snd_ctl_card_info_get_id(cardinfo);
+        const char* cardName = snd_ctl_card_info_get_name(cardinfo);
 
-        std::snprintf(hwcard, sizeof(hwcard) - 1, "hw:%i", card);
+       #ifdef __MOD_DEVICES__
+        if (cardName != nullptr && *cardName != '\0')
+        {
+            if (std::strcmp(cardName, "MOD DUO") == 0)
+                goto skip;
+            if (std::strcmp(cardName, "MOD DUOX") == 0)
+                goto skip;
+            if (std::strcmp(cardName, "MOD DWARF") == 0)
+                goto skip;
+            if (std::strcmp(cardName, "USB Gadget") == 0)
+                goto skip;
+            if (std::strcmp(cardName, "UAC2_Gadget") == 0)
+                goto skip;
+        }
+       #endif
 
-        if (snd_ctl_open(&ctl, hwcard, SND_CTL_NONBLOCK) < 0)
-            continue;
+        if (cardId == nullptr || isdigit(cardId))
+        {
+            std::snprintf(reserve, sizeof(reserve) - 1, "%i", card);
+            cardId = reserve;
+        }
+
+        if (cardName == nullptr || *cardName == '\0')
+            cardName = cardId;
 
-        if (snd_ctl_card_info(ctl, cardinfo) >= 0)
+        int device = -1;
+
+        snd_pcm_info_t* pcminfo;
+        snd_pcm_info_alloca(&pcminfo);
+
+        for (;;)
         {
-            const char* cardId = snd_ctl_card_info_get_id(cardinfo);
-            const char* cardName = snd_ctl_card_info_get_name(cardinfo);
+            if (snd_ctl_pcm_next_device(ctl, &device) < 0 || device < 0)
+                break;
 
-           #ifdef __MOD_DEVICES__
-            if (cardName != nullptr && *cardName != '\0')
-            {
-                if (std::strcmp(cardName, "MOD DUO") == 0)
-                    goto skip;
-                if (std::strcmp(cardName, "MOD DUOX") == 0)
-                    goto skip;
-                if (std::strcmp(cardName, "MOD DWARF") == 0)
-                    goto skip;
-                if (std::strcmp(cardName, "USB Gadget") == 0)
-                    goto skip;
-                if (std::strcmp(cardName, "UAC2_Gadget") == 0)
-                    goto skip;
-            }
-           #endif
+            snd_pcm_info_set_device(pcminfo, device);
 
-            if (cardId == nullptr || isdigit(cardId))
+            for (int subDevice = 0, nbSubDevice = 1; subDevice < nbSubDevice; ++subDevice)
             {
-                std::snprintf(reserve, sizeof(reserve) - 1, "%i", card);
-                cardId = reserve;
-            }
+                snd_pcm_info_set_subdevice(pcminfo, subDevice);
 
-            if (cardName == nullptr || *cardName == '\0')
-                cardName = cardId;
+                snd_pcm_info_set_stream(pcminfo, SND_PCM_STREAM_CAPTURE);
+                const bool isInput = (snd_ctl_pcm_info(ctl, pcminfo) >= 0);
 
-            int device = -1;
+                snd_pcm_info_set_stream(pcminfo, SND_PCM_STREAM_PLAYBACK);
+                const bool isOutput = (snd_ctl_pcm_info(ctl, pcminfo) >= 0);
 
-            snd_pcm_info_t* pcminfo;
-            snd_pcm_info_alloca(&pcminfo);
+                if (! (isInput || isOutput))
+                    continue;
 
-            for (;;)
-            {
-                if (snd_ctl_pcm_next_device(ctl, &device) < 0 || device < 0)
-                    break;
+                if (nbSubDevice == 1)
+                    nbSubDevice = snd_pcm_info_get_subdevices_count(pcminfo);
+
+                std::string strid(hwcard);
+                std::string strname(cardName);
 
-                snd_pcm_info_set_device(pcminfo, device);
+                strid += ",";
+                strid += std::to_string(device);
 
-                for (int subDevice = 0, nbSubDevice = 1; subDevice < nbSubDevice; ++subDevice)
+                if (const char* const pcmName = snd_pcm_info_get_name(pcminfo))
                 {
-                    snd_pcm_info_set_subdevice(pcminfo, subDevice);
+                    if (pcmName[0] != '\0')
+                    {
+                        strname += ", ";
+                        strname += pcmName;
+                    }
+                }
+
+                if (nbSubDevice != 1)
+                {
+                    strid += ",";
+                    strid += std::to_string(subDevice);
+                    strname += " {";
+                    strname += snd_pcm_info_get_subdevice_name(pcminfo);
+                    strname += "}";
+                }
+
+                if (isInput)
+                    inputs.push_back({ strid, strname });
+
+                if (isOutput)
+                    outputs.push_back({ strid, strname });
+            }
+        }
+    }
 
-                    snd_pcm_info_set_stream(pcminfo, SND_PCM_STREAM_CAPTURE);
-                    const bool isInput = (snd_ctl_pcm_info(ctl, pcminfo) >= 0);
+   #ifdef __MOD_DEVICES__
+skip:
+   #endif
+    snd_ctl_close(ctl);
+}
 
-                    snd_pcm_info_set_stream(pcminfo, SND_PCM_STREAM_PLAYBACK);
-                    const bool isOutput = (snd_ctl_pcm_info(ctl, pcminfo) >= 0);
+// --------------------------------------------------------------------------------------------------------------------
+// cached results, reused while soundcard hotplug watching reports no changes for the card
+
+struct CachedSoundcard {
+    int card;
+    uint32_t serial;
+    std::vector<DeviceID> inputs;
+    std::vector<DeviceID> outputs;
+};
+
+struct CachedDeviceProperties {
+    bool checkInput;
+    bool checkOutput;
+    unsigned sampleRate;
+    uint32_t serial;
+    DeviceProperties props;
+};
+
+// protects everything below, enumeration can happen from plugin worker threads
+static pthread_mutex_t gCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<CachedSoundcard> gCachedSoundcards;
+static std::map<std::string, CachedDeviceProperties> gCachedDeviceProperties;
+
+// card index from ids like "hw:1,0" or "plughw:1,0", -1 if unknown
+static int getDeviceCardIndex(const std::string& deviceID)
+{
+    int card = -1;
+    return std::sscanf(deviceID.c_str(), "%*[^:]:%d", &card) == 1 ? card : -1;
+}
 
-                    if (! (isInput || isOutput))
-                        continue;
+bool enumerateSoundcards(std::vector<DeviceID>& inputs, std::vector<DeviceID>& outputs)
+{
+    pthread_mutex_lock(&gCacheMutex);
 
-                    if (nbSubDevice == 1)
-                        nbSubDevice = snd_pcm_info_get_subdevices_count(pcminfo);
+    const bool watching = isSoundcardHotplugWatching();
 
-                    std::string strid(hwcard);
-                    std::string strname(cardName);
+    std::vector<CachedSoundcard> soundcards;
+    soundcards.reserve(gCachedSoundcards.size());
 
-                    strid += ",";
-                    strid += std::to_string(device);
+    int card = -1;
 
-                    if (const char* const pcmName = snd_pcm_info_get_name(pcminfo))
-                    {
-                        if (pcmName[0] != '\0')
-                        {
-                            strname += ", ";
-                            strname += pcmName;
-                        }
-                    }
+    while (inputs.size() + outputs.size() <= 64)
+    {
+        // only checks for the card control node, cheap
+        if (snd_card_next(&card) != 0 || card < 0)
+            break;
 
-                    if (nbSubDevice != 1)
-                    {
-                        strid += ",";
-                        strid += std::to_string(subDevice);
-                        strname += " {";
-                        strname += snd_pcm_info_get_subdevice_name(pcminfo);
-                        strname += "}";
-                    }
+        // read before probing, so changes happening during it invalidate the result
+        const uint32_t serial = getSoundcardHotplugCardSerial(card);
 
-                    if (isInput)
-                        inputs.push_back({ strid, strname });
+        const CachedSoundcard* cached = nullptr;
 
-                    if (isOutput)
-                        outputs.push_back({ strid, strname });
+        if (watching)
+        {
+            for (const CachedSoundcard& sc : gCachedSoundcards)
+            {
+                if (sc.card == card && sc.serial == serial)
+                {
+                    cached = &sc;
+                    break;
                 }
             }
         }
 
-   #ifdef __MOD_DEVICES__
-    skip:
-        snd_ctl_close(ctl);
-   #endif
+        if (cached != nullptr)
+        {
+            soundcards.push_back(*cached);
+        }
+        else
+        {
+            soundcards.push_back({ card, serial, {}, {} });
+            probeSoundcard(card, soundcards.back().inputs, soundcards.back().outputs);
+        }
+
+        const CachedSoundcard& sc = soundcards.back();
+        inputs.insert(inputs.end(), sc.inputs.begin(), sc.inputs.end());
+        outputs.insert(outputs.end(), sc.outputs.begin(), sc.outputs.end());
     }
 
+    // removed cards are dropped here
+    gCachedSoundcards.swap(soundcards);
+
+    pthread_mutex_unlock(&gCacheMutex);
+
     return inputs.size() + outputs.size() != 0;
 }
 
-bool getDeviceProperties(const std::string& deviceID,
-                         const bool checkInput,
-                         const bool checkOutput,
-                         const unsigned sampleRate,
-                         DeviceProperties& props)
+static bool probeDeviceProperties(const std::string& deviceID,
+                                  const bool checkInput,
+                                  const bool checkOutput,
+                                  const unsigned sampleRate,
+                                  DeviceProperties& props)
 {
-    props.minChansOut = props.maxChansOut = props.minChansIn = props.maxChansIn = 0;
-    props.bufsizes.clear();
+    props = DeviceProperties();
 
     if (deviceID.empty())
         return false;
@@ -273,7 +444,7 @@ bool getDeviceProperties(const std::string& deviceID,
         if (snd_pcm_open(&pcm, deviceID.c_str(), SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK) >= 0)
         {
             ok = fillDeviceProperties(pcm, true, sampleRate, props);
-            snd_pcm_close(pcm);
+            closeSoundcardPcm(pcm);
         }
         else
         {
@@ -289,7 +460,7 @@ bool getDeviceProperties(const std::string& deviceID,
         if (snd_pcm_open(&pcm, deviceID.c_str(), SND_PCM_STREAM_CAPTURE, SND_PCM_NONBLOCK) >= 0)
         {
             ok = fillDeviceProperties(pcm, false, sampleRate, props);
-            snd_pcm_close(pcm);
+            closeSoundcardPcm(pcm);
         }
         else
         {
@@ -301,7 +472,68 @@ bool getDeviceProperties(const std::string& deviceID,
     return ok;
 }
 
+bool getDeviceProperties(const std::string& deviceID,
+                         const bool checkInput,
+                         const bool checkOutput,
+                         const unsigned sampleRate,
+                         DeviceProperties& props)
+{
+    pthread_mutex_lock(&gCacheMutex);
+
+    const uint32_t serial = getSoundcardHotplugCardSerial(getDeviceCardIndex(deviceID));
+
+    if (isSoundcardHotplugWatching())
+    {
+        const std::map<std::string, CachedDeviceProperties>::const_iterator it = gCachedDeviceProperties.find(deviceID);
+
+        if (it != gCachedDeviceProperties.end()
+            && it->second.checkInput == checkInput
+            && it->second.checkOutput == checkOutput
+            && it->second.sampleRate == sampleRate
+            && it->second.serial == serial)
+        {
+            props = it->second.props;
+            pthread_mutex_unlock(&gCacheMutex);
+            return true;
+        }
+    }
+
+    const bool ok = probeDeviceProperties(deviceID, checkInput, checkOutput, sampleRate, props);
+
+    // failures are not cached, device might just be busy
+    if (ok)
+        gCachedDeviceProperties[deviceID] = { checkInput, checkOutput, sampleRate, serial, props };
+    else
+        gCachedDeviceProperties.erase(deviceID);
+
+    pthread_mutex_unlock(&gCacheMutex);
+
+    return ok;
+}
+
+void clearSoundcardCache()
+{
+    pthread_mutex_lock(&gCacheMutex);
+    gCachedSoundcards.clear();
+    gCachedDeviceProperties.clear();
+    pthread_mutex_unlock(&gCacheMutex);
+}
+
+void closeSoundcardPcm(snd_pcm_t* const pcm)
+{
+    snd_pcm_info_t* info;
+    snd_pcm_info_alloca(&info);
+
+    // plugins without a hardware device behind them (card -1) do not touch any node
+    if (snd_pcm_info(pcm, info) == 0)
+        ignoreSoundcardHotplugClose(snd_pcm_info_get_card(info), snd_pcm_info_get_device(info),
+                                    snd_pcm_info_get_stream(info) == SND_PCM_STREAM_CAPTURE);
+
+    snd_pcm_close(pcm);
+}
+
 void cleanup()
 {
+    clearSoundcardCache();
     snd_config_update_free_global();
 }
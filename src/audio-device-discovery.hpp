@@ -3,22 +3,53 @@
 
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
+typedef struct _snd_pcm snd_pcm_t;
+typedef struct _snd_pcm_hw_params snd_pcm_hw_params_t;
+
 struct DeviceID {
     std::string id;
     std::string name;
 };
 
+// what a device supports in one direction, as reported by ALSA without any plugin conversions
+struct DeviceCapabilities {
+    unsigned minChans = 0;
+    unsigned maxChans = 0;
+    unsigned minRate = 0;
+    unsigned maxRate = 0;
+    unsigned minPeriods = 0;
+    unsigned maxPeriods = 0;
+    unsigned long minPeriodSize = 0;
+    unsigned long maxPeriodSize = 0;
+    // bitmask of 1 << snd_pcm_access_t
+    uint32_t access = 0;
+    // bitmask of 1 << snd_pcm_format_t
+    uint64_t formats = 0;
+    // same, restricted to each mmap access mode, as some formats might only be available with one of them
+    uint64_t interleavedFormats = 0;
+    uint64_t nonInterleavedFormats = 0;
+    // common rates and the one given for probing, if supported
+    std::vector<unsigned> rates;
+    // power of 2 period sizes, at the rate given for probing
+    std::vector<unsigned> periodSizes;
+};
+
 struct DeviceProperties {
     unsigned minChansIn = 0;
     unsigned maxChansIn = 0;
     unsigned minChansOut = 0;
     unsigned maxChansOut = 0;
     std::vector<unsigned> bufsizes;
+    DeviceCapabilities capture;
+    DeviceCapabilities playback;
 };
 
+// results are cached and only probed again for cards that changed, while soundcard hotplug watching is active
+// see audio-device-hotplug.hpp, without it every call probes all cards
 bool enumerateSoundcards(std::vector<DeviceID>& inputs, std::vector<DeviceID>& outputs);
 
 bool getDeviceProperties(const std::string& deviceID,
@@ -27,4 +58,17 @@ bool getDeviceProperties(const std::string& deviceID,
                          unsigned sampleRate,
                          DeviceProperties& props);
 
+// probe everything a device allows within params, usually straight from snd_pcm_hw_params_any
+// period sizes are probed at sampleRate, or without a fixed rate if the device does not support it
+// returns false if there is no usable configuration
+bool getDeviceCapabilities(snd_pcm_t* pcm, const snd_pcm_hw_params_t* params, unsigned sampleRate,
+                           DeviceCapabilities& caps);
+
+// forget cached results, next calls probe all cards again
+void clearSoundcardCache();
+
+// close a PCM device opened by us for probing or that failed to be set up,
+// without its close event counting as a soundcard change, see ignoreSoundcardHotplugClose
+void closeSoundcardPcm(snd_pcm_t* pcm);
+
 void cleanup();
@@ -0,0 +1,427 @@
+// SPDX-FileCopyrightText: 2021-2024 Filipe Coelho <falktx@falktx.com>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include "audio-device-hotplug.hpp"
+#include "audio-log.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+// --------------------------------------------------------------------------------------------------------------------
+
+// control nodes are also opened by enumerateSoundcards, closing them must not count as a change
+static constexpr const uint32_t kControlEvents = IN_CREATE | IN_DELETE | IN_ATTRIB;
+static constexpr const uint32_t kPcmEvents = IN_CREATE | IN_DELETE | IN_ATTRIB | IN_CLOSE_WRITE;
+
+// how often the serial is incremented when inotify is not available, in milliseconds
+static constexpr const int kFallbackInterval = 1000;
+
+// ALSA allows up to 256 cards, depending on kernel configuration
+static constexpr const int kMaxCards = 256;
+
+// PCM devices per card whose own closes can be ignored, closes of others always count as changes
+static constexpr const int kMaxPcmDevices = 32;
+
+static std::atomic<uint32_t> gSerial;
+
+// per card, only for node changes (not closing), last one is for any card
+static std::atomic<uint32_t> gCardSerials[kMaxCards + 1];
+
+// per PCM node (card, device and direction), closes by this process whose event has not been seen yet
+static std::atomic<uint32_t> gOwnCloses[kMaxCards][kMaxPcmDevices][2];
+static std::atomic<bool> gWatching;
+
+// protects everything below, and is used for waking up waiters
+static pthread_mutex_t gMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gCond;
+static uint32_t gRefCount;
+static pthread_t gThread;
+static int gStopFd = -1;
+static char gDirectory[PATH_MAX] = "/dev/snd";
+
+// --------------------------------------------------------------------------------------------------------------------
+
+static void initCondition()
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&gCond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static void ensureCondition()
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, initCondition);
+}
+
+// card -1 for all of them, when changes can have been missed
+static void notifyCardChange(const int card)
+{
+    if (card >= 0 && card < kMaxCards)
+    {
+        gCardSerials[card].fetch_add(1, std::memory_order_release);
+    }
+    else
+    {
+        for (int i = 0; i < kMaxCards; ++i)
+            gCardSerials[i].fetch_add(1, std::memory_order_release);
+    }
+
+    gCardSerials[kMaxCards].fetch_add(1, std::memory_order_release);
+}
+
+// own close count of a PCM node, nullptr if out of range
+static std::atomic<uint32_t>* getOwnCloses(const int card, const int device, const bool capture)
+{
+    if (card < 0 || card >= kMaxCards || device < 0 || device >= kMaxPcmDevices)
+        return nullptr;
+
+    return &gOwnCloses[card][device][capture ? 1 : 0];
+}
+
+// returns true if the close event of a PCM node (like "pcmC0D0p") was caused by this process
+// see ignoreSoundcardHotplugClose
+static bool consumeOwnClose(const char* const name)
+{
+    int card, device;
+    char stream;
+
+    if (std::sscanf(name, "pcmC%dD%d%c", &card, &device, &stream) != 3)
+        return false;
+
+    std::atomic<uint32_t>* const closes = getOwnCloses(card, device, stream == 'c');
+
+    if (closes == nullptr)
+        return false;
+
+    uint32_t count = closes->load(std::memory_order_acquire);
+
+    while (count != 0)
+    {
+        if (closes->compare_exchange_weak(count, count - 1, std::memory_order_acq_rel))
+            return true;
+    }
+
+    return false;
+}
+
+static void notifyChange()
+{
+    gSerial.fetch_add(1, std::memory_order_release);
+
+    pthread_mutex_lock(&gMutex);
+    pthread_cond_broadcast(&gCond);
+    pthread_mutex_unlock(&gMutex);
+}
+
+// returns true if the event is about a soundcard node
+static bool handleEvent(const struct inotify_event* const event)
+{
+    if (event->len == 0)
+        return false;
+
+    if (std::strncmp(event->name, "pcmC", 4) == 0)
+    {
+        if ((event->mask & kPcmEvents) == 0)
+            return false;
+
+        const int card = std::atoi(event->name + 4);
+
+        if (event->mask & kControlEvents)
+            notifyCardChange(card);
+        else if (consumeOwnClose(event->name))
+            return false;
+
+        return true;
+    }
+
+    if (std::strncmp(event->name, "controlC", 8) != 0 || (event->mask & kControlEvents) == 0)
+        return false;
+
+    notifyCardChange(std::atoi(event->name + 8));
+
+    if (event->mask & IN_CREATE)
+        AUDIO_LOG(kAudioLogInfo, "soundcard %s added", event->name + 8);
+    else if (event->mask & IN_DELETE)
+        AUDIO_LOG(kAudioLogInfo, "soundcard %s removed", event->name + 8);
+
+    return true;
+}
+
+static void* hotplugThread(void* const arg)
+{
+    const int stopFd = static_cast<int>(reinterpret_cast<intptr_t>(arg));
+
+    // the directory only exists while there are soundcards, so its parent is watched for it to be created
+    char parent[PATH_MAX];
+    std::strncpy(parent, gDirectory, sizeof(parent) - 1);
+    parent[sizeof(parent) - 1] = '\0';
+
+    char* const slash = std::strrchr(parent, '/');
+    const char* const name = slash != nullptr ? gDirectory + (slash - parent) + 1 : gDirectory;
+
+    if (slash == parent)
+        slash[1] = '\0';
+    else if (slash != nullptr)
+        *slash = '\0';
+
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    int parentWd = -1, dirWd = -1;
+
+    if (fd >= 0)
+    {
+        parentWd = inotify_add_watch(fd, parent, IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+        dirWd = inotify_add_watch(fd, gDirectory, kPcmEvents | IN_ONLYDIR);
+
+        if (parentWd < 0 && dirWd < 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    if (fd < 0)
+        AUDIO_LOG(kAudioLogWarning, "soundcard hotplug | cannot watch %s, checking periodically", gDirectory);
+
+    // anything cached before this point could have changed without notice
+    notifyCardChange(-1);
+
+    for (int i = 0; i < kMaxCards; ++i)
+    {
+        for (int j = 0; j < kMaxPcmDevices; ++j)
+        {
+            gOwnCloses[i][j][0].store(0, std::memory_order_relaxed);
+            gOwnCloses[i][j][1].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    gWatching.store(fd >= 0, std::memory_order_release);
+
+    struct pollfd pfds[2] = {
+        { stopFd, POLLIN, 0 },
+        { fd, POLLIN, 0 },
+    };
+
+    for (;;)
+    {
+        const int ret = poll(pfds, fd >= 0 ? 2 : 1, fd >= 0 ? -1 : kFallbackInterval);
+
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (pfds[0].revents != 0)
+            break;
+
+        if (fd < 0)
+        {
+            notifyChange();
+            continue;
+        }
+
+        if (pfds[1].revents == 0)
+            continue;
+
+        bool changed = false;
+        alignas(struct inotify_event) char buffer[4096];
+        ssize_t len;
+
+        while ((len = read(fd, buffer, sizeof(buffer))) > 0)
+        {
+            for (const char* ptr = buffer; ptr < buffer + len;)
+            {
+                const struct inotify_event* const event = reinterpret_cast<const struct inotify_event*>(ptr);
+                ptr += sizeof(struct inotify_event) + event->len;
+
+                if (event->mask & IN_Q_OVERFLOW)
+                {
+                    notifyCardChange(-1);
+                    changed = true;
+                }
+                else if (event->wd == parentWd)
+                {
+                    if (dirWd < 0 && event->len != 0 && std::strcmp(event->name, name) == 0)
+                    {
+                        dirWd = inotify_add_watch(fd, gDirectory, kPcmEvents | IN_ONLYDIR);
+                        changed = true;
+                    }
+                }
+                else if (event->wd == dirWd)
+                {
+                    // directory was removed, together with the last soundcard
+                    if (event->mask & IN_IGNORED)
+                    {
+                        dirWd = -1;
+                        notifyCardChange(-1);
+                        changed = true;
+                    }
+                    else if (handleEvent(event))
+                    {
+                        changed = true;
+                    }
+                }
+            }
+        }
+
+        if (changed)
+            notifyChange();
+    }
+
+    gWatching.store(false, std::memory_order_release);
+
+    if (fd >= 0)
+        close(fd);
+
+    return nullptr;
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+void soundcardHotplugStart()
+{
+    ensureCondition();
+
+    pthread_mutex_lock(&gMutex);
+
+    if (gRefCount++ == 0)
+    {
+        gStopFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+        if (gStopFd < 0 ||
+            pthread_create(&gThread, nullptr, hotplugThread, reinterpret_cast<void*>(static_cast<intptr_t>(gStopFd))) != 0)
+        {
+            // no thread, waiting falls back to sleeping, see waitForSoundcardHotplug
+            AUDIO_LOG(kAudioLogWarning, "soundcard hotplug | failed to start thread");
+            if (gStopFd >= 0)
+                close(gStopFd);
+            gStopFd = -1;
+            gThread = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&gMutex);
+}
+
+void soundcardHotplugStop()
+{
+    pthread_mutex_lock(&gMutex);
+
+    if (gRefCount == 0 || --gRefCount != 0)
+    {
+        pthread_mutex_unlock(&gMutex);
+        return;
+    }
+
+    const pthread_t thread = gThread;
+    const int stopFd = gStopFd;
+    gThread = 0;
+    gStopFd = -1;
+    pthread_mutex_unlock(&gMutex);
+
+    // nothing will change anymore, waiters must not block forever
+    notifyChange();
+
+    if (thread != 0)
+    {
+        const uint64_t value = 1;
+        if (write(stopFd, &value, sizeof(value)) != sizeof(value))
+            AUDIO_LOG(kAudioLogError, "soundcard hotplug | failed to stop thread");
+        pthread_join(thread, nullptr);
+        close(stopFd);
+    }
+}
+
+uint32_t getSoundcardHotplugSerial()
+{
+    return gSerial.load(std::memory_order_acquire);
+}
+
+uint32_t getSoundcardHotplugCardSerial(const int card)
+{
+    return gCardSerials[card >= 0 && card < kMaxCards ? card : kMaxCards].load(std::memory_order_acquire);
+}
+
+bool isSoundcardHotplugWatching()
+{
+    return gWatching.load(std::memory_order_acquire);
+}
+
+uint32_t waitForSoundcardHotplug(const uint32_t serial, const int timeoutMs)
+{
+    ensureCondition();
+
+    pthread_mutex_lock(&gMutex);
+
+    if (gThread == 0)
+    {
+        pthread_mutex_unlock(&gMutex);
+
+        const int sleepMs = timeoutMs >= 0 && timeoutMs < kFallbackInterval ? timeoutMs : kFallbackInterval;
+        usleep(sleepMs * 1000);
+
+        return gSerial.fetch_add(1, std::memory_order_acq_rel) + 1;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeoutMs / 1000;
+    deadline.tv_nsec += (timeoutMs % 1000) * 1000000L;
+
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        ++deadline.tv_sec;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    while (gSerial.load(std::memory_order_acquire) == serial)
+    {
+        if (timeoutMs < 0)
+            pthread_cond_wait(&gCond, &gMutex);
+        else if (pthread_cond_timedwait(&gCond, &gMutex, &deadline) == ETIMEDOUT)
+            break;
+    }
+
+    pthread_mutex_unlock(&gMutex);
+
+    return gSerial.load(std::memory_order_acquire);
+}
+
+void wakeSoundcardHotplugWaiters()
+{
+    ensureCondition();
+    notifyChange();
+}
+
+void ignoreSoundcardHotplugClose(const int card, const int device, const bool capture)
+{
+    // events are only seen (and the count consumed) while watching
+    if (! gWatching.load(std::memory_order_acquire))
+        return;
+
+    if (std::atomic<uint32_t>* const closes = getOwnCloses(card, device, capture))
+        closes->fetch_add(1, std::memory_order_acq_rel);
+}
+
+void setSoundcardHotplugDirectory(const char* const dir)
+{
+    pthread_mutex_lock(&gMutex);
+    std::snprintf(gDirectory, sizeof(gDirectory), "%s", dir != nullptr ? dir : "/dev/snd");
+    pthread_mutex_unlock(&gMutex);
+}
+
+// --------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,62 @@
+// SPDX-FileCopyrightText: 2021-2024 Filipe Coelho <falktx@falktx.com>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#pragma once
+
+#include <cstdint>
+
+// --------------------------------------------------------------------------------------------------------------------
+
+/**
+   Soundcard hotplug notifications, without polling.
+
+   A low-priority thread watches /dev/snd with inotify, where the kernel (through devtmpfs and udev) creates and removes
+   the control and PCM device nodes of each card. Every change to them increments a serial number, which is cheap to
+   check from real-time threads, and wakes up threads waiting for it.
+   Permission changes (udev applying ACLs after creating a node) and PCM devices being closed by other applications
+   also count as changes, so that opening a card is retried once it becomes usable.
+   So do PCM devices closed by this process after streaming, other users of the process (like another plugin instance)
+   might be waiting for them. Only closes after a failed or probing open do not, see ignoreSoundcardHotplugClose.
+
+   The thread runs while at least 1 user needs it (see soundcardHotplugStart and soundcardHotplugStop).
+   If inotify is not available, the serial is incremented once per second instead, like the old polling loops.
+ */
+
+// how many milliseconds to wait after a change before trying to open a card
+// lets udev finish creating nodes and applying permissions, and merges bursts of events into a single retry
+#define AUDIO_BRIDGE_HOTPLUG_SETTLE_TIME 100
+
+// start or stop the watching thread, calls are reference counted and must be balanced
+void soundcardHotplugStart();
+void soundcardHotplugStop();
+
+// incremented on every soundcard change, real-time safe
+uint32_t getSoundcardHotplugSerial();
+
+// incremented when nodes of a card are added, removed or change permissions, but not when closed
+// card is the ALSA card index, -1 (or out of range) for changes to any card
+// also incremented for all cards when watching starts or events could have been missed, for cache invalidation
+uint32_t getSoundcardHotplugCardSerial(int card);
+
+// true while changes are being reported as they happen, without falling back to periodic checks
+// per card serials can only be trusted while this is true
+bool isSoundcardHotplugWatching();
+
+// blocks until the serial is different from the given one, or timeout passes
+// timeout is in milliseconds, negative to wait forever, returns the current serial
+// read the serial before checking for soundcards and wait with it afterwards, so no change is missed in between
+uint32_t waitForSoundcardHotplug(uint32_t serial, int timeoutMs);
+
+// increments the serial, making current and upcoming waitForSoundcardHotplug calls return, for shutdown
+void wakeSoundcardHotplugWaiters();
+
+// a PCM device is about to be closed by this process after a failed or probing open, its close event must not count
+// as a change, otherwise failed attempts to open a card (which close it again) would keep retrying
+// only the close of this exact node (card, device and direction) is ignored, see closeSoundcardPcm
+void ignoreSoundcardHotplugClose(int card, int device, bool capture);
+
+// watch a different directory instead of /dev/snd, for testing
+// must be called before the thread starts, nullptr restores the default
+void setSoundcardHotplugDirectory(const char* dir);
+
+// --------------------------------------------------------------------------------------------------------------------
@@ -4,29 +4,59 @@
 #include "audio-device-init.hpp"
 
 #include <algorithm>
+#include <cerrno>
 #include <cmath>
+#include <cstdlib>
 #include <cstring>
+#include <endian.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 // --------------------------------------------------------------------------------------------------------------------
 
 // private
 static void deviceFailInitHints(DeviceAudio* dev);
+static void deviceNotify(DeviceAudio* dev);
+static bool deviceWaitForNotify(DeviceAudio* dev, int timeout);
 static void deviceTimedWait(DeviceAudio* dev);
+static void devicePollWait(DeviceAudio* dev);
+static void deviceResetClock(DeviceAudio* dev, DelayLockedLoop& dll);
+static void deviceUpdateClock(DeviceAudio* dev, DelayLockedLoop& dll, int64_t transferred);
+static uint32_t getDeviceRingBufferTarget(DeviceAudio* dev);
+static uint32_t hostToDeviceFrames(DeviceAudio* dev, uint32_t frames);
+static uint32_t deviceToHostFrames(DeviceAudio* dev, uint32_t frames);
+static void deviceXrunRecovered(DeviceAudio* dev, const struct timespec& xrunTime);
+static void deviceSetResamplerRatio(DeviceAudio* dev, double ratio);
+static void deviceResetLatencyWindow(DeviceAudio* dev);
+static void deviceResetLatency(DeviceAudio* dev);
+static void deviceUpdateLatency(DeviceAudio* dev, uint16_t frames);
+static uint32_t deviceProcessChannels(DeviceAudio* dev, float** inputs, uint32_t frames, float** outputs);
 static void* deviceCaptureThread(void* arg);
 static void* devicePlaybackThread(void* arg);
-static void runDeviceAudioPlayback(DeviceAudio* dev, float* buffers[], uint32_t frame);
-static void runDeviceAudioCapture(DeviceAudio* dev, float* buffers[], uint32_t frame);
+static void* deviceDuplexThread(void* arg);
+static void runDeviceAudioPlayback(DeviceAudio* dev, float* buffers[], uint16_t frames, uint32_t frame);
+static void runDeviceAudioCapture(DeviceAudio* dev, float* buffers[], uint16_t frames, uint32_t frame);
 
 // TODO cleanup, see what is needed
-static int xrun_recovery(snd_pcm_t *handle, int err);
+static int xrun_recovery(DeviceBackend* backend, int err);
 
 // --------------------------------------------------------------------------------------------------------------------
 
-static constexpr const snd_pcm_format_t kFormatsToTry[] = {
-    SND_PCM_FORMAT_S32,
-    SND_PCM_FORMAT_S24_3LE,
-    SND_PCM_FORMAT_S24,
-    SND_PCM_FORMAT_S16,
+// float first, as it only needs (de)interleaving
+// big-endian formats last, they are rare and always use scalar conversion
+static constexpr const struct {
+    snd_pcm_format_t format;
+    uint32_t hint;
+} kFormatsToTry[] = {
+    { SND_PCM_FORMAT_FLOAT, kDeviceSampleFloat },
+    { SND_PCM_FORMAT_S32, kDeviceSample32 },
+    { SND_PCM_FORMAT_S24_3LE, kDeviceSample24LE3 },
+    { SND_PCM_FORMAT_S24, kDeviceSample24 },
+    { SND_PCM_FORMAT_S16, kDeviceSample16 },
+   #if __BYTE_ORDER == __LITTLE_ENDIAN
+    { SND_PCM_FORMAT_S32_BE, kDeviceSample32BE },
+    { SND_PCM_FORMAT_S24_3BE, kDeviceSample24BE3 },
+   #endif
 };
 
 static constexpr const unsigned kPeriodsToTry[] = { 3, 4 };
@@ -98,41 +128,44 @@ static const char* SND_PCM_FORMAT_STRING(const snd_pcm_format_t format)
 
 // --------------------------------------------------------------------------------------------------------------------
 
-// TODO cleanup, see what is needed
-static int xrun_recovery(snd_pcm_t *handle, int err)
+// returns the prepare or resume error if the stream could not be recovered, -EAGAIN while still suspended
+// never blocks, as this runs in the device thread, a suspended stream is retried on the next call
+static int xrun_recovery(DeviceBackend* const backend, int err)
 {
     // static int count = 0;
     // if ((count % 200) == 0)
     {
         // count = 1;
-        printf("stream recovery: %s\n", snd_strerror(err));
+        AUDIO_LOG(kAudioLogWarning, "stream recovery: %s", snd_strerror(err));
     }
 
     if (err == -EPIPE)
     {
         /* under-run */
-        err = snd_pcm_prepare(handle);
+        err = backend->prepare();
         if (err < 0)
-            printf("Can't recovery from underrun, prepare failed: %s\n", snd_strerror(err));
-        return 0;
+            AUDIO_LOG(kAudioLogError, "Can't recovery from underrun, prepare failed: %s", snd_strerror(err));
+        return err;
     }
     else if (err == -ESTRPIPE)
     {
-        while ((err = snd_pcm_resume(handle)) == -EAGAIN)
-            sleep(1);   /* wait until the suspend flag is released */
+        err = backend->resume();
+
+        /* wait until the suspend flag is released */
+        if (err == -EAGAIN)
+            return err;
 
         if (err < 0)
         {
-            err = snd_pcm_prepare(handle);
+            err = backend->prepare();
             if (err < 0)
-                printf("Can't recovery from suspend, prepare failed: %s\n", snd_strerror(err));
+                AUDIO_LOG(kAudioLogError, "Can't recovery from suspend, prepare failed: %s", snd_strerror(err));
         }
 
-        return 0;
+        return err;
     }
 
     return 0;
-    return err;
 }
 
 static void deviceFailInitHints(DeviceAudio* const dev)
@@ -140,47 +173,258 @@ static void deviceFailInitHints(DeviceAudio* const dev)
     dev->hints |= kDeviceInitializing|kDeviceStarting|kDeviceBuffering;
     dev->framesDone = 0;
     dev->rbRatio = 1.0;
+    dev->clock.fill = 1.0;
+    // only requested here, as this is called from both sides, the consumer empties the ringbuffer on its next run
     dev->ringbuffer->flush();
 }
 
+static void deviceNotify(DeviceAudio* const dev)
+{
+    eventfd_write(dev->pollfds[0].fd, 1);
+}
+
+static bool deviceWaitForNotify(DeviceAudio* const dev, const int timeout)
+{
+    const int ret = dev->backend->poll(dev->pollfds, 1, timeout);
+    ++dev->numWakeups;
+
+    if (ret <= 0)
+        return false;
+
+    eventfd_t value;
+    eventfd_read(dev->pollfds[0].fd, &value);
+    return true;
+}
+
+// wait for a JACK cycle notification, up to 1 period
 static void deviceTimedWait(DeviceAudio* const dev)
 {
-    if (sem_trywait(&dev->sem) == 0)
-        return;
+    deviceWaitForNotify(dev, dev->bufferSize * 1000 / dev->sampleRate + 1);
+}
 
-    const uint32_t periodTime = (dev->bufferSize * 1000000) / dev->sampleRate * 1000 / AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MULT;
+// wait for the device to reach avail_min frames (or error), up to 1 period
+// JACK cycle notifications do not wake up the thread unless we are closing
+static void devicePollWait(DeviceAudio* const dev)
+{
+    const int timeout = dev->bufferSize * 1000 / dev->sampleRate + 1;
+    unsigned short revents;
 
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
+    do {
+        const int ret = dev->backend->poll(dev->pollfds, dev->numPollFds, timeout);
+        ++dev->numWakeups;
+
+        if (ret <= 0)
+            return;
+
+        if (dev->pollfds[0].revents != 0)
+        {
+            eventfd_t value;
+            eventfd_read(dev->pollfds[0].fd, &value);
+
+            if (dev->hwstatus.channels == 0)
+                return;
+        }
 
-    ts.tv_nsec += periodTime;
-    if (ts.tv_nsec >= 1000000000LL)
+        revents = 0;
+        dev->backend->pollDescriptorsRevents(dev->pollfds + 1, dev->numPollFds - 1, &revents);
+    } while (revents == 0);
+}
+
+// what a device thread waits for before processing again, returned by the non-blocking capture and playback steps
+enum DeviceWait {
+    // more work to do right away
+    kDeviceWaitNone,
+    // device is not ready for reading or writing, see devicePollWait
+    kDeviceWaitDevice,
+    // ringbuffer is full or empty, needs the host to run, see deviceTimedWait
+    kDeviceWaitHost,
+    // unrecoverable error, thread must stop
+    kDeviceWaitStop,
+};
+
+// wait as requested by a single capture or playback step, returns false if the thread must stop
+static bool deviceWait(DeviceAudio* const dev, const DeviceWait wait)
+{
+    switch (wait)
     {
-        ++ts.tv_sec;
-        ts.tv_nsec -= 1000000000LL;
+    case kDeviceWaitNone:
+        break;
+    case kDeviceWaitDevice:
+        devicePollWait(dev);
+        break;
+    case kDeviceWaitHost:
+        deviceTimedWait(dev);
+        break;
+    case kDeviceWaitStop:
+        return false;
     }
-    sem_timedwait(&dev->sem, &ts);
+
+    return true;
+}
+
+static void deviceResetClock(DeviceAudio* const dev, DelayLockedLoop& dll)
+{
+    dll.reset();
+    dev->clock.deviceFrameTime = 0.0;
+}
+
+// feed the device delay-locked loop with the hardware position at the latest timestamp
+static void deviceUpdateClock(DeviceAudio* const dev, DelayLockedLoop& dll, const int64_t transferred)
+{
+    snd_pcm_uframes_t avail;
+    snd_htimestamp_t tstamp;
+
+    if (dev->backend->htimestamp(&avail, &tstamp) != 0)
+        return;
+    if (tstamp.tv_sec == 0 && tstamp.tv_nsec == 0)
+        return;
+
+    const int64_t position = dev->hints & kDeviceCapture
+                           ? transferred + static_cast<int64_t>(avail)
+                           : transferred - static_cast<int64_t>(dev->hwstatus.fullBufferSize - avail);
+
+    dll.update(tstamp.tv_sec + tstamp.tv_nsec * 1e-9, position);
+
+    dev->clock.deviceFrameTime = dll.isLocked() ? dll.getFrameTime() : 0.0;
+}
+
+// ringbuffer fill level target, in frames
+static uint32_t getDeviceRingBufferTarget(DeviceAudio* const dev)
+{
+    return dev->rbFillTarget * dev->rbTotalNumSamples * kRingBufferDataFactor;
+}
+
+// nominal conversion between host and device frames, for when sample rates differ
+static uint32_t hostToDeviceFrames(DeviceAudio* const dev, const uint32_t frames)
+{
+    return static_cast<uint64_t>(frames) * dev->hwstatus.sampleRate / dev->sampleRate;
+}
+
+static uint32_t deviceToHostFrames(DeviceAudio* const dev, const uint32_t frames)
+{
+    return static_cast<uint64_t>(frames) * dev->sampleRate / dev->hwstatus.sampleRate;
+}
+
+static void deviceXrunRecovered(DeviceAudio* const dev, const struct timespec& xrunTime)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    dev->xruns.recoveryTime = (ts.tv_sec - xrunTime.tv_sec) * 1000000 + (ts.tv_nsec - xrunTime.tv_nsec) / 1000;
+    ++dev->xruns.count;
+
+    DEBUGPRINT("%08u | %s | recovered from xrun in %u us", dev->frame,
+               dev->hints & kDeviceCapture ? "capture" : "playback", dev->xruns.recoveryTime);
+}
+
+// pointer to the first sample at offset within a mmap area
+// for interleaved access that is the first channel of the frame, and only areas[0] is used
+static inline uint8_t* getDeviceMmapPointer(const snd_pcm_channel_area_t& area, const snd_pcm_uframes_t offset)
+{
+    return static_cast<uint8_t*>(area.addr) + (area.first + offset * area.step) / 8;
 }
 
 // --------------------------------------------------------------------------------------------------------------------
 
-DeviceAudio* initDeviceAudio(const char* const deviceID,
-                             const bool playback,
-                             const uint16_t bufferSize,
-                             const uint32_t sampleRate)
+bool chooseDeviceConfig(const DeviceCapabilities& caps,
+                        const uint16_t bufferSize,
+                        const uint32_t sampleRate,
+                        const uint8_t channels,
+                        const uint32_t deviceSampleRate,
+                        DeviceConfig& config)
+{
+    config = {};
+
+    const auto chooseFormat = [&config](const uint64_t formats) -> bool
+    {
+        for (const auto& f : kFormatsToTry)
+        {
+            if (formats & (UINT64_C(1) << f.format))
+            {
+                config.format = f.format;
+                config.sampleHint = f.hint;
+                return true;
+            }
+        }
+
+        return false;
+    };
+
+    // prefer non-interleaved access, each channel then maps directly to a host buffer
+    // formats depend on the access mode, fall back to interleaved if none of ours is available without it
+    if ((caps.access & (1u << SND_PCM_ACCESS_MMAP_NONINTERLEAVED)) && chooseFormat(caps.nonInterleavedFormats))
+    {
+        config.access = SND_PCM_ACCESS_MMAP_NONINTERLEAVED;
+        config.sampleHint |= kDeviceNonInterleaved;
+    }
+    else if ((caps.access & (1u << SND_PCM_ACCESS_MMAP_INTERLEAVED)) && chooseFormat(caps.interleavedFormats))
+    {
+        config.access = SND_PCM_ACCESS_MMAP_INTERLEAVED;
+    }
+    else
+    {
+        return false;
+    }
+
+    // use the nearest rate the device supports and resample, like for fixed-rate USB and HDMI devices
+    const uint32_t preferredRate = deviceSampleRate != 0 ? deviceSampleRate : sampleRate;
+    uint32_t distance = UINT32_MAX;
+
+    config.sampleRate = std::min(std::max<uint32_t>(preferredRate, caps.minRate), caps.maxRate);
+
+    for (const unsigned rate : caps.rates)
+    {
+        const uint32_t rateDistance = rate > preferredRate ? rate - preferredRate : preferredRate - rate;
+
+        if (rateDistance < distance)
+        {
+            distance = rateDistance;
+            config.sampleRate = rate;
+        }
+    }
+
+    // keep the same period duration as the host
+    config.periodSize = static_cast<uint64_t>(bufferSize) * config.sampleRate / sampleRate;
+
+    if (caps.maxPeriodSize != 0)
+        config.periodSize = std::min<unsigned long>(std::max<unsigned long>(config.periodSize, caps.minPeriodSize),
+                                                    caps.maxPeriodSize);
+
+    for (const unsigned periods : kPeriodsToTry)
+    {
+        if (periods >= caps.minPeriods && periods <= caps.maxPeriods)
+        {
+            config.periods = periods;
+            break;
+        }
+    }
+
+    if (config.periods == 0)
+        config.periods = std::min(std::max(kPeriodsToTry[0], caps.minPeriods), caps.maxPeriods);
+
+    config.channels = std::min<unsigned>(std::max<unsigned>(channels, caps.minChans), std::min(caps.maxChans, 255U));
+
+    return true;
+}
+
+DeviceBackend* openDeviceBackend(const char* const deviceID,
+                                 const bool playback,
+                                 const uint16_t bufferSize,
+                                 const uint32_t sampleRate,
+                                 const uint8_t channels,
+                                 const uint32_t deviceSampleRate,
+                                 uint32_t& sampleHint,
+                                 DeviceAudio::HWStatus& hwstatus)
 {
     int err;
-    DeviceAudio dev = {};
-    dev.sampleRate = sampleRate;
-    dev.bufferSize = bufferSize;
-    dev.hints = kDeviceInitializing|kDeviceStarting|kDeviceBuffering|(playback ? 0 : kDeviceCapture);
+    snd_pcm_t* pcm;
 
     const snd_pcm_stream_t mode = playback ? SND_PCM_STREAM_PLAYBACK : SND_PCM_STREAM_CAPTURE;
 
     // SND_PCM_ASYNC
     // SND_PCM_NONBLOCK
     const int flags = SND_PCM_NONBLOCK | SND_PCM_NO_AUTO_RESAMPLE | SND_PCM_NO_AUTO_CHANNELS | SND_PCM_NO_AUTO_FORMAT | SND_PCM_NO_SOFTVOL;
-    if ((err = snd_pcm_open(&dev.pcm, deviceID, mode, flags)) < 0)
+    if ((err = snd_pcm_open(&pcm, deviceID, mode, flags)) < 0)
     {
         DEBUGPRINT("snd_pcm_open fail %d %s\n", playback, snd_strerror(err));
         return nullptr;
@@ -194,168 +438,129 @@ DeviceAudio* initDeviceAudio(const char* const deviceID,
 
     unsigned uintParam;
     unsigned long ulongParam;
+    const unsigned deviceRate = deviceSampleRate != 0 ? deviceSampleRate : sampleRate;
+    snd_pcm_uframes_t periodSize;
+    DeviceCapabilities caps;
+    DeviceConfig config;
 
-    if ((err = snd_pcm_hw_params_any(dev.pcm, params)) < 0)
+    if ((err = snd_pcm_hw_params_any(pcm, params)) < 0)
     {
         DEBUGPRINT("snd_pcm_hw_params_any fail %s", snd_strerror(err));
         goto error;
     }
 
-    if ((err = snd_pcm_hw_params_set_rate_resample(dev.pcm, params, 0)) != 0)
+    if ((err = snd_pcm_hw_params_set_rate_resample(pcm, params, 0)) != 0)
     {
         DEBUGPRINT("snd_pcm_hw_params_set_rate_resample fail %s", snd_strerror(err));
         goto error;
     }
 
-    if ((err = snd_pcm_hw_params_set_access(dev.pcm, params, SND_PCM_ACCESS_MMAP_INTERLEAVED)) != 0)
+    // everything is picked up front from what the device supports, no need to try one value after another
+    if (! getDeviceCapabilities(pcm, params, deviceRate, caps))
     {
-        DEBUGPRINT("snd_pcm_hw_params_set_access fail %s", snd_strerror(err));
+        DEBUGPRINT("getDeviceCapabilities fail");
         goto error;
     }
 
-    for (snd_pcm_format_t format : kFormatsToTry)
+    if (! chooseDeviceConfig(caps, bufferSize, sampleRate, channels, deviceSampleRate, config))
     {
-        if ((err = snd_pcm_hw_params_set_format(dev.pcm, params, format)) != 0)
-        {
-            // DEBUGPRINT("snd_pcm_hw_params_set_format fail %u:%s %s", format, SND_PCM_FORMAT_STRING(format), snd_strerror(err));
-            continue;
-        }
-
-        switch (format)
-        {
-        case SND_PCM_FORMAT_S16:
-            dev.hints |= kDeviceSample16;
-            break;
-        case SND_PCM_FORMAT_S24:
-            dev.hints |= kDeviceSample24;
-            break;
-        case SND_PCM_FORMAT_S24_3LE:
-            dev.hints |= kDeviceSample24LE3;
-            break;
-        case SND_PCM_FORMAT_S32:
-            dev.hints |= kDeviceSample32;
-            break;
-        default:
-            DEBUGPRINT("snd_pcm_hw_params_set_format fail unimplemented format %u:%s", format, SND_PCM_FORMAT_STRING(format));
-            continue;
-        }
-
-        DEBUGPRINT("snd_pcm_hw_params_set_format %s", SND_PCM_FORMAT_STRING(format));
-        break;
+        DEBUGPRINT("chooseDeviceConfig fail, no usable access or format");
+        goto error;
     }
 
-    if ((dev.hints & kDeviceSampleHints) == 0)
+    if ((err = snd_pcm_hw_params_set_access(pcm, params, config.access)) != 0)
     {
-        DEBUGPRINT("snd_pcm_hw_params_set_format fail %s", snd_strerror(err));
+        DEBUGPRINT("snd_pcm_hw_params_set_access fail %s", snd_strerror(err));
         goto error;
     }
 
-    if ((err = snd_pcm_hw_params_set_rate(dev.pcm, params, sampleRate, 0)) != 0)
+    DEBUGPRINT("snd_pcm_hw_params_set_access %s",
+               config.access == SND_PCM_ACCESS_MMAP_NONINTERLEAVED ? "non-interleaved" : "interleaved");
+
+    if ((err = snd_pcm_hw_params_set_format(pcm, params, config.format)) != 0)
     {
-        DEBUGPRINT("snd_pcm_hw_params_set_rate fail %s", snd_strerror(err));
+        DEBUGPRINT("snd_pcm_hw_params_set_format fail %s %s", SND_PCM_FORMAT_STRING(config.format), snd_strerror(err));
         goto error;
     }
 
-    // if ((err = snd_pcm_hw_params_set_rate(dev.pcm, params, sampleRate, 1)) != 0)
-    // {
-    //     DEBUGPRINT("snd_pcm_hw_params_set_rate fail %s", snd_strerror(err));
-    //     goto error;
-    // }
+    DEBUGPRINT("snd_pcm_hw_params_set_format %s", SND_PCM_FORMAT_STRING(config.format));
+    sampleHint = config.sampleHint;
 
-    uintParam = 0;
-    for (unsigned periods : kPeriodsToTry)
+    if ((err = snd_pcm_hw_params_set_channels(pcm, params, config.channels)) != 0)
     {
-        if ((err = snd_pcm_hw_params_set_period_size(dev.pcm, params, bufferSize, 0)) != 0)
-        {
-            DEBUGPRINT("snd_pcm_hw_params_set_period_size fail %u %u %s", periods, bufferSize, snd_strerror(err));
-            continue;
-        }
-
-        if ((err = snd_pcm_hw_params_set_periods(dev.pcm, params, periods, 0)) != 0)
-        {
-            DEBUGPRINT("snd_pcm_hw_params_set_periods fail %u %u %s", periods, bufferSize, snd_strerror(err));
-            continue;
-        }
-
-        uintParam = periods;
-        break;
+        DEBUGPRINT("snd_pcm_hw_params_set_channels fail %u %s", config.channels, snd_strerror(err));
+        goto error;
     }
 
-    if (uintParam == 0)
-    {
-        for (unsigned periods : kPeriodsToTry)
-        {
-            ulongParam = bufferSize * periods;
-            if ((err = snd_pcm_hw_params_set_buffer_size_max(dev.pcm, params, &ulongParam)) != 0)
-            {
-                DEBUGPRINT("snd_pcm_hw_params_set_buffer_size_max fail %u %u %s", periods, bufferSize, snd_strerror(err));
-                continue;
-            }
-
-            uintParam = periods;
-            break;
-        }
+    hwstatus.channels = config.channels;
 
-        if (uintParam == 0)
-        {
-            DEBUGPRINT("can't find a buffer size match");
-            goto error;
-        }
+    uintParam = config.sampleRate;
+    if ((err = snd_pcm_hw_params_set_rate_near(pcm, params, &uintParam, nullptr)) != 0)
+    {
+        DEBUGPRINT("snd_pcm_hw_params_set_rate_near fail %u %s", config.sampleRate, snd_strerror(err));
+        goto error;
     }
 
-    dev.hwstatus.periods = uintParam;
+    if (uintParam != deviceRate)
+        DEBUGPRINT("snd_pcm_hw_params_set_rate_near %u, will resample from %u", uintParam, sampleRate);
 
-    if (snd_pcm_hw_params_set_channels(dev.pcm, params, 2) == 0)
+    ulongParam = config.periodSize;
+    if ((err = snd_pcm_hw_params_set_period_size_near(pcm, params, &ulongParam, nullptr)) != 0)
     {
-        dev.hwstatus.channels = 2;
+        DEBUGPRINT("snd_pcm_hw_params_set_period_size_near fail %u %s", config.periodSize, snd_strerror(err));
+        goto error;
     }
-    else if ((err = snd_pcm_hw_params_get_channels(params, &uintParam)) != 0)
+
+    uintParam = config.periods;
+    if ((err = snd_pcm_hw_params_set_periods_near(pcm, params, &uintParam, nullptr)) != 0)
     {
-        DEBUGPRINT("snd_pcm_hw_params_get_channels fail %s", snd_strerror(err));
+        DEBUGPRINT("snd_pcm_hw_params_set_periods_near fail %u %s", config.periods, snd_strerror(err));
         goto error;
     }
-    else
+
+    if ((err = snd_pcm_hw_params(pcm, params)) != 0)
     {
-        dev.hwstatus.channels = uintParam;
+        DEBUGPRINT("snd_pcm_hw_params fail %s", snd_strerror(err));
+        goto error;
     }
 
-    if ((err = snd_pcm_hw_params(dev.pcm, params)) != 0)
+    if ((err = snd_pcm_hw_params_get_period_size(params, &periodSize, nullptr)) != 0)
     {
-        DEBUGPRINT("snd_pcm_hw_params fail %s", snd_strerror(err));
+        DEBUGPRINT("snd_pcm_hw_params_get_period_size fail %s", snd_strerror(err));
         goto error;
     }
 
-    if ((err = snd_pcm_sw_params_current(dev.pcm, swparams)) != 0)
+    if ((err = snd_pcm_sw_params_current(pcm, swparams)) != 0)
     {
         DEBUGPRINT("snd_pcm_sw_params_current fail %s", snd_strerror(err));
         goto error;
     }
 
     // SND_PCM_TSTAMP_NONE SND_PCM_TSTAMP_ENABLE (= SND_PCM_TSTAMP_MMAP)
-    if ((err = snd_pcm_sw_params_set_tstamp_mode(dev.pcm, swparams, SND_PCM_TSTAMP_MMAP)) != 0)
+    if ((err = snd_pcm_sw_params_set_tstamp_mode(pcm, swparams, SND_PCM_TSTAMP_MMAP)) != 0)
     {
         DEBUGPRINT("snd_pcm_sw_params_set_tstamp_mode fail %s", snd_strerror(err));
         goto error;
     }
 
-    // SND_PCM_TSTAMP_TYPE_MONOTONIC
-    if ((err = snd_pcm_sw_params_set_tstamp_type(dev.pcm, swparams, SND_PCM_TSTAMP_TYPE_MONOTONIC_RAW)) != 0)
+    // same clock as JACK, so that timestamps can be compared with jack_get_cycle_times
+    if ((err = snd_pcm_sw_params_set_tstamp_type(pcm, swparams, SND_PCM_TSTAMP_TYPE_MONOTONIC)) != 0)
     {
         DEBUGPRINT("snd_pcm_sw_params_set_tstamp_type fail %s", snd_strerror(err));
         goto error;
     }
 
-    if (playback)
+    // wake up from poll once a full period can be read or written
+    if ((err = snd_pcm_sw_params_set_avail_min(pcm, swparams, periodSize)) != 0)
     {
-        // unused in playback?
-        if ((err = snd_pcm_sw_params_set_avail_min(dev.pcm, swparams, 0)) != 0)
-        {
-            DEBUGPRINT("snd_pcm_sw_params_set_avail_min fail %s", snd_strerror(err));
-            goto error;
-        }
+        DEBUGPRINT("snd_pcm_sw_params_set_avail_min fail %s", snd_strerror(err));
+        goto error;
+    }
 
+    if (playback)
+    {
         // how many samples we need to write until audio hw starts
-        if ((err = snd_pcm_sw_params_set_start_threshold(dev.pcm, swparams, bufferSize)) != 0)
+        if ((err = snd_pcm_sw_params_set_start_threshold(pcm, swparams, periodSize)) != 0)
         {
             DEBUGPRINT("snd_pcm_sw_params_set_start_threshold fail %s", snd_strerror(err));
             goto error;
@@ -363,58 +568,212 @@ DeviceAudio* initDeviceAudio(const char* const deviceID,
     }
     else
     {
-        if ((err = snd_pcm_sw_params_set_avail_min(dev.pcm, swparams, 1)) != 0)
-        {
-            DEBUGPRINT("snd_pcm_sw_params_set_avail_min fail %s", snd_strerror(err));
-            goto error;
-        }
-
-        if ((err = snd_pcm_sw_params_set_start_threshold(dev.pcm, swparams, 0)) != 0)
+        if ((err = snd_pcm_sw_params_set_start_threshold(pcm, swparams, 0)) != 0)
         {
             DEBUGPRINT("snd_pcm_sw_params_set_start_threshold fail %s", snd_strerror(err));
             goto error;
         }
     }
 
-    if ((err = snd_pcm_sw_params_set_stop_threshold(dev.pcm, swparams, (snd_pcm_uframes_t)-1)) != 0)
+    if ((err = snd_pcm_sw_params_set_stop_threshold(pcm, swparams, (snd_pcm_uframes_t)-1)) != 0)
     {
         DEBUGPRINT("snd_pcm_sw_params_set_stop_threshold fail %s", snd_strerror(err));
         goto error;
     }
 
-    if ((err = snd_pcm_sw_params_set_silence_threshold(dev.pcm, swparams, 0)) != 0)
+    if ((err = snd_pcm_sw_params_set_silence_threshold(pcm, swparams, 0)) != 0)
     {
         DEBUGPRINT("snd_pcm_sw_params_set_silence_threshold fail %s", snd_strerror(err));
         goto error;
     }
 
-    if ((err = snd_pcm_sw_params(dev.pcm, swparams)) != 0)
+    if ((err = snd_pcm_sw_params(pcm, swparams)) != 0)
     {
         DEBUGPRINT("snd_pcm_sw_params fail %s", snd_strerror(err));
         goto error;
     }
 
-    if ((err = snd_pcm_prepare(dev.pcm)) != 0)
+    if ((err = snd_pcm_prepare(pcm)) != 0)
     {
         DEBUGPRINT("snd_pcm_prepare fail %s", snd_strerror(err));
         goto error;
     }
 
     snd_pcm_hw_params_get_channels(params, &uintParam);
-    DEBUGPRINT("num channels %u | %u", uintParam, dev.hwstatus.channels);
-    dev.hwstatus.channels = uintParam;
+    DEBUGPRINT("num channels %u | %u", uintParam, hwstatus.channels);
+    hwstatus.channels = uintParam;
 
     snd_pcm_hw_params_get_periods(params, &uintParam, nullptr);
-    DEBUGPRINT("num periods %u | %u", uintParam, dev.hwstatus.periods);
-    dev.hwstatus.periods = uintParam;
+    DEBUGPRINT("num periods %u | %u", uintParam, hwstatus.periods);
+    hwstatus.periods = uintParam;
 
-    snd_pcm_hw_params_get_period_size(params, &ulongParam, nullptr);
-    DEBUGPRINT("period size %lu | %u", ulongParam, dev.bufferSize);
-    dev.hwstatus.periodSize = ulongParam;
+    DEBUGPRINT("period size %lu | %u", periodSize, bufferSize);
+    hwstatus.periodSize = periodSize;
 
     snd_pcm_hw_params_get_buffer_size(params, &ulongParam);
-    DEBUGPRINT("buffer size %lu | %u", ulongParam, dev.bufferSize * dev.hwstatus.periods);
-    dev.hwstatus.fullBufferSize = ulongParam;
+    DEBUGPRINT("buffer size %lu | %lu", ulongParam, periodSize * hwstatus.periods);
+    hwstatus.fullBufferSize = ulongParam;
+
+    snd_pcm_hw_params_get_rate(params, &uintParam, nullptr);
+    DEBUGPRINT("sample rate %u | %u", uintParam, sampleRate);
+    hwstatus.sampleRate = uintParam;
+
+    return new AlsaDeviceBackend(pcm);
+
+error:
+    closeSoundcardPcm(pcm);
+    return nullptr;
+}
+
+DeviceAudio* initDeviceAudio(const char* const deviceID,
+                             const bool playback,
+                             const uint16_t bufferSize,
+                             const uint32_t sampleRate,
+                             const uint8_t channels,
+                             const uint32_t deviceSampleRate,
+                             const DeviceResamplerQuality quality)
+{
+    uint32_t sampleHint = 0;
+    DeviceAudio::HWStatus hwstatus = {};
+
+    DeviceBackend* const backend = openDeviceBackend(deviceID, playback, bufferSize, sampleRate,
+                                                     channels, deviceSampleRate, sampleHint, hwstatus);
+    if (backend == nullptr)
+        return nullptr;
+
+    return initDeviceAudio(backend, deviceID, playback, bufferSize, sampleRate, sampleHint, hwstatus, quality);
+}
+
+DeviceAudio* initDeviceAudioDuplex(const char* const deviceID,
+                                   const uint16_t bufferSize,
+                                   const uint32_t sampleRate,
+                                   const uint8_t channels,
+                                   const uint32_t deviceSampleRate,
+                                   const DeviceResamplerQuality quality)
+{
+    uint32_t captureHint = 0, playbackHint = 0;
+    DeviceAudio::HWStatus captureHw = {}, playbackHw = {};
+
+    DeviceBackend* const captureBackend = openDeviceBackend(deviceID, false, bufferSize, sampleRate,
+                                                            channels, deviceSampleRate, captureHint, captureHw);
+    if (captureBackend == nullptr)
+        return nullptr;
+
+    // linked streams share the hardware pointer, so playback must run at the rate capture got
+    DeviceBackend* const playbackBackend = openDeviceBackend(deviceID, true, bufferSize, sampleRate,
+                                                             channels, captureHw.sampleRate, playbackHint, playbackHw);
+    if (playbackBackend == nullptr)
+    {
+        delete captureBackend;
+        return nullptr;
+    }
+
+    if (playbackHw.sampleRate != captureHw.sampleRate)
+    {
+        DEBUGPRINT("duplex sample rate mismatch, capture %u playback %u", captureHw.sampleRate, playbackHw.sampleRate);
+        delete captureBackend;
+        delete playbackBackend;
+        return nullptr;
+    }
+
+    return initDeviceAudioDuplex(captureBackend, playbackBackend, deviceID, bufferSize, sampleRate,
+                                 captureHint, captureHw, playbackHint, playbackHw, quality);
+}
+
+// pick the converters for the device format once, with a fixed channel count when available
+// non-interleaved channels are converted one at a time
+static void deviceSetupConverters(DeviceAudio& dev)
+{
+    const bool playback = (dev.hints & kDeviceCapture) == 0;
+    const simd::Converters& conv = simd::getConverters(dev.hints & kDeviceNonInterleaved ? 1 : dev.hwstatus.channels);
+
+    simd::Float2IntFunc f2i;
+    simd::Int2FloatFunc i2f;
+
+    switch (dev.hints & kDeviceSampleHints)
+    {
+    case kDeviceSample16:
+        f2i = conv.f2i_s16;
+        i2f = conv.i2f_s16;
+        break;
+    case kDeviceSample24:
+        f2i = conv.f2i_s24;
+        i2f = conv.i2f_s24;
+        break;
+    case kDeviceSample24LE3:
+        f2i = conv.f2i_s24le3;
+        i2f = conv.i2f_s24le3;
+        break;
+    case kDeviceSampleFloat:
+        f2i = conv.f2i_f32;
+        i2f = conv.i2f_f32;
+        break;
+    case kDeviceSample24BE3:
+        f2i = conv.f2i_s24be3;
+        i2f = conv.i2f_s24be3;
+        break;
+    case kDeviceSample32BE:
+        f2i = conv.f2i_s32be;
+        i2f = conv.i2f_s32be;
+        break;
+    case kDeviceSample32:
+    default:
+        f2i = conv.f2i_s32;
+        i2f = conv.i2f_s32;
+        break;
+    }
+
+    dev.convert.playback = playback ? f2i : nullptr;
+    dev.convert.capture = playback ? nullptr : i2f;
+}
+
+// everything but the device thread, which is started afterwards with startDeviceThread
+// takes ownership of the backend, deleting it on failure
+static DeviceAudio* createDeviceAudio(DeviceBackend* const backend,
+                                      const char* const deviceID,
+                                      const bool playback,
+                                      const uint16_t bufferSize,
+                                      const uint32_t sampleRate,
+                                      const uint32_t sampleHint,
+                                      const DeviceAudio::HWStatus& hwstatus,
+                                      const DeviceResamplerQuality quality)
+{
+    int err;
+    DeviceAudio dev = {};
+    dev.backend = backend;
+    dev.sampleRate = sampleRate;
+    dev.bufferSize = bufferSize;
+    dev.hints = kDeviceInitializing|kDeviceStarting|kDeviceBuffering|(playback ? 0 : kDeviceCapture)|sampleHint;
+    dev.hwstatus = hwstatus;
+
+    if (dev.hwstatus.sampleRate == 0)
+        dev.hwstatus.sampleRate = sampleRate;
+
+    audioLogStart();
+
+    if ((err = backend->pollDescriptorsCount()) <= 0)
+    {
+        DEBUGPRINT("pollDescriptorsCount fail %s", snd_strerror(err));
+        goto error;
+    }
+
+    dev.numPollFds = err + 1;
+    dev.pollfds = new struct pollfd[dev.numPollFds]();
+
+    if ((err = backend->pollDescriptors(dev.pollfds + 1, dev.numPollFds - 1)) < 0)
+    {
+        DEBUGPRINT("pollDescriptors fail %s", snd_strerror(err));
+        goto error;
+    }
+
+    if ((dev.pollfds[0].fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+    {
+        DEBUGPRINT("eventfd fail %s", std::strerror(errno));
+        goto error;
+    }
+
+    dev.pollfds[0].events = POLLIN;
+    dev.pollfds[0].revents = 0;
 
     dev.deviceID = strdup(deviceID);
     dev.enabled = true;
@@ -423,13 +782,73 @@ DeviceAudio* initDeviceAudio(const char* const deviceID,
         const uint8_t channels = dev.hwstatus.channels;
         const uint16_t blocks = (playback ? AUDIO_BRIDGE_PLAYBACK_RINGBUFFER_BLOCKS
                                           : AUDIO_BRIDGE_CAPTURE_RINGBUFFER_BLOCKS);
-        const size_t rawbufferlen = getSampleSizeFromHints(dev.hints) * dev.bufferSize * channels * 2;
 
-        dev.buffers.raw = new int8_t[rawbufferlen * AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MULT];
+        // resampler output rate divided by input rate
+        const double ratio = playback ? static_cast<double>(dev.hwstatus.sampleRate) / sampleRate
+                                      : static_cast<double>(sampleRate) / dev.hwstatus.sampleRate;
+
+        // playback reads 1 host period at a time, capture up to AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MULT device periods
+        const uint32_t maxInputFrames = playback ? bufferSize
+                                                 : dev.hwstatus.periodSize * AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MULT;
+
+        // split channels into groups for the worker threads, if there are enough of them
+        dev.numChannelGroups = std::max(1u, std::min<uint32_t>(getDeviceAudioWorkerThreads() + 1u,
+                                                               channels / AUDIO_BRIDGE_WORKER_MIN_CHANNELS));
+
+        if (dev.numChannelGroups > 1)
+        {
+            dev.workers = new WorkerPool;
+
+            if (dev.workers->start(dev.numChannelGroups - 1, playback ? 69 : 70))
+            {
+                DEBUGPRINT("using %u worker threads for %u channels", dev.numChannelGroups - 1, channels);
+            }
+            else
+            {
+                DEBUGPRINT("worker threads start fail, using a single thread");
+                delete dev.workers;
+                dev.workers = nullptr;
+                dev.numChannelGroups = 1;
+            }
+        }
+
+        dev.resamplers = new AdaptiveResampler[dev.numChannelGroups];
+
+        for (uint8_t g = 0; g < dev.numChannelGroups; ++g)
+        {
+            const uint8_t groupChannels = (g + 1) * channels / dev.numChannelGroups - g * channels / dev.numChannelGroups;
+
+            if (! dev.resamplers[g].setup(ratio, groupChannels, getResamplerFilterLength(quality), maxInputFrames,
+                                          AUDIO_BRIDGE_RESAMPLER_BYPASS_EPSILON,
+                                          (playback ? dev.hwstatus.sampleRate : sampleRate)
+                                          * AUDIO_BRIDGE_RESAMPLER_CROSSFADE_TIME))
+            {
+                DEBUGPRINT("resampler setup fail, ratio %f quality %s", ratio, getResamplerQualityName(quality));
+                delete dev.workers;
+                delete[] dev.resamplers;
+                std::free(dev.deviceID);
+                goto error;
+            }
+        }
+
+        if (dev.hwstatus.sampleRate != sampleRate)
+        {
+            DEBUGPRINT("resampling between host %u and device %u", sampleRate, dev.hwstatus.sampleRate);
+        }
+
+        DEBUGPRINT("resampler quality %s, %u frames delay",
+                   getResamplerQualityName(quality), dev.resamplers[0].getLatency());
+
+        // device read buffer for capture, resampler output for playback
+        const uint32_t bufferFrames = std::max(dev.hwstatus.periodSize * AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MULT,
+                                               dev.resamplers[0].getMaxOutputFrames(maxInputFrames));
+
         dev.buffers.f32 = new float*[channels];
 
         for (uint8_t c=0; c<channels; ++c)
-            dev.buffers.f32[c] = new float[dev.bufferSize * 2 * AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MULT];
+            dev.buffers.f32[c] = new float[bufferFrames];
+
+        deviceSetupConverters(dev);
 
         dev.ringbuffer = new AudioRingBuffer;
         dev.ringbuffer->createBuffer(channels, dev.bufferSize * blocks);
@@ -437,51 +856,181 @@ DeviceAudio* initDeviceAudio(const char* const deviceID,
         dev.rbFillTarget = static_cast<double>(playback ? 1 : AUDIO_BRIDGE_CAPTURE_LATENCY_BLOCKS) / blocks;
         dev.rbTotalNumSamples = dev.bufferSize * blocks / kRingBufferDataFactor;
         dev.rbRatio = 1.0;
-        printf("target is %f\n", dev.rbFillTarget);
+        AUDIO_LOG(kAudioLogDebug, "target is %f", dev.rbFillTarget);
+
+        deviceResetLatencyWindow(&dev);
+
+        if (! playback && getDeviceAudioAdaptiveLatency() > 0.f)
+        {
+            dev.latency.margin = std::max(1u, static_cast<uint32_t>(getDeviceAudioAdaptiveLatency()
+                                                                    * sampleRate / 1000));
+            DEBUGPRINT("adaptive latency, %u frames of margin", dev.latency.margin);
+        }
+
+        dev.clock.host.setup(sampleRate);
+        dev.clock.fill = 1.0;
 
         DeviceAudio* const devptr = new DeviceAudio;
         std::memcpy(devptr, &dev, sizeof(dev));
 
-        void* (*threadCall)(void*) = playback ? devicePlaybackThread : deviceCaptureThread;
+        return devptr;
+    }
 
-        pthread_attr_t attr;
+error:
+    if (dev.pollfds != nullptr)
+    {
+        if (dev.pollfds[0].fd > 0)
+            close(dev.pollfds[0].fd);
+        delete[] dev.pollfds;
+    }
+
+    delete backend;
+    audioLogStop();
+    return nullptr;
+}
+
+static bool startDeviceThread(DeviceAudio* const dev, void* (*const threadCall)(void*), const int priority)
+{
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    sched_param sched = {};
+    sched.sched_priority = priority;
+    pthread_attr_setschedparam(&attr, &sched);
+    if (pthread_create(&dev->thread, &attr, threadCall, dev) != 0)
+    {
+        pthread_attr_destroy(&attr);
         pthread_attr_init(&attr);
-        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
-        pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
-        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
-        sched_param sched = {};
-        sched.sched_priority = playback ? 69 : 70;
-        pthread_attr_setschedparam(&attr, &sched);
-        if (pthread_create(&devptr->thread, &attr, threadCall, devptr) != 0)
+        if (pthread_create(&dev->thread, &attr, threadCall, dev) != 0)
         {
             pthread_attr_destroy(&attr);
-            pthread_attr_init(&attr);
-            if (pthread_create(&devptr->thread, &attr, threadCall, devptr) != 0)
-            {
-                pthread_attr_destroy(&attr);
-                goto error;
-            }
+            dev->thread = 0;
+            return false;
         }
-        pthread_attr_destroy(&attr);
+    }
+    pthread_attr_destroy(&attr);
 
-        return devptr;
+    return true;
+}
+
+DeviceAudio* initDeviceAudio(DeviceBackend* const backend,
+                             const char* const deviceID,
+                             const bool playback,
+                             const uint16_t bufferSize,
+                             const uint32_t sampleRate,
+                             const uint32_t sampleHint,
+                             const DeviceAudio::HWStatus& hwstatus,
+                             const DeviceResamplerQuality quality)
+{
+    DeviceAudio* const dev = createDeviceAudio(backend, deviceID, playback, bufferSize, sampleRate,
+                                               sampleHint, hwstatus, quality);
+    if (dev == nullptr)
+        return nullptr;
+
+    if (! startDeviceThread(dev, playback ? devicePlaybackThread : deviceCaptureThread, playback ? 69 : 70))
+    {
+        DEBUGPRINT("pthread_create fail");
+        closeDeviceAudio(dev);
+        return nullptr;
     }
 
-error:
-    snd_pcm_close(dev.pcm);
-    return nullptr;
+    return dev;
+}
+
+DeviceAudio* initDeviceAudioDuplex(DeviceBackend* const captureBackend,
+                                   DeviceBackend* const playbackBackend,
+                                   const char* const deviceID,
+                                   const uint16_t bufferSize,
+                                   const uint32_t sampleRate,
+                                   const uint32_t captureHint,
+                                   const DeviceAudio::HWStatus& captureHw,
+                                   const uint32_t playbackHint,
+                                   const DeviceAudio::HWStatus& playbackHw,
+                                   const DeviceResamplerQuality quality)
+{
+    int err;
+
+    // must happen before any of them starts, so both always start, stop and prepare together
+    if ((err = captureBackend->link(playbackBackend)) < 0)
+    {
+        DEBUGPRINT("link fail %s", snd_strerror(err));
+        delete captureBackend;
+        delete playbackBackend;
+        return nullptr;
+    }
+
+    DeviceAudio* const dev = createDeviceAudio(captureBackend, deviceID, false, bufferSize, sampleRate,
+                                               captureHint, captureHw, quality);
+    if (dev == nullptr)
+    {
+        delete playbackBackend;
+        return nullptr;
+    }
+
+    DeviceAudio* const playDev = createDeviceAudio(playbackBackend, deviceID, true, bufferSize, sampleRate,
+                                                   playbackHint, playbackHw, quality);
+    if (playDev == nullptr)
+    {
+        closeDeviceAudio(dev);
+        return nullptr;
+    }
+
+    dev->duplex = playDev;
+    playDev->duplex = dev;
+
+    // JACK cycle notifications for either side wake up the single thread
+    close(playDev->pollfds[0].fd);
+
+    if ((playDev->pollfds[0].fd = dup(dev->pollfds[0].fd)) < 0)
+    {
+        DEBUGPRINT("dup fail %s", std::strerror(errno));
+        closeDeviceAudio(dev);
+        return nullptr;
+    }
+
+    if (! startDeviceThread(dev, deviceDuplexThread, 70))
+    {
+        DEBUGPRINT("pthread_create fail");
+        closeDeviceAudio(dev);
+        return nullptr;
+    }
+
+    // same thread serves both, joined when closing the capture side
+    playDev->thread = dev->thread;
+
+    return dev;
 }
 
-bool runDeviceAudio(DeviceAudio* const dev, float* buffers[])
+bool runDeviceAudio(DeviceAudio* const dev, float* buffers[], const uint16_t frames, const uint64_t cycleTimeUsecs)
 {
+    DISTRHO_SAFE_ASSERT_RETURN(frames <= dev->bufferSize, dev->thread != 0);
+
+    if (frames == 0)
+        return dev->thread != 0;
+
     const uint32_t frame = dev->frame;
 
+    if (cycleTimeUsecs != 0)
+    {
+        dev->clock.host.update(cycleTimeUsecs * 1e-6, dev->clock.hostFrames);
+    }
+    else
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        dev->clock.host.update(ts.tv_sec + ts.tv_nsec * 1e-9, dev->clock.hostFrames);
+    }
+
+    dev->clock.hostFrames += frames;
+
     if (dev->hints & kDeviceCapture)
-        runDeviceAudioCapture(dev, buffers, frame);
+        runDeviceAudioCapture(dev, buffers, frames, frame);
     else
-        runDeviceAudioPlayback(dev, buffers, frame);
+        runDeviceAudioPlayback(dev, buffers, frames, frame);
 
-    dev->frame += dev->bufferSize;
+    dev->frame += frames;
 
     return dev->thread != 0;
 }
@@ -490,32 +1039,228 @@ void closeDeviceAudio(DeviceAudio* const dev)
 {
     const uint8_t channels = dev->hwstatus.channels;
 
-    if (dev->thread != 0)
+    // thread resets dev->thread when closing, keep a copy for joining
+    if (const pthread_t thread = dev->thread)
     {
         dev->hwstatus.channels = 0;
-        sem_post(&dev->sem);
-        pthread_join(dev->thread, nullptr);
-        snd_pcm_close(dev->pcm);
+        deviceNotify(dev);
+        pthread_join(thread, nullptr);
+    }
+
+    // playback side of full-duplex mode, its thread was the one just joined
+    if (DeviceAudio* const duplex = dev->duplex)
+    {
+        duplex->duplex = nullptr;
+        duplex->thread = 0;
+        closeDeviceAudio(duplex);
     }
 
-    sem_destroy(&dev->sem);
+    delete dev->backend;
+    delete dev->ringbuffer;
+    delete dev->workers;
+    delete[] dev->resamplers;
+
+    close(dev->pollfds[0].fd);
+    delete[] dev->pollfds;
 
     std::free(dev->deviceID);
 
     for (uint8_t c=0; c<channels; ++c)
         delete[] dev->buffers.f32[c];
     delete[] dev->buffers.f32;
-    delete[] dev->buffers.raw;
 
     delete dev;
+
+    audioLogStop();
+}
+
+uint32_t getDeviceAudioLatency(DeviceAudio* const dev)
+{
+    // resampler delay is in input frames, host for playback and device for capture
+    const uint32_t resamplerLatency = dev->hints & kDeviceCapture
+                                    ? deviceToHostFrames(dev, dev->resamplers[0].getLatency())
+                                    : dev->resamplers[0].getLatency();
+
+    return getDeviceRingBufferTarget(dev) + deviceToHostFrames(dev, dev->hwstatus.fullBufferSize) + resamplerLatency;
+}
+
+uint32_t getDeviceAudioMeasuredLatency(DeviceAudio* const dev)
+{
+    const uint32_t level = dev->latency.level;
+
+    if (level == 0)
+        return getDeviceAudioLatency(dev);
+
+    return getDeviceAudioLatency(dev) - getDeviceRingBufferTarget(dev) + level;
 }
 
 // --------------------------------------------------------------------------------------------------------------------
 
-static void setDeviceTimings(DeviceAudio* const dev)
+// -1 until set or read from the environment
+static int gNumWorkerThreads = -1;
+
+void setDeviceAudioWorkerThreads(const uint8_t count)
+{
+    gNumWorkerThreads = count;
+}
+
+uint8_t getDeviceAudioWorkerThreads()
+{
+    if (gNumWorkerThreads < 0)
+    {
+        const char* const env = std::getenv("AUDIO_BRIDGE_WORKER_THREADS");
+        gNumWorkerThreads = env != nullptr ? std::max(0, std::min(255, std::atoi(env))) : 0;
+    }
+
+    return gNumWorkerThreads;
+}
+
+// negative until set or read from the environment
+static float gAdaptiveLatencyMargin = -1.f;
+
+void setDeviceAudioAdaptiveLatency(const float marginMs)
+{
+    gAdaptiveLatencyMargin = std::max(0.f, marginMs);
+}
+
+float getDeviceAudioAdaptiveLatency()
+{
+    if (gAdaptiveLatencyMargin < 0.f)
+    {
+        const char* const env = std::getenv("AUDIO_BRIDGE_ADAPTIVE_LATENCY");
+        gAdaptiveLatencyMargin = env != nullptr ? std::max(0.f, static_cast<float>(std::atof(env))) : 0.f;
+    }
+
+    return gAdaptiveLatencyMargin;
+}
+
+static void deviceSetResamplerRatio(DeviceAudio* const dev, const double ratio)
+{
+    for (uint8_t g = 0; g < dev->numChannelGroups; ++g)
+        dev->resamplers[g].setRatio(ratio);
+}
+
+// volume applied by the device threads while converting from/to the device format
+struct DeviceGain {
+    // smooth initial volume to prevent clicks on start, also used for enabling and disabling
+    ExponentialValueSmoother gain;
+    // quick fade-in after xruns
+    LinearValueSmoother fade;
+    // 1 value per device frame
+    float* gains;
+
+    DeviceGain(const uint32_t sampleRate, const uint32_t maxFrames)
+        : gains(new float[maxFrames])
+    {
+        gain.setSampleRate(sampleRate);
+        gain.setTimeConstant(0.5f);
+
+        fade.setSampleRate(sampleRate);
+        fade.setTimeConstant(AUDIO_BRIDGE_XRUN_FADE_TIME);
+        fade.setTargetValue(1.f);
+        fade.clearToTargetValue();
+    }
+
+    ~DeviceGain()
+    {
+        delete[] gains;
+    }
+
+    // returns the gains for the next frames, or nullptr if they are all 1 so converters can skip applying them
+    const float* process(const uint32_t frames) noexcept
+    {
+        if (fade.getCurrentValue() == 1.f && fade.getTargetValue() == 1.f && gain.getTargetValue() == 1.f)
+        {
+            // the exponential smoother never reaches its target on its own
+            if (gain.getCurrentValue() >= AUDIO_BRIDGE_GAIN_UNITY_THRESHOLD)
+            {
+                gain.clearToTargetValue();
+                return nullptr;
+            }
+        }
+
+        for (uint32_t i = 0; i < frames; ++i)
+            gains[i] = gain.next() * fade.next();
+
+        return gains;
+    }
+};
+
+struct DeviceChannelsJob {
+    DeviceAudio* dev;
+    float** inputs;
+    float** outputs;
+    uint32_t channels;
+    uint32_t inputFrames;
+    uint32_t outputFrames;
+};
+
+// resample the channels of 1 group, from the device thread or a worker
+static void deviceProcessChannelGroup(void* const arg, const uint32_t group)
+{
+    DeviceChannelsJob* const job = static_cast<DeviceChannelsJob*>(arg);
+    DeviceAudio* const dev = job->dev;
+
+    const uint32_t first = group * job->channels / dev->numChannelGroups;
+
+    const uint32_t frames = dev->resamplers[group].process(job->inputs + first, job->inputFrames, job->outputs + first);
+
+    // all resamplers get the same ratio and amount of input, so they output the same amount too
+    if (group == 0)
+        job->outputFrames = frames;
+}
+
+// returns the amount of frames written into outputs
+static uint32_t deviceProcessChannels(DeviceAudio* const dev,
+                                      float** const inputs,
+                                      const uint32_t frames,
+                                      float** const outputs)
+{
+    DeviceChannelsJob job = { dev, inputs, outputs, dev->hwstatus.channels, frames, 0 };
+
+    // channel count goes to 0 when closing, nothing to do then
+    if (job.channels == 0)
+        return 0;
+
+    if (dev->workers != nullptr)
+        dev->workers->run(deviceProcessChannelGroup, &job);
+    else
+        deviceProcessChannelGroup(&job, 0);
+
+    return job.outputFrames;
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+static void setDeviceTimings(DeviceAudio* const dev, const uint16_t frames)
 {
     if (dev->hints & kDeviceBuffering)
         return;
+
+    // use timestamp-based clock-drift estimation when available, with a slow ringbuffer fill correction on top
+    // in full-duplex mode both sides run from the same hardware clock, estimated by the capture side
+    const double deviceFrameTime = dev->duplex != nullptr && (dev->hints & kDeviceCapture) == 0
+                                 ? dev->duplex->clock.deviceFrameTime
+                                 : dev->clock.deviceFrameTime;
+
+    if (deviceFrameTime != 0.0 && dev->clock.host.isLocked())
+    {
+        // compare against nominal rates, the resampler takes care of the rate conversion itself
+        const double hostFrameTime = dev->clock.host.getFrameTime() * dev->sampleRate / dev->hwstatus.sampleRate;
+        const double drift = dev->hints & kDeviceCapture ? deviceFrameTime / hostFrameTime
+                                                         : hostFrameTime / deviceFrameTime;
+
+        const double fill = dev->ringbuffer->getNumReadableSamples()
+                          / (double)kRingBufferDataFactor / dev->rbTotalNumSamples / dev->rbFillTarget;
+
+        dev->clock.fill += (fill - dev->clock.fill) * frames / (dev->sampleRate * AUDIO_BRIDGE_CLOCK_FILL_TIME);
+
+        dev->rbRatio = std::max(0.9, std::min(1.1,
+            drift * (1.0 - (dev->clock.fill - 1.0) * AUDIO_BRIDGE_CLOCK_FILL_CORRECTION)
+        ));
+        return;
+    }
+
     if (dev->framesDone < dev->sampleRate * AUDIO_BRIDGE_CLOCK_DRIFT_WAIT_DELAY)
         return;
 
@@ -532,9 +1277,88 @@ static void setDeviceTimings(DeviceAudio* const dev)
         dev->rbRatio = balratio;
 }
 
+// target is in host frames, the default one is also the maximum
+static void deviceSetLatencyTarget(DeviceAudio* const dev, const uint32_t target)
+{
+    const uint32_t maxTarget = dev->bufferSize * AUDIO_BRIDGE_CAPTURE_LATENCY_BLOCKS;
+
+    dev->rbFillTarget = std::max(dev->bufferSize, std::min(maxTarget, target))
+                      / (dev->rbTotalNumSamples * kRingBufferDataFactor);
+}
+
+static void deviceResetLatencyWindow(DeviceAudio* const dev)
+{
+    dev->latency.frames = 0;
+    dev->latency.minLevel = UINT32_MAX;
+    dev->latency.sumLevel = 0;
+    dev->latency.numLevels = 0;
+}
+
+// real underrun while adapting, go back to the default target and stay there for a while
+static void deviceResetLatency(DeviceAudio* const dev)
+{
+    if (dev->latency.margin == 0)
+        return;
+
+    deviceSetLatencyTarget(dev, dev->bufferSize * AUDIO_BRIDGE_CAPTURE_LATENCY_BLOCKS);
+    deviceResetLatencyWindow(dev);
+    dev->latency.hold = dev->sampleRate * AUDIO_BRIDGE_ADAPTIVE_LATENCY_HOLD_TIME;
+    dev->latency.refilling = false;
+
+    AUDIO_LOG(kAudioLogWarning, "%08u | capture | underrun, latency target reset to %u frames",
+              dev->frame, getDeviceRingBufferTarget(dev));
+}
+
+// called by the host side after each ringbuffer read or write, measuring the fill level over time
+// when adapting, the target is lowered 1 host block at a time down to the observed jitter (average minus minimum
+// fill level) plus margin, and raised right away if the fill level goes below half of the margin
+static void deviceUpdateLatency(DeviceAudio* const dev, const uint16_t frames)
+{
+    const uint32_t level = dev->ringbuffer->getNumReadableSamples();
+
+    dev->latency.frames += frames;
+    dev->latency.minLevel = std::min(dev->latency.minLevel, level);
+    dev->latency.sumLevel += level;
+    ++dev->latency.numLevels;
+    dev->latency.hold -= std::min<uint32_t>(dev->latency.hold, frames);
+
+    const uint32_t margin = dev->latency.margin;
+    const uint32_t target = getDeviceRingBufferTarget(dev);
+
+    if (margin != 0 && level < margin / 2)
+    {
+        deviceSetLatencyTarget(dev, std::max(target, level + margin) + dev->bufferSize);
+        deviceResetLatencyWindow(dev);
+        dev->latency.hold = dev->sampleRate * AUDIO_BRIDGE_ADAPTIVE_LATENCY_HOLD_TIME;
+        dev->latency.refilling = true;
+
+        AUDIO_LOG(kAudioLogWarning, "%08u | capture | near-underrun with %u frames left, latency target raised to %u",
+                  dev->frame, level, getDeviceRingBufferTarget(dev));
+        return;
+    }
+
+    if (dev->latency.frames < dev->sampleRate * AUDIO_BRIDGE_ADAPTIVE_LATENCY_WINDOW)
+        return;
+
+    const uint32_t average = dev->latency.sumLevel / dev->latency.numLevels;
+    const uint32_t jitter = average - dev->latency.minLevel;
+
+    dev->latency.level = average;
+    deviceResetLatencyWindow(dev);
+
+    if (margin == 0 || dev->latency.hold != 0 || jitter + margin >= target)
+        return;
+
+    deviceSetLatencyTarget(dev, std::max(jitter + margin, target - dev->bufferSize));
+
+    DEBUGPRINT("%08u | capture | fill level jitter %u frames, average %u, latency target lowered to %u",
+               dev->frame, jitter, average, getDeviceRingBufferTarget(dev));
+}
+
 // --------------------------------------------------------------------------------------------------------------------
 
 #include "audio-capture.cpp"
 #include "audio-playback.cpp"
+#include "audio-duplex.cpp"
 
 // --------------------------------------------------------------------------------------------------------------------
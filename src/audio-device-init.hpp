@@ -6,19 +6,31 @@
 //#define ALSA_PCM_NEW_HW_PARAMS_API
 //#define ALSA_PCM_NEW_SW_PARAMS_API
 #include <alsa/asoundlib.h>
+#include <poll.h>
 #include <pthread.h>
-#include <semaphore.h>
 
+#include "AdaptiveResampler.hpp"
+#include "DelayLockedLoop.hpp"
 #include "RingBuffer.hpp"
+#include "WorkerPool.hpp"
+#include "audio-device-backend.hpp"
+#include "audio-device-discovery.hpp"
+#include "audio-log.hpp"
+#include "audio-utils.hpp"
 #include "ValueSmoother.hpp"
 
-#include "zita-resampler/vresampler.h"
-
 // --------------------------------------------------------------------------------------------------------------------
 
 // how many seconds to wait until start trying to compensate for clock drift
+// only used as fallback when timestamps are not available, see DelayLockedLoop for the regular case
 #define AUDIO_BRIDGE_CLOCK_DRIFT_WAIT_DELAY 2
 
+// how many seconds of ringbuffer fill level to average for latency correction
+#define AUDIO_BRIDGE_CLOCK_FILL_TIME 1.0
+
+// how much the ringbuffer fill level error (relative to target) steers the clock-drift estimate
+#define AUDIO_BRIDGE_CLOCK_FILL_CORRECTION 0.0005
+
 // how many steps to use for smoothing the clock-drift compensation filter
 #define AUDIO_BRIDGE_CLOCK_FILTER_STEPS_1 1024
 #define AUDIO_BRIDGE_CLOCK_FILTER_STEPS_2 8192
@@ -33,9 +45,33 @@
 // prefer to read in big blocks, higher latency but more stable capture
 #define AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MULT 8
 
+// how many seconds of ringbuffer fill level to observe before lowering the adaptive capture latency target
+#define AUDIO_BRIDGE_ADAPTIVE_LATENCY_WINDOW 2.0
+
+// how many seconds to wait after a near-underrun before lowering the adaptive capture latency target again
+#define AUDIO_BRIDGE_ADAPTIVE_LATENCY_HOLD_TIME 10.0
+
 // how many audio buffer-size blocks to keep in the playback ringbuffer
 #define AUDIO_BRIDGE_PLAYBACK_RINGBUFFER_BLOCKS 8
 
+// how many seconds to fade-in audio after recovering from an xrun
+#define AUDIO_BRIDGE_XRUN_FADE_TIME 0.01f
+
+// how close to 1 the start/enable volume ramp has to get before gain is no longer applied
+#define AUDIO_BRIDGE_GAIN_UNITY_THRESHOLD 0.99999f
+
+// how far from 1 the clock-drift ratio can be before the resampler is engaged, 0 to always resample
+#define AUDIO_BRIDGE_RESAMPLER_BYPASS_EPSILON 5e-6
+
+// how many seconds to crossfade when engaging or bypassing the resampler
+#define AUDIO_BRIDGE_RESAMPLER_CROSSFADE_TIME 0.005
+
+// minimum amount of channels per thread when using worker threads, see setDeviceAudioWorkerThreads
+#define AUDIO_BRIDGE_WORKER_MIN_CHANNELS 4
+
+// resampler quality used when none is given, see DeviceResamplerQuality
+#define AUDIO_BRIDGE_RESAMPLER_DEFAULT_QUALITY kResamplerQualityLow
+
 // --------------------------------------------------------------------------------------------------------------------
 
 enum DeviceHints {
@@ -47,50 +83,162 @@ enum DeviceHints {
     kDeviceSample24 = 0x20,
     kDeviceSample24LE3 = 0x40,
     kDeviceSample32 = 0x80,
+    kDeviceSampleFloat = 0x100,
+    kDeviceSample24BE3 = 0x200,
+    kDeviceSample32BE = 0x400,
     kDeviceSampleHints = kDeviceSample16|kDeviceSample24|kDeviceSample24LE3|kDeviceSample32
+                       |kDeviceSampleFloat|kDeviceSample24BE3|kDeviceSample32BE,
+    // each channel has its own mmap area, instead of a single interleaved one
+    kDeviceNonInterleaved = 0x800,
+};
+
+// resampler quality presets, higher ones have less aliasing but use more CPU and add more latency
+// run "audio-bridge-test bench-quality" for the actual numbers on a given machine
+enum DeviceResamplerQuality {
+    kResamplerQualityLow,
+    kResamplerQualityMedium,
+    kResamplerQualityHigh,
+    kResamplerQualityBest,
+    kResamplerQualityCount
 };
 
 static constexpr const uint8_t kRingBufferDataFactor = 32;
 
 static inline constexpr
-uint8_t getSampleSizeFromHints(const uint8_t hints)
+uint8_t getSampleSizeFromHints(const uint32_t hints)
 {
     return hints & kDeviceSample16 ? sizeof(int16_t) :
            hints & kDeviceSample24 ? sizeof(int32_t) :
-           hints & kDeviceSample24LE3 ? 3 :
-           hints & kDeviceSample32 ? sizeof(int32_t) :
+           hints & (kDeviceSample24LE3|kDeviceSample24BE3) ? 3 :
+           hints & (kDeviceSample32|kDeviceSample32BE) ? sizeof(int32_t) :
+           hints & kDeviceSampleFloat ? sizeof(float) :
            0;
 }
 
+// filter half-length, which is also the group delay in input frames
+static inline constexpr
+uint32_t getResamplerFilterLength(const DeviceResamplerQuality quality)
+{
+    return quality == kResamplerQualityMedium ? 16 :
+           quality == kResamplerQualityHigh ? 32 :
+           quality == kResamplerQualityBest ? 48 :
+           8;
+}
+
+static inline constexpr
+const char* getResamplerQualityName(const DeviceResamplerQuality quality)
+{
+    return quality == kResamplerQualityMedium ? "medium" :
+           quality == kResamplerQualityHigh ? "high" :
+           quality == kResamplerQualityBest ? "best" :
+           "low";
+}
+
+// parse a preset name as returned by getResamplerQualityName, returns false if unknown
+static inline
+bool parseResamplerQuality(const char* const name, DeviceResamplerQuality& quality)
+{
+    for (uint8_t q = 0; q < kResamplerQualityCount; ++q)
+    {
+        if (std::strcmp(name, getResamplerQualityName(static_cast<DeviceResamplerQuality>(q))) == 0)
+        {
+            quality = static_cast<DeviceResamplerQuality>(q);
+            return true;
+        }
+    }
+
+    return false;
+}
+
 // --------------------------------------------------------------------------------------------------------------------
 
 struct DeviceAudio {
+    // device side configuration, sizes in device frames
     struct HWStatus {
         uint32_t channels;
         uint32_t periods;
         uint32_t periodSize;
         uint32_t fullBufferSize;
+        uint32_t sampleRate;
     } hwstatus;
 
     char* deviceID;
 
-    snd_pcm_t* pcm;
+    DeviceBackend* backend;
     uint32_t frame;
     uint32_t framesDone;
+    // host side sample rate and buffer size, can be different from the device
     uint32_t sampleRate;
     uint32_t bufferSize;
     uint32_t hints;
     bool enabled;
 
     struct {
-        int8_t* raw;
         float** f32;
     } buffers;
 
+    // conversion between buffers.f32 and the device mmap area, specialized for the format and channel layout
+    // only the one matching the device direction is set
+    struct {
+        simd::Float2IntFunc playback;
+        simd::Int2FloatFunc capture;
+    } convert;
+
     pthread_t thread;
-    sem_t sem;
+
+    // full-duplex mode, set on the capture device pointing to the playback one and the other way around
+    // both are served by the same thread and started together, see initDeviceAudioDuplex
+    DeviceAudio* duplex;
+
+    // pollfds[0] is an eventfd for JACK cycle notification and shutdown, followed by the device descriptors
+    struct pollfd* pollfds;
+    uint32_t numPollFds;
+    uint32_t numWakeups;
 
     AudioRingBuffer* ringbuffer;
+
+    // converts between host and device rates (if different) and compensates clock drift
+    // there is 1 per channel group, all given the same ratio so they stay in sync
+    AdaptiveResampler* resamplers;
+
+    // channels are split into groups processed in parallel by the workers, a single group without them
+    WorkerPool* workers;
+    uint8_t numChannelGroups;
+
+    struct {
+        // host side delay-locked loop, updated on every audio cycle
+        DelayLockedLoop host;
+        uint64_t hostFrames;
+        // device frame time estimate from the device thread, 0 if not locked yet
+        double deviceFrameTime;
+        // averaged ringbuffer fill level, 1.0 meaning on target
+        double fill;
+    } clock;
+
+    struct {
+        uint32_t count;
+        // time from the last xrun until audio was flowing again, in microseconds
+        uint32_t recoveryTime;
+    } xruns;
+
+    // ringbuffer fill level statistics, measured on the host side after each read or write
+    // capture uses them to adapt rbFillTarget when enabled, see setDeviceAudioAdaptiveLatency
+    struct {
+        // minimum fill level to keep after each read, in host frames, 0 if not adapting
+        uint32_t margin;
+        // current window, in host frames
+        uint32_t frames;
+        uint32_t minLevel;
+        uint64_t sumLevel;
+        uint32_t numLevels;
+        // average fill level of the last complete window, in host frames
+        uint32_t level;
+        // host frames left until the target can be lowered again
+        uint32_t hold;
+        // target was raised, host gets silence until the ringbuffer is filled up to it
+        bool refilling;
+    } latency;
+
     double rbFillTarget;
     double rbTotalNumSamples;
     double rbRatio = 1.0;
@@ -98,10 +246,92 @@ struct DeviceAudio {
 
 // --------------------------------------------------------------------------------------------------------------------
 
-DeviceAudio* initDeviceAudio(const char* deviceID, bool playback, uint16_t bufferSize, uint32_t sampleRate);
-bool runDeviceAudio(DeviceAudio* dev, float* buffers[]);
+// channels is the preferred amount, the device can be opened with a different one if it does not support it
+// deviceSampleRate is the preferred device rate, 0 meaning the same as the host
+// if the device does not support the preferred rate, the nearest one it does is used and audio gets resampled
+DeviceAudio* initDeviceAudio(const char* deviceID, bool playback, uint16_t bufferSize, uint32_t sampleRate,
+                             uint8_t channels = 2, uint32_t deviceSampleRate = 0,
+                             DeviceResamplerQuality quality = AUDIO_BRIDGE_RESAMPLER_DEFAULT_QUALITY);
+
+// open and configure an ALSA device without starting it, as used by initDeviceAudio
+// returns the backend together with the sample format (one of kDeviceSample*, optionally with kDeviceNonInterleaved)
+// and hwstatus it was configured with, which can then be passed to initDeviceAudio, possibly wrapped for testing
+DeviceBackend* openDeviceBackend(const char* deviceID, bool playback, uint16_t bufferSize, uint32_t sampleRate,
+                                 uint8_t channels, uint32_t deviceSampleRate,
+                                 uint32_t& sampleHint, DeviceAudio::HWStatus& hwstatus);
+
+// initialize using an already configured backend, taking ownership of it
+// sampleHint (one of kDeviceSample*, optionally with kDeviceNonInterleaved) and hwstatus must match the backend configuration
+DeviceAudio* initDeviceAudio(DeviceBackend* backend, const char* deviceID, bool playback,
+                             uint16_t bufferSize, uint32_t sampleRate,
+                             uint32_t sampleHint, const DeviceAudio::HWStatus& hwstatus,
+                             DeviceResamplerQuality quality = AUDIO_BRIDGE_RESAMPLER_DEFAULT_QUALITY);
+
+// full-duplex mode, opening capture and playback of the same device as linked streams served by a single thread
+// returns the capture side, with the playback one in its duplex field, both used with runDeviceAudio as usual
+// streams start and recover from xruns together, keeping the round-trip latency constant, and share the same
+// clock-drift estimate; playback uses the device sample rate capture got, failing if it does not support it
+// closeDeviceAudio must only be called for the returned capture side, which closes both
+DeviceAudio* initDeviceAudioDuplex(const char* deviceID, uint16_t bufferSize, uint32_t sampleRate,
+                                   uint8_t channels = 2, uint32_t deviceSampleRate = 0,
+                                   DeviceResamplerQuality quality = AUDIO_BRIDGE_RESAMPLER_DEFAULT_QUALITY);
+
+// initialize full-duplex mode using already configured backends, taking ownership of them
+DeviceAudio* initDeviceAudioDuplex(DeviceBackend* captureBackend, DeviceBackend* playbackBackend,
+                                   const char* deviceID, uint16_t bufferSize, uint32_t sampleRate,
+                                   uint32_t captureHint, const DeviceAudio::HWStatus& captureHw,
+                                   uint32_t playbackHint, const DeviceAudio::HWStatus& playbackHw,
+                                   DeviceResamplerQuality quality = AUDIO_BRIDGE_RESAMPLER_DEFAULT_QUALITY);
+
+// device configuration with the lowest conversion overhead, as picked by chooseDeviceConfig
+struct DeviceConfig {
+    snd_pcm_access_t access;
+    snd_pcm_format_t format;
+    // one of kDeviceSample*, plus kDeviceNonInterleaved for non-interleaved access
+    uint32_t sampleHint;
+    uint32_t sampleRate;
+    uint32_t periodSize;
+    uint32_t periods;
+    uint8_t channels;
+};
+
+// pick access, format, rate, channels and period layout from what the device supports, used by initDeviceAudio
+// arguments are the same as in initDeviceAudio, values the device does not support are replaced by the nearest ones
+// returns false if the device has no access mode or sample format audio-bridge can use
+bool chooseDeviceConfig(const DeviceCapabilities& caps, uint16_t bufferSize, uint32_t sampleRate,
+                        uint8_t channels, uint32_t deviceSampleRate, DeviceConfig& config);
+
+// extra threads used for resampling of devices opened afterwards, splitting channels across CPU cores
+// gain stays in the device thread, applied together with the sample format conversion
+// default is 0 (all done in the device thread), unless set by the AUDIO_BRIDGE_WORKER_THREADS environment variable
+// only useful with high channel counts, each thread gets at least AUDIO_BRIDGE_WORKER_MIN_CHANNELS channels
+void setDeviceAudioWorkerThreads(uint8_t count);
+uint8_t getDeviceAudioWorkerThreads();
+
+// adaptive capture latency for devices opened afterwards, lowering the ringbuffer target to the observed
+// fill level jitter plus a safety margin, and raising it again (with a short silence) after near-underruns
+// margin is in milliseconds, 0 disables it (default) unless set by the AUDIO_BRIDGE_ADAPTIVE_LATENCY environment variable
+// playback is not affected, its ringbuffer target is already a single host block
+void setDeviceAudioAdaptiveLatency(float marginMs);
+float getDeviceAudioAdaptiveLatency();
+
+// total latency added between host and device, in host frames
+// includes ringbuffer target, device buffer and resampler delay (which depends on the quality preset)
+// can change over time with adaptive latency
+uint32_t getDeviceAudioLatency(DeviceAudio* dev);
+
+// same as getDeviceAudioLatency, but using the average ringbuffer fill level actually measured,
+// which follows target changes slowly as the clock-drift correction steers it
+// returns getDeviceAudioLatency until the first measurement is done, a couple of seconds after starting
+uint32_t getDeviceAudioMeasuredLatency(DeviceAudio* dev);
+
+// frames can be less than bufferSize, for hosts that split their audio cycles
+// cycleTimeUsecs is the (filtered) start time of the current audio cycle as CLOCK_MONOTONIC microseconds,
+// typically from jack_get_cycle_times, if 0 the current time is used instead
+bool runDeviceAudio(DeviceAudio* dev, float* buffers[], uint16_t frames, uint64_t cycleTimeUsecs = 0);
 void closeDeviceAudio(DeviceAudio* dev);
 
-#define DEBUGPRINT(...) { printf(__VA_ARGS__); puts(""); }
+// real-time safe, see audio-log.hpp
+#define DEBUGPRINT(...) AUDIO_LOG(kAudioLogDebug, __VA_ARGS__)
 
 // --------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,424 @@
+// SPDX-FileCopyrightText: 2021-2024 Filipe Coelho <falktx@falktx.com>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include "audio-device-simulator.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// --------------------------------------------------------------------------------------------------------------------
+
+SimulatedDeviceBackend::SimulatedDeviceBackend(const Config& c)
+    : config(c),
+      fullBufferSize(c.periodSize * c.periods),
+      frameSize(c.channels * getSampleSizeFromHints(c.sampleHint)),
+      periodTime(c.periodSize / (c.sampleRate * (1.0 + c.clockOffset))),
+      buffer(new uint8_t[fullBufferSize * frameSize]()),
+      mmapAreas(new snd_pcm_channel_area_t[c.channels]),
+      fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+      pcmState(SND_PCM_STATE_PREPARED),
+      hwPtr(0),
+      applPtr(0),
+      numXruns(0),
+      linked(nullptr),
+      // start at an arbitrary non-zero time, like CLOCK_MONOTONIC would
+      time(1000.0),
+      lastPeriodTime(0.0),
+      nextPeriodTime(0.0),
+      rng(c.seed),
+      noise(0.0, 1.0),
+      waiting(false),
+      numWaitFds(0),
+      waitFds()
+{
+    // same layout as ALSA uses for each access type
+    const uint32_t sampleSize = getSampleSizeFromHints(c.sampleHint);
+
+    for (uint32_t i = 0; i < c.channels; ++i)
+    {
+        if (c.sampleHint & kDeviceNonInterleaved)
+        {
+            mmapAreas[i].addr = buffer + i * fullBufferSize * sampleSize;
+            mmapAreas[i].first = 0;
+            mmapAreas[i].step = sampleSize * 8;
+        }
+        else
+        {
+            mmapAreas[i].addr = buffer;
+            mmapAreas[i].first = i * sampleSize * 8;
+            mmapAreas[i].step = frameSize * 8;
+        }
+    }
+
+    pthread_mutex_init(&mutex, nullptr);
+}
+
+SimulatedDeviceBackend::~SimulatedDeviceBackend()
+{
+    if (linked != nullptr)
+        linked->linked = nullptr;
+
+    if (fd >= 0)
+        close(fd);
+
+    pthread_mutex_destroy(&mutex);
+    delete[] mmapAreas;
+    delete[] buffer;
+}
+
+DeviceAudio::HWStatus SimulatedDeviceBackend::getHWStatus() const noexcept
+{
+    DeviceAudio::HWStatus hwstatus;
+    hwstatus.channels = config.channels;
+    hwstatus.periods = config.periods;
+    hwstatus.periodSize = config.periodSize;
+    hwstatus.fullBufferSize = fullBufferSize;
+    hwstatus.sampleRate = config.sampleRate;
+    return hwstatus;
+}
+
+double SimulatedDeviceBackend::getTime() noexcept
+{
+    pthread_mutex_lock(&mutex);
+    const double ret = time;
+    pthread_mutex_unlock(&mutex);
+    return ret;
+}
+
+void SimulatedDeviceBackend::advance(const double seconds)
+{
+    // linked streams run from the same clock, both are moved together
+    pthread_mutex_lock(&mutex);
+    if (linked != nullptr)
+        pthread_mutex_lock(&linked->mutex);
+
+    bool xrun = advanceStream(seconds);
+
+    if (linked != nullptr)
+        xrun |= linked->advanceStream(seconds);
+
+    if (xrun)
+    {
+        stopOnXrun();
+
+        if (linked != nullptr)
+            linked->stopOnXrun();
+    }
+
+    updateReadiness();
+
+    if (linked != nullptr)
+    {
+        linked->updateReadiness();
+        pthread_mutex_unlock(&linked->mutex);
+    }
+
+    pthread_mutex_unlock(&mutex);
+}
+
+void SimulatedDeviceBackend::injectXrun()
+{
+    // linked stream must stop at the same time, before the device thread can recover any of them
+    pthread_mutex_lock(&mutex);
+    if (linked != nullptr)
+        pthread_mutex_lock(&linked->mutex);
+
+    stopOnXrun();
+
+    if (linked != nullptr)
+    {
+        linked->stopOnXrun();
+        pthread_mutex_unlock(&linked->mutex);
+    }
+
+    pthread_mutex_unlock(&mutex);
+}
+
+bool SimulatedDeviceBackend::waitIdle(const int timeoutMs)
+{
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (;;)
+    {
+        pthread_mutex_lock(&mutex);
+
+        // waiting, and none of the waited descriptors are ready (otherwise the thread is about to wake up)
+        const bool idle = waiting && ::poll(waitFds, numWaitFds, 0) == 0;
+
+        pthread_mutex_unlock(&mutex);
+
+        if (idle)
+            return true;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        if ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 > timeoutMs)
+            return false;
+
+        sched_yield();
+    }
+}
+
+uint32_t SimulatedDeviceBackend::getNumXruns() noexcept
+{
+    pthread_mutex_lock(&mutex);
+    const uint32_t ret = numXruns;
+    pthread_mutex_unlock(&mutex);
+    return ret;
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+snd_pcm_state_t SimulatedDeviceBackend::state()
+{
+    pthread_mutex_lock(&mutex);
+    const snd_pcm_state_t ret = pcmState;
+    pthread_mutex_unlock(&mutex);
+    return ret;
+}
+
+int SimulatedDeviceBackend::prepare()
+{
+    prepareStream();
+
+    if (linked != nullptr)
+        linked->prepareStream();
+
+    return 0;
+}
+
+int SimulatedDeviceBackend::resume()
+{
+    // simulated device never gets suspended
+    return -ENOSYS;
+}
+
+int SimulatedDeviceBackend::start()
+{
+    const int ret = startStream();
+
+    if (ret == 0 && linked != nullptr)
+        linked->startStream();
+
+    return ret;
+}
+
+snd_pcm_sframes_t SimulatedDeviceBackend::availUpdate()
+{
+    pthread_mutex_lock(&mutex);
+    const snd_pcm_sframes_t ret = pcmState == SND_PCM_STATE_XRUN ? -EPIPE : static_cast<snd_pcm_sframes_t>(getAvail());
+    pthread_mutex_unlock(&mutex);
+    return ret;
+}
+
+int SimulatedDeviceBackend::htimestamp(snd_pcm_uframes_t* const avail, snd_htimestamp_t* const tstamp)
+{
+    pthread_mutex_lock(&mutex);
+
+    const double t = lastPeriodTime + noise(rng) * config.jitter;
+
+    *avail = getAvail();
+    tstamp->tv_sec = static_cast<time_t>(t);
+    tstamp->tv_nsec = static_cast<long>((t - tstamp->tv_sec) * 1e9);
+
+    pthread_mutex_unlock(&mutex);
+    return 0;
+}
+
+int SimulatedDeviceBackend::mmapBegin(const snd_pcm_channel_area_t** const areas,
+                                      snd_pcm_uframes_t* const offset,
+                                      snd_pcm_uframes_t* const frames)
+{
+    int ret = 0;
+    pthread_mutex_lock(&mutex);
+
+    if (pcmState == SND_PCM_STATE_XRUN)
+    {
+        ret = -EPIPE;
+    }
+    else
+    {
+        *areas = mmapAreas;
+        *offset = applPtr % fullBufferSize;
+        *frames = std::min<snd_pcm_uframes_t>({ *frames, fullBufferSize - *offset, getAvail() });
+    }
+
+    pthread_mutex_unlock(&mutex);
+    return ret;
+}
+
+snd_pcm_sframes_t SimulatedDeviceBackend::mmapCommit(snd_pcm_uframes_t, const snd_pcm_uframes_t frames)
+{
+    snd_pcm_sframes_t ret;
+    pthread_mutex_lock(&mutex);
+
+    if (pcmState == SND_PCM_STATE_XRUN)
+    {
+        ret = -EPIPE;
+    }
+    else
+    {
+        applPtr += frames;
+        ret = frames;
+        updateReadiness();
+    }
+
+    pthread_mutex_unlock(&mutex);
+    return ret;
+}
+
+int SimulatedDeviceBackend::pollDescriptorsCount()
+{
+    return 1;
+}
+
+int SimulatedDeviceBackend::pollDescriptors(struct pollfd* const pfds, const unsigned int space)
+{
+    if (space < 1)
+        return 0;
+
+    pfds[0].fd = fd;
+    pfds[0].events = POLLIN;
+    pfds[0].revents = 0;
+    return 1;
+}
+
+int SimulatedDeviceBackend::pollDescriptorsRevents(struct pollfd*, unsigned int, unsigned short* const revents)
+{
+    pthread_mutex_lock(&mutex);
+
+    if (pcmState == SND_PCM_STATE_XRUN)
+        *revents = POLLERR;
+    else if (getAvail() >= config.periodSize)
+        *revents = config.playback ? POLLOUT : POLLIN;
+    else
+        *revents = 0;
+
+    pthread_mutex_unlock(&mutex);
+    return 0;
+}
+
+int SimulatedDeviceBackend::poll(struct pollfd* const pfds, const unsigned int nfds, int timeout)
+{
+    // virtual time does not move while waiting on the device, so only the harness can wake us up
+    if (nfds > 1)
+        timeout = -1;
+
+    pthread_mutex_lock(&mutex);
+    updateReadiness();
+    waiting = true;
+    numWaitFds = nfds < kMaxWaitFds ? nfds : kMaxWaitFds;
+    for (unsigned int i = 0; i < numWaitFds; ++i)
+    {
+        waitFds[i].fd = pfds[i].fd;
+        waitFds[i].events = pfds[i].events;
+        waitFds[i].revents = 0;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    const int ret = ::poll(pfds, nfds, timeout);
+
+    pthread_mutex_lock(&mutex);
+    waiting = false;
+    pthread_mutex_unlock(&mutex);
+
+    return ret;
+}
+
+int SimulatedDeviceBackend::link(DeviceBackend* const other)
+{
+    SimulatedDeviceBackend* const sim = dynamic_cast<SimulatedDeviceBackend*>(other);
+
+    if (sim == nullptr || sim == this || linked != nullptr || sim->linked != nullptr)
+        return -EINVAL;
+
+    linked = sim;
+    sim->linked = this;
+    return 0;
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+int SimulatedDeviceBackend::startStream()
+{
+    int ret = 0;
+    pthread_mutex_lock(&mutex);
+
+    if (pcmState == SND_PCM_STATE_PREPARED)
+    {
+        pcmState = SND_PCM_STATE_RUNNING;
+        lastPeriodTime = time;
+        nextPeriodTime = time + periodTime;
+        updateReadiness();
+    }
+    else
+    {
+        ret = -EBADFD;
+    }
+
+    pthread_mutex_unlock(&mutex);
+    return ret;
+}
+
+void SimulatedDeviceBackend::prepareStream()
+{
+    pthread_mutex_lock(&mutex);
+    pcmState = SND_PCM_STATE_PREPARED;
+    hwPtr = applPtr = 0;
+    updateReadiness();
+    pthread_mutex_unlock(&mutex);
+}
+
+bool SimulatedDeviceBackend::advanceStream(const double seconds)
+{
+    time += seconds;
+
+    while (pcmState == SND_PCM_STATE_RUNNING && nextPeriodTime <= time)
+    {
+        hwPtr += config.periodSize;
+        lastPeriodTime = nextPeriodTime;
+        nextPeriodTime += periodTime;
+
+        // playback underrun when hardware consumed everything, capture overrun when the whole buffer is filled
+        if (config.playback ? hwPtr >= applPtr : hwPtr - applPtr >= fullBufferSize)
+            return true;
+    }
+
+    return false;
+}
+
+void SimulatedDeviceBackend::stopOnXrun()
+{
+    if (pcmState != SND_PCM_STATE_RUNNING)
+        return;
+
+    pcmState = SND_PCM_STATE_XRUN;
+    ++numXruns;
+    updateReadiness();
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+snd_pcm_uframes_t SimulatedDeviceBackend::getAvail() const noexcept
+{
+    if (config.playback)
+        return fullBufferSize - std::min<uint64_t>(applPtr > hwPtr ? applPtr - hwPtr : 0, fullBufferSize);
+
+    return std::min<uint64_t>(hwPtr - applPtr, fullBufferSize);
+}
+
+void SimulatedDeviceBackend::updateReadiness()
+{
+    eventfd_t value;
+    eventfd_read(fd, &value);
+
+    if (pcmState == SND_PCM_STATE_XRUN || getAvail() >= config.periodSize)
+        eventfd_write(fd, 1);
+}
+
+// --------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,134 @@
+// SPDX-FileCopyrightText: 2021-2024 Filipe Coelho <falktx@falktx.com>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#pragma once
+
+#include "audio-device-init.hpp"
+
+#include <random>
+
+// --------------------------------------------------------------------------------------------------------------------
+
+/**
+   A simulated soundcard running on virtual time, for deterministic testing and benchmarking without hardware.
+
+   Virtual time only moves forward when the test harness calls advance(), typically once per simulated JACK cycle,
+   followed by waitIdle() so that the device thread has processed everything before the next cycle.
+   The hardware pointer moves in period steps at the configured sample rate plus clockOffset,
+   and timestamps are reported with gaussian jitter.
+
+   Unlike the ALSA setup (which disables the stop threshold), under/overruns always stop the stream,
+   so that xruns are reported to the device thread in a predictable way.
+
+   Linked streams (see link) share start, prepare and xrun state like snd_pcm_link does,
+   and run from the same clock, calling advance() on any of them moves both.
+ */
+class SimulatedDeviceBackend : public DeviceBackend
+{
+public:
+    struct Config {
+        bool playback;
+        uint32_t sampleRate;
+        uint32_t channels;
+        uint32_t periodSize;
+        uint32_t periods;
+        // one of kDeviceSample*, optionally with kDeviceNonInterleaved
+        uint32_t sampleHint;
+        // relative deviation of the device clock from nominal sample rate, e.g. 100e-6 for +100 ppm
+        double clockOffset;
+        // standard deviation of timestamp noise, in seconds
+        double jitter;
+        uint32_t seed;
+    };
+
+    explicit SimulatedDeviceBackend(const Config& config);
+    ~SimulatedDeviceBackend() override;
+
+    // hwstatus to pass into initDeviceAudio
+    DeviceAudio::HWStatus getHWStatus() const noexcept;
+
+    // current virtual time, in seconds
+    double getTime() noexcept;
+
+    // move virtual time forward, waking up the device thread
+    // also moves the linked stream, if any
+    void advance(double seconds);
+
+    // force an xrun as if the device thread missed its deadline
+    void injectXrun();
+
+    // wait until the device thread is blocked waiting on nothing that is ready, returns false on (real-time) timeout
+    bool waitIdle(int timeoutMs = 2000);
+
+    // number of xruns so far, injected or not
+    uint32_t getNumXruns() noexcept;
+
+    snd_pcm_state_t state() override;
+    int prepare() override;
+    int resume() override;
+    int start() override;
+
+    snd_pcm_sframes_t availUpdate() override;
+    int htimestamp(snd_pcm_uframes_t* avail, snd_htimestamp_t* tstamp) override;
+
+    int mmapBegin(const snd_pcm_channel_area_t** areas, snd_pcm_uframes_t* offset, snd_pcm_uframes_t* frames) override;
+    snd_pcm_sframes_t mmapCommit(snd_pcm_uframes_t offset, snd_pcm_uframes_t frames) override;
+
+    int pollDescriptorsCount() override;
+    int pollDescriptors(struct pollfd* pfds, unsigned int space) override;
+    int pollDescriptorsRevents(struct pollfd* pfds, unsigned int nfds, unsigned short* revents) override;
+
+    int poll(struct pollfd* pfds, unsigned int nfds, int timeout) override;
+
+    int link(DeviceBackend* other) override;
+
+private:
+    static constexpr const unsigned int kMaxWaitFds = 8;
+
+    const Config config;
+    const uint32_t fullBufferSize;
+    const uint32_t frameSize;
+    const double periodTime;
+
+    uint8_t* const buffer;
+    snd_pcm_channel_area_t* const mmapAreas;
+
+    pthread_mutex_t mutex;
+    int fd;
+
+    snd_pcm_state_t pcmState;
+    uint64_t hwPtr;
+    uint64_t applPtr;
+    uint32_t numXruns;
+
+    // other stream started, prepared and stopped together with this one, if any
+    SimulatedDeviceBackend* linked;
+
+    double time;
+    double lastPeriodTime;
+    double nextPeriodTime;
+
+    std::mt19937 rng;
+    std::normal_distribution<double> noise;
+
+    // what the device thread is currently waiting on, copied so it can be checked safely from other threads
+    bool waiting;
+    unsigned int numWaitFds;
+    struct pollfd waitFds[kMaxWaitFds];
+
+    snd_pcm_uframes_t getAvail() const noexcept;
+
+    // state changes of a single stream, the public calls apply them to the linked one too
+    int startStream();
+    void prepareStream();
+
+    // mutex must be locked, only from the harness thread which is the only one locking both streams at once
+    // advanceStream returns true on under/overrun, which stops both linked streams
+    bool advanceStream(double seconds);
+    void stopOnXrun();
+
+    // make the poll descriptor readable only while there is something to do, like ALSA does
+    void updateReadiness();
+};
+
+// --------------------------------------------------------------------------------------------------------------------
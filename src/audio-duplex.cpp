@@ -0,0 +1,136 @@
+// SPDX-FileCopyrightText: 2021-2024 Filipe Coelho <falktx@falktx.com>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include "audio-device-init.hpp"
+
+// full-duplex device thread, serving the linked capture (dev) and playback (dev->duplex) streams of a device
+// playback goes first, so that after an xrun the silence it queues restarts both streams together
+static void* deviceDuplexThread(void* const arg)
+{
+    DeviceAudio* const dev = static_cast<DeviceAudio*>(arg);
+    DeviceAudio* const playDev = dev->duplex;
+
+    simd::init();
+
+    // shared eventfd, followed by the descriptors of each side that is waiting on the device
+    const uint32_t numCaptureFds = dev->numPollFds - 1;
+    const uint32_t numPlaybackFds = playDev->numPollFds - 1;
+    struct pollfd* const pollfds = new struct pollfd[1 + numCaptureFds + numPlaybackFds];
+    pollfds[0] = dev->pollfds[0];
+
+    const int timeout = dev->bufferSize * 1000 / dev->sampleRate + 1;
+
+    {
+        DeviceCapture capture(dev);
+        DevicePlayback playback(playDev);
+
+        DeviceWait captureWait = kDeviceWaitNone;
+        DeviceWait playbackWait = kDeviceWaitNone;
+
+        // wait for audio thread to post
+        if (deviceWaitForNotify(dev, 15000))
+        {
+            while (dev->hwstatus.channels != 0)
+            {
+                // both streams stopped on xrun, the other side has to resync too
+                if (playbackWait == kDeviceWaitNone)
+                {
+                    const uint32_t numResyncs = playback.numResyncs;
+                    playbackWait = playback.process();
+
+                    if (playback.numResyncs != numResyncs)
+                    {
+                        capture.resync();
+                        captureWait = kDeviceWaitNone;
+                    }
+                }
+
+                if (captureWait == kDeviceWaitNone)
+                {
+                    const uint32_t numResyncs = capture.numResyncs;
+                    captureWait = capture.process();
+
+                    if (capture.numResyncs != numResyncs)
+                    {
+                        playback.resync();
+                        playbackWait = kDeviceWaitNone;
+                    }
+                }
+
+                if (captureWait == kDeviceWaitStop || playbackWait == kDeviceWaitStop)
+                    break;
+
+                if (captureWait == kDeviceWaitNone || playbackWait == kDeviceWaitNone)
+                    continue;
+
+                // both sides are waiting, either on the host or on the device
+                uint32_t numPollFds = 1;
+
+                struct pollfd* const captureFds = pollfds + numPollFds;
+                if (captureWait == kDeviceWaitDevice)
+                {
+                    std::memcpy(captureFds, dev->pollfds + 1, sizeof(struct pollfd) * numCaptureFds);
+                    numPollFds += numCaptureFds;
+                }
+
+                struct pollfd* const playbackFds = pollfds + numPollFds;
+                if (playbackWait == kDeviceWaitDevice)
+                {
+                    std::memcpy(playbackFds, playDev->pollfds + 1, sizeof(struct pollfd) * numPlaybackFds);
+                    numPollFds += numPlaybackFds;
+                }
+
+                const int ret = dev->backend->poll(pollfds, numPollFds, timeout);
+                ++dev->numWakeups;
+
+                // timed out, check both again
+                if (ret <= 0)
+                {
+                    captureWait = playbackWait = kDeviceWaitNone;
+                    continue;
+                }
+
+                if (pollfds[0].revents != 0)
+                {
+                    eventfd_t value;
+                    eventfd_read(pollfds[0].fd, &value);
+
+                    if (captureWait == kDeviceWaitHost)
+                        captureWait = kDeviceWaitNone;
+                    if (playbackWait == kDeviceWaitHost)
+                        playbackWait = kDeviceWaitNone;
+                }
+
+                unsigned short revents;
+
+                if (captureWait == kDeviceWaitDevice)
+                {
+                    revents = 0;
+                    dev->backend->pollDescriptorsRevents(captureFds, numCaptureFds, &revents);
+                    if (revents != 0)
+                        captureWait = kDeviceWaitNone;
+                }
+
+                if (playbackWait == kDeviceWaitDevice)
+                {
+                    revents = 0;
+                    playDev->backend->pollDescriptorsRevents(playbackFds, numPlaybackFds, &revents);
+                    if (revents != 0)
+                        playbackWait = kDeviceWaitNone;
+                }
+            }
+        }
+        else
+        {
+            AUDIO_LOG(kAudioLogError, "%08u | duplex | audio thread failed to post", dev->frame);
+        }
+    }
+
+    delete[] pollfds;
+
+    DEBUGPRINT("%08u | duplex | audio thread closed", dev->frame);
+
+    playDev->thread = 0;
+    dev->thread = 0;
+    return nullptr;
+}
@@ -0,0 +1,298 @@
+// SPDX-FileCopyrightText: 2021-2024 Filipe Coelho <falktx@falktx.com>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include "audio-log.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <pthread.h>
+
+static_assert((AUDIO_BRIDGE_LOG_QUEUE_SIZE & (AUDIO_BRIDGE_LOG_QUEUE_SIZE - 1)) == 0,
+              "AUDIO_BRIDGE_LOG_QUEUE_SIZE must be a power of 2");
+
+// --------------------------------------------------------------------------------------------------------------------
+
+// bounded multi-producer queue, each slot has a sequence number telling if it is free for writing or ready for reading
+// producers claim a slot by moving the head forward, then format directly into it
+// see "Bounded MPMC queue" by Dmitry Vyukov
+struct AudioLogSlot {
+    std::atomic<uint32_t> sequence;
+    uint8_t level;
+    char msg[AUDIO_BRIDGE_LOG_MESSAGE_SIZE];
+};
+
+static AudioLogSlot gSlots[AUDIO_BRIDGE_LOG_QUEUE_SIZE];
+static std::atomic<uint32_t> gHead;
+static uint32_t gTail;
+
+static std::atomic<uint32_t> gNumDropped;
+static std::atomic<int> gLevel;
+static std::atomic<AudioLogSink> gSink;
+
+// protects starting, stopping and flushing (there can only be 1 consumer at a time)
+static pthread_mutex_t gMutex = PTHREAD_MUTEX_INITIALIZER;
+static std::atomic<bool> gRunning;
+static uint32_t gRefCount;
+static pthread_t gThread;
+
+// how long the printing thread sleeps between checks, in nanoseconds
+static constexpr const long kLogThreadInterval = 20000000;
+
+// --------------------------------------------------------------------------------------------------------------------
+
+static void defaultSink(const AudioLogLevel level, const char* const msg)
+{
+    switch (level)
+    {
+    case kAudioLogDebug:
+    case kAudioLogInfo:
+        std::puts(msg);
+        break;
+    case kAudioLogWarning:
+        std::fprintf(stderr, "%s\n", msg);
+        break;
+    case kAudioLogError:
+        std::fprintf(stderr, "\x1b[31m%s\x1b[0m\n", msg);
+        break;
+    }
+}
+
+static void printMessage(const AudioLogLevel level, const char* const msg)
+{
+    if (const AudioLogSink sink = gSink.load(std::memory_order_acquire))
+        sink(level, msg);
+    else
+        defaultSink(level, msg);
+}
+
+static void formatMessage(char* const msg, const uint32_t suppressed, const char* const fmt, va_list args)
+{
+    const int len = std::vsnprintf(msg, AUDIO_BRIDGE_LOG_MESSAGE_SIZE, fmt, args);
+
+    if (suppressed != 0 && len >= 0 && len < AUDIO_BRIDGE_LOG_MESSAGE_SIZE)
+        std::snprintf(msg + len, AUDIO_BRIDGE_LOG_MESSAGE_SIZE - len, " (%u similar messages suppressed)", suppressed);
+}
+
+// must be called with gMutex locked
+static void drainQueue()
+{
+    for (;;)
+    {
+        AudioLogSlot& slot(gSlots[gTail % AUDIO_BRIDGE_LOG_QUEUE_SIZE]);
+
+        if (slot.sequence.load(std::memory_order_acquire) != gTail + 1)
+            break;
+
+        printMessage(static_cast<AudioLogLevel>(slot.level), slot.msg);
+
+        slot.sequence.store(gTail + AUDIO_BRIDGE_LOG_QUEUE_SIZE, std::memory_order_release);
+        ++gTail;
+    }
+
+    static uint32_t lastNumDropped = 0;
+    const uint32_t numDropped = gNumDropped.load(std::memory_order_relaxed);
+
+    if (numDropped != lastNumDropped)
+    {
+        char msg[64];
+        std::snprintf(msg, sizeof(msg), "log queue full, %u messages dropped", numDropped - lastNumDropped);
+        printMessage(kAudioLogWarning, msg);
+        lastNumDropped = numDropped;
+    }
+
+    std::fflush(stdout);
+}
+
+static void* logThread(void*)
+{
+    const struct timespec interval = { 0, kLogThreadInterval };
+
+    while (gRunning.load(std::memory_order_acquire))
+    {
+        nanosleep(&interval, nullptr);
+
+        pthread_mutex_lock(&gMutex);
+        drainQueue();
+        pthread_mutex_unlock(&gMutex);
+    }
+
+    return nullptr;
+}
+
+static void initQueue()
+{
+    for (uint32_t i = 0; i < AUDIO_BRIDGE_LOG_QUEUE_SIZE; ++i)
+        gSlots[i].sequence.store(i, std::memory_order_relaxed);
+
+    gHead.store(0, std::memory_order_release);
+    gTail = 0;
+
+    if (const char* const env = std::getenv("AUDIO_BRIDGE_LOG_LEVEL"))
+    {
+        if (std::strcmp(env, "debug") == 0)
+            gLevel.store(kAudioLogDebug);
+        else if (std::strcmp(env, "info") == 0)
+            gLevel.store(kAudioLogInfo);
+        else if (std::strcmp(env, "warning") == 0)
+            gLevel.store(kAudioLogWarning);
+        else if (std::strcmp(env, "error") == 0)
+            gLevel.store(kAudioLogError);
+    }
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+void audioLogStart()
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, initQueue);
+
+    pthread_mutex_lock(&gMutex);
+
+    if (gRefCount++ == 0)
+    {
+        gRunning.store(true, std::memory_order_release);
+
+        if (pthread_create(&gThread, nullptr, logThread, nullptr) != 0)
+        {
+            // no thread, messages will be printed on the next flush or stop
+            gRunning.store(false, std::memory_order_release);
+            gThread = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&gMutex);
+}
+
+void audioLogStop()
+{
+    pthread_mutex_lock(&gMutex);
+
+    if (gRefCount == 0 || --gRefCount != 0)
+    {
+        pthread_mutex_unlock(&gMutex);
+        return;
+    }
+
+    const pthread_t thread = gThread;
+    gThread = 0;
+    gRunning.store(false, std::memory_order_release);
+    pthread_mutex_unlock(&gMutex);
+
+    if (thread != 0)
+        pthread_join(thread, nullptr);
+
+    audioLogFlush();
+}
+
+void audioLogFlush()
+{
+    pthread_mutex_lock(&gMutex);
+    drainQueue();
+    pthread_mutex_unlock(&gMutex);
+}
+
+void setAudioLogLevel(const AudioLogLevel level)
+{
+    gLevel.store(level, std::memory_order_relaxed);
+}
+
+void setAudioLogSink(const AudioLogSink sink)
+{
+    gSink.store(sink, std::memory_order_release);
+}
+
+uint32_t getAudioLogNumDropped()
+{
+    return gNumDropped.load(std::memory_order_relaxed);
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+void audioLog(const AudioLogLevel level, const char* const fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    audioLogv(level, 0, fmt, args);
+    va_end(args);
+}
+
+void audioLogv(const AudioLogLevel level, const uint32_t suppressed, const char* const fmt, va_list args)
+{
+    if (level < gLevel.load(std::memory_order_relaxed))
+        return;
+
+    // nothing real-time is running, print directly
+    if (! gRunning.load(std::memory_order_acquire))
+    {
+        char msg[AUDIO_BRIDGE_LOG_MESSAGE_SIZE];
+        formatMessage(msg, suppressed, fmt, args);
+        printMessage(level, msg);
+        return;
+    }
+
+    uint32_t pos = gHead.load(std::memory_order_relaxed);
+    AudioLogSlot* slot;
+
+    for (;;)
+    {
+        slot = &gSlots[pos % AUDIO_BRIDGE_LOG_QUEUE_SIZE];
+
+        const int32_t diff = static_cast<int32_t>(slot->sequence.load(std::memory_order_acquire) - pos);
+
+        if (diff == 0)
+        {
+            if (gHead.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            // slot not read yet, queue is full
+            gNumDropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        else
+        {
+            // another producer claimed this slot first
+            pos = gHead.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->level = level;
+    formatMessage(slot->msg, suppressed, fmt, args);
+    slot->sequence.store(pos + 1, std::memory_order_release);
+}
+
+void audioLogRateLimited(AudioLogRateLimit& limit, const AudioLogLevel level, const char* const fmt, ...)
+{
+    if (level < gLevel.load(std::memory_order_relaxed))
+        return;
+
+    // clock_gettime does not enter the kernel for CLOCK_MONOTONIC, safe to call from real-time threads
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    // small races between threads logging from the same call site only make the limit slightly inaccurate
+    const uint32_t now = static_cast<uint32_t>(ts.tv_sec);
+
+    if (limit.windowStart.load(std::memory_order_relaxed) != now)
+    {
+        limit.windowStart.store(now, std::memory_order_relaxed);
+        limit.count.store(0, std::memory_order_relaxed);
+    }
+
+    if (limit.count.fetch_add(1, std::memory_order_relaxed) >= AUDIO_BRIDGE_LOG_RATE_LIMIT)
+    {
+        limit.suppressed.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    audioLogv(level, limit.suppressed.exchange(0, std::memory_order_relaxed), fmt, args);
+    va_end(args);
+}
+
+// --------------------------------------------------------------------------------------------------------------------
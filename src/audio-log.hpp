@@ -0,0 +1,81 @@
+// SPDX-FileCopyrightText: 2021-2024 Filipe Coelho <falktx@falktx.com>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#pragma once
+
+#include <atomic>
+#include <cstdarg>
+#include <cstdint>
+
+// --------------------------------------------------------------------------------------------------------------------
+
+/**
+   Real-time safe logging, usable from the JACK process callback and the device threads.
+
+   Messages are formatted into a preallocated lock-free queue and printed later by a low-priority thread,
+   which runs while at least 1 device is open (see audioLogStart and audioLogStop).
+   Outside of that, nothing real-time is running and messages are printed directly.
+
+   Each call site is rate limited to a few messages per second, with the amount of suppressed messages
+   reported on the next one that gets through. If the queue is full, messages are dropped and counted instead.
+ */
+
+enum AudioLogLevel {
+    kAudioLogDebug,
+    kAudioLogInfo,
+    kAudioLogWarning,
+    kAudioLogError,
+};
+
+// how many messages a single call site can log per second
+#define AUDIO_BRIDGE_LOG_RATE_LIMIT 10
+
+// how many messages fit in the queue, must be a power of 2
+#define AUDIO_BRIDGE_LOG_QUEUE_SIZE 256
+
+// maximum length of a single message, longer ones are truncated
+#define AUDIO_BRIDGE_LOG_MESSAGE_SIZE 256
+
+// per call site state, see AUDIO_LOG
+struct AudioLogRateLimit {
+    std::atomic<uint32_t> windowStart;
+    std::atomic<uint32_t> count;
+    std::atomic<uint32_t> suppressed;
+};
+
+// where messages go when printed, by default stdout (or stderr for warnings and errors)
+typedef void (*AudioLogSink)(AudioLogLevel level, const char* msg);
+
+// start or stop the printing thread, calls are reference counted and must be balanced
+void audioLogStart();
+void audioLogStop();
+
+// print everything currently queued, from the calling thread
+// must not be called from real-time threads, useful before shutdown and in tests
+void audioLogFlush();
+
+// messages below this level are ignored, default is kAudioLogDebug
+// the AUDIO_BRIDGE_LOG_LEVEL environment variable (debug, info, warning or error) overrides it on 1st start
+void setAudioLogLevel(AudioLogLevel level);
+
+// replace the sink, nullptr restores the default one
+void setAudioLogSink(AudioLogSink sink);
+
+// how many messages were dropped because of a full queue, since the beginning
+uint32_t getAudioLogNumDropped();
+
+// log without rate limiting, prefer the macros below
+void audioLog(AudioLogLevel level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+void audioLogv(AudioLogLevel level, uint32_t suppressed, const char* fmt, va_list args);
+
+// log with rate limiting, as used by the macros below
+void audioLogRateLimited(AudioLogRateLimit& limit, AudioLogLevel level, const char* fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+#define AUDIO_LOG(level, ...)                                      \
+    do {                                                           \
+        static AudioLogRateLimit _audio_log_limit;                 \
+        audioLogRateLimited(_audio_log_limit, level, __VA_ARGS__); \
+    } while (0)
+
+// --------------------------------------------------------------------------------------------------------------------
@@ -4,196 +4,316 @@
 #include "audio-device-init.hpp"
 #include "audio-utils.hpp"
 
-static void* devicePlaybackThread(void* const  arg)
+// write into the device mmap area, converting directly from dev->buffers.f32 (or writing silence if convert is null)
+// gain and xrun fade are applied during conversion, unless volume is null
+static snd_pcm_sframes_t deviceWriteMmap(DeviceAudio* const dev,
+                                         const simd::Float2IntFunc convert,
+                                         DeviceGain* const volume,
+                                         float** const ptrs,
+                                         const uint32_t srcOffset,
+                                         const uint32_t maxFrames)
 {
-    DeviceAudio* const dev = static_cast<DeviceAudio*>(arg);
+    snd_pcm_sframes_t err;
+
+    if ((err = dev->backend->availUpdate()) <= 0)
+        return err == 0 ? -EAGAIN : err;
 
-    const uint8_t hints = dev->hints;
     const uint8_t channels = dev->hwstatus.channels;
-    const uint8_t sampleSize = getSampleSizeFromHints(hints);
-    const uint16_t bufferSize = dev->bufferSize;
+    const snd_pcm_uframes_t avail = err;
+    const snd_pcm_uframes_t total = std::min<snd_pcm_uframes_t>(avail, maxFrames);
+    snd_pcm_uframes_t done = 0;
 
-    float** buffers = new float*[channels];
-    for (uint8_t c=0; c<channels; ++c)
-        buffers[c] = new float[bufferSize];
+    // the mmap area can wrap around, needing 2 iterations
+    while (done < total)
+    {
+        const snd_pcm_channel_area_t* areas;
+        snd_pcm_uframes_t offset;
+        snd_pcm_uframes_t frames = total - done;
 
-    simd::init();
+        if ((err = dev->backend->mmapBegin(&areas, &offset, &frames)) < 0)
+            return err;
+
+        const float* const gains = convert != nullptr && volume != nullptr ? volume->process(frames) : nullptr;
 
-    // smooth initial volume to prevent clicks on start
-    ExponentialValueSmoother gain;
-    gain.setSampleRate(dev->sampleRate);
-    gain.setTimeConstant(0.5f);
+        if (dev->hints & kDeviceNonInterleaved)
+        {
+            // each channel is contiguous, float can be copied as-is when there is no gain to apply
+            for (uint8_t c=0; c<channels; ++c)
+            {
+                uint8_t* const dst = getDeviceMmapPointer(areas[c], offset);
 
-    VResampler* const resampler = new VResampler;
-    resampler->setup(1.0, channels, 8);
+                if (convert == nullptr)
+                {
+                    std::memset(dst, 0, frames * areas[c].step / 8);
+                    continue;
+                }
+
+                ptrs[c] = dev->buffers.f32[c] + srcOffset + done;
+
+                if ((dev->hints & kDeviceSampleFloat) != 0 && gains == nullptr)
+                    std::memcpy(dst, ptrs[c], sizeof(float) * frames);
+                else
+                    convert(dst, ptrs + c, gains, 1, frames);
+            }
+        }
+        else if (convert != nullptr)
+        {
+            for (uint8_t c=0; c<channels; ++c)
+                ptrs[c] = dev->buffers.f32[c] + srcOffset + done;
+
+            convert(getDeviceMmapPointer(areas[0], offset), ptrs, gains, channels, frames);
+        }
+        else
+        {
+            std::memset(getDeviceMmapPointer(areas[0], offset), 0, frames * areas[0].step / 8);
+        }
+
+        if ((err = dev->backend->mmapCommit(offset, frames)) < 0)
+            return err;
+
+        if (static_cast<snd_pcm_uframes_t>(err) != frames)
+            return -EPIPE;
+
+        done += frames;
+    }
+
+    // mmap access does not auto-start the stream, start once at least 1 period is queued
+    if (dev->backend->state() == SND_PCM_STATE_PREPARED &&
+        dev->hwstatus.fullBufferSize - avail + done >= dev->hwstatus.periodSize &&
+        (err = dev->backend->start()) < 0)
+        return err;
+
+    return done;
+}
+
+// playback side of a device thread, reading from the ringbuffer and writing into the device
+// process never blocks, it returns what to wait for instead, so that a single thread can also serve capture
+struct DevicePlayback {
+    DeviceAudio* const dev;
+    const uint8_t channels;
+    const uint16_t bufferSize;
+    const simd::Float2IntFunc convert;
+
+    // ringbuffer output, in host frames
+    float** const buffers;
+    float** const ptrs;
+
+    // gain and xrun fade, applied during conversion after resampling
+    DeviceGain volume;
+
+    DelayLockedLoop dll;
+    int64_t transferred = 0;
 
-    snd_pcm_sframes_t err;
-    float xgain;
     double rbRatio = 0.0;
     bool enabled = true;
+    bool resyncing = false;
+    struct timespec xrunTime = {};
+
+    // incremented on every xrun recovery, so the other side can follow in full-duplex mode
+    uint32_t numResyncs = 0;
+
+    // resampler output not written into the device yet, starting at offset
+    uint32_t pending = 0;
+    uint32_t offset = 0;
+
+    explicit DevicePlayback(DeviceAudio* const d)
+        : dev(d),
+          channels(d->hwstatus.channels),
+          bufferSize(d->bufferSize),
+          convert(d->convert.playback),
+          buffers(new float*[channels]),
+          ptrs(new float*[channels]),
+          volume(d->hwstatus.sampleRate, d->resamplers[0].getMaxOutputFrames(bufferSize))
+    {
+        for (uint8_t c=0; c<channels; ++c)
+            buffers[c] = new float[bufferSize];
+
+        dll.setup(dev->hwstatus.sampleRate);
+    }
+
+    ~DevicePlayback()
+    {
+        for (uint8_t c=0; c<channels; ++c)
+            delete[] buffers[c];
+        delete[] buffers;
+        delete[] ptrs;
+    }
 
-    auto restart = [&dev, &resampler, &gain, &enabled]()
+    void restart()
     {
         deviceFailInitHints(dev);
-        gain.setTargetValue(0.f);
-        gain.clearToTargetValue();
+        resyncing = false;
+        pending = 0;
+        volume.gain.setTargetValue(0.f);
+        volume.gain.clearToTargetValue();
         if (enabled)
-            gain.setTargetValue(1.f);
-    };
+            volume.gain.setTargetValue(1.f);
+    }
 
-    // wait for audio thread to post
+    // lightweight xrun recovery, keeping ringbuffer, resampler and clock-drift state
+    void resync()
     {
-        struct timespec ts;
-        clock_gettime(CLOCK_REALTIME, &ts);
-        ts.tv_sec += 15;
-
-        if (sem_timedwait(&dev->sem, &ts) != 0)
-        {
-            printf("%08u | playback | audio thread failed to post\n", dev->frame);
-            goto end;
-        }
+        clock_gettime(CLOCK_MONOTONIC, &xrunTime);
+        resyncing = true;
+        ++numResyncs;
+        pending = 0;
+
+        dll.resync();
+        transferred = 0;
+
+        // keep the same latency as before, dropping audio queued during the xrun or adding silence
+        // ringbuffer is in host frames, silence is written in device frames
+        const uint32_t target = getDeviceRingBufferTarget(dev) + deviceToHostFrames(dev, dev->hwstatus.fullBufferSize);
+        const uint32_t readable = dev->ringbuffer->getNumReadableSamples();
+
+        if (readable > target)
+            dev->ringbuffer->skip(readable - target);
+        else if (readable < target)
+            deviceWriteMmap(dev, nullptr, nullptr, ptrs, 0, hostToDeviceFrames(dev, target - readable));
+
+        volume.fade.setTargetValue(0.f);
+        volume.fade.clearToTargetValue();
+        volume.fade.setTargetValue(1.f);
     }
 
-    while (dev->hwstatus.channels != 0)
+    DeviceWait process()
     {
         const uint32_t frame = dev->frame;
+        snd_pcm_sframes_t err;
 
-        if (dev->hints & kDeviceInitializing)
+        if (pending == 0)
         {
-            // write silence until alsa buffers are full
-            bool started = false;
-            std::memset(dev->buffers.raw, 0, sampleSize * bufferSize * channels * 2);
-            while ((err = snd_pcm_mmap_writei(dev->pcm, dev->buffers.raw, bufferSize * 2)) > 0)
-                started = true;
-
-            if (err != -EAGAIN)
+            if (dev->hints & kDeviceInitializing)
             {
-                printf("%08u | playback | initial write error: %s\n", frame, snd_strerror(err));
-                goto end;
-            }
+                // write silence until alsa buffers are full
+                bool started = false;
+                while ((err = deviceWriteMmap(dev, nullptr, nullptr, ptrs, 0, dev->hwstatus.periodSize * 2)) > 0)
+                    started = true;
+
+                if (err != -EAGAIN)
+                {
+                    AUDIO_LOG(kAudioLogError, "%08u | playback | initial write error: %s", frame, snd_strerror(err));
+                    return kDeviceWaitStop;
+                }
+
+                if (! started)
+                    return kDeviceWaitDevice;
 
-            if (started)
-            {
                 DEBUGPRINT("%08u | playback | can write data? removing kDeviceInitializing", frame);
                 restart();
                 dev->hints &= ~kDeviceInitializing;
             }
-            else
+
+            if (dev->hints & kDeviceStarting)
             {
-                deviceTimedWait(dev);
-                continue;
+                // check if device is running and has space to write
+                err = dev->backend->availUpdate();
+
+                switch (err)
+                {
+                case 0:
+                    return kDeviceWaitDevice;
+                default:
+                    if (err < 0)
+                    {
+                        AUDIO_LOG(kAudioLogError, "%08u | playback | initial write error: %s", frame, snd_strerror(err));
+                        return kDeviceWaitStop;
+                    }
+                    DEBUGPRINT("%08u | playback | can write data, removing kDeviceStarting", frame);
+                    dev->hints &= ~kDeviceStarting;
+                    // device played part of the initial silence while waiting for the host, top it up again
+                    // so the latency matches the one after xrun recovery, with at least 1 period of margin
+                    deviceWriteMmap(dev, nullptr, nullptr, ptrs, 0, dev->hwstatus.fullBufferSize);
+                    deviceResetClock(dev, dll);
+                    transferred = 0;
+                    break;
+                }
             }
-        }
 
-        if (dev->hints & kDeviceStarting)
-        {
-            // try writing a single sample to see if device is running
-            std::memset(dev->buffers.raw, 0, sampleSize * channels);
-            err = snd_pcm_mmap_writei(dev->pcm, dev->buffers.raw, 1);
+            // ringbuffer reset requested by either side, see deviceFailInitHints
+            dev->ringbuffer->applyFlush();
 
-            switch (err)
+            if (dev->ringbuffer->getNumReadableSamples() < bufferSize)
+                return kDeviceWaitHost;
+
+            while (!dev->ringbuffer->read(buffers, bufferSize))
             {
-            case 1:
-                DEBUGPRINT("%08u | playback | wrote data, removing kDeviceStarting", frame);
-                dev->hints &= ~kDeviceStarting;
-                snd_pcm_rewind(dev->pcm, 1);
-                break;
-            case -EAGAIN:
-                deviceTimedWait(dev);
-                continue;
-            default:
-                printf("%08u | playback | initial write error: %s\n", frame, snd_strerror(err));
-                goto end;
+                AUDIO_LOG(kAudioLogWarning, "%08u | playback | failed reading data", frame);
+                sched_yield();
             }
-        }
 
-        if (dev->ringbuffer->getNumReadableSamples() < bufferSize)
-        {
-            deviceTimedWait(dev);
-            continue;
-        }
+            if (dev->hwstatus.channels == 0)
+                return kDeviceWaitStop;
 
-        while (!dev->ringbuffer->read(buffers, bufferSize))
-        {
-            DEBUGPRINT("%08u | playback | WARNING | failed reading data", frame);
-            sched_yield();
-        }
+            if (enabled != dev->enabled)
+            {
+                enabled = dev->enabled;
+                volume.gain.setTargetValue(enabled ? 1.f : 0.f);
+            }
 
-        if (dev->hwstatus.channels == 0)
-            break;
+            if (rbRatio != dev->rbRatio)
+            {
+                rbRatio = dev->rbRatio;
+                deviceSetResamplerRatio(dev, rbRatio);
+            }
 
-        if (enabled != dev->enabled)
-        {
-            enabled = dev->enabled;
-            gain.setTargetValue(enabled ? 1.f : 0.f);
+            pending = deviceProcessChannels(dev, buffers, bufferSize, dev->buffers.f32);
+            offset = 0;
         }
 
-        if (rbRatio != dev->rbRatio)
+        while (dev->hwstatus.channels != 0 && pending != 0)
         {
-            rbRatio = dev->rbRatio;
-            resampler->set_rratio(rbRatio);
-        }
+            err = deviceWriteMmap(dev, convert, &volume, ptrs, offset, pending);
+            // DEBUGPRINT("write %d of %u", err, pending);
 
-        resampler->inp_count = bufferSize;
-        resampler->out_count = bufferSize * 2;
-        resampler->inp_data = buffers;
-        resampler->out_data = dev->buffers.f32;
-        resampler->process();
+            if (err < 0)
+            {
+                if (err == -EAGAIN)
+                    return kDeviceWaitDevice;
 
-        uint16_t frames = bufferSize * 2 - resampler->out_count;
+                pending = 0;
 
-        for (uint16_t i=0; i<frames; ++i)
-        {
-            xgain = gain.next();
-            for (uint8_t c=0; c<channels; ++c)
-                dev->buffers.f32[c][i] *= xgain;
-        }
-
-        switch (hints & kDeviceSampleHints)
-        {
-        case kDeviceSample16:
-            float2int::s16(dev->buffers.raw, dev->buffers.f32, channels, frames);
-            break;
-        case kDeviceSample24:
-            float2int::s24(dev->buffers.raw, dev->buffers.f32, channels, frames);
-            break;
-        case kDeviceSample24LE3:
-            float2int::s24le3(dev->buffers.raw, dev->buffers.f32, channels, frames);
-            break;
-        case kDeviceSample32:
-            float2int::s32(dev->buffers.raw, dev->buffers.f32, channels, frames);
-            break;
-        default:
-            DEBUGPRINT("unknown format");
-            break;
-        }
+                if (err == -EPIPE || err == -ESTRPIPE)
+                {
+                    DEBUGPRINT("%08u | playback | xrun, resyncing", frame);
+                    err = xrun_recovery(dev->backend, err);
 
-        int8_t* ptr = dev->buffers.raw;
+                    // still suspended, try again after a while
+                    if (err == -EAGAIN)
+                        return kDeviceWaitHost;
 
-        while (dev->hwstatus.channels != 0 && frames != 0)
-        {
-            err = snd_pcm_mmap_writei(dev->pcm, ptr, frames);
-            // DEBUGPRINT("write %d of %u", err, frames);
+                    // stream could not be prepared again, start over
+                    if (err < 0)
+                        restart();
+                    else
+                        resync();
 
-            if (err < 0)
-            {
-                if (err == -EAGAIN)
-                {
-                    deviceTimedWait(dev);
-                    continue;
+                    return kDeviceWaitNone;
                 }
 
                 restart();
 
-                printf("%08u | playback | Write error: %s\n", frame, snd_strerror(err));
+                AUDIO_LOG(kAudioLogError, "%08u | playback | Write error: %s", frame, snd_strerror(err));
 
-                if (xrun_recovery(dev->pcm, err) < 0)
+                if (xrun_recovery(dev->backend, err) < 0)
                 {
-                    printf("playback | xrun_recovery error: %s\n", snd_strerror(err));
-                    goto end;
+                    AUDIO_LOG(kAudioLogError, "playback | xrun_recovery error: %s", snd_strerror(err));
+                    return kDeviceWaitStop;
                 }
 
-                break;
+                return kDeviceWaitNone;
+            }
+
+            transferred += err;
+
+            // linked to a capture device, which drives the clock for both, see setDeviceTimings
+            if (dev->duplex == nullptr)
+                deviceUpdateClock(dev, dll, transferred);
+
+            if (resyncing)
+            {
+                resyncing = false;
+                deviceXrunRecovered(dev, xrunTime);
             }
 
             if (dev->hints & kDeviceBuffering)
@@ -203,39 +323,51 @@ static void* devicePlaybackThread(void* const  arg)
             }
 
             // FIXME check against snd_pcm_sw_params_set_avail_min ??
-            if (static_cast<uint16_t>(err) != frames)
+            if (static_cast<uint32_t>(err) != pending)
             {
-                DEBUGPRINT("%08u | playback | Incomplete write %ld of %u", frame, err, frames);
-
-                ptr += err * channels * sampleSize;
-                frames -= err;
+                DEBUGPRINT("%08u | playback | Incomplete write %ld of %u", frame, err, pending);
 
-                deviceTimedWait(dev);
-                continue;
+                offset += err;
+                pending -= err;
+                return kDeviceWaitDevice;
             }
 
-            break;
+            pending = 0;
         }
+
+        return kDeviceWaitNone;
     }
+};
 
-end:
-    DEBUGPRINT("%08u | playback | audio thread closed", dev->frame);
+static void* devicePlaybackThread(void* const  arg)
+{
+    DeviceAudio* const dev = static_cast<DeviceAudio*>(arg);
 
-    delete resampler;
+    simd::init();
 
-    for (uint8_t c=0; c<channels; ++c)
-        delete[] buffers[c];
-    delete[] buffers;
+    {
+        DevicePlayback playback(dev);
+
+        // wait for audio thread to post
+        if (deviceWaitForNotify(dev, 15000))
+        {
+            while (dev->hwstatus.channels != 0 && deviceWait(dev, playback.process())) {}
+        }
+        else
+        {
+            AUDIO_LOG(kAudioLogError, "%08u | playback | audio thread failed to post", dev->frame);
+        }
+    }
+
+    DEBUGPRINT("%08u | playback | audio thread closed", dev->frame);
 
     dev->thread = 0;
     return nullptr;
 }
 
-static void runDeviceAudioPlayback(DeviceAudio* const dev, float* buffers[], const uint32_t frame)
+static void runDeviceAudioPlayback(DeviceAudio* const dev, float* buffers[], const uint16_t frames, const uint32_t frame)
 {
-    const uint16_t bufferSize = dev->bufferSize;
-
-    sem_post(&dev->sem);
+    deviceNotify(dev);
 
     if (dev->hints & kDeviceStarting)
     {
@@ -244,15 +376,16 @@ static void runDeviceAudioPlayback(DeviceAudio* const dev, float* buffers[], con
         return;
     }
 
-    if (dev->ringbuffer->getNumWritableSamples() < bufferSize)
+    if (dev->ringbuffer->getNumWritableSamples() < frames)
     {
         DEBUGPRINT("%08u | playback | ringbuffer full, adding kDeviceInitializing|kDeviceStarting|kDeviceBuffering", frame);
         deviceFailInitHints(dev);
         return;
     }
 
-    DISTRHO_SAFE_ASSERT_RETURN(dev->ringbuffer->write(buffers, bufferSize),);
+    DISTRHO_SAFE_ASSERT_RETURN(dev->ringbuffer->write(buffers, frames),);
 
-    dev->framesDone += bufferSize;
-    setDeviceTimings(dev);
+    dev->framesDone += frames;
+    deviceUpdateLatency(dev, frames);
+    setDeviceTimings(dev, frames);
 }
@@ -4,10 +4,28 @@
 #pragma once
 
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <endian.h>
 #include <sched.h>
 
 #if defined(__SSE2_MATH__)
-# include <xmmintrin.h>
+# include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+# include <arm_neon.h>
+#endif
+
+// vectorized (de)interleaving converters, only for little-endian hosts with IEEE float math in vector units
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+# if defined(__SSE2_MATH__)
+#  define AUDIO_BRIDGE_SIMD_SSE2
+#  if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#   define AUDIO_BRIDGE_SIMD_AVX2
+#   define AUDIO_BRIDGE_TARGET_AVX2 __attribute__((target("avx2")))
+#  endif
+# elif defined(__aarch64__) && defined(__ARM_NEON)
+#  define AUDIO_BRIDGE_SIMD_NEON
+# endif
 #endif
 
 // --------------------------------------------------------------------------------------------------------------------
@@ -39,6 +57,13 @@ int32_t float32(const double s)
            std::lrint(s * 2147483647.f);
 }
 
+// optional per-frame gain of the converters, without gains the value is left untouched (not even multiplied by 1)
+static inline
+float applyGain(const float s, const float* const gains, const uint32_t i) noexcept
+{
+    return gains != nullptr ? s * gains[i] : s;
+}
+
 // unused, keep it might be useful later
 static constexpr inline
 int32_t sbit(const int8_t s, const int b)
@@ -51,29 +76,43 @@ int32_t sbit(const int8_t s, const int b)
 namespace float2int
 {
 
+// scalar reference implementation, the vectorized variants must produce bit-identical output
+// a non-zero kChannels replaces the runtime channel count, so loops can be unrolled for common layouts
+namespace scalar
+{
+
+template<uint8_t kChannels = 0>
 static inline
-void s16(void* const dst, float* const* const src, const uint8_t channels, const uint16_t samples)
+void s16(void* const dst, float* const* const src, const float* const gains,
+         const uint8_t numChannels, const uint16_t samples)
 {
+    const uint8_t channels = kChannels != 0 ? kChannels : numChannels;
     int16_t* const dstptr = static_cast<int16_t*>(dst);
 
     for (uint16_t i=0; i<samples; ++i)
         for (uint8_t c=0; c<channels; ++c)
-            dstptr[i*channels+c] = float16(src[c][i]);
+            dstptr[i*channels+c] = float16(applyGain(src[c][i], gains, i));
 }
 
+template<uint8_t kChannels = 0>
 static inline
-void s24(void* const dst, float* const* const src, const uint8_t channels, const uint16_t samples)
+void s24(void* const dst, float* const* const src, const float* const gains,
+         const uint8_t numChannels, const uint16_t samples)
 {
+    const uint8_t channels = kChannels != 0 ? kChannels : numChannels;
     int32_t* const dstptr = static_cast<int32_t*>(dst);
 
     for (uint16_t i=0; i<samples; ++i)
         for (uint8_t c=0; c<channels; ++c)
-            dstptr[i*channels+c] = float24(src[c][i]);
+            dstptr[i*channels+c] = float24(applyGain(src[c][i], gains, i));
 }
 
+template<uint8_t kChannels = 0>
 static inline
-void s24le3(void* const dst, float* const* const src, const uint8_t channels, const uint16_t samples)
+void s24le3(void* const dst, float* const* const src, const float* const gains,
+            const uint8_t numChannels, const uint16_t samples)
 {
+    const uint8_t channels = kChannels != 0 ? kChannels : numChannels;
     int8_t* dstptr = static_cast<int8_t*>(dst);
     int32_t z;
 
@@ -81,7 +120,7 @@ void s24le3(void* const dst, float* const* const src, const uint8_t channels, co
     {
         for (uint8_t c=0; c<channels; ++c)
         {
-            z = float24(src[c][i]);
+            z = float24(applyGain(src[c][i], gains, i));
            #if __BYTE_ORDER == __BIG_ENDIAN
             dstptr[2] = static_cast<int8_t>(z);
             dstptr[1] = static_cast<int8_t>(z >> 8);
@@ -96,16 +135,70 @@ void s24le3(void* const dst, float* const* const src, const uint8_t channels, co
     }
 }
 
+template<uint8_t kChannels = 0>
 static inline
-void s32(void* const dst, float* const* const src, const uint8_t channels, const uint16_t samples)
+void s32(void* const dst, float* const* const src, const float* const gains,
+         const uint8_t numChannels, const uint16_t samples)
 {
+    const uint8_t channels = kChannels != 0 ? kChannels : numChannels;
     int32_t* const dstptr = static_cast<int32_t*>(dst);
 
     for (uint16_t i=0; i<samples; ++i)
         for (uint8_t c=0; c<channels; ++c)
-            dstptr[i*channels+c] = float32(src[c][i]);
+            dstptr[i*channels+c] = float32(applyGain(src[c][i], gains, i));
+}
+
+// no conversion needed, just interleaving (and gain)
+template<uint8_t kChannels = 0>
+static inline
+void f32(void* const dst, float* const* const src, const float* const gains,
+         const uint8_t numChannels, const uint16_t samples)
+{
+    const uint8_t channels = kChannels != 0 ? kChannels : numChannels;
+    float* const dstptr = static_cast<float*>(dst);
+
+    for (uint16_t i=0; i<samples; ++i)
+        for (uint8_t c=0; c<channels; ++c)
+            dstptr[i*channels+c] = applyGain(src[c][i], gains, i);
+}
+
+template<uint8_t kChannels = 0>
+static inline
+void s24be3(void* const dst, float* const* const src, const float* const gains,
+            const uint8_t numChannels, const uint16_t samples)
+{
+    const uint8_t channels = kChannels != 0 ? kChannels : numChannels;
+    uint8_t* dstptr = static_cast<uint8_t*>(dst);
+    int32_t z;
+
+    for (uint16_t i=0; i<samples; ++i)
+    {
+        for (uint8_t c=0; c<channels; ++c)
+        {
+            z = float24(applyGain(src[c][i], gains, i));
+            dstptr[0] = static_cast<uint8_t>(z >> 16);
+            dstptr[1] = static_cast<uint8_t>(z >> 8);
+            dstptr[2] = static_cast<uint8_t>(z);
+            dstptr += 3;
+        }
+    }
+}
+
+template<uint8_t kChannels = 0>
+static inline
+void s32be(void* const dst, float* const* const src, const float* const gains,
+           const uint8_t numChannels, const uint16_t samples)
+{
+    const uint8_t channels = kChannels != 0 ? kChannels : numChannels;
+    uint32_t* const dstptr = static_cast<uint32_t*>(dst);
+
+    for (uint16_t i=0; i<samples; ++i)
+        for (uint8_t c=0; c<channels; ++c)
+            dstptr[i*channels+c] = htobe32(static_cast<uint32_t>(float32(applyGain(src[c][i], gains, i))));
 }
 
+} // namespace scalar
+
 } // namespace float2int
 
 // --------------------------------------------------------------------------------------------------------------------
@@ -113,29 +206,42 @@ void s32(void* const dst, float* const* const src, const uint8_t channels, const
 namespace int2float
 {
 
+// scalar reference implementation, the vectorized variants must produce bit-identical output
+namespace scalar
+{
+
+template<uint8_t kChannels = 0>
 static inline
-void s16(float* const* const dst, void* const src, const uint8_t channels, const uint16_t samples)
+void s16(float* const* const dst, void* const src, const float* const gains,
+         const uint8_t numChannels, const uint16_t samples)
 {
+    const uint8_t channels = kChannels != 0 ? kChannels : numChannels;
     int16_t* const srcptr = static_cast<int16_t*>(src);
 
     for (uint16_t i=0; i<samples; ++i)
         for (uint8_t c=0; c<channels; ++c)
-            dst[c][i] = static_cast<float>(srcptr[i*channels+c]) * (1.f / 32767.f);
+            dst[c][i] = applyGain(static_cast<float>(srcptr[i*channels+c]) * (1.f / 32767.f), gains, i);
 }
 
+template<uint8_t kChannels = 0>
 static inline
-void s24(float* const* const dst, void* const src, const uint8_t channels, const uint16_t samples)
+void s24(float* const* const dst, void* const src, const float* const gains,
+         const uint8_t numChannels, const uint16_t samples)
 {
+    const uint8_t channels = kChannels != 0 ? kChannels : numChannels;
     int32_t* const srcptr = static_cast<int32_t*>(src);
 
     for (uint16_t i=0; i<samples; ++i)
         for (uint8_t c=0; c<channels; ++c)
-            dst[c][i] = static_cast<float>(srcptr[i*channels+c]) * (1.f / 8388607.f);
+            dst[c][i] = applyGain(static_cast<float>(srcptr[i*channels+c]) * (1.f / 8388607.f), gains, i);
 }
 
+template<uint8_t kChannels = 0>
 static inline
-void s24le3(float* const* const dst, void* const src, const uint8_t channels, const uint16_t samples)
+void s24le3(float* const* const dst, void* const src, const float* const gains,
+            const uint8_t numChannels, const uint16_t samples)
 {
+    const uint8_t channels = kChannels != 0 ? kChannels : numChannels;
     uint8_t* srcptr = static_cast<uint8_t*>(src);
     int32_t z;
 
@@ -159,25 +265,92 @@ void s24le3(float* const* const dst, void* const src, const uint8_t channels, co
                 z |= 0xff000000;
            #endif
 
-            dst[c][i] = z <= -8388607 ? -1.f
-                      : z >= 8388607 ? 1.f
-                      : static_cast<float>(z) * (1.f / 8388607.f);
+            dst[c][i] = applyGain(z <= -8388607 ? -1.f
+                                : z >= 8388607 ? 1.f
+                                : static_cast<float>(z) * (1.f / 8388607.f), gains, i);
 
             srcptr += 3;
         }
     }
 }
 
+template<uint8_t kChannels = 0>
 static inline
-void s32(float* const* const dst, void* const src, const uint8_t channels, const uint16_t samples)
+void s32(float* const* const dst, void* const src, const float* const gains,
+         const uint8_t numChannels, const uint16_t samples)
 {
+    const uint8_t channels = kChannels != 0 ? kChannels : numChannels;
     int32_t* const srcptr = static_cast<int32_t*>(src);
 
     for (uint16_t i=0; i<samples; ++i)
         for (uint8_t c=0; c<channels; ++c)
-            dst[c][i] = static_cast<double>(srcptr[i*channels+c]) * (1.0 / 2147483647.0);
+            dst[c][i] = applyGain(static_cast<float>(static_cast<double>(srcptr[i*channels+c]) * (1.0 / 2147483647.0)),
+                                  gains, i);
+}
+
+// no conversion needed, just deinterleaving (and gain)
+template<uint8_t kChannels = 0>
+static inline
+void f32(float* const* const dst, void* const src, const float* const gains,
+         const uint8_t numChannels, const uint16_t samples)
+{
+    const uint8_t channels = kChannels != 0 ? kChannels : numChannels;
+    float* const srcptr = static_cast<float*>(src);
+
+    for (uint16_t i=0; i<samples; ++i)
+        for (uint8_t c=0; c<channels; ++c)
+            dst[c][i] = applyGain(srcptr[i*channels+c], gains, i);
+}
+
+template<uint8_t kChannels = 0>
+static inline
+void s24be3(float* const* const dst, void* const src, const float* const gains,
+            const uint8_t numChannels, const uint16_t samples)
+{
+    const uint8_t channels = kChannels != 0 ? kChannels : numChannels;
+    uint8_t* srcptr = static_cast<uint8_t*>(src);
+    int32_t z;
+
+    for (uint16_t i=0; i<samples; ++i)
+    {
+        for (uint8_t c=0; c<channels; ++c)
+        {
+            z = (static_cast<int32_t>(srcptr[0]) << 16)
+              + (static_cast<int32_t>(srcptr[1]) << 8)
+              +  static_cast<int32_t>(srcptr[2]);
+
+            if (srcptr[0] & 0x80)
+                z |= 0xff000000;
+
+            dst[c][i] = applyGain(z <= -8388607 ? -1.f
+                                : z >= 8388607 ? 1.f
+                                : static_cast<float>(z) * (1.f / 8388607.f), gains, i);
+
+            srcptr += 3;
+        }
+    }
+}
+
+template<uint8_t kChannels = 0>
+static inline
+void s32be(float* const* const dst, void* const src, const float* const gains,
+           const uint8_t numChannels, const uint16_t samples)
+{
+    const uint8_t channels = kChannels != 0 ? kChannels : numChannels;
+    uint32_t* const srcptr = static_cast<uint32_t*>(src);
+
+    for (uint16_t i=0; i<samples; ++i)
+    {
+        for (uint8_t c=0; c<channels; ++c)
+        {
+            const int32_t z = static_cast<int32_t>(be32toh(srcptr[i*channels+c]));
+            dst[c][i] = applyGain(static_cast<float>(static_cast<double>(z) * (1.0 / 2147483647.0)), gains, i);
+        }
+    }
 }
 
+} // namespace scalar
+
 } // namespace int2float
 
 // --------------------------------------------------------------------------------------------------------------------
@@ -187,7 +360,7 @@ namespace simd
 
 // disable denormals and enable flush to zero
 static inline
-void init()
+void initFPU()
 {
    #if defined(__SSE2_MATH__)
     _mm_setcsr(_mm_getcsr() | 0x8040);
@@ -202,6 +375,1268 @@ void init()
    #endif
 }
 
-} // namespace simd
+// --------------------------------------------------------------------------------------------------------------------
+// per-sample conversions, used for leftover frames and channels of the vectorized variants
+
+struct SampleS16 {
+    enum { kSize = sizeof(int16_t) };
+
+    static inline float read(const uint8_t* const p) noexcept
+    {
+        int16_t z;
+        std::memcpy(&z, p, sizeof(z));
+        return static_cast<float>(z) * (1.f / 32767.f);
+    }
+
+    static inline void write(uint8_t* const p, const float s) noexcept
+    {
+        const int16_t z = float16(s);
+        std::memcpy(p, &z, sizeof(z));
+    }
+};
+
+struct SampleS24 {
+    enum { kSize = sizeof(int32_t) };
+
+    static inline float read(const uint8_t* const p) noexcept
+    {
+        int32_t z;
+        std::memcpy(&z, p, sizeof(z));
+        return static_cast<float>(z) * (1.f / 8388607.f);
+    }
+
+    static inline void write(uint8_t* const p, const float s) noexcept
+    {
+        const int32_t z = float24(s);
+        std::memcpy(p, &z, sizeof(z));
+    }
+};
+
+struct SampleS24LE3 {
+    enum { kSize = 3 };
+
+    static inline float read(const uint8_t* const p) noexcept
+    {
+        int32_t z = (static_cast<int32_t>(p[2]) << 16)
+                  + (static_cast<int32_t>(p[1]) << 8)
+                  +  static_cast<int32_t>(p[0]);
+
+        if (p[2] & 0x80)
+            z |= 0xff000000;
+
+        return z <= -8388607 ? -1.f
+             : z >= 8388607 ? 1.f
+             : static_cast<float>(z) * (1.f / 8388607.f);
+    }
+
+    static inline void write(uint8_t* const p, const float s) noexcept
+    {
+        const int32_t z = float24(s);
+        p[0] = static_cast<uint8_t>(z);
+        p[1] = static_cast<uint8_t>(z >> 8);
+        p[2] = static_cast<uint8_t>(z >> 16);
+    }
+};
+
+struct SampleS32 {
+    enum { kSize = sizeof(int32_t) };
+
+    static inline float read(const uint8_t* const p) noexcept
+    {
+        int32_t z;
+        std::memcpy(&z, p, sizeof(z));
+        return static_cast<double>(z) * (1.0 / 2147483647.0);
+    }
+
+    static inline void write(uint8_t* const p, const float s) noexcept
+    {
+        const int32_t z = float32(s);
+        std::memcpy(p, &z, sizeof(z));
+    }
+};
+
+struct SampleF32 {
+    enum { kSize = sizeof(float) };
+
+    static inline float read(const uint8_t* const p) noexcept
+    {
+        float s;
+        std::memcpy(&s, p, sizeof(s));
+        return s;
+    }
+
+    static inline void write(uint8_t* const p, const float s) noexcept
+    {
+        std::memcpy(p, &s, sizeof(s));
+    }
+};
+
+// --------------------------------------------------------------------------------------------------------------------
+// SSE2, 4 frames at a time
+
+#ifdef AUDIO_BRIDGE_SIMD_SSE2
+namespace sse2
+{
+
+// clamp to [-1, 1] and scale, rounding to nearest just like lrintf
+// NaN is zeroed first, min/max would turn it into full scale while the scalar code outputs 0
+static inline
+__m128i scaleToInt(const __m128 s, const float scale) noexcept
+{
+    const __m128 z = _mm_and_ps(s, _mm_cmpord_ps(s, s));
+    return _mm_cvtps_epi32(_mm_mul_ps(_mm_max_ps(_mm_min_ps(z, _mm_set1_ps(1.f)), _mm_set1_ps(-1.f)),
+                                      _mm_set1_ps(scale)));
+}
+
+static inline
+__m128i load12(const uint8_t* const p) noexcept
+{
+    int32_t last;
+    std::memcpy(&last, p + 8, sizeof(last));
+    return _mm_unpacklo_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)), _mm_cvtsi32_si128(last));
+}
+
+static inline
+void store12(uint8_t* const p, const __m128i v) noexcept
+{
+    const int32_t last = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(p), v);
+    std::memcpy(p + 8, &last, sizeof(last));
+}
+
+struct S16 : SampleS16 {
+    static inline __m128 load(const uint8_t* const p) noexcept
+    {
+        const __m128i z = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p));
+        return _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(z, z), 16)), _mm_set1_ps(1.f / 32767.f));
+    }
+
+    static inline void store(uint8_t* const p, const __m128 s) noexcept
+    {
+        const __m128i z = scaleToInt(s, 32767.f);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(p), _mm_packs_epi32(z, z));
+    }
+};
+
+struct S24 : SampleS24 {
+    static inline __m128 load(const uint8_t* const p) noexcept
+    {
+        const __m128i z = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        return _mm_mul_ps(_mm_cvtepi32_ps(z), _mm_set1_ps(1.f / 8388607.f));
+    }
+
+    static inline void store(uint8_t* const p, const __m128 s) noexcept
+    {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(p), scaleToInt(s, 8388607.f));
+    }
+};
+
+struct S24LE3 : SampleS24LE3 {
+    static inline __m128 load(const uint8_t* const p) noexcept
+    {
+        // move each 3-byte sample into the upper 3 bytes of its lane, then sign-extend with an arithmetic shift
+        const __m128i b = load12(p);
+        __m128i z = _mm_and_si128(_mm_slli_si128(b, 1), _mm_setr_epi32(-1, 0, 0, 0));
+        z = _mm_or_si128(z, _mm_and_si128(_mm_slli_si128(b, 2), _mm_setr_epi32(0, -1, 0, 0)));
+        z = _mm_or_si128(z, _mm_and_si128(_mm_slli_si128(b, 3), _mm_setr_epi32(0, 0, -1, 0)));
+        z = _mm_or_si128(z, _mm_and_si128(_mm_slli_si128(b, 4), _mm_setr_epi32(0, 0, 0, -1)));
+        z = _mm_srai_epi32(z, 8);
+
+        const __m128 hi = _mm_castsi128_ps(_mm_cmpgt_epi32(z, _mm_set1_epi32(8388606)));
+        const __m128 lo = _mm_castsi128_ps(_mm_cmplt_epi32(z, _mm_set1_epi32(-8388606)));
+        const __m128 s = _mm_mul_ps(_mm_cvtepi32_ps(z), _mm_set1_ps(1.f / 8388607.f));
+
+        return _mm_or_ps(_mm_andnot_ps(_mm_or_ps(hi, lo), s),
+                         _mm_or_ps(_mm_and_ps(hi, _mm_set1_ps(1.f)), _mm_and_ps(lo, _mm_set1_ps(-1.f))));
+    }
+
+    static inline void store(uint8_t* const p, const __m128 s) noexcept
+    {
+        // pack the lower 3 bytes of each lane together
+        const __m128i z = scaleToInt(s, 8388607.f);
+        __m128i b = _mm_and_si128(z, _mm_setr_epi8(-1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0));
+        b = _mm_or_si128(b, _mm_and_si128(_mm_srli_si128(z, 1), _mm_setr_epi8(0, 0, 0, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0)));
+        b = _mm_or_si128(b, _mm_and_si128(_mm_srli_si128(z, 2), _mm_setr_epi8(0, 0, 0, 0, 0, 0, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0)));
+        b = _mm_or_si128(b, _mm_and_si128(_mm_srli_si128(z, 3), _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 0, -1, -1, -1, 0, 0, 0, 0)));
+        store12(p, b);
+    }
+};
+
+struct S32 : SampleS32 {
+    static inline __m128 load(const uint8_t* const p) noexcept
+    {
+        // double precision like the scalar code, 2 samples at a time
+        const __m128i z = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        const __m128d scale = _mm_set1_pd(1.0 / 2147483647.0);
+        const __m128 s1 = _mm_cvtpd_ps(_mm_mul_pd(_mm_cvtepi32_pd(z), scale));
+        const __m128 s2 = _mm_cvtpd_ps(_mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(z, 8)), scale));
+        return _mm_movelh_ps(s1, s2);
+    }
+
+    static inline void store(uint8_t* const p, const __m128 s) noexcept
+    {
+        // scaling by 2^31 is exact, so single precision matches the scalar double code.
+        // +/-1 overflow into 0x80000000 and need to be fixed up
+        const __m128i hi = _mm_castps_si128(_mm_cmpge_ps(s, _mm_set1_ps(1.f)));
+        const __m128i lo = _mm_castps_si128(_mm_cmple_ps(s, _mm_set1_ps(-1.f)));
+        const __m128i z = scaleToInt(s, 2147483648.f);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(p),
+                         _mm_or_si128(_mm_andnot_si128(_mm_or_si128(hi, lo), z),
+                                      _mm_or_si128(_mm_and_si128(hi, _mm_set1_epi32(2147483647)),
+                                                   _mm_and_si128(lo, _mm_set1_epi32(-2147483647)))));
+    }
+};
+
+struct F32 : SampleF32 {
+    static inline __m128 load(const uint8_t* const p) noexcept
+    {
+        return _mm_loadu_ps(reinterpret_cast<const float*>(p));
+    }
+
+    static inline void store(uint8_t* const p, const __m128 s) noexcept
+    {
+        _mm_storeu_ps(reinterpret_cast<float*>(p), s);
+    }
+};
+
+// load or store planar float data, applying the per-frame gain if kGain
+template<bool kGain>
+static inline
+__m128 loadGain(const float* const p, const float* const gains) noexcept
+{
+    return kGain ? _mm_mul_ps(_mm_loadu_ps(p), _mm_loadu_ps(gains)) : _mm_loadu_ps(p);
+}
+
+template<bool kGain>
+static inline
+void storeGain(float* const p, const __m128 s, const float* const gains) noexcept
+{
+    _mm_storeu_ps(p, kGain ? _mm_mul_ps(s, _mm_loadu_ps(gains)) : s);
+}
+
+template<class F, uint8_t kChannels, bool kGain>
+static inline
+void int2floatImpl(float* const* const dst, void* const src, const float* const gains,
+                   const uint8_t numChannels, const uint16_t samples)
+{
+    const uint8_t channels = kChannels != 0 ? kChannels : numChannels;
+    const uint8_t* const srcptr = static_cast<const uint8_t*>(src);
+    const uint32_t stride = channels * F::kSize;
+    uint32_t i = 0;
+
+    if (channels == 1)
+    {
+        for (; i + 4 <= samples; i += 4)
+            storeGain<kGain>(dst[0] + i, F::load(srcptr + i * F::kSize), gains + i);
+    }
+    else if (channels == 2)
+    {
+        for (; i + 4 <= samples; i += 4)
+        {
+            const __m128 a = F::load(srcptr + i * stride);
+            const __m128 b = F::load(srcptr + (i + 2) * stride);
+            storeGain<kGain>(dst[0] + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)), gains + i);
+            storeGain<kGain>(dst[1] + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)), gains + i);
+        }
+    }
+    else
+    {
+        for (; i + 4 <= samples; i += 4)
+        {
+            const uint8_t* const ptr = srcptr + i * stride;
+            uint8_t c = 0;
+
+            for (; c + 4 <= channels; c += 4)
+            {
+                __m128 r0 = F::load(ptr + c * F::kSize);
+                __m128 r1 = F::load(ptr + c * F::kSize + stride);
+                __m128 r2 = F::load(ptr + c * F::kSize + stride * 2);
+                __m128 r3 = F::load(ptr + c * F::kSize + stride * 3);
+                _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+                storeGain<kGain>(dst[c] + i, r0, gains + i);
+                storeGain<kGain>(dst[c + 1] + i, r1, gains + i);
+                storeGain<kGain>(dst[c + 2] + i, r2, gains + i);
+                storeGain<kGain>(dst[c + 3] + i, r3, gains + i);
+            }
+
+            for (; c < channels; ++c)
+                for (uint8_t k = 0; k < 4; ++k)
+                    dst[c][i + k] = applyGain(F::read(ptr + c * F::kSize + stride * k), kGain ? gains : nullptr, i + k);
+        }
+    }
+
+    for (; i < samples; ++i)
+        for (uint8_t c = 0; c < channels; ++c)
+            dst[c][i] = applyGain(F::read(srcptr + i * stride + c * F::kSize), kGain ? gains : nullptr, i);
+}
+
+template<class F, uint8_t kChannels, bool kGain>
+static inline
+void float2intImpl(void* const dst, float* const* const src, const float* const gains,
+                   const uint8_t numChannels, const uint16_t samples)
+{
+    const uint8_t channels = kChannels != 0 ? kChannels : numChannels;
+    uint8_t* const dstptr = static_cast<uint8_t*>(dst);
+    const uint32_t stride = channels * F::kSize;
+    uint32_t i = 0;
+
+    if (channels == 1)
+    {
+        for (; i + 4 <= samples; i += 4)
+            F::store(dstptr + i * F::kSize, loadGain<kGain>(src[0] + i, gains + i));
+    }
+    else if (channels == 2)
+    {
+        for (; i + 4 <= samples; i += 4)
+        {
+            const __m128 l = loadGain<kGain>(src[0] + i, gains + i);
+            const __m128 r = loadGain<kGain>(src[1] + i, gains + i);
+            F::store(dstptr + i * stride, _mm_unpacklo_ps(l, r));
+            F::store(dstptr + (i + 2) * stride, _mm_unpackhi_ps(l, r));
+        }
+    }
+    else
+    {
+        for (; i + 4 <= samples; i += 4)
+        {
+            uint8_t* const ptr = dstptr + i * stride;
+            uint8_t c = 0;
+
+            for (; c + 4 <= channels; c += 4)
+            {
+                __m128 r0 = loadGain<kGain>(src[c] + i, gains + i);
+                __m128 r1 = loadGain<kGain>(src[c + 1] + i, gains + i);
+                __m128 r2 = loadGain<kGain>(src[c + 2] + i, gains + i);
+                __m128 r3 = loadGain<kGain>(src[c + 3] + i, gains + i);
+                _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+                F::store(ptr + c * F::kSize, r0);
+                F::store(ptr + c * F::kSize + stride, r1);
+                F::store(ptr + c * F::kSize + stride * 2, r2);
+                F::store(ptr + c * F::kSize + stride * 3, r3);
+            }
+
+            for (; c < channels; ++c)
+                for (uint8_t k = 0; k < 4; ++k)
+                    F::write(ptr + c * F::kSize + stride * k, applyGain(src[c][i + k], kGain ? gains : nullptr, i + k));
+        }
+    }
+
+    for (; i < samples; ++i)
+        for (uint8_t c = 0; c < channels; ++c)
+            F::write(dstptr + i * stride + c * F::kSize, applyGain(src[c][i], kGain ? gains : nullptr, i));
+}
+
+
+// dispatch to the variant with or without gain, once per call
+template<class F, uint8_t kChannels = 0>
+static inline
+void int2float(float* const* const dst, void* const src, const float* const gains,
+               const uint8_t numChannels, const uint16_t samples)
+{
+    if (gains != nullptr)
+        int2floatImpl<F, kChannels, true>(dst, src, gains, numChannels, samples);
+    else
+        int2floatImpl<F, kChannels, false>(dst, src, nullptr, numChannels, samples);
+}
+
+template<class F, uint8_t kChannels = 0>
+static inline
+void float2int(void* const dst, float* const* const src, const float* const gains,
+               const uint8_t numChannels, const uint16_t samples)
+{
+    if (gains != nullptr)
+        float2intImpl<F, kChannels, true>(dst, src, gains, numChannels, samples);
+    else
+        float2intImpl<F, kChannels, false>(dst, src, nullptr, numChannels, samples);
+}
+
+} // namespace sse2
+#endif // AUDIO_BRIDGE_SIMD_SSE2
+
+// --------------------------------------------------------------------------------------------------------------------
+// AVX2, 8 frames at a time, only used if the CPU supports it
+
+#ifdef AUDIO_BRIDGE_SIMD_AVX2
+namespace avx2
+{
+
+AUDIO_BRIDGE_TARGET_AVX2
+static inline
+__m256i scaleToInt(const __m256 s, const float scale) noexcept
+{
+    const __m256 z = _mm256_and_ps(s, _mm256_cmp_ps(s, s, _CMP_ORD_Q));
+    return _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_max_ps(_mm256_min_ps(z, _mm256_set1_ps(1.f)),
+                                                          _mm256_set1_ps(-1.f)),
+                                            _mm256_set1_ps(scale)));
+}
+
+AUDIO_BRIDGE_TARGET_AVX2
+static inline
+__m256i combine(const __m128i lo, const __m128i hi) noexcept
+{
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+
+// same as _MM_TRANSPOSE4_PS, but for each 128-bit lane
+AUDIO_BRIDGE_TARGET_AVX2
+static inline
+void transpose4x2(__m256& r0, __m256& r1, __m256& r2, __m256& r3) noexcept
+{
+    const __m256 t0 = _mm256_unpacklo_ps(r0, r1);
+    const __m256 t1 = _mm256_unpackhi_ps(r0, r1);
+    const __m256 t2 = _mm256_unpacklo_ps(r2, r3);
+    const __m256 t3 = _mm256_unpackhi_ps(r2, r3);
+    r0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    r1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    r2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    r3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+}
+
+// formats load/store 4 samples from/to 2 separate locations, one per 128-bit lane
+
+struct S16 : SampleS16 {
+    AUDIO_BRIDGE_TARGET_AVX2
+    static inline __m256 load(const uint8_t* const p1, const uint8_t* const p2) noexcept
+    {
+        const __m128i z = _mm_unpacklo_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p1)),
+                                             _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p2)));
+        return _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(z)), _mm256_set1_ps(1.f / 32767.f));
+    }
+
+    AUDIO_BRIDGE_TARGET_AVX2
+    static inline void store(uint8_t* const p1, uint8_t* const p2, const __m256 s) noexcept
+    {
+        const __m256i z = scaleToInt(s, 32767.f);
+        const __m256i w = _mm256_packs_epi32(z, z);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(p1), _mm256_castsi256_si128(w));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(p2), _mm256_extracti128_si256(w, 1));
+    }
+};
+
+struct S24 : SampleS24 {
+    AUDIO_BRIDGE_TARGET_AVX2
+    static inline __m256 load(const uint8_t* const p1, const uint8_t* const p2) noexcept
+    {
+        const __m256i z = combine(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p1)),
+                                  _mm_loadu_si128(reinterpret_cast<const __m128i*>(p2)));
+        return _mm256_mul_ps(_mm256_cvtepi32_ps(z), _mm256_set1_ps(1.f / 8388607.f));
+    }
+
+    AUDIO_BRIDGE_TARGET_AVX2
+    static inline void store(uint8_t* const p1, uint8_t* const p2, const __m256 s) noexcept
+    {
+        const __m256i z = scaleToInt(s, 8388607.f);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(p1), _mm256_castsi256_si128(z));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(p2), _mm256_extracti128_si256(z, 1));
+    }
+};
+
+struct S24LE3 : SampleS24LE3 {
+    AUDIO_BRIDGE_TARGET_AVX2
+    static inline __m128i load12(const uint8_t* const p) noexcept
+    {
+        int32_t last;
+        std::memcpy(&last, p + 8, sizeof(last));
+        return _mm_insert_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)), last, 2);
+    }
+
+    AUDIO_BRIDGE_TARGET_AVX2
+    static inline void store12(uint8_t* const p, const __m128i v) noexcept
+    {
+        const int32_t last = _mm_extract_epi32(v, 2);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(p), v);
+        std::memcpy(p + 8, &last, sizeof(last));
+    }
+
+    AUDIO_BRIDGE_TARGET_AVX2
+    static inline __m256 load(const uint8_t* const p1, const uint8_t* const p2) noexcept
+    {
+        // move each 3-byte sample into the upper 3 bytes of its lane, then sign-extend with an arithmetic shift
+        const __m256i shuf = _mm256_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+                                              -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+        const __m256i z = _mm256_srai_epi32(_mm256_shuffle_epi8(combine(load12(p1), load12(p2)), shuf), 8);
+        const __m256 s = _mm256_mul_ps(_mm256_cvtepi32_ps(z), _mm256_set1_ps(1.f / 8388607.f));
+
+        const __m256 hi = _mm256_castsi256_ps(_mm256_cmpgt_epi32(z, _mm256_set1_epi32(8388606)));
+        const __m256 lo = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(-8388606), z));
+
+        return _mm256_blendv_ps(_mm256_blendv_ps(s, _mm256_set1_ps(1.f), hi), _mm256_set1_ps(-1.f), lo);
+    }
+
+    AUDIO_BRIDGE_TARGET_AVX2
+    static inline void store(uint8_t* const p1, uint8_t* const p2, const __m256 s) noexcept
+    {
+        // pack the lower 3 bytes of each lane together
+        const __m256i shuf = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                              0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+        const __m256i b = _mm256_shuffle_epi8(scaleToInt(s, 8388607.f), shuf);
+        store12(p1, _mm256_castsi256_si128(b));
+        store12(p2, _mm256_extracti128_si256(b, 1));
+    }
+};
+
+struct S32 : SampleS32 {
+    AUDIO_BRIDGE_TARGET_AVX2
+    static inline __m128 load4(const uint8_t* const p) noexcept
+    {
+        // double precision like the scalar code
+        const __m128i z = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        return _mm256_cvtpd_ps(_mm256_mul_pd(_mm256_cvtepi32_pd(z), _mm256_set1_pd(1.0 / 2147483647.0)));
+    }
+
+    AUDIO_BRIDGE_TARGET_AVX2
+    static inline __m256 load(const uint8_t* const p1, const uint8_t* const p2) noexcept
+    {
+        return _mm256_insertf128_ps(_mm256_castps128_ps256(load4(p1)), load4(p2), 1);
+    }
+
+    AUDIO_BRIDGE_TARGET_AVX2
+    static inline void store(uint8_t* const p1, uint8_t* const p2, const __m256 s) noexcept
+    {
+        // see sse2::S32::store
+        const __m256 hi = _mm256_cmp_ps(s, _mm256_set1_ps(1.f), _CMP_GE_OQ);
+        const __m256 lo = _mm256_cmp_ps(s, _mm256_set1_ps(-1.f), _CMP_LE_OQ);
+        __m256i z = scaleToInt(s, 2147483648.f);
+        z = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(z),
+                                                 _mm256_castsi256_ps(_mm256_set1_epi32(2147483647)), hi));
+        z = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(z),
+                                                 _mm256_castsi256_ps(_mm256_set1_epi32(-2147483647)), lo));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(p1), _mm256_castsi256_si128(z));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(p2), _mm256_extracti128_si256(z, 1));
+    }
+};
+
+struct F32 : SampleF32 {
+    AUDIO_BRIDGE_TARGET_AVX2
+    static inline __m256 load(const uint8_t* const p1, const uint8_t* const p2) noexcept
+    {
+        return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(reinterpret_cast<const float*>(p1))),
+                                    _mm_loadu_ps(reinterpret_cast<const float*>(p2)), 1);
+    }
+
+    AUDIO_BRIDGE_TARGET_AVX2
+    static inline void store(uint8_t* const p1, uint8_t* const p2, const __m256 s) noexcept
+    {
+        _mm_storeu_ps(reinterpret_cast<float*>(p1), _mm256_castps256_ps128(s));
+        _mm_storeu_ps(reinterpret_cast<float*>(p2), _mm256_extractf128_ps(s, 1));
+    }
+};
+
+// load or store planar float data, applying the per-frame gain if kGain
+template<bool kGain>
+AUDIO_BRIDGE_TARGET_AVX2
+static inline
+__m256 loadGain(const float* const p, const float* const gains) noexcept
+{
+    return kGain ? _mm256_mul_ps(_mm256_loadu_ps(p), _mm256_loadu_ps(gains)) : _mm256_loadu_ps(p);
+}
+
+template<bool kGain>
+AUDIO_BRIDGE_TARGET_AVX2
+static inline
+void storeGain(float* const p, const __m256 s, const float* const gains) noexcept
+{
+    _mm256_storeu_ps(p, kGain ? _mm256_mul_ps(s, _mm256_loadu_ps(gains)) : s);
+}
+
+template<class F, uint8_t kChannels, bool kGain>
+AUDIO_BRIDGE_TARGET_AVX2
+static inline
+void int2floatImpl(float* const* const dst, void* const src, const float* const gains,
+                   const uint8_t numChannels, const uint16_t samples)
+{
+    const uint8_t channels = kChannels != 0 ? kChannels : numChannels;
+    const uint8_t* const srcptr = static_cast<const uint8_t*>(src);
+    const uint32_t stride = channels * F::kSize;
+    uint32_t i = 0;
+
+    if (channels == 1)
+    {
+        for (; i + 8 <= samples; i += 8)
+        {
+            const uint8_t* const ptr = srcptr + i * F::kSize;
+            storeGain<kGain>(dst[0] + i, F::load(ptr, ptr + 4 * F::kSize), gains + i);
+        }
+    }
+    else if (channels == 2)
+    {
+        for (; i + 8 <= samples; i += 8)
+        {
+            const uint8_t* const ptr = srcptr + i * stride;
+            const __m256 a = F::load(ptr, ptr + stride * 4);
+            const __m256 b = F::load(ptr + stride * 2, ptr + stride * 6);
+            storeGain<kGain>(dst[0] + i, _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)), gains + i);
+            storeGain<kGain>(dst[1] + i, _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)), gains + i);
+        }
+    }
+    else
+    {
+        for (; i + 8 <= samples; i += 8)
+        {
+            const uint8_t* const ptr = srcptr + i * stride;
+            uint8_t c = 0;
+
+            for (; c + 4 <= channels; c += 4)
+            {
+                const uint8_t* const cptr = ptr + c * F::kSize;
+                __m256 r0 = F::load(cptr, cptr + stride * 4);
+                __m256 r1 = F::load(cptr + stride, cptr + stride * 5);
+                __m256 r2 = F::load(cptr + stride * 2, cptr + stride * 6);
+                __m256 r3 = F::load(cptr + stride * 3, cptr + stride * 7);
+                transpose4x2(r0, r1, r2, r3);
+                storeGain<kGain>(dst[c] + i, r0, gains + i);
+                storeGain<kGain>(dst[c + 1] + i, r1, gains + i);
+                storeGain<kGain>(dst[c + 2] + i, r2, gains + i);
+                storeGain<kGain>(dst[c + 3] + i, r3, gains + i);
+            }
+
+            for (; c < channels; ++c)
+                for (uint8_t k = 0; k < 8; ++k)
+                    dst[c][i + k] = applyGain(F::read(ptr + c * F::kSize + stride * k), kGain ? gains : nullptr, i + k);
+        }
+    }
+
+    for (; i < samples; ++i)
+        for (uint8_t c = 0; c < channels; ++c)
+            dst[c][i] = applyGain(F::read(srcptr + i * stride + c * F::kSize), kGain ? gains : nullptr, i);
+}
+
+template<class F, uint8_t kChannels, bool kGain>
+AUDIO_BRIDGE_TARGET_AVX2
+static inline
+void float2intImpl(void* const dst, float* const* const src, const float* const gains,
+                   const uint8_t numChannels, const uint16_t samples)
+{
+    const uint8_t channels = kChannels != 0 ? kChannels : numChannels;
+    uint8_t* const dstptr = static_cast<uint8_t*>(dst);
+    const uint32_t stride = channels * F::kSize;
+    uint32_t i = 0;
+
+    if (channels == 1)
+    {
+        for (; i + 8 <= samples; i += 8)
+        {
+            uint8_t* const ptr = dstptr + i * F::kSize;
+            F::store(ptr, ptr + 4 * F::kSize, loadGain<kGain>(src[0] + i, gains + i));
+        }
+    }
+    else if (channels == 2)
+    {
+        for (; i + 8 <= samples; i += 8)
+        {
+            uint8_t* const ptr = dstptr + i * stride;
+            const __m256 l = loadGain<kGain>(src[0] + i, gains + i);
+            const __m256 r = loadGain<kGain>(src[1] + i, gains + i);
+            F::store(ptr, ptr + stride * 4, _mm256_unpacklo_ps(l, r));
+            F::store(ptr + stride * 2, ptr + stride * 6, _mm256_unpackhi_ps(l, r));
+        }
+    }
+    else
+    {
+        for (; i + 8 <= samples; i += 8)
+        {
+            uint8_t* const ptr = dstptr + i * stride;
+            uint8_t c = 0;
+
+            for (; c + 4 <= channels; c += 4)
+            {
+                uint8_t* const cptr = ptr + c * F::kSize;
+                __m256 r0 = loadGain<kGain>(src[c] + i, gains + i);
+                __m256 r1 = loadGain<kGain>(src[c + 1] + i, gains + i);
+                __m256 r2 = loadGain<kGain>(src[c + 2] + i, gains + i);
+                __m256 r3 = loadGain<kGain>(src[c + 3] + i, gains + i);
+                transpose4x2(r0, r1, r2, r3);
+                F::store(cptr, cptr + stride * 4, r0);
+                F::store(cptr + stride, cptr + stride * 5, r1);
+                F::store(cptr + stride * 2, cptr + stride * 6, r2);
+                F::store(cptr + stride * 3, cptr + stride * 7, r3);
+            }
+
+            for (; c < channels; ++c)
+                for (uint8_t k = 0; k < 8; ++k)
+                    F::write(ptr + c * F::kSize + stride * k, applyGain(src[c][i + k], kGain ? gains : nullptr, i + k));
+        }
+    }
+
+    for (; i < samples; ++i)
+        for (uint8_t c = 0; c < channels; ++c)
+            F::write(dstptr + i * stride + c * F::kSize, applyGain(src[c][i], kGain ? gains : nullptr, i));
+}
+
+
+// dispatch to the variant with or without gain, once per call
+template<class F, uint8_t kChannels = 0>
+AUDIO_BRIDGE_TARGET_AVX2
+static inline
+void int2float(float* const* const dst, void* const src, const float* const gains,
+               const uint8_t numChannels, const uint16_t samples)
+{
+    if (gains != nullptr)
+        int2floatImpl<F, kChannels, true>(dst, src, gains, numChannels, samples);
+    else
+        int2floatImpl<F, kChannels, false>(dst, src, nullptr, numChannels, samples);
+}
+
+template<class F, uint8_t kChannels = 0>
+AUDIO_BRIDGE_TARGET_AVX2
+static inline
+void float2int(void* const dst, float* const* const src, const float* const gains,
+               const uint8_t numChannels, const uint16_t samples)
+{
+    if (gains != nullptr)
+        float2intImpl<F, kChannels, true>(dst, src, gains, numChannels, samples);
+    else
+        float2intImpl<F, kChannels, false>(dst, src, nullptr, numChannels, samples);
+}
+
+} // namespace avx2
+#endif // AUDIO_BRIDGE_SIMD_AVX2
+
+// --------------------------------------------------------------------------------------------------------------------
+// NEON (aarch64 only, armv7 lacks round-to-nearest conversion), 4 frames at a time
+
+#ifdef AUDIO_BRIDGE_SIMD_NEON
+namespace neon
+{
+
+static inline
+int32x4_t scaleToInt(const float32x4_t s, const float scale) noexcept
+{
+    const float32x4_t z = vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(s), vceqq_f32(s, s)));
+    return vcvtnq_s32_f32(vmulq_n_f32(vmaxq_f32(vminq_f32(z, vdupq_n_f32(1.f)), vdupq_n_f32(-1.f)), scale));
+}
+
+static inline
+void transpose4(float32x4_t& r0, float32x4_t& r1, float32x4_t& r2, float32x4_t& r3) noexcept
+{
+    const float64x2_t t0 = vreinterpretq_f64_f32(vtrn1q_f32(r0, r1));
+    const float64x2_t t1 = vreinterpretq_f64_f32(vtrn2q_f32(r0, r1));
+    const float64x2_t t2 = vreinterpretq_f64_f32(vtrn1q_f32(r2, r3));
+    const float64x2_t t3 = vreinterpretq_f64_f32(vtrn2q_f32(r2, r3));
+    r0 = vreinterpretq_f32_f64(vtrn1q_f64(t0, t2));
+    r1 = vreinterpretq_f32_f64(vtrn1q_f64(t1, t3));
+    r2 = vreinterpretq_f32_f64(vtrn2q_f64(t0, t2));
+    r3 = vreinterpretq_f32_f64(vtrn2q_f64(t1, t3));
+}
+
+struct S16 : SampleS16 {
+    static inline float32x4_t load(const uint8_t* const p) noexcept
+    {
+        const int32x4_t z = vmovl_s16(vreinterpret_s16_u8(vld1_u8(p)));
+        return vmulq_n_f32(vcvtq_f32_s32(z), 1.f / 32767.f);
+    }
+
+    static inline void store(uint8_t* const p, const float32x4_t s) noexcept
+    {
+        vst1_u8(p, vreinterpret_u8_s16(vmovn_s32(scaleToInt(s, 32767.f))));
+    }
+};
+
+struct S24 : SampleS24 {
+    static inline float32x4_t load(const uint8_t* const p) noexcept
+    {
+        return vmulq_n_f32(vcvtq_f32_s32(vreinterpretq_s32_u8(vld1q_u8(p))), 1.f / 8388607.f);
+    }
+
+    static inline void store(uint8_t* const p, const float32x4_t s) noexcept
+    {
+        vst1q_u8(p, vreinterpretq_u8_s32(scaleToInt(s, 8388607.f)));
+    }
+};
+
+struct S24LE3 : SampleS24LE3 {
+    static inline float32x4_t load(const uint8_t* const p) noexcept
+    {
+        // move each 3-byte sample into the upper 3 bytes of its lane, then sign-extend with an arithmetic shift
+        static const uint8_t kShuffle[16] = { 255, 0, 1, 2, 255, 3, 4, 5, 255, 6, 7, 8, 255, 9, 10, 11 };
+        uint32_t last;
+        std::memcpy(&last, p + 8, sizeof(last));
+        const uint8x16_t b = vcombine_u8(vld1_u8(p), vreinterpret_u8_u32(vdup_n_u32(last)));
+        const int32x4_t z = vshrq_n_s32(vreinterpretq_s32_u8(vqtbl1q_u8(b, vld1q_u8(kShuffle))), 8);
+
+        float32x4_t s = vmulq_n_f32(vcvtq_f32_s32(z), 1.f / 8388607.f);
+        s = vbslq_f32(vcgtq_s32(z, vdupq_n_s32(8388606)), vdupq_n_f32(1.f), s);
+        s = vbslq_f32(vcltq_s32(z, vdupq_n_s32(-8388606)), vdupq_n_f32(-1.f), s);
+        return s;
+    }
+
+    static inline void store(uint8_t* const p, const float32x4_t s) noexcept
+    {
+        // pack the lower 3 bytes of each lane together
+        static const uint8_t kShuffle[16] = { 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, 255, 255, 255, 255 };
+        const uint8x16_t b = vqtbl1q_u8(vreinterpretq_u8_s32(scaleToInt(s, 8388607.f)), vld1q_u8(kShuffle));
+        const uint32_t last = vgetq_lane_u32(vreinterpretq_u32_u8(b), 2);
+        vst1_u8(p, vget_low_u8(b));
+        std::memcpy(p + 8, &last, sizeof(last));
+    }
+};
+
+struct S32 : SampleS32 {
+    static inline float32x4_t load(const uint8_t* const p) noexcept
+    {
+        // double precision like the scalar code
+        const int32x4_t z = vreinterpretq_s32_u8(vld1q_u8(p));
+        const float64x2_t scale = vdupq_n_f64(1.0 / 2147483647.0);
+        const float32x2_t s1 = vcvt_f32_f64(vmulq_f64(vcvtq_f64_s64(vmovl_s32(vget_low_s32(z))), scale));
+        const float32x2_t s2 = vcvt_f32_f64(vmulq_f64(vcvtq_f64_s64(vmovl_s32(vget_high_s32(z))), scale));
+        return vcombine_f32(s1, s2);
+    }
+
+    static inline void store(uint8_t* const p, const float32x4_t s) noexcept
+    {
+        // conversion saturates to 0x7fffffff on +1, -1 needs to be fixed up
+        const int32x4_t z = vmaxq_s32(scaleToInt(s, 2147483648.f), vdupq_n_s32(-2147483647));
+        vst1q_u8(p, vreinterpretq_u8_s32(z));
+    }
+};
+
+struct F32 : SampleF32 {
+    static inline float32x4_t load(const uint8_t* const p) noexcept
+    {
+        return vreinterpretq_f32_u8(vld1q_u8(p));
+    }
+
+    static inline void store(uint8_t* const p, const float32x4_t s) noexcept
+    {
+        vst1q_u8(p, vreinterpretq_u8_f32(s));
+    }
+};
+
+// load or store planar float data, applying the per-frame gain if kGain
+template<bool kGain>
+static inline
+float32x4_t loadGain(const float* const p, const float* const gains) noexcept
+{
+    return kGain ? vmulq_f32(vld1q_f32(p), vld1q_f32(gains)) : vld1q_f32(p);
+}
+
+template<bool kGain>
+static inline
+void storeGain(float* const p, const float32x4_t s, const float* const gains) noexcept
+{
+    vst1q_f32(p, kGain ? vmulq_f32(s, vld1q_f32(gains)) : s);
+}
+
+template<class F, uint8_t kChannels, bool kGain>
+static inline
+void int2floatImpl(float* const* const dst, void* const src, const float* const gains,
+                   const uint8_t numChannels, const uint16_t samples)
+{
+    const uint8_t channels = kChannels != 0 ? kChannels : numChannels;
+    const uint8_t* const srcptr = static_cast<const uint8_t*>(src);
+    const uint32_t stride = channels * F::kSize;
+    uint32_t i = 0;
+
+    if (channels == 1)
+    {
+        for (; i + 4 <= samples; i += 4)
+            storeGain<kGain>(dst[0] + i, F::load(srcptr + i * F::kSize), gains + i);
+    }
+    else if (channels == 2)
+    {
+        for (; i + 4 <= samples; i += 4)
+        {
+            const float32x4_t a = F::load(srcptr + i * stride);
+            const float32x4_t b = F::load(srcptr + (i + 2) * stride);
+            storeGain<kGain>(dst[0] + i, vuzp1q_f32(a, b), gains + i);
+            storeGain<kGain>(dst[1] + i, vuzp2q_f32(a, b), gains + i);
+        }
+    }
+    else
+    {
+        for (; i + 4 <= samples; i += 4)
+        {
+            const uint8_t* const ptr = srcptr + i * stride;
+            uint8_t c = 0;
+
+            for (; c + 4 <= channels; c += 4)
+            {
+                float32x4_t r0 = F::load(ptr + c * F::kSize);
+                float32x4_t r1 = F::load(ptr + c * F::kSize + stride);
+                float32x4_t r2 = F::load(ptr + c * F::kSize + stride * 2);
+                float32x4_t r3 = F::load(ptr + c * F::kSize + stride * 3);
+                transpose4(r0, r1, r2, r3);
+                storeGain<kGain>(dst[c] + i, r0, gains + i);
+                storeGain<kGain>(dst[c + 1] + i, r1, gains + i);
+                storeGain<kGain>(dst[c + 2] + i, r2, gains + i);
+                storeGain<kGain>(dst[c + 3] + i, r3, gains + i);
+            }
+
+            for (; c < channels; ++c)
+                for (uint8_t k = 0; k < 4; ++k)
+                    dst[c][i + k] = applyGain(F::read(ptr + c * F::kSize + stride * k), kGain ? gains : nullptr, i + k);
+        }
+    }
+
+    for (; i < samples; ++i)
+        for (uint8_t c = 0; c < channels; ++c)
+            dst[c][i] = applyGain(F::read(srcptr + i * stride + c * F::kSize), kGain ? gains : nullptr, i);
+}
+
+template<class F, uint8_t kChannels, bool kGain>
+static inline
+void float2intImpl(void* const dst, float* const* const src, const float* const gains,
+                   const uint8_t numChannels, const uint16_t samples)
+{
+    const uint8_t channels = kChannels != 0 ? kChannels : numChannels;
+    uint8_t* const dstptr = static_cast<uint8_t*>(dst);
+    const uint32_t stride = channels * F::kSize;
+    uint32_t i = 0;
+
+    if (channels == 1)
+    {
+        for (; i + 4 <= samples; i += 4)
+            F::store(dstptr + i * F::kSize, loadGain<kGain>(src[0] + i, gains + i));
+    }
+    else if (channels == 2)
+    {
+        for (; i + 4 <= samples; i += 4)
+        {
+            const float32x4_t l = loadGain<kGain>(src[0] + i, gains + i);
+            const float32x4_t r = loadGain<kGain>(src[1] + i, gains + i);
+            F::store(dstptr + i * stride, vzip1q_f32(l, r));
+            F::store(dstptr + (i + 2) * stride, vzip2q_f32(l, r));
+        }
+    }
+    else
+    {
+        for (; i + 4 <= samples; i += 4)
+        {
+            uint8_t* const ptr = dstptr + i * stride;
+            uint8_t c = 0;
+
+            for (; c + 4 <= channels; c += 4)
+            {
+                float32x4_t r0 = loadGain<kGain>(src[c] + i, gains + i);
+                float32x4_t r1 = loadGain<kGain>(src[c + 1] + i, gains + i);
+                float32x4_t r2 = loadGain<kGain>(src[c + 2] + i, gains + i);
+                float32x4_t r3 = loadGain<kGain>(src[c + 3] + i, gains + i);
+                transpose4(r0, r1, r2, r3);
+                F::store(ptr + c * F::kSize, r0);
+                F::store(ptr + c * F::kSize + stride, r1);
+                F::store(ptr + c * F::kSize + stride * 2, r2);
+                F::store(ptr + c * F::kSize + stride * 3, r3);
+            }
+
+            for (; c < channels; ++c)
+                for (uint8_t k = 0; k < 4; ++k)
+                    F::write(ptr + c * F::kSize + stride * k, applyGain(src[c][i + k], kGain ? gains : nullptr, i + k));
+        }
+    }
+
+    for (; i < samples; ++i)
+        for (uint8_t c = 0; c < channels; ++c)
+            F::write(dstptr + i * stride + c * F::kSize, applyGain(src[c][i], kGain ? gains : nullptr, i));
+}
+
+
+// dispatch to the variant with or without gain, once per call
+template<class F, uint8_t kChannels = 0>
+static inline
+void int2float(float* const* const dst, void* const src, const float* const gains,
+               const uint8_t numChannels, const uint16_t samples)
+{
+    if (gains != nullptr)
+        int2floatImpl<F, kChannels, true>(dst, src, gains, numChannels, samples);
+    else
+        int2floatImpl<F, kChannels, false>(dst, src, nullptr, numChannels, samples);
+}
+
+template<class F, uint8_t kChannels = 0>
+static inline
+void float2int(void* const dst, float* const* const src, const float* const gains,
+               const uint8_t numChannels, const uint16_t samples)
+{
+    if (gains != nullptr)
+        float2intImpl<F, kChannels, true>(dst, src, gains, numChannels, samples);
+    else
+        float2intImpl<F, kChannels, false>(dst, src, nullptr, numChannels, samples);
+}
+
+} // namespace neon
+#endif // AUDIO_BRIDGE_SIMD_NEON
+
+// --------------------------------------------------------------------------------------------------------------------
+// runtime dispatch
+
+// gains has 1 value per frame, or is nullptr for unity gain
+typedef void (*Float2IntFunc)(void* dst, float* const* src, const float* gains, uint8_t channels, uint16_t samples);
+typedef void (*Int2FloatFunc)(float* const* dst, void* src, const float* gains, uint8_t channels, uint16_t samples);
+
+struct Converters {
+    const char* name;
+    Float2IntFunc f2i_s16, f2i_s24, f2i_s24le3, f2i_s32;
+    Int2FloatFunc i2f_s16, i2f_s24, i2f_s24le3, i2f_s32;
+    // float needs no conversion, these only (de)interleave and apply gain
+    Float2IntFunc f2i_f32;
+    Int2FloatFunc i2f_f32;
+    // big-endian formats are rare, all variants use the scalar code for them
+    Float2IntFunc f2i_s24be3, f2i_s32be;
+    Int2FloatFunc i2f_s24be3, i2f_s32be;
+};
+
+// tables for a compile-time channel count, 0 meaning any
+template<uint8_t kChannels>
+static constexpr inline
+Converters makeScalarConverters() noexcept
+{
+    return {
+        "scalar",
+        float2int::scalar::s16<kChannels>, float2int::scalar::s24<kChannels>,
+        float2int::scalar::s24le3<kChannels>, float2int::scalar::s32<kChannels>,
+        int2float::scalar::s16<kChannels>, int2float::scalar::s24<kChannels>,
+        int2float::scalar::s24le3<kChannels>, int2float::scalar::s32<kChannels>,
+        float2int::scalar::f32<kChannels>, int2float::scalar::f32<kChannels>,
+        float2int::scalar::s24be3<kChannels>, float2int::scalar::s32be<kChannels>,
+        int2float::scalar::s24be3<kChannels>, int2float::scalar::s32be<kChannels>,
+    };
+}
+
+// channel counts with dedicated converters, in the same order as the kFixedConverters tables
+static constexpr const uint8_t kNumFixedChannels = 4;
+static constexpr const uint8_t kFixedChannels[kNumFixedChannels] = { 1, 2, 4, 8 };
+
+static constexpr const Converters kScalarConverters = makeScalarConverters<0>();
+static constexpr const Converters kScalarFixedConverters[kNumFixedChannels] = {
+    makeScalarConverters<1>(), makeScalarConverters<2>(), makeScalarConverters<4>(), makeScalarConverters<8>(),
+};
+
+#ifdef AUDIO_BRIDGE_SIMD_SSE2
+namespace sse2
+{
+template<uint8_t kChannels>
+static constexpr inline
+Converters makeConverters() noexcept
+{
+    return {
+        "sse2",
+        float2int<S16, kChannels>, float2int<S24, kChannels>, float2int<S24LE3, kChannels>, float2int<S32, kChannels>,
+        int2float<S16, kChannels>, int2float<S24, kChannels>, int2float<S24LE3, kChannels>, int2float<S32, kChannels>,
+        float2int<F32, kChannels>, int2float<F32, kChannels>,
+        float2int::scalar::s24be3<kChannels>, float2int::scalar::s32be<kChannels>,
+        int2float::scalar::s24be3<kChannels>, int2float::scalar::s32be<kChannels>,
+    };
+}
+
+static constexpr const Converters kConverters = makeConverters<0>();
+static constexpr const Converters kFixedConverters[kNumFixedChannels] = {
+    makeConverters<1>(), makeConverters<2>(), makeConverters<4>(), makeConverters<8>(),
+};
+}
+#endif
+
+#ifdef AUDIO_BRIDGE_SIMD_AVX2
+namespace avx2
+{
+template<uint8_t kChannels>
+static constexpr inline
+Converters makeConverters() noexcept
+{
+    return {
+        "avx2",
+        float2int<S16, kChannels>, float2int<S24, kChannels>, float2int<S24LE3, kChannels>, float2int<S32, kChannels>,
+        int2float<S16, kChannels>, int2float<S24, kChannels>, int2float<S24LE3, kChannels>, int2float<S32, kChannels>,
+        float2int<F32, kChannels>, int2float<F32, kChannels>,
+        float2int::scalar::s24be3<kChannels>, float2int::scalar::s32be<kChannels>,
+        int2float::scalar::s24be3<kChannels>, int2float::scalar::s32be<kChannels>,
+    };
+}
+
+static constexpr const Converters kConverters = makeConverters<0>();
+static constexpr const Converters kFixedConverters[kNumFixedChannels] = {
+    makeConverters<1>(), makeConverters<2>(), makeConverters<4>(), makeConverters<8>(),
+};
+}
+#endif
+
+#ifdef AUDIO_BRIDGE_SIMD_NEON
+namespace neon
+{
+template<uint8_t kChannels>
+static constexpr inline
+Converters makeConverters() noexcept
+{
+    return {
+        "neon",
+        float2int<S16, kChannels>, float2int<S24, kChannels>, float2int<S24LE3, kChannels>, float2int<S32, kChannels>,
+        int2float<S16, kChannels>, int2float<S24, kChannels>, int2float<S24LE3, kChannels>, int2float<S32, kChannels>,
+        float2int<F32, kChannels>, int2float<F32, kChannels>,
+        float2int::scalar::s24be3<kChannels>, float2int::scalar::s32be<kChannels>,
+        int2float::scalar::s24be3<kChannels>, int2float::scalar::s32be<kChannels>,
+    };
+}
+
+static constexpr const Converters kConverters = makeConverters<0>();
+static constexpr const Converters kFixedConverters[kNumFixedChannels] = {
+    makeConverters<1>(), makeConverters<2>(), makeConverters<4>(), makeConverters<8>(),
+};
+}
+#endif
+
+// pick the best available converters for the running CPU
+static inline
+const Converters& detectConverters() noexcept
+{
+   #ifdef AUDIO_BRIDGE_SIMD_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return avx2::kConverters;
+   #endif
+   #if defined(AUDIO_BRIDGE_SIMD_SSE2)
+    return sse2::kConverters;
+   #elif defined(AUDIO_BRIDGE_SIMD_NEON)
+    return neon::kConverters;
+   #else
+    return kScalarConverters;
+   #endif
+}
+
+static inline
+const Converters& getConverters() noexcept
+{
+    static const Converters& converters = detectConverters();
+    return converters;
+}
+
+// same as detectConverters, for the fixed channel count tables
+static inline
+const Converters* detectFixedConverters() noexcept
+{
+   #ifdef AUDIO_BRIDGE_SIMD_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return avx2::kFixedConverters;
+   #endif
+   #if defined(AUDIO_BRIDGE_SIMD_SSE2)
+    return sse2::kFixedConverters;
+   #elif defined(AUDIO_BRIDGE_SIMD_NEON)
+    return neon::kFixedConverters;
+   #else
+    return kScalarFixedConverters;
+   #endif
+}
+
+// converters specialized for a channel count if available, the generic ones otherwise
+// the returned functions must only be called with this exact channel count
+static inline
+const Converters& getConverters(const uint8_t channels) noexcept
+{
+    static const Converters* const fixed = detectFixedConverters();
+
+    for (uint8_t i = 0; i < kNumFixedChannels; ++i)
+        if (kFixedChannels[i] == channels)
+            return fixed[i];
+
+    return getConverters();
+}
+
+// setup FPU flags and runtime dispatch, to be called at the start of each audio thread
+static inline
+void init()
+{
+    initFPU();
+    getConverters();
+}
+
+} // namespace simd
+
+// --------------------------------------------------------------------------------------------------------------------
+
+namespace float2int
+{
+
+static inline
+void s16(void* const dst, float* const* const src, const uint8_t channels, const uint16_t samples)
+{
+    simd::getConverters().f2i_s16(dst, src, nullptr, channels, samples);
+}
+
+static inline
+void s24(void* const dst, float* const* const src, const uint8_t channels, const uint16_t samples)
+{
+    simd::getConverters().f2i_s24(dst, src, nullptr, channels, samples);
+}
+
+static inline
+void s24le3(void* const dst, float* const* const src, const uint8_t channels, const uint16_t samples)
+{
+    simd::getConverters().f2i_s24le3(dst, src, nullptr, channels, samples);
+}
+
+static inline
+void s32(void* const dst, float* const* const src, const uint8_t channels, const uint16_t samples)
+{
+    simd::getConverters().f2i_s32(dst, src, nullptr, channels, samples);
+}
+
+static inline
+void f32(void* const dst, float* const* const src, const uint8_t channels, const uint16_t samples)
+{
+    simd::getConverters().f2i_f32(dst, src, nullptr, channels, samples);
+}
+
+static inline
+void s24be3(void* const dst, float* const* const src, const uint8_t channels, const uint16_t samples)
+{
+    simd::getConverters().f2i_s24be3(dst, src, nullptr, channels, samples);
+}
+
+static inline
+void s32be(void* const dst, float* const* const src, const uint8_t channels, const uint16_t samples)
+{
+    simd::getConverters().f2i_s32be(dst, src, nullptr, channels, samples);
+}
+
+} // namespace float2int
+
+// --------------------------------------------------------------------------------------------------------------------
+
+namespace int2float
+{
+
+static inline
+void s16(float* const* const dst, void* const src, const uint8_t channels, const uint16_t samples)
+{
+    simd::getConverters().i2f_s16(dst, src, nullptr, channels, samples);
+}
+
+static inline
+void s24(float* const* const dst, void* const src, const uint8_t channels, const uint16_t samples)
+{
+    simd::getConverters().i2f_s24(dst, src, nullptr, channels, samples);
+}
+
+static inline
+void s24le3(float* const* const dst, void* const src, const uint8_t channels, const uint16_t samples)
+{
+    simd::getConverters().i2f_s24le3(dst, src, nullptr, channels, samples);
+}
+
+static inline
+void s32(float* const* const dst, void* const src, const uint8_t channels, const uint16_t samples)
+{
+    simd::getConverters().i2f_s32(dst, src, nullptr, channels, samples);
+}
+
+static inline
+void f32(float* const* const dst, void* const src, const uint8_t channels, const uint16_t samples)
+{
+    simd::getConverters().i2f_f32(dst, src, nullptr, channels, samples);
+}
+
+static inline
+void s24be3(float* const* const dst, void* const src, const uint8_t channels, const uint16_t samples)
+{
+    simd::getConverters().i2f_s24be3(dst, src, nullptr, channels, samples);
+}
+
+static inline
+void s32be(float* const* const dst, void* const src, const uint8_t channels, const uint16_t samples)
+{
+    simd::getConverters().i2f_s32be(dst, src, nullptr, channels, samples);
+}
+
+} // namespace int2float
 
 // --------------------------------------------------------------------------------------------------------------------
@@ -2,9 +2,13 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later
 
 #include "audio-device-discovery.hpp"
+#include "audio-device-hotplug.hpp"
 #include "audio-device-init.hpp"
 
 #include <jack/jack.h>
+#include <atomic>
+#include <cctype>
+#include <cstdlib>
 #include <cstring>
 #include <unistd.h>
 
@@ -15,6 +19,7 @@
 struct ClientData;
 static bool activate_capture(ClientData* d);
 static bool activate_playback(ClientData* d);
+static bool activate_duplex(ClientData* d);
 
 struct ClientData {
     DeviceAudio* dev = nullptr;
@@ -22,12 +27,139 @@ struct ClientData {
     float** buffers = {};
     jack_port_t** ports = {};
     uint8_t channels = 0;
+    // native rate to open the device with, 0 for the same as JACK
+    uint32_t deviceSampleRate = 0;
+    DeviceResamplerQuality quality = AUDIO_BRIDGE_RESAMPLER_DEFAULT_QUALITY;
+    // reported on our ports, in JACK frames
+    uint32_t latency = 0;
     bool playback = false;
-    bool active = true;
     bool running = true;
 
-   #ifdef AUDIO_BRIDGE_INTERNAL_JACK_CLIENT
+    // dev can be used by the process callback, which clears this once the device stops
+    // dev is only replaced while this is false, setting it with release ordering publishes the new one to the callback
+    std::atomic<bool> active = {false};
+
+    // full-duplex mode, capture ports come first and are followed by the playback ones
+    bool duplex = false;
+    uint8_t playbackChannels = 0;
+    uint32_t playbackLatency = 0;
+
+    // ports are registered and usable from the process callback
+    // in aggregate mode this happens while the client is already active, so it must be published to the callbacks
+    std::atomic<bool> registered = {false};
+
+    // hotplug serial of the last failed attempt to open the device, only tried again once soundcards change
+    uint32_t failedSerial = 0;
+    bool failed = false;
+
+    // aggregate mode, this one has no device and owns the client, processing all devices from its callback
+    // each device gets its own ClientData (and device thread), with label used as prefix for its port names
+    bool aggregate = false;
+    std::vector<ClientData*> devices;
+    std::string label;
     char* deviceID = nullptr;
+
+    DeviceAudio* openDevice(const char* const id, const uint16_t bufferSize, const uint32_t sampleRate)
+    {
+        if (duplex)
+            return initDeviceAudioDuplex(id, bufferSize, sampleRate, 2, deviceSampleRate, quality);
+
+        return initDeviceAudio(id, playback, bufferSize, sampleRate, 2, deviceSampleRate, quality);
+    }
+
+    // returns true if the latency reported on our ports changed
+    bool updateLatency()
+    {
+        const uint32_t newLatency = getDeviceAudioLatency(dev);
+        const uint32_t newPlaybackLatency = dev->duplex != nullptr ? getDeviceAudioLatency(dev->duplex) : 0;
+
+        if (latency == newLatency && playbackLatency == newPlaybackLatency)
+            return false;
+
+        latency = newLatency;
+        playbackLatency = newPlaybackLatency;
+        return true;
+    }
+
+    bool activate()
+    {
+        channels = dev->hwstatus.channels;
+        playbackChannels = dev->duplex != nullptr ? dev->duplex->hwstatus.channels : 0;
+
+        const bool ok = duplex ? activate_duplex(this) : playback ? activate_playback(this) : activate_capture(this);
+        registered.store(ok, std::memory_order_release);
+        return ok;
+    }
+
+    // (re)open the device if needed and keep its latency up to date, returns false while it is not available
+    bool updateDevice(const char* const id, const uint16_t bufferSize, const uint32_t sampleRate, const uint32_t serial)
+    {
+        if (dev != nullptr && ! active.load(std::memory_order_acquire))
+        {
+            // try to reopen right away, the device might still be there
+            closeDeviceAudio(dev);
+            dev = nullptr;
+        }
+
+        if (dev == nullptr)
+        {
+            if (failed && failedSerial == serial)
+                return false;
+
+            dev = openDevice(id, bufferSize, sampleRate);
+
+            if (dev == nullptr)
+            {
+                failed = true;
+                failedSerial = serial;
+                return false;
+            }
+
+            failed = false;
+            active.store(true, std::memory_order_release);
+
+            // device might have reopened with a different buffer size or sample rate
+            if (updateLatency() && registered.load(std::memory_order_relaxed))
+                jack_recompute_total_latencies(client);
+
+            if (! registered.load(std::memory_order_relaxed))
+                activate();
+        }
+        else if (updateLatency())
+        {
+            // adaptive latency target changed
+            jack_recompute_total_latencies(client);
+        }
+
+        return true;
+    }
+
+    void runAggregate()
+    {
+        const uint16_t bufferSize = jack_get_buffer_size(client);
+        const uint32_t sampleRate = jack_get_sample_rate(client);
+
+        soundcardHotplugStart();
+
+        while (running)
+        {
+            const uint32_t serial = getSoundcardHotplugSerial();
+            bool missing = false;
+
+            for (ClientData* const d : devices)
+                missing |= ! d->updateDevice(d->deviceID, bufferSize, sampleRate, serial);
+
+            // wait for soundcard changes while some device is missing, without delaying latency updates of the others
+            if (! missing)
+                usleep(250000); // 250ms
+            else if (waitForSoundcardHotplug(serial, 250) != serial)
+                usleep(AUDIO_BRIDGE_HOTPLUG_SETTLE_TIME * 1000);
+        }
+
+        soundcardHotplugStop();
+    }
+
+   #ifdef AUDIO_BRIDGE_INTERNAL_JACK_CLIENT
     pthread_t thread = {};
 
     void runInternal()
@@ -35,88 +167,85 @@ struct ClientData {
         const uint16_t bufferSize = jack_get_buffer_size(client);
         const uint32_t sampleRate = jack_get_sample_rate(client);
 
+        soundcardHotplugStart();
+
         while (running && dev == nullptr)
         {
-            dev = initDeviceAudio(deviceID, playback, bufferSize, sampleRate);
+            const uint32_t serial = getSoundcardHotplugSerial();
+
+            dev = openDevice(deviceID, bufferSize, sampleRate);
 
             if (dev != nullptr)
             {
-                channels = dev->hwstatus.channels;
-
-                if (playback)
-                    activate_playback(this);
-                else
-                    activate_capture(this);
-
+                updateLatency();
+                active.store(true, std::memory_order_release);
+                activate();
                 break;
             }
 
-            usleep(250000); // 250ms
+            waitForSoundcardHotplug(serial, -1);
+            usleep(AUDIO_BRIDGE_HOTPLUG_SETTLE_TIME * 1000);
         }
 
+        soundcardHotplugStop();
         running = false;
     }
 
     static void* threadRunInternal(void* const arg)
     {
         ClientData* const d = static_cast<ClientData*>(arg);
-        d->runInternal();
+
+        if (d->aggregate)
+            d->runAggregate();
+        else
+            d->runInternal();
+
         return nullptr;
     }
    #else
-    void runExternal(const char* const deviceID)
+    void runExternal(const char* const id)
     {
         const uint16_t bufferSize = jack_get_buffer_size(client);
         const uint32_t sampleRate = jack_get_sample_rate(client);
-        bool needsToInitialise = true;
+
+        soundcardHotplugStart();
 
         while (running)
         {
-            if (dev == nullptr)
+            const uint32_t serial = getSoundcardHotplugSerial();
+
+            // idle until soundcards change, otherwise keep checking for the device going away or latency changes
+            if (updateDevice(id, bufferSize, sampleRate, serial))
             {
-                dev = initDeviceAudio(deviceID, playback, bufferSize, sampleRate);
-
-                if (dev != nullptr)
-                {
-                    active = true;
-
-                    if (needsToInitialise)
-                    {
-                        needsToInitialise = false;
-                        channels = dev->hwstatus.channels;
-
-                        if (playback)
-                            activate_playback(this);
-                        else
-                            activate_capture(this);
-                    }
-                }
+                usleep(250000); // 250ms
             }
-            else if (! active)
+            else
             {
-                closeDeviceAudio(dev);
-                dev = nullptr;
+                waitForSoundcardHotplug(serial, -1);
+                usleep(AUDIO_BRIDGE_HOTPLUG_SETTLE_TIME * 1000);
             }
-
-            usleep(250000); // 250ms
         }
+
+        soundcardHotplugStop();
     }
    #endif
 };
 
-static int jack_process(const unsigned frames, void* const arg)
+static void process_device(ClientData* const d, const unsigned frames, const jack_time_t current_usecs)
 {
-    ClientData* const d = static_cast<ClientData*>(arg);
-
-    for (uint8_t c = 0; c < d->channels; ++c)
+    for (uint8_t c = 0; c < d->channels + d->playbackChannels; ++c)
         d->buffers[c] = static_cast<float*>(jack_port_get_buffer(d->ports[c], frames));
 
-    if (d->dev != nullptr && d->active)
+    if (d->active.load(std::memory_order_acquire))
     {
-        if (runDeviceAudio(d->dev, d->buffers))
-            return 0;
+        DeviceAudio* const dev = d->dev;
+
+        // in duplex mode both sides are served by the same device thread, and stop together
+        if (runDeviceAudio(dev, d->buffers, frames, current_usecs) &&
+            (dev->duplex == nullptr || runDeviceAudio(dev->duplex, d->buffers + d->channels, frames, current_usecs)))
+            return;
 
-        d->active = false;
+        d->active.store(false, std::memory_order_release);
     }
 
     if (!d->playback)
@@ -124,10 +253,93 @@ static int jack_process(const unsigned frames, void* const arg)
         for (uint8_t c = 0; c < d->channels; ++c)
             std::memset(d->buffers[c], 0, sizeof(float)*frames);
     }
+}
+
+static int jack_process(const unsigned frames, void* const arg)
+{
+    ClientData* const d = static_cast<ClientData*>(arg);
+
+    jack_nframes_t current_frames;
+    jack_time_t current_usecs, next_usecs;
+    float period_usecs;
+
+    if (jack_get_cycle_times(d->client, &current_frames, &current_usecs, &next_usecs, &period_usecs) != 0)
+        current_usecs = 0;
+
+    if (! d->aggregate)
+    {
+        process_device(d, frames, current_usecs);
+        return 0;
+    }
+
+    // aggregate mode, every device gets the same cycle time for its own clock-drift compensation
+    for (ClientData* const dev : d->devices)
+    {
+        if (dev->registered.load(std::memory_order_acquire))
+            process_device(dev, frames, current_usecs);
+    }
 
     return 0;
 }
 
+// optional arguments after the device and mode, a number for the device sample rate or a resampler quality name
+static bool parse_option(const char* const arg, uint32_t& deviceSampleRate, DeviceResamplerQuality& quality)
+{
+    char* end;
+    const long rate = std::strtol(arg, &end, 10);
+
+    if (end != arg && *end == '\0' && rate > 0)
+    {
+        deviceSampleRate = rate;
+        return true;
+    }
+
+    return parseResamplerQuality(arg, quality);
+}
+
+static void set_device_latency(ClientData* const d, const jack_latency_callback_mode_t mode)
+{
+    // device side is the end of the chain, only our own ports need latency set
+    if (d->duplex)
+    {
+        const bool playback = mode == JackPlaybackLatency;
+        const uint8_t first = playback ? d->channels : 0;
+        const uint8_t count = playback ? d->playbackChannels : d->channels;
+        const uint32_t latency = playback ? d->playbackLatency : d->latency;
+        jack_latency_range_t range = { latency, latency };
+
+        for (uint8_t c = first; c < first + count; ++c)
+            jack_port_set_latency_range(d->ports[c], mode, &range);
+        return;
+    }
+
+    if (mode != (d->playback ? JackPlaybackLatency : JackCaptureLatency))
+        return;
+
+    jack_latency_range_t range = { d->latency, d->latency };
+
+    for (uint8_t c = 0; c < d->channels; ++c)
+        jack_port_set_latency_range(d->ports[c], mode, &range);
+}
+
+static void jack_latency(const jack_latency_callback_mode_t mode, void* const arg)
+{
+    ClientData* const d = static_cast<ClientData*>(arg);
+
+    if (! d->aggregate)
+    {
+        if (d->registered.load(std::memory_order_acquire))
+            set_device_latency(d, mode);
+        return;
+    }
+
+    for (ClientData* const dev : d->devices)
+    {
+        if (dev->registered.load(std::memory_order_acquire))
+            set_device_latency(dev, mode);
+    }
+}
+
 static ClientData* init_capture(jack_client_t* client = nullptr)
 {
     if (client == nullptr)
@@ -146,6 +358,7 @@ static ClientData* init_capture(jack_client_t* client = nullptr)
     d->playback = false;
 
     jack_set_process_callback(client, jack_process, d);
+    jack_set_latency_callback(client, jack_latency, d);
 
     return d;
 }
@@ -163,10 +376,43 @@ static ClientData* init_playback(jack_client_t* client = nullptr)
     d->playback = true;
 
     jack_set_process_callback(client, jack_process, d);
+    jack_set_latency_callback(client, jack_latency, d);
+
+    return d;
+}
+
+static ClientData* init_duplex(jack_client_t* client = nullptr)
+{
+    if (client == nullptr)
+        client = jack_client_open("audio-bridge-duplex", JackNoStartServer, nullptr);
+
+    if (client == nullptr)
+        return nullptr;
+
+    ClientData* const d = new ClientData;
+    d->client = client;
+    d->playback = false;
+    d->duplex = true;
+
+    jack_set_process_callback(client, jack_process, d);
+    jack_set_latency_callback(client, jack_latency, d);
 
     return d;
 }
 
+// aggregate mode, port name is prefixed with the device label
+static jack_port_t* register_port(ClientData* const d, const char* const prefix, const int index, const unsigned long flags)
+{
+    char name[64] = {};
+
+    if (d->label.empty())
+        std::snprintf(name, sizeof(name)-1, "%s%d", prefix, index);
+    else
+        std::snprintf(name, sizeof(name)-1, "%s_%s%d", d->label.c_str(), prefix, index);
+
+    return jack_port_register(d->client, name, JACK_DEFAULT_AUDIO_TYPE, flags|JackPortIsTerminal, 0);
+}
+
 static bool activate_capture(ClientData* const d)
 {
     if (d->dev == nullptr || d->dev->hwstatus.channels == 0)
@@ -179,11 +425,11 @@ static bool activate_capture(ClientData* const d)
     d->ports = new jack_port_t* [channels];
 
     for (uint8_t c = 0; c < channels; ++c)
-    {
-        char name[16] = {};
-        std::snprintf(name, sizeof(name)-1, "p%d", c + 1);
-        d->ports[c] = jack_port_register(client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput|JackPortIsTerminal, 0);
-    }
+        d->ports[c] = register_port(d, "p", c + 1, JackPortIsOutput);
+
+    // aggregate client is already active, connections are left to the user
+    if (! d->label.empty())
+        return true;
 
     jack_activate(client);
 
@@ -237,11 +483,10 @@ static bool activate_playback(ClientData* const d)
     d->ports = new jack_port_t* [channels];
 
     for (uint8_t c = 0; c < channels; ++c)
-    {
-        char name[16] = {};
-        std::snprintf(name, sizeof(name)-1, "p%d", c + 1);
-        d->ports[c] = jack_port_register(client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput|JackPortIsTerminal, 0);
-    }
+        d->ports[c] = register_port(d, "p", c + 1, JackPortIsInput);
+
+    if (! d->label.empty())
+        return true;
 
     jack_activate(client);
 
@@ -260,6 +505,133 @@ static bool activate_playback(ClientData* const d)
     return true;
 }
 
+static bool activate_duplex(ClientData* const d)
+{
+    if (d->dev == nullptr || d->dev->hwstatus.channels == 0 || d->dev->duplex == nullptr)
+        return false;
+
+    const uint8_t captureChannels = d->dev->hwstatus.channels;
+    const uint8_t playbackChannels = d->dev->duplex->hwstatus.channels;
+    jack_client_t* const client = d->client;
+
+    d->buffers = new float* [captureChannels + playbackChannels];
+    d->ports = new jack_port_t* [captureChannels + playbackChannels];
+
+    for (uint8_t c = 0; c < captureChannels; ++c)
+        d->ports[c] = register_port(d, "capture_", c + 1, JackPortIsOutput);
+
+    for (uint8_t c = 0; c < playbackChannels; ++c)
+        d->ports[captureChannels + c] = register_port(d, "playback_", c + 1, JackPortIsInput);
+
+    if (! d->label.empty())
+        return true;
+
+    jack_activate(client);
+
+    return true;
+}
+
+// device ID without the ALSA plugin prefix and keywords, suitable for JACK port names, "hw:CARD=USB,DEV=0" is "USB_0"
+static std::string get_device_label(const char* const deviceID)
+{
+    const char* const colon = std::strchr(deviceID, ':');
+    std::string label;
+
+    for (const char* s = colon != nullptr ? colon + 1 : deviceID; *s != '\0'; ++s)
+    {
+        if (std::strncmp(s, "CARD=", 5) == 0)
+            s += 4;
+        else if (std::strncmp(s, "DEV=", 4) == 0)
+            s += 3;
+        else
+            label += std::isalnum(static_cast<unsigned char>(*s)) || *s == '-' ? *s : '_';
+    }
+
+    return label;
+}
+
+// "device [capture|playback|duplex] device [capture|playback|duplex] ... [options...]", see parse_option
+// all devices are served from a single client and process callback, and share its options
+static ClientData* init_aggregate(const int argc, const char* const argv[], jack_client_t* client = nullptr)
+{
+    uint32_t deviceSampleRate = 0;
+    DeviceResamplerQuality quality = AUDIO_BRIDGE_RESAMPLER_DEFAULT_QUALITY;
+    std::vector<ClientData*> devices;
+
+    for (int i = 0; i < argc; ++i)
+    {
+        if (parse_option(argv[i], deviceSampleRate, quality))
+            continue;
+
+        if (std::strcmp(argv[i], "capture") == 0 || std::strcmp(argv[i], "playback") == 0 ||
+            std::strcmp(argv[i], "duplex") == 0)
+        {
+            if (devices.empty())
+            {
+                printf("ignoring mode %s without device\n", argv[i]);
+                continue;
+            }
+
+            devices.back()->playback = std::strcmp(argv[i], "playback") == 0;
+            devices.back()->duplex = std::strcmp(argv[i], "duplex") == 0;
+            continue;
+        }
+
+        ClientData* const sd = new ClientData;
+        sd->playback = true;
+        sd->deviceID = strdup(argv[i]);
+        devices.push_back(sd);
+    }
+
+    // only options, there would be nothing to serve
+    if (devices.empty())
+    {
+        printf("no devices given for aggregate mode\n");
+        return nullptr;
+    }
+
+    if (client == nullptr)
+        client = jack_client_open("audio-bridge-aggregate", JackNoStartServer, nullptr);
+
+    if (client == nullptr)
+    {
+        for (ClientData* const sd : devices)
+        {
+            std::free(sd->deviceID);
+            delete sd;
+        }
+        return nullptr;
+    }
+
+    ClientData* const d = new ClientData;
+    d->client = client;
+    d->aggregate = true;
+    d->devices = devices;
+
+    for (size_t i = 0; i < devices.size(); ++i)
+    {
+        ClientData* const sd = devices[i];
+        sd->client = client;
+        sd->deviceSampleRate = deviceSampleRate;
+        sd->quality = quality;
+        sd->label = get_device_label(sd->deviceID);
+
+        // same card can be used more than once, in different modes
+        int count = 1;
+        for (size_t j = 0; j < i; ++j)
+            count += get_device_label(devices[j]->deviceID) == sd->label ? 1 : 0;
+
+        if (count > 1)
+            sd->label += "_" + std::to_string(count);
+    }
+
+    jack_set_process_callback(client, jack_process, d);
+    jack_set_latency_callback(client, jack_latency, d);
+    jack_activate(client);
+
+    return d;
+}
+
 static void close(ClientData* const d)
 {
     if (d->client != nullptr)
@@ -268,7 +640,16 @@ static void close(ClientData* const d)
         jack_client_close(d->client);
     }
 
-    closeDeviceAudio(d->dev);
+    // shared client is closed above, before any device goes away
+    for (ClientData* const sd : d->devices)
+    {
+        sd->client = nullptr;
+        std::free(sd->deviceID);
+        close(sd);
+    }
+
+    if (d->dev != nullptr)
+        closeDeviceAudio(d->dev);
 
     delete[] d->buffers;
     delete[] d->ports;
@@ -292,16 +673,51 @@ int jack_initialize(jack_client_t* const client, const char* const load_init)
         return 1;
    #endif
 
-    if (const char* const ctype = std::strrchr(load_init, ' '))
+    // "aggregate device [mode] device [mode] ... [options...]", see init_aggregate
+    // arguments are split on spaces, so device IDs cannot contain them in this mode
+    if (std::strncmp(load_init, "aggregate ", 10) == 0)
+    {
+        char* const args = strdup(load_init + 10);
+        std::vector<const char*> argv;
+
+        char* saveptr = nullptr;
+        for (char* arg = strtok_r(args, " ", &saveptr); arg != nullptr; arg = strtok_r(nullptr, " ", &saveptr))
+            argv.push_back(arg);
+
+        ClientData* const d = init_aggregate(static_cast<int>(argv.size()), argv.data(), client);
+        std::free(args);
+
+        if (d == nullptr)
+            return 1;
+
+        if (pthread_create(&d->thread, nullptr, ClientData::threadRunInternal, d) == 0)
+            return 0;
+
+        jack_finish(d);
+        return 1;
+    }
+
+    // "deviceID playback|capture|duplex [options...]", see parse_option
+    // options are parsed from the end, device IDs can contain spaces
+    uint32_t deviceSampleRate = 0;
+    DeviceResamplerQuality quality = AUDIO_BRIDGE_RESAMPLER_DEFAULT_QUALITY;
+    char* const args = strdup(load_init);
+
+    for (char* space; (space = std::strrchr(args, ' ')) != nullptr && parse_option(space + 1, deviceSampleRate, quality);)
+        *space = '\0';
+
+    if (char* const ctype = std::strrchr(args, ' '))
     {
+        *ctype = '\0';
+
         const bool playback = std::strcmp(ctype + 1, "playback") == 0;
+        const bool duplex = std::strcmp(ctype + 1, "duplex") == 0;
 
-        if (ClientData* const d = playback ? init_playback(client) : init_capture(client))
+        if (ClientData* const d = playback ? init_playback(client) : duplex ? init_duplex(client) : init_capture(client))
         {
-            const size_t devlen = ctype - load_init;
-            d->deviceID = static_cast<char*>(std::malloc(devlen + 1));
-            std::memcpy(d->deviceID, load_init, devlen);
-            d->deviceID[devlen] = '\0';
+            d->deviceSampleRate = deviceSampleRate;
+            d->quality = quality;
+            d->deviceID = args;
 
             printf("deviceID %s || %d %d\n", d->deviceID, d->playback, playback);
 
@@ -309,9 +725,11 @@ int jack_initialize(jack_client_t* const client, const char* const load_init)
                 return 0;
 
             jack_finish(d);
+            return 1;
         }
     }
 
+    std::free(args);
     return 1;
 }
 
@@ -322,6 +740,7 @@ void jack_finish(void* const arg)
     if (d->running)
     {
         d->running = false;
+        wakeSoundcardHotplugWaiters();
         pthread_join(d->thread, nullptr);
     }
 
@@ -338,11 +757,31 @@ int main(int argc, const char* argv[])
     ClientData* d;
     const char* deviceID;
 
+    if (argc > 2 && std::strcmp(argv[1], "aggregate") == 0)
+    {
+        d = init_aggregate(argc - 2, argv + 2);
+
+        if (d == nullptr)
+            return 1;
+
+        d->runAggregate();
+        close(d);
+
+        cleanup();
+
+        return 0;
+    }
+
     if (argc > 2 && std::strcmp(argv[2], "capture") == 0)
     {
         deviceID = argv[1];
         d = init_capture();
     }
+    else if (argc > 2 && std::strcmp(argv[2], "duplex") == 0)
+    {
+        deviceID = argv[1];
+        d = init_duplex();
+    }
     else if (argc > 1)
     {
         deviceID = argv[1];
@@ -358,6 +797,12 @@ int main(int argc, const char* argv[])
     {
     }
 
+    for (int i = 3; i < argc; ++i)
+    {
+        if (! parse_option(argv[i], d->deviceSampleRate, d->quality))
+            printf("ignoring unknown option %s\n", argv[i]);
+    }
+
     d->runExternal(deviceID);
     close(d);
 
@@ -2,6 +2,7 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later
 
 #include "audio-device-discovery.hpp"
+#include "audio-device-hotplug.hpp"
 #include "audio-device-init.hpp"
 
 #include <lv2/core/lv2.h>
@@ -53,9 +54,14 @@ struct PluginData {
     uint16_t bufferSize = 0;
     uint32_t sampleRate = 0;
     uint32_t maxRingBufferSize = 0;
-    bool playback = false;
+    const uint8_t numAudioPorts;
+    const bool playback;
     bool activated = false;
+    // soundcard changes seen so far, new ones trigger another attempt to open a device
+    uint32_t hotplugSerial = 0;
     uint32_t numSamplesUntilWorkerIdle = 0;
+    // used on the next device open
+    int32_t quality = AUDIO_BRIDGE_RESAMPLER_DEFAULT_QUALITY;
    #ifndef __MOD_DEVICES__
     char* deviceID = nullptr;
    #endif
@@ -79,6 +85,7 @@ struct PluginData {
     struct URIs {
         const LV2_URID atom_Int;
         const LV2_URID bufsize_maxBlockLength;
+        const LV2_URID resamplerQuality;
        #ifndef __MOD_DEVICES__
         const LV2_URID atom_String;
         const LV2_URID deviceid;
@@ -86,21 +93,31 @@ struct PluginData {
 
         URIs(const LV2_URID_Map* const uridMap)
             : atom_Int(uridMap->map(uridMap->handle, LV2_ATOM__Int)),
-              bufsize_maxBlockLength(uridMap->map(uridMap->handle, LV2_BUF_SIZE__maxBlockLength))
+              bufsize_maxBlockLength(uridMap->map(uridMap->handle, LV2_BUF_SIZE__maxBlockLength)),
+              resamplerQuality(uridMap->map(uridMap->handle, "https://falktx.com/plugins/audio-bridge#resamplerQuality"))
            #ifndef __MOD_DEVICES__
-            , deviceid(uridMap->map(uridMap->handle,"https://falktx.com/plugins/audio-bridge#deviceid")),
-            , atom_String(uridMap->map(uridMap->handle, LV2_ATOM__String))
+            , atom_String(uridMap->map(uridMap->handle, LV2_ATOM__String)),
+              deviceid(uridMap->map(uridMap->handle, "https://falktx.com/plugins/audio-bridge#deviceid"))
            #endif
         {}
     } uris;
 
-    PluginData(const uint32_t sampleRate_, const LV2_Feature* const* const featuresPtr)
+    PluginData(const uint32_t sampleRate_,
+               const bool playback_,
+               const uint8_t numAudioPorts_,
+               const LV2_Feature* const* const featuresPtr)
         : sampleRate(sampleRate_),
+          numAudioPorts(numAudioPorts_),
+          playback(playback_),
           features(featuresPtr),
           uris(features.uridMap)
     {
         // set initial options
         optionsSet(static_cast<const LV2_Options_Option*>(lv2_features_data(featuresPtr, LV2_OPTIONS__options)));
+
+        // first attempt does not need to wait for changes
+        soundcardHotplugStart();
+        hotplugSerial = getSoundcardHotplugSerial() - 1;
     }
 
     ~PluginData()
@@ -110,6 +127,8 @@ struct PluginData {
         if (dev != nullptr)
             closeDeviceAudio(dev);
 
+        soundcardHotplugStop();
+
         delete[] buffers.dummy;
     }
 
@@ -125,24 +144,22 @@ struct PluginData {
 
     void connectPort(const uint32_t index, void* const data)
     {
-        switch (index)
-        {
-        case 0 ... 1:
+        if (index < numAudioPorts)
             buffers.pointers[index] = static_cast<float*>(data);
-            break;
-        case 2 ... kControlCount + 2:
-            controlports[index - 2] = static_cast<float*>(data);
-            break;
-        }
+        else if (index - numAudioPorts < kControlCount)
+            controlports[index - numAudioPorts] = static_cast<float*>(data);
     }
 
     void run(const uint32_t frames)
     {
-        if (dev != nullptr && ! runDeviceAudio(dev, buffers.pointers))
+        if (dev != nullptr && ! runDeviceAudio(dev, buffers.pointers, frames))
         {
             DeviceAudio* const olddev = dev;
             dev = nullptr;
 
+            // device thread stopped by itself, the card might still be there so try to open it once more
+            hotplugSerial = getSoundcardHotplugSerial() - 1;
+
             const WorkerDevice r = { kWorkerDestroyDevice, olddev };
             features.workerSchedule->schedule_work(features.workerSchedule->handle, sizeof(r), &r);
         }
@@ -171,6 +188,13 @@ struct PluginData {
             }
 
             dev->enabled = *controlports[kControlEnabled] > 0.5f;
+
+            // device has less channels than we have ports, nothing was written to the remaining ones
+            if (!playback)
+            {
+                for (uint8_t i = dev->hwstatus.channels; i < numAudioPorts; ++i)
+                    std::memset(buffers.pointers[i], 0, sizeof(float)*frames);
+            }
         }
         else
         {
@@ -181,23 +205,43 @@ struct PluginData {
 
             if (!playback)
             {
-                std::memset(buffers.pointers[0], 0, sizeof(float)*frames);
-                std::memset(buffers.pointers[1], 0, sizeof(float)*frames);
+                for (uint8_t i = 0; i < numAudioPorts; ++i)
+                    std::memset(buffers.pointers[i], 0, sizeof(float)*frames);
             }
 
-            numSamplesUntilWorkerIdle += frames;
+            // try again once soundcards change, after letting them settle
+            // without a watcher thread nothing reports changes, so keep trying once per second like before
+            const bool watching = isSoundcardHotplugWatching();
 
-            if (numSamplesUntilWorkerIdle >= sampleRate)
+            if (! watching || hotplugSerial != getSoundcardHotplugSerial())
             {
-                numSamplesUntilWorkerIdle = 0;
-                const uint32_t r = kWorkerLoadLastAvailableDevice;
-                features.workerSchedule->schedule_work(features.workerSchedule->handle, sizeof(r), &r);
+                numSamplesUntilWorkerIdle += frames;
+
+                if (numSamplesUntilWorkerIdle >= (watching ? sampleRate * AUDIO_BRIDGE_HOTPLUG_SETTLE_TIME / 1000
+                                                           : sampleRate))
+                {
+                    numSamplesUntilWorkerIdle = 0;
+                    hotplugSerial = getSoundcardHotplugSerial();
+                    const uint32_t r = kWorkerLoadLastAvailableDevice;
+                    features.workerSchedule->schedule_work(features.workerSchedule->handle, sizeof(r), &r);
+                }
             }
         }
     }
 
-    uint32_t optionsGet(LV2_Options_Option*)
+    uint32_t optionsGet(LV2_Options_Option* const options)
     {
+        for (size_t i=0; options[i].key; ++i)
+        {
+            if (options[i].key == uris.resamplerQuality)
+            {
+                options[i].size = sizeof(int32_t);
+                options[i].type = uris.atom_Int;
+                options[i].value = &quality;
+                return LV2_OPTIONS_SUCCESS;
+            }
+        }
+
         return LV2_OPTIONS_ERR_UNKNOWN;
     }
 
@@ -209,7 +253,12 @@ struct PluginData {
             {
                 DISTRHO_SAFE_ASSERT(! activated);
                 setBufferSize(*static_cast<const int32_t*>(options[i].value));
-                break;
+            }
+            else if (options[i].key == uris.resamplerQuality && options[i].type == uris.atom_Int)
+            {
+                const int32_t value = *static_cast<const int32_t*>(options[i].value);
+                DISTRHO_SAFE_ASSERT_RETURN(value >= 0 && value < kResamplerQualityCount, LV2_OPTIONS_ERR_BAD_VALUE);
+                quality = value;
             }
         }
 
@@ -227,7 +276,8 @@ struct PluginData {
         buffers.dummy = new float[newBufferSize];
         std::memset(buffers.dummy, 0, sizeof(float) * bufferSize);
 
-        for (uint8_t i=2; i<kMaxIO; ++i)
+        // device channels without a matching port use dummy buffer
+        for (uint8_t i=numAudioPorts; i<kMaxIO; ++i)
             buffers.pointers[i] = buffers.dummy;
     }
 
@@ -284,6 +334,22 @@ struct PluginData {
     }
    #endif
 
+    DeviceAudio* initDeviceAudioChecked(const char* const id)
+    {
+        DeviceAudio* const devptr = initDeviceAudio(id, playback, bufferSize, sampleRate, numAudioPorts, 0,
+                                                    static_cast<DeviceResamplerQuality>(quality));
+
+        // we only have room for kMaxIO device buffers
+        if (devptr != nullptr && devptr->hwstatus.channels > kMaxIO)
+        {
+            DEBUGPRINT("device %s has too many channels (%u), ignoring it", id, devptr->hwstatus.channels);
+            closeDeviceAudio(devptr);
+            return nullptr;
+        }
+
+        return devptr;
+    }
+
     LV2_Worker_Status work(const LV2_Worker_Respond_Function respond,
                            const LV2_Worker_Respond_Handle handle,
                            const uint32_t size,
@@ -302,7 +368,7 @@ struct PluginData {
            #ifndef __MOD_DEVICES__
             if (deviceID != nullptr)
             {
-                devptr = initDeviceAudio(deviceID, playback, bufferSize, sampleRate);
+                devptr = initDeviceAudioChecked(deviceID);
             }
             else
            #endif
@@ -313,7 +379,7 @@ struct PluginData {
                 const std::vector<DeviceID>& devices(playback ? outputs : inputs);
 
                 for (cri it = devices.rbegin(); it != devices.rend() && devptr == nullptr; ++it)
-                    devptr = initDeviceAudio((*it).id.c_str(), playback, bufferSize, sampleRate);
+                    devptr = initDeviceAudioChecked((*it).id.c_str());
             }
 
             if (devptr == nullptr)
@@ -327,7 +393,7 @@ struct PluginData {
         {
             const char* const nextDeviceID = reinterpret_cast<const char*>(udata + 1);
             DeviceAudio* const devptr = nextDeviceID[0] != '\0'
-                                      ? initDeviceAudio(nextDeviceID, playback, bufferSize, sampleRate)
+                                      ? initDeviceAudioChecked(nextDeviceID)
                                       : nullptr;
             respond(handle, sizeof(devptr), &devptr);
             break;
@@ -358,17 +424,23 @@ struct PluginData {
         if (olddev == nullptr)
             return LV2_WORKER_SUCCESS;
 
+        // closing the old device is not reported as a soundcard change, retry once in case there is no new one
+        hotplugSerial = getSoundcardHotplugSerial() - 1;
+
         const WorkerDevice r = { kWorkerDestroyDevice, olddev };
         return features.workerSchedule->schedule_work(features.workerSchedule->handle, sizeof(r), &r);
     }
 };
 
-PluginData* lv2_instantiate(const double sampleRate, const LV2_Feature* const* const features)
+PluginData* lv2_instantiate(const double sampleRate,
+                            const bool playback,
+                            const uint8_t numAudioPorts,
+                            const LV2_Feature* const* const features)
 {
     if (std::fmod(sampleRate, 1.0) != 0.0)
         return nullptr;
 
-    PluginData* const p = new PluginData(sampleRate, features);
+    PluginData* const p = new PluginData(sampleRate, playback, numAudioPorts, features);
     if (p->bufferSize != 0)
         return p;
 
@@ -376,30 +448,24 @@ PluginData* lv2_instantiate(const double sampleRate, const LV2_Feature* const* c
     return nullptr;
 }
 
+template <uint8_t numAudioPorts>
 LV2_Handle lv2_instantiate_capture(const LV2_Descriptor*,
                                    const double sampleRate,
                                    const char*,
                                    const LV2_Feature* const* const features)
 {
-    if (PluginData* const p = lv2_instantiate(sampleRate, features))
-    {
-        p->playback = false;
-        return p;
-    }
-    return nullptr;
+    static_assert(numAudioPorts <= kMaxIO, "too many audio ports");
+    return lv2_instantiate(sampleRate, false, numAudioPorts, features);
 }
 
+template <uint8_t numAudioPorts>
 LV2_Handle lv2_instantiate_playback(const LV2_Descriptor*,
                                     const double sampleRate,
                                     const char*,
                                     const LV2_Feature* const* const features)
 {
-    if (PluginData* const p = lv2_instantiate(sampleRate, features))
-    {
-        p->playback = true;
-        return p;
-    }
-    return nullptr;
+    static_assert(numAudioPorts <= kMaxIO, "too many audio ports");
+    return lv2_instantiate(sampleRate, true, numAudioPorts, features);
 }
 
 void lv2_connect_port(const LV2_Handle handle, const uint32_t index, void* const data)
@@ -502,37 +568,25 @@ const void* lv2_extension_data(const char* const uri)
     return nullptr;
 }
 
+#define AUDIO_BRIDGE_DESCRIPTOR(uri, instantiate) \
+    { uri, instantiate, lv2_connect_port, lv2_activate, lv2_run, lv2_deactivate, lv2_cleanup, lv2_extension_data }
+
 LV2_SYMBOL_EXPORT
 const LV2_Descriptor* lv2_descriptor(const uint32_t index)
 {
-    static const LV2_Descriptor descriptor_capture = {
-        "https://falktx.com/plugins/audio-bridge#capture",
-        lv2_instantiate_capture,
-        lv2_connect_port,
-        lv2_activate,
-        lv2_run,
-        lv2_deactivate,
-        lv2_cleanup,
-        lv2_extension_data
-    };
-    static const LV2_Descriptor descriptor_playback = {
-        "https://falktx.com/plugins/audio-bridge#playback",
-        lv2_instantiate_playback,
-        lv2_connect_port,
-        lv2_activate,
-        lv2_run,
-        lv2_deactivate,
-        lv2_cleanup,
-        lv2_extension_data
+    // stereo variants keep their original URIs
+    static const LV2_Descriptor descriptors[] = {
+        AUDIO_BRIDGE_DESCRIPTOR("https://falktx.com/plugins/audio-bridge#capture", lv2_instantiate_capture<2>),
+        AUDIO_BRIDGE_DESCRIPTOR("https://falktx.com/plugins/audio-bridge#playback", lv2_instantiate_playback<2>),
+        AUDIO_BRIDGE_DESCRIPTOR("https://falktx.com/plugins/audio-bridge#capture-4", lv2_instantiate_capture<4>),
+        AUDIO_BRIDGE_DESCRIPTOR("https://falktx.com/plugins/audio-bridge#playback-4", lv2_instantiate_playback<4>),
+        AUDIO_BRIDGE_DESCRIPTOR("https://falktx.com/plugins/audio-bridge#capture-8", lv2_instantiate_capture<8>),
+        AUDIO_BRIDGE_DESCRIPTOR("https://falktx.com/plugins/audio-bridge#playback-8", lv2_instantiate_playback<8>),
+        AUDIO_BRIDGE_DESCRIPTOR("https://falktx.com/plugins/audio-bridge#capture-16", lv2_instantiate_capture<16>),
+        AUDIO_BRIDGE_DESCRIPTOR("https://falktx.com/plugins/audio-bridge#playback-16", lv2_instantiate_playback<16>),
+        AUDIO_BRIDGE_DESCRIPTOR("https://falktx.com/plugins/audio-bridge#capture-32", lv2_instantiate_capture<32>),
+        AUDIO_BRIDGE_DESCRIPTOR("https://falktx.com/plugins/audio-bridge#playback-32", lv2_instantiate_playback<32>),
     };
 
-    switch (index)
-    {
-    case 0:
-        return &descriptor_capture;
-    case 1:
-        return &descriptor_playback;
-    default:
-        return nullptr;
-    }
+    return index < sizeof(descriptors) / sizeof(descriptors[0]) ? &descriptors[index] : nullptr;
 }
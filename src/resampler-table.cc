@@ -67,7 +67,7 @@ Resampler_table::Resampler_table (double fr, unsigned int hl, unsigned int np) :
 
     n = hl * (np + 1);
    #ifdef ENABLE_VEC4
-    posix_memalign ((void **) &_ctab, 16, n * sizeof (float));
+    posix_memalign ((void **) &_ctab, 32, n * sizeof (float));
    #else
     _ctab = new float [n];
    #endif
@@ -2,8 +2,1772 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later
 
 #include "audio-device-discovery.hpp"
+#include "audio-device-hotplug.hpp"
+#include "audio-device-init.hpp"
+#include "audio-device-simulator.hpp"
+#include "audio-utils.hpp"
+#include "RingBuffer.hpp"
 
-int main()
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <limits>
+#include <pthread.h>
+#include <random>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// --------------------------------------------------------------------------------------------------------------------
+
+// fixedChannels limits the test to the channel count conv was specialized for, if any
+static bool testConverters(const simd::Converters& conv, const uint8_t fixedChannels = 0)
+{
+    static constexpr const uint16_t kMaxSamples = 77;
+    static constexpr const uint8_t kMaxChannels = 34;
+
+    const simd::Converters& ref = simd::kScalarConverters;
+    bool ok = true;
+
+    float* fsrc[kMaxChannels];
+    float* fref[kMaxChannels];
+    float* ftest[kMaxChannels];
+    for (uint8_t c = 0; c < kMaxChannels; ++c)
+    {
+        fsrc[c] = new float[kMaxSamples];
+        fref[c] = new float[kMaxSamples];
+        ftest[c] = new float[kMaxSamples];
+    }
+
+    const size_t rawlen = kMaxSamples * kMaxChannels * sizeof(int32_t);
+    uint8_t* const rawsrc = new uint8_t[rawlen];
+    uint8_t* const rawref = new uint8_t[rawlen];
+    uint8_t* const rawtest = new uint8_t[rawlen];
+
+    // gain ramp fused into the conversion, half of the runs use unity gain instead
+    float* const gainsrc = new float[kMaxSamples];
+
+    static constexpr const uint8_t kNumFormats = 7;
+    static constexpr const char* const kFormatNames[kNumFormats] = {
+        "s16", "s24", "s24le3", "s32", "f32", "s24be3", "s32be"
+    };
+
+    const uint8_t firstChannels = fixedChannels != 0 ? fixedChannels : 1;
+    const uint8_t lastChannels = fixedChannels != 0 ? fixedChannels : kMaxChannels;
+
+    for (uint8_t channels = firstChannels; channels <= lastChannels && ok; ++channels)
+    {
+        for (uint16_t samples = 0; samples <= kMaxSamples && ok; samples += channels % 3 + 1)
+        {
+            // random data with exact boundaries, out-of-range and non-finite values mixed in
+            for (uint8_t c = 0; c < channels; ++c)
+            {
+                for (uint16_t i = 0; i < samples; ++i)
+                {
+                    switch (std::rand() % 12)
+                    {
+                    case 0: fsrc[c][i] = 1.f; break;
+                    case 1: fsrc[c][i] = -1.f; break;
+                    case 2: fsrc[c][i] = static_cast<float>(std::rand()) / RAND_MAX * 4.f - 2.f; break;
+                    case 3: fsrc[c][i] = std::numeric_limits<float>::quiet_NaN(); break;
+                    case 4: fsrc[c][i] = std::numeric_limits<float>::infinity(); break;
+                    case 5: fsrc[c][i] = -std::numeric_limits<float>::infinity(); break;
+                    default: fsrc[c][i] = static_cast<float>(std::rand()) / RAND_MAX * 2.f - 1.f; break;
+                    }
+                }
+            }
+
+            for (size_t i = 0; i < rawlen; ++i)
+                rawsrc[i] = static_cast<uint8_t>(std::rand());
+
+            for (uint16_t i = 0; i < samples; ++i)
+                gainsrc[i] = static_cast<float>(std::rand()) / RAND_MAX * 1.5f;
+
+            const float* const gains = std::rand() % 2 ? gainsrc : nullptr;
+
+            // keep s24 values within 24 bits, as provided by ALSA
+            if (std::rand() % 2)
+            {
+                for (size_t i = 0; i + 3 < rawlen; i += 4)
+                    rawsrc[i + 3] = rawsrc[i + 2] & 0x80 ? 0xff : 0x00;
+            }
+
+            const simd::Float2IntFunc f2iref[kNumFormats] = {
+                ref.f2i_s16, ref.f2i_s24, ref.f2i_s24le3, ref.f2i_s32, ref.f2i_f32, ref.f2i_s24be3, ref.f2i_s32be
+            };
+            const simd::Float2IntFunc f2itest[kNumFormats] = {
+                conv.f2i_s16, conv.f2i_s24, conv.f2i_s24le3, conv.f2i_s32, conv.f2i_f32, conv.f2i_s24be3, conv.f2i_s32be
+            };
+            const simd::Int2FloatFunc i2fref[kNumFormats] = {
+                ref.i2f_s16, ref.i2f_s24, ref.i2f_s24le3, ref.i2f_s32, ref.i2f_f32, ref.i2f_s24be3, ref.i2f_s32be
+            };
+            const simd::Int2FloatFunc i2ftest[kNumFormats] = {
+                conv.i2f_s16, conv.i2f_s24, conv.i2f_s24le3, conv.i2f_s32, conv.i2f_f32, conv.i2f_s24be3, conv.i2f_s32be
+            };
+
+            for (uint8_t f = 0; f < kNumFormats; ++f)
+            {
+                std::memset(rawref, 0, rawlen);
+                std::memset(rawtest, 0, rawlen);
+                f2iref[f](rawref, fsrc, gains, channels, samples);
+                f2itest[f](rawtest, fsrc, gains, channels, samples);
+
+                if (std::memcmp(rawref, rawtest, rawlen) != 0)
+                {
+                    std::printf("%s float2int::%s mismatch, %u channels, %u samples, gain %s\n",
+                                conv.name, kFormatNames[f], channels, samples, gains != nullptr ? "on" : "off");
+                    ok = false;
+                }
+
+                for (uint8_t c = 0; c < channels; ++c)
+                {
+                    std::memset(fref[c], 0, sizeof(float) * kMaxSamples);
+                    std::memset(ftest[c], 0, sizeof(float) * kMaxSamples);
+                }
+                i2fref[f](fref, rawsrc, gains, channels, samples);
+                i2ftest[f](ftest, rawsrc, gains, channels, samples);
+
+                for (uint8_t c = 0; c < channels; ++c)
+                {
+                    if (std::memcmp(fref[c], ftest[c], sizeof(float) * kMaxSamples) != 0)
+                    {
+                        std::printf("%s int2float::%s mismatch, %u channels, %u samples, channel %u, gain %s\n",
+                                    conv.name, kFormatNames[f], channels, samples, c,
+                                    gains != nullptr ? "on" : "off");
+                        ok = false;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    for (uint8_t c = 0; c < kMaxChannels; ++c)
+    {
+        delete[] fsrc[c];
+        delete[] fref[c];
+        delete[] ftest[c];
+    }
+    delete[] rawsrc;
+    delete[] rawref;
+    delete[] rawtest;
+    delete[] gainsrc;
+
+    if (fixedChannels != 0)
+        std::printf("%s converters, %u channels: %s\n", conv.name, fixedChannels, ok ? "ok" : "FAIL");
+    else
+        std::printf("%s converters: %s\n", conv.name, ok ? "ok" : "FAIL");
+    return ok;
+}
+
+// checks the reference code of formats that derive from others, float must be lossless
+// and big-endian formats must match little-endian ones with their bytes reversed
+static bool testConverterFormats()
+{
+    static constexpr const uint8_t kChannels = 3;
+    static constexpr const uint16_t kSamples = 64;
+
+    const simd::Converters& ref = simd::kScalarConverters;
+    float src[kChannels][kSamples];
+    float dst[kChannels][kSamples];
+    float* srcptrs[kChannels];
+    float* dstptrs[kChannels];
+    for (uint8_t c = 0; c < kChannels; ++c)
+    {
+        for (uint16_t i = 0; i < kSamples; ++i)
+            src[c][i] = static_cast<float>(std::rand()) / RAND_MAX * 4.f - 2.f;
+        srcptrs[c] = src[c];
+        dstptrs[c] = dst[c];
+    }
+
+    uint8_t le[kChannels * kSamples * sizeof(int32_t)];
+    uint8_t be[kChannels * kSamples * sizeof(int32_t)];
+    bool ok = true;
+
+    ref.f2i_f32(le, srcptrs, nullptr, kChannels, kSamples);
+    ref.i2f_f32(dstptrs, le, nullptr, kChannels, kSamples);
+    ok &= std::memcmp(src, dst, sizeof(src)) == 0;
+
+    ref.f2i_s32(le, srcptrs, nullptr, kChannels, kSamples);
+    ref.f2i_s32be(be, srcptrs, nullptr, kChannels, kSamples);
+    for (uint32_t i = 0; i < kChannels * kSamples * 4; i += 4)
+        ok &= le[i] == be[i + 3] && le[i + 1] == be[i + 2] && le[i + 2] == be[i + 1] && le[i + 3] == be[i];
+
+    ref.f2i_s24le3(le, srcptrs, nullptr, kChannels, kSamples);
+    ref.f2i_s24be3(be, srcptrs, nullptr, kChannels, kSamples);
+    for (uint32_t i = 0; i < kChannels * kSamples * 3; i += 3)
+        ok &= le[i] == be[i + 2] && le[i + 1] == be[i + 1] && le[i + 2] == be[i];
+
+    ref.i2f_s24le3(srcptrs, le, nullptr, kChannels, kSamples);
+    ref.i2f_s24be3(dstptrs, be, nullptr, kChannels, kSamples);
+    ok &= std::memcmp(src, dst, sizeof(src)) == 0;
+
+    std::printf("converter formats: %s\n", ok ? "ok" : "FAIL");
+    return ok;
+}
+
+static bool testConverters()
+{
+    bool ok = testConverterFormats();
+
+    for (uint8_t i = 0; i < simd::kNumFixedChannels; ++i)
+        ok &= testConverters(simd::kScalarFixedConverters[i], simd::kFixedChannels[i]);
+
+   #ifdef AUDIO_BRIDGE_SIMD_SSE2
+    ok &= testConverters(simd::sse2::kConverters);
+    for (uint8_t i = 0; i < simd::kNumFixedChannels; ++i)
+        ok &= testConverters(simd::sse2::kFixedConverters[i], simd::kFixedChannels[i]);
+   #endif
+   #ifdef AUDIO_BRIDGE_SIMD_AVX2
+    if (__builtin_cpu_supports("avx2"))
+    {
+        ok &= testConverters(simd::avx2::kConverters);
+        for (uint8_t i = 0; i < simd::kNumFixedChannels; ++i)
+            ok &= testConverters(simd::avx2::kFixedConverters[i], simd::kFixedChannels[i]);
+    }
+   #endif
+   #ifdef AUDIO_BRIDGE_SIMD_NEON
+    ok &= testConverters(simd::neon::kConverters);
+    for (uint8_t i = 0; i < simd::kNumFixedChannels; ++i)
+        ok &= testConverters(simd::neon::kFixedConverters[i], simd::kFixedChannels[i]);
+   #endif
+
+    std::printf("runtime converters: %s\n", simd::getConverters().name);
+    return ok;
+}
+
+// print the cost of the runtime converters per sample, generic vs specialized for the channel count,
+// and specialized with a fused gain ramp
+static void benchConverters()
+{
+    static constexpr const uint16_t kFrames = 256;
+    static constexpr const uint32_t kIterations = 4000;
+    static constexpr const uint8_t kRounds = 7;
+    static constexpr const uint8_t kMaxChannels = 8;
+
+    float* buffers[kMaxChannels];
+    for (uint8_t c = 0; c < kMaxChannels; ++c)
+    {
+        buffers[c] = new float[kFrames];
+        for (uint16_t i = 0; i < kFrames; ++i)
+            buffers[c][i] = static_cast<float>(std::rand()) / RAND_MAX * 2.f - 1.f;
+    }
+
+    uint8_t* const raw = new uint8_t[kFrames * kMaxChannels * sizeof(int32_t)];
+
+    // values just below 1, so repeated conversions in place do not go silent or clip
+    float gains[kFrames];
+    for (uint16_t i = 0; i < kFrames; ++i)
+        gains[i] = 1.f - i * 1e-6f;
+
+    static constexpr const char* const kFormatNames[4] = { "s16", "s24le3", "s32", "f32" };
+
+    // best of a few rounds, to filter out noise from other processes
+    const auto time = [&](const simd::Float2IntFunc f2i,
+                          const simd::Int2FloatFunc i2f,
+                          const float* const g,
+                          const uint8_t channels)
+    {
+        double best = 0.0;
+
+        for (uint8_t round = 0; round < kRounds; ++round)
+        {
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+
+            for (uint32_t i = 0; i < kIterations; ++i)
+            {
+                f2i(raw, buffers, g, channels, kFrames);
+                i2f(buffers, raw, g, channels, kFrames);
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &end);
+
+            const double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+            if (round == 0 || ns < best)
+                best = ns;
+        }
+
+        return best / (2.0 * kIterations * kFrames * channels);
+    };
+
+    std::printf("%s converters, ns per sample (both directions averaged), generic vs fixed vs fixed+gain\n",
+                simd::getConverters().name);
+
+    for (const uint8_t channels : { 1, 2, 4, 8 })
+    {
+        const simd::Converters& generic = simd::getConverters();
+        const simd::Converters& fixed = simd::getConverters(channels);
+
+        std::printf("%u channels |", channels);
+
+        for (uint8_t f = 0; f < 4; ++f)
+        {
+            const simd::Float2IntFunc f2i[2] = {
+                f == 0 ? generic.f2i_s16 : f == 1 ? generic.f2i_s24le3 : f == 2 ? generic.f2i_s32 : generic.f2i_f32,
+                f == 0 ? fixed.f2i_s16 : f == 1 ? fixed.f2i_s24le3 : f == 2 ? fixed.f2i_s32 : fixed.f2i_f32,
+            };
+            const simd::Int2FloatFunc i2f[2] = {
+                f == 0 ? generic.i2f_s16 : f == 1 ? generic.i2f_s24le3 : f == 2 ? generic.i2f_s32 : generic.i2f_f32,
+                f == 0 ? fixed.i2f_s16 : f == 1 ? fixed.i2f_s24le3 : f == 2 ? fixed.i2f_s32 : fixed.i2f_f32,
+            };
+
+            const double tgeneric = time(f2i[0], i2f[0], nullptr, channels);
+            const double tfixed = time(f2i[1], i2f[1], nullptr, channels);
+            const double tgain = time(f2i[1], i2f[1], gains, channels);
+            std::printf(" %s %5.3f vs %5.3f vs %5.3f |", kFormatNames[f], tgeneric, tfixed, tgain);
+        }
+
+        std::printf("\n");
+    }
+
+    for (uint8_t c = 0; c < kMaxChannels; ++c)
+        delete[] buffers[c];
+    delete[] raw;
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+struct ResamplerTest {
+    static constexpr const uint8_t kChannels = 3;
+    static constexpr const uint32_t kFrames = 4096;
+
+    static constexpr const char* const kKernelNames[] = { "auto", "scalar", "vec4", "vec8" };
+
+    std::vector<float> input[kChannels];
+    std::vector<float> output[kChannels];
+
+    ResamplerTest()
+    {
+        std::mt19937 rng(1337);
+        std::uniform_real_distribution<float> noise(-1.f, 1.f);
+
+        for (uint8_t c = 0; c < kChannels; ++c)
+        {
+            input[c].resize(kFrames);
+            output[c].resize(kFrames * 2);
+
+            for (uint32_t i = 0; i < kFrames; ++i)
+                input[c][i] = 0.5f * std::sin(i * 0.01f * (c + 1)) + 0.1f * noise(rng);
+        }
+    }
+
+    // resample the whole input in small blocks, returns the number of output frames
+    uint32_t run(VResampler& resampler, const double ratio)
+    {
+        const float* inputs[kChannels];
+        float* outputs[kChannels];
+        uint32_t done = 0;
+
+        resampler.set_rratio(ratio);
+
+        for (uint32_t offset = 0; offset + 128 <= kFrames; offset += 128)
+        {
+            for (uint8_t c = 0; c < kChannels; ++c)
+            {
+                inputs[c] = input[c].data() + offset;
+                outputs[c] = output[c].data() + done;
+            }
+
+            resampler.inp_count = 128;
+            resampler.out_count = 256;
+            resampler.inp_data = inputs;
+            resampler.out_data = outputs;
+            resampler.process();
+
+            done += 256 - resampler.out_count;
+        }
+
+        return done;
+    }
+};
+
+constexpr const char* const ResamplerTest::kKernelNames[];
+
+// check bypass while the ratio is 1, and that switching in and out of resampling has no discontinuities
+static bool testAdaptiveResampler()
+{
+    static constexpr const uint8_t kChannels = 2;
+    static constexpr const uint32_t kBlockSize = 128;
+    static constexpr const float kAmplitude = 0.5f;
+    static constexpr const float kOmega = 2.f * M_PI * 1000.f / 48000.f;
+
+    // sine step between samples is at most kAmplitude * kOmega (about 0.065), allow some extra for the crossfade
+    static constexpr const float kMaxStep = 0.08f;
+
+    AdaptiveResampler resampler;
+    resampler.setup(1.0, kChannels, 8, kBlockSize, AUDIO_BRIDGE_RESAMPLER_BYPASS_EPSILON, 240);
+
+    float input[kChannels][kBlockSize];
+    float output[kChannels][kBlockSize * 2];
+    float* inputs[kChannels] = { input[0], input[1] };
+    float* outputs[kChannels] = { output[0], output[1] };
+
+    const uint32_t latency = resampler.getLatency();
+    uint32_t inputPos = 0;
+    uint32_t outputPos = 0;
+    float last = 0.f;
+    bool ok = true;
+
+    const struct {
+        double ratio;
+        bool bypassed;
+    } steps[] = {
+        { 1.0, true },
+        { 1.0001, false },
+        { 0.9999, false },
+        { 1.000001, true },
+        { 0.99, false },
+        { 1.0, true },
+    };
+
+    for (const auto& step : steps)
+    {
+        resampler.setRatio(step.ratio);
+
+        for (uint32_t b = 0; b < 50; ++b)
+        {
+            for (uint32_t i = 0; i < kBlockSize; ++i, ++inputPos)
+                input[0][i] = input[1][i] = kAmplitude * std::sin(inputPos * kOmega);
+
+            const uint32_t frames = resampler.process(inputs, kBlockSize, outputs);
+
+            for (uint32_t i = 0; i < frames; ++i, ++outputPos)
+            {
+                // exact delayed input while bypassed from the start
+                if (step.ratio == 1.0 && outputPos < 50 * kBlockSize)
+                {
+                    const float expected = outputPos >= latency
+                                         ? kAmplitude * std::sin((outputPos - latency) * kOmega)
+                                         : 0.f;
+                    ok &= output[0][i] == expected;
+                }
+
+                ok &= std::abs(output[0][i] - last) < kMaxStep && output[0][i] == output[1][i];
+                last = output[0][i];
+            }
+        }
+
+        ok &= resampler.isBypassed() == step.bypassed;
+    }
+
+    if (! ok)
+        std::printf("adaptive resampler: FAIL\n");
+
+    return ok;
+}
+
+// check that all filter kernels available on this CPU give the same output as the scalar one
+static bool testResampler()
+{
+    static constexpr const float kMaxError = 1e-5f;
+
+    ResamplerTest t;
+    ResamplerTest ref;
+    bool ok = true;
+
+    for (const uint32_t hlen : { 8, 12, 16, 24, 32, 48, 64 })
+    {
+        for (const double ratio : { 1.0, 0.9998, 1.0003, 48000.0 / 44100.0 })
+        {
+            VResampler scalar;
+            scalar.setup(1.0, ResamplerTest::kChannels, hlen);
+            scalar.set_kernel(VResampler::KERNEL_SCALAR);
+            const uint32_t frames = ref.run(scalar, ratio);
+
+            for (const int kernel : { VResampler::KERNEL_VEC4, VResampler::KERNEL_VEC8 })
+            {
+                VResampler resampler;
+                resampler.setup(1.0, ResamplerTest::kChannels, hlen);
+
+                if (! resampler.set_kernel(kernel))
+                    continue;
+
+                float error = frames == t.run(resampler, ratio) ? 0.f : 1.f;
+
+                for (uint8_t c = 0; c < ResamplerTest::kChannels; ++c)
+                    for (uint32_t i = 0; i < frames; ++i)
+                        error = std::max(error, std::abs(t.output[c][i] - ref.output[c][i]));
+
+                if (error > kMaxError)
+                {
+                    std::printf("resampler %s hlen %u ratio %f, error %g\n",
+                                ResamplerTest::kKernelNames[kernel], hlen, ratio, error);
+                    ok = false;
+                }
+            }
+        }
+    }
+
+    ok &= testAdaptiveResampler();
+
+    std::printf("resampler: %s\n", ok ? "ok" : "FAIL");
+    return ok;
+}
+
+// print the cost of each filter kernel per sample and channel
+static void benchResampler()
+{
+    static constexpr const uint32_t kIterations = 100;
+
+    ResamplerTest t;
+
+    for (const uint32_t hlen : { 8, 16, 24, 32, 48, 64, 96 })
+    {
+        std::printf("hlen %2u |", hlen);
+
+        for (const int kernel : { VResampler::KERNEL_SCALAR, VResampler::KERNEL_VEC4, VResampler::KERNEL_VEC8 })
+        {
+            VResampler resampler;
+            resampler.setup(1.0, ResamplerTest::kChannels, hlen);
+
+            if (! resampler.set_kernel(kernel))
+            {
+                std::printf(" %s n/a |", ResamplerTest::kKernelNames[kernel]);
+                continue;
+            }
+
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+
+            uint64_t frames = 0;
+            for (uint32_t i = 0; i < kIterations; ++i)
+                frames += t.run(resampler, 1.0001);
+
+            clock_gettime(CLOCK_MONOTONIC, &end);
+
+            const double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+            std::printf(" %s %6.2f ns |", ResamplerTest::kKernelNames[kernel], ns / frames / ResamplerTest::kChannels);
+        }
+
+        std::printf("\n");
+    }
+}
+
+// THD+N of a resampled sine, by fitting a sine of the expected frequency to it, anything left is distortion and noise
+static double measureThdN(const std::vector<float>& signal, const uint32_t start, const uint32_t end, const double omega)
+{
+    // least squares fit of a * sin + b * cos + c
+    double ss = 0.0, sc = 0.0, cc = 0.0, s1 = 0.0, c1 = 0.0, ys = 0.0, yc = 0.0, y1 = 0.0;
+    const double n = end - start;
+
+    for (uint32_t i = start; i < end; ++i)
+    {
+        const double s = std::sin(omega * i);
+        const double c = std::cos(omega * i);
+        ss += s * s;
+        sc += s * c;
+        cc += c * c;
+        s1 += s;
+        c1 += c;
+        ys += signal[i] * s;
+        yc += signal[i] * c;
+        y1 += signal[i];
+    }
+
+    // solve the 3x3 normal equations with Cramer's rule
+    const double det = ss * (cc * n - c1 * c1) - sc * (sc * n - c1 * s1) + s1 * (sc * c1 - cc * s1);
+    const double a = (ys * (cc * n - c1 * c1) - sc * (yc * n - c1 * y1) + s1 * (yc * c1 - cc * y1)) / det;
+    const double b = (ss * (yc * n - y1 * c1) - ys * (sc * n - c1 * s1) + s1 * (sc * y1 - yc * s1)) / det;
+    const double k = (ss * (cc * y1 - c1 * yc) - sc * (sc * y1 - c1 * ys) + s1 * (sc * yc - cc * ys)) / det;
+
+    double signalPower = 0.0, residualPower = 0.0;
+
+    for (uint32_t i = start; i < end; ++i)
+    {
+        const double fit = a * std::sin(omega * i) + b * std::cos(omega * i) + k;
+        signalPower += fit * fit;
+        residualPower += (signal[i] - fit) * (signal[i] - fit);
+    }
+
+    return 10.0 * std::log10(residualPower / signalPower);
+}
+
+// print the cost, latency and quality of each resampler preset, converting 48kHz to 44.1kHz with some drift on top
+static void benchResamplerQuality()
+{
+    static constexpr const uint32_t kInputRate = 48000;
+    static constexpr const uint32_t kOutputRate = 44100;
+    static constexpr const double kDrift = 1.0001;
+    static constexpr const uint32_t kFrames = kInputRate;
+    static constexpr const uint32_t kBlockSize = 128;
+    static constexpr const uint8_t kChannels = 2;
+    static constexpr const uint32_t kIterations = 10;
+
+    const double ratio = static_cast<double>(kOutputRate) / kInputRate;
+    const double frequencies[] = { 1000.0, 10000.0, 18000.0 };
+
+    for (uint8_t q = 0; q < kResamplerQualityCount; ++q)
+    {
+        const DeviceResamplerQuality quality = static_cast<DeviceResamplerQuality>(q);
+        const uint32_t hlen = getResamplerFilterLength(quality);
+
+        std::printf("%-6s | hlen %2u | latency %.2f ms |", getResamplerQualityName(quality), hlen, hlen * 1000.0 / kInputRate);
+
+        std::vector<float> input(kFrames);
+        std::vector<float> output(kFrames + kBlockSize);
+        const float* inputs[kChannels];
+        float* outputs[kChannels];
+        double ns = 0.0;
+        uint64_t numSamples = 0;
+
+        for (const double frequency : frequencies)
+        {
+            for (uint32_t i = 0; i < kFrames; ++i)
+                input[i] = 0.5f * std::sin(2.0 * M_PI * frequency * i / kInputRate);
+
+            uint32_t done = 0;
+
+            for (uint32_t iteration = 0; iteration < kIterations; ++iteration)
+            {
+                VResampler resampler;
+                resampler.setup(ratio, kChannels, hlen);
+                resampler.set_rratio(kDrift);
+                done = 0;
+
+                struct timespec start, end;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+
+                for (uint32_t offset = 0; offset + kBlockSize <= kFrames; offset += kBlockSize)
+                {
+                    // same data on all channels, only the 1st one is measured
+                    for (uint8_t c = 0; c < kChannels; ++c)
+                    {
+                        inputs[c] = input.data() + offset;
+                        outputs[c] = output.data() + done;
+                    }
+
+                    resampler.inp_count = kBlockSize;
+                    resampler.out_count = kBlockSize;
+                    resampler.inp_data = inputs;
+                    resampler.out_data = outputs;
+                    resampler.process();
+
+                    done += kBlockSize - resampler.out_count;
+                }
+
+                clock_gettime(CLOCK_MONOTONIC, &end);
+
+                ns += (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+                numSamples += static_cast<uint64_t>(done) * kChannels;
+            }
+
+            // skip the filter startup, output sine frequency is scaled by the total ratio
+            const double omega = 2.0 * M_PI * frequency / (kInputRate * ratio * kDrift);
+            std::printf(" %2.0fkHz %6.1f dB |", frequency / 1000.0, measureThdN(output, hlen * 4, done, omega));
+        }
+
+        std::printf(" %6.2f ns/sample\n", ns / numSamples);
+    }
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+struct RingBufferTest {
+    static constexpr const uint8_t kChannels = 3;
+    static constexpr const uint32_t kTotalSamples = 20000000;
+
+    AudioRingBuffer rb;
+    bool ok = true;
+
+    // each channel carries a running counter, offset per channel
+    static float value(const uint32_t counter, const uint8_t c) noexcept
+    {
+        return static_cast<float>((counter + c * 1000) & 0xffffff);
+    }
+
+    static void pin(const int cpu)
+    {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(cpu, &cpuset);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    }
+
+    static void* producer(void* const arg)
+    {
+        RingBufferTest* const t = static_cast<RingBufferTest*>(arg);
+        pin(0);
+
+        float data[kChannels][256];
+        float* buffers[kChannels];
+        for (uint8_t c = 0; c < kChannels; ++c)
+            buffers[c] = data[c];
+
+        for (uint32_t counter = 0, n = 1; counter < kTotalSamples; n = n % 255 + 1)
+        {
+            const uint32_t samples = std::min(n, kTotalSamples - counter);
+
+            for (uint32_t i = 0; i < samples; ++i)
+                for (uint8_t c = 0; c < kChannels; ++c)
+                    data[c][i] = value(counter + i, c);
+
+            while (t->rb.getNumWritableSamples() < samples)
+                sched_yield();
+
+            if (! t->rb.write(buffers, samples))
+            {
+                t->ok = false;
+                break;
+            }
+
+            counter += samples;
+        }
+
+        return nullptr;
+    }
+
+    static void* consumer(void* const arg)
+    {
+        RingBufferTest* const t = static_cast<RingBufferTest*>(arg);
+        pin(1);
+
+        float data[kChannels][256];
+        float* buffers[kChannels];
+        for (uint8_t c = 0; c < kChannels; ++c)
+            buffers[c] = data[c];
+
+        for (uint32_t counter = 0, n = 1; counter < kTotalSamples && t->ok; n = n % 253 + 1)
+        {
+            const uint32_t samples = std::min(n, kTotalSamples - counter);
+
+            while (t->rb.getNumReadableSamples() < samples)
+                sched_yield();
+
+            if (! t->rb.read(buffers, samples))
+            {
+                t->ok = false;
+                break;
+            }
+
+            for (uint32_t i = 0; i < samples; ++i)
+            {
+                for (uint8_t c = 0; c < kChannels; ++c)
+                {
+                    if (data[c][i] != value(counter + i, c))
+                    {
+                        std::printf("ringbuffer mismatch at sample %u, channel %u\n", counter + i, c);
+                        t->ok = false;
+                        return nullptr;
+                    }
+                }
+            }
+
+            counter += samples;
+        }
+
+        return nullptr;
+    }
+};
+
+static bool testRingBuffer()
+{
+    RingBufferTest t;
+    t.rb.createBuffer(RingBufferTest::kChannels, 1000);
+
+    pthread_t producer, consumer;
+    pthread_create(&consumer, nullptr, RingBufferTest::consumer, &t);
+    pthread_create(&producer, nullptr, RingBufferTest::producer, &t);
+    pthread_join(producer, nullptr);
+    pthread_join(consumer, nullptr);
+
+    if (t.ok && t.rb.getNumReadableSamples() != 0)
+        t.ok = false;
+
+    // silence and skipping, across the wrap-around point
+    if (t.ok)
+    {
+        float data[RingBufferTest::kChannels][8];
+        float* buffers[RingBufferTest::kChannels];
+        for (uint8_t c = 0; c < RingBufferTest::kChannels; ++c)
+        {
+            std::fill(data[c], data[c] + 8, 1.f);
+            buffers[c] = data[c];
+        }
+
+        const uint32_t size = t.rb.getNumSamples();
+
+        for (uint32_t i = 0; i < size - 4; i += 8)
+            t.ok &= t.rb.write(buffers, 8) && t.rb.skip(8);
+
+        t.ok &= t.rb.writeSilence(6) && t.rb.write(buffers, 2) && t.rb.getNumReadableSamples() == 8;
+        t.ok &= t.rb.skip(3) && t.rb.read(buffers, 5) && t.rb.getNumReadableSamples() == 0;
+        t.ok &= ! t.rb.skip(1);
+
+        for (uint8_t c = 0; c < RingBufferTest::kChannels; ++c)
+            t.ok &= data[c][0] == 0.f && data[c][2] == 0.f && data[c][3] == 1.f && data[c][4] == 1.f;
+
+        // flush only empties the buffer once the consumer applies it
+        t.ok &= t.rb.write(buffers, 8) && ! t.rb.applyFlush();
+        t.rb.flush();
+        t.ok &= t.rb.getNumReadableSamples() == 8 && t.rb.write(buffers, 4);
+        t.ok &= t.rb.applyFlush() && ! t.rb.applyFlush() && t.rb.getNumReadableSamples() == 0;
+        t.ok &= t.rb.write(buffers, 8) && t.rb.read(buffers, 8) && t.rb.getNumReadableSamples() == 0;
+
+        // restart with a full ring, the producer must not count data that is pending a flush as buffered
+        while (t.rb.getNumWritableSamples() >= 8)
+            t.ok &= t.rb.write(buffers, 8);
+        t.ok &= t.rb.writeSilence(t.rb.getNumWritableSamples()) && t.rb.getNumWritableSamples() == 0;
+        t.ok &= ! t.rb.isFlushPending();
+        t.rb.flush();
+        t.ok &= t.rb.isFlushPending() && t.rb.getNumReadableSamples() == size - 1;
+        t.ok &= t.rb.applyFlush() && ! t.rb.isFlushPending();
+        t.ok &= t.rb.getNumReadableSamples() == 0 && t.rb.getNumWritableSamples() == size - 1;
+    }
+
+    std::printf("ringbuffer: %s\n", t.ok ? "ok" : "FAIL");
+    return t.ok;
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+// simulate a device and host running at slightly different rates, with timing jitter on both sides
+static bool testDelayLockedLoop()
+{
+    static constexpr const double kSampleRate = 48000;
+    static constexpr const uint16_t kBufferSize = 128;
+
+    // maximum allowed ratio error after 1 second
+    static constexpr const double kMaxError = 2e-6;
+
+    std::mt19937 rng(1337);
+    std::normal_distribution<double> jitter(0.0, 1.0);
+
+    bool ok = true;
+
+    for (const double deviceDrift : { -150e-6, -10e-6, 0.0, 40e-6, 300e-6 })
+    {
+        const double hostDrift = -25e-6;
+        const double devicePeriod = kBufferSize / (kSampleRate * (1.0 + deviceDrift));
+        const double hostPeriod = kBufferSize / (kSampleRate * (1.0 + hostDrift));
+        const double expected = (1.0 + deviceDrift) / (1.0 + hostDrift);
+
+        DelayLockedLoop device, host;
+        device.setup(kSampleRate);
+        host.setup(kSampleRate);
+
+        double deviceTime = 1000.0;
+        double hostTime = 1000.0 + hostPeriod * 0.37;
+        int64_t devicePosition = 0;
+        int64_t hostPosition = 0;
+        double error = 0.0;
+
+        while (hostTime < 1001.0)
+        {
+            // hardware timestamps and JACK cycle times are already quite precise
+            device.update(deviceTime + jitter(rng) * 2e-6, devicePosition);
+            host.update(hostTime + jitter(rng) * 2e-6, hostPosition);
+
+            deviceTime += devicePeriod;
+            hostTime += hostPeriod;
+            devicePosition += kBufferSize;
+            hostPosition += kBufferSize;
+        }
+
+        if (device.isLocked() && host.isLocked())
+            error = host.getFrameTime() / device.getFrameTime() - expected;
+        else
+            error = 1.0;
+
+        if (std::abs(error) > kMaxError)
+        {
+            std::printf("dll drift %.0f ppm, error %.3f ppm\n", deviceDrift * 1e6, error * 1e6);
+            ok = false;
+        }
+    }
+
+    std::printf("dll: %s\n", ok ? "ok" : "FAIL");
+    return ok;
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+struct LogTest {
+    static constexpr const uint32_t kProducers = 4;
+    static constexpr const uint32_t kMessages = 2000;
+
+    static uint32_t received[kProducers];
+    static uint32_t numSuppressed;
+    static bool ordered;
+
+    static void sink(AudioLogLevel, const char* const msg)
+    {
+        uint32_t producer, index;
+
+        if (std::strstr(msg, "similar messages suppressed") != nullptr)
+            ++numSuppressed;
+
+        if (std::sscanf(msg, "producer %u message %u", &producer, &index) == 2 && producer < kProducers)
+        {
+            // messages from the same thread must arrive in order, but some can be dropped
+            ordered &= index >= received[producer];
+            received[producer] = index + 1;
+        }
+    }
+
+    static void* producer(void* const arg)
+    {
+        const uint32_t producer = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(arg));
+        const struct timespec ts = { 0, 10000 };
+
+        for (uint32_t i = 0; i < kMessages; ++i)
+        {
+            audioLog(kAudioLogInfo, "producer %u message %u", producer, i);
+
+            if (i % 32 == 0)
+                nanosleep(&ts, nullptr);
+        }
+
+        return nullptr;
+    }
+
+    // always the same call site
+    static void rateLimited(const uint32_t index)
+    {
+        AUDIO_LOG(kAudioLogDebug, "producer 0 message %u", index);
+    }
+};
+
+uint32_t LogTest::received[LogTest::kProducers];
+uint32_t LogTest::numSuppressed;
+bool LogTest::ordered = true;
+
+static bool testLog()
+{
+    bool ok = true;
+
+    setAudioLogSink(LogTest::sink);
+    audioLogStart();
+
+    pthread_t producers[LogTest::kProducers];
+    for (uint32_t p = 0; p < LogTest::kProducers; ++p)
+        pthread_create(&producers[p], nullptr, LogTest::producer, reinterpret_cast<void*>(static_cast<uintptr_t>(p)));
+    for (uint32_t p = 0; p < LogTest::kProducers; ++p)
+        pthread_join(producers[p], nullptr);
+
+    audioLogFlush();
+
+    // last message of each thread can only be lost if the queue was full at that point
+    for (uint32_t p = 0; p < LogTest::kProducers; ++p)
+        ok &= LogTest::received[p] == LogTest::kMessages || getAudioLogNumDropped() != 0;
+
+    ok &= LogTest::ordered;
+
+    // rate limiting, only a few messages per second from the same call site
+    for (uint32_t i = 0; i < 100; ++i)
+        LogTest::rateLimited(LogTest::kMessages + i);
+
+    audioLogFlush();
+
+    const uint32_t numRateLimited = LogTest::received[0] - LogTest::kMessages;
+    ok &= numRateLimited >= AUDIO_BRIDGE_LOG_RATE_LIMIT && numRateLimited <= AUDIO_BRIDGE_LOG_RATE_LIMIT * 2;
+
+    // next message after the limit window reports how many were suppressed
+    const struct timespec ts = { 1, 0 };
+    nanosleep(&ts, nullptr);
+
+    LogTest::rateLimited(LogTest::kMessages + 100);
+
+    audioLogStop();
+    setAudioLogSink(nullptr);
+
+    ok &= LogTest::numSuppressed != 0;
+
+    std::printf("log: %s\n", ok ? "ok" : "FAIL");
+    return ok;
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+// fake soundcard nodes in a temporary directory, which does not exist at first (like /dev/snd without soundcards)
+static bool testHotplug()
+{
+    char base[] = "/tmp/audio-bridge-test-XXXXXX";
+    if (mkdtemp(base) == nullptr)
+    {
+        std::printf("hotplug | failed to create temporary directory\n");
+        return false;
+    }
+
+    char dir[64], control[96], pcm[96], pcm2[96], other[96];
+    std::snprintf(dir, sizeof(dir), "%s/snd", base);
+    std::snprintf(control, sizeof(control), "%s/controlC3", dir);
+    std::snprintf(pcm, sizeof(pcm), "%s/pcmC3D0p", dir);
+    std::snprintf(pcm2, sizeof(pcm2), "%s/pcmC3D0c", dir);
+    std::snprintf(other, sizeof(other), "%s/timer", dir);
+
+    setSoundcardHotplugDirectory(dir);
+    soundcardHotplugStart();
+
+    // let the thread set up its watches
+    usleep(100000);
+
+    bool ok = isSoundcardHotplugWatching();
+    uint32_t serial = getSoundcardHotplugSerial();
+    uint32_t serial2 = getSoundcardHotplugCardSerial(2);
+    uint32_t serial3 = getSoundcardHotplugCardSerial(3);
+
+    // changedCards is which card serials must change: 0 for none, 3 for card 3 only, -1 for all
+    const auto step = [&](const bool expected, const int changedCards, const char* const what)
+    {
+        const uint32_t current = waitForSoundcardHotplug(serial, expected ? 1000 : 100);
+
+        if ((current != serial) != expected)
+        {
+            std::printf("hotplug | %s: expected %s\n", what, expected ? "a change" : "no change");
+            ok = false;
+        }
+
+        // events from the same action can be split across reads, let them all through before the next step
+        usleep(50000);
+        serial = getSoundcardHotplugSerial();
+
+        const uint32_t current2 = getSoundcardHotplugCardSerial(2);
+        const uint32_t current3 = getSoundcardHotplugCardSerial(3);
+
+        if ((current2 != serial2) != (changedCards == -1) || (current3 != serial3) != (changedCards != 0))
+        {
+            std::printf("hotplug | %s: unexpected card serial changes\n", what);
+            ok = false;
+        }
+
+        serial2 = current2;
+        serial3 = current3;
+    };
+
+    const auto touch = [](const char* const path)
+    {
+        const int fd = open(path, O_CREAT | O_WRONLY, 0644);
+        if (fd >= 0)
+            close(fd);
+    };
+
+    mkdir(dir, 0755);
+    step(true, 0, "directory created");
+
+    touch(control);
+    step(true, 3, "control node created");
+
+    touch(control);
+    step(false, 0, "control node opened and closed");
+
+    touch(other);
+    step(false, 0, "unrelated node created");
+
+    touch(pcm);
+    step(true, 3, "pcm node created");
+
+    touch(pcm);
+    step(true, 0, "pcm node closed by another application");
+
+    touch(pcm2);
+    step(true, 3, "capture pcm node created");
+
+    // node present but opening it failed, closing it again must not make waiters retry right away
+    // only for that node, others of the same card can still be closed by other users
+    ignoreSoundcardHotplugClose(3, 0, false);
+    touch(pcm2);
+    step(true, 0, "other pcm node of the same card closed");
+    touch(pcm);
+    step(false, 0, "pcm node closed after a failed open");
+
+    touch(pcm);
+    step(true, 0, "pcm node closed by another application again");
+
+    chmod(pcm, 0600);
+    step(true, 3, "pcm node permissions changed");
+
+    unlink(pcm);
+    step(true, 3, "pcm node removed");
+
+    unlink(pcm2);
+    step(true, 3, "capture pcm node removed");
+
+    unlink(control);
+    step(true, 3, "control node removed");
+
+    unlink(other);
+    rmdir(dir);
+    step(true, -1, "directory removed");
+
+    // shutdown must not block forever
+    wakeSoundcardHotplugWaiters();
+    ok &= waitForSoundcardHotplug(serial, -1) != serial;
+
+    soundcardHotplugStop();
+    setSoundcardHotplugDirectory(nullptr);
+    rmdir(base);
+
+    std::printf("hotplug: %s\n", ok ? "ok" : "FAIL");
+    return ok;
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+// device configurations picked from typical soundcard capabilities
+static bool testCapabilities()
+{
+    bool ok = true;
+
+    const auto check = [&ok](const char* const what, const bool result)
+    {
+        if (! result)
+        {
+            std::printf("capabilities | %s\n", what);
+            ok = false;
+        }
+    };
+
+    DeviceConfig config;
+
+    // usb class-compliant, fixed 2 channels, no float
+    DeviceCapabilities usb;
+    usb.minChans = usb.maxChans = 2;
+    usb.minRate = 44100;
+    usb.maxRate = 48000;
+    usb.rates = { 44100, 48000 };
+    usb.minPeriods = 2;
+    usb.maxPeriods = 1024;
+    usb.minPeriodSize = 16;
+    usb.maxPeriodSize = 65536;
+    usb.access = (1u << SND_PCM_ACCESS_MMAP_INTERLEAVED) | (1u << SND_PCM_ACCESS_RW_INTERLEAVED);
+    usb.formats = (UINT64_C(1) << SND_PCM_FORMAT_S16) | (UINT64_C(1) << SND_PCM_FORMAT_S24_3LE)
+                | (UINT64_C(1) << SND_PCM_FORMAT_S32);
+    usb.interleavedFormats = usb.formats;
+
+    check("usb config", chooseDeviceConfig(usb, 128, 48000, 8, 0, config));
+    check("usb access", config.access == SND_PCM_ACCESS_MMAP_INTERLEAVED);
+    check("usb format", config.format == SND_PCM_FORMAT_S32 && config.sampleHint == kDeviceSample32);
+    check("usb rate", config.sampleRate == 48000);
+    check("usb period size", config.periodSize == 128);
+    check("usb periods", config.periods == 3);
+    check("usb channels", config.channels == 2);
+
+    // nearest supported rate, keeping the same period duration
+    check("usb resampled config", chooseDeviceConfig(usb, 256, 96000, 2, 0, config));
+    check("usb resampled rate", config.sampleRate == 48000);
+    check("usb resampled period size", config.periodSize == 128);
+
+    // pci card with float and non-interleaved access, large minimum period, only 2 periods
+    DeviceCapabilities pci;
+    pci.minChans = 2;
+    pci.maxChans = 26;
+    pci.minRate = 32000;
+    pci.maxRate = 192000;
+    pci.rates = { 32000, 44100, 48000, 88200, 96000, 176400, 192000 };
+    pci.minPeriods = pci.maxPeriods = 2;
+    pci.minPeriodSize = 256;
+    pci.maxPeriodSize = 8192;
+    pci.access = (1u << SND_PCM_ACCESS_MMAP_INTERLEAVED) | (1u << SND_PCM_ACCESS_MMAP_NONINTERLEAVED);
+    pci.formats = (UINT64_C(1) << SND_PCM_FORMAT_S32) | (UINT64_C(1) << SND_PCM_FORMAT_FLOAT);
+    pci.interleavedFormats = pci.nonInterleavedFormats = pci.formats;
+
+    check("pci config", chooseDeviceConfig(pci, 64, 44100, 1, 96000, config));
+    check("pci access", config.access == SND_PCM_ACCESS_MMAP_NONINTERLEAVED);
+    check("pci format", config.format == SND_PCM_FORMAT_FLOAT
+                        && config.sampleHint == (kDeviceSampleFloat|kDeviceNonInterleaved));
+    check("pci rate", config.sampleRate == 96000);
+    check("pci period size", config.periodSize == 256);
+    check("pci periods", config.periods == 2);
+    check("pci channels", config.channels == 2);
+
+    // 24-bit only available interleaved, must not pick non-interleaved access for it
+    DeviceCapabilities mixed = pci;
+    mixed.formats = mixed.interleavedFormats = UINT64_C(1) << SND_PCM_FORMAT_S24_3LE;
+    mixed.nonInterleavedFormats = UINT64_C(1) << SND_PCM_FORMAT_U8;
+    check("mixed config", chooseDeviceConfig(mixed, 64, 48000, 2, 0, config));
+    check("mixed access", config.access == SND_PCM_ACCESS_MMAP_INTERLEAVED);
+    check("mixed format", config.format == SND_PCM_FORMAT_S24_3LE && config.sampleHint == kDeviceSample24LE3);
+
+    // nothing audio-bridge can use
+    DeviceCapabilities rw = usb;
+    rw.access = 1u << SND_PCM_ACCESS_RW_INTERLEAVED;
+    check("rw-only access", ! chooseDeviceConfig(rw, 128, 48000, 2, 0, config));
+
+    DeviceCapabilities u8 = usb;
+    u8.formats = u8.interleavedFormats = UINT64_C(1) << SND_PCM_FORMAT_U8;
+    check("u8-only format", ! chooseDeviceConfig(u8, 128, 48000, 2, 0, config));
+
+    std::printf("capabilities: %s\n", ok ? "ok" : "FAIL");
+    return ok;
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+// wraps a real device backend, stalling the device thread on request long enough for the hardware to xrun
+class XrunInjectingBackend : public DeviceBackend
+{
+    DeviceBackend* const backend;
+    const useconds_t stallTime;
+    std::atomic<bool> inject = {false};
+
+public:
+    XrunInjectingBackend(DeviceBackend* const b, const DeviceAudio::HWStatus& hwstatus)
+        : backend(b),
+          stallTime(2000000ULL * hwstatus.fullBufferSize / hwstatus.sampleRate) {}
+
+    ~XrunInjectingBackend() override
+    {
+        delete backend;
+    }
+
+    // called from the bench thread, the device thread stalls on its next availUpdate
+    void injectXrun()
+    {
+        inject.store(true, std::memory_order_release);
+    }
+
+    snd_pcm_state_t state() override { return backend->state(); }
+    int prepare() override { return backend->prepare(); }
+    int resume() override { return backend->resume(); }
+    int start() override { return backend->start(); }
+
+    snd_pcm_sframes_t availUpdate() override
+    {
+        if (inject.exchange(false, std::memory_order_acq_rel))
+            usleep(stallTime);
+
+        return backend->availUpdate();
+    }
+
+    int htimestamp(snd_pcm_uframes_t* const avail, snd_htimestamp_t* const tstamp) override
+    {
+        return backend->htimestamp(avail, tstamp);
+    }
+
+    int mmapBegin(const snd_pcm_channel_area_t** const areas,
+                  snd_pcm_uframes_t* const offset,
+                  snd_pcm_uframes_t* const frames) override
+    {
+        return backend->mmapBegin(areas, offset, frames);
+    }
+
+    snd_pcm_sframes_t mmapCommit(const snd_pcm_uframes_t offset, const snd_pcm_uframes_t frames) override
+    {
+        return backend->mmapCommit(offset, frames);
+    }
+
+    int pollDescriptorsCount() override { return backend->pollDescriptorsCount(); }
+
+    int pollDescriptors(struct pollfd* const pfds, const unsigned int space) override
+    {
+        return backend->pollDescriptors(pfds, space);
+    }
+
+    int pollDescriptorsRevents(struct pollfd* const pfds, const unsigned int nfds, unsigned short* const revents) override
+    {
+        return backend->pollDescriptorsRevents(pfds, nfds, revents);
+    }
+
+    int poll(struct pollfd* const pfds, const unsigned int nfds, const int timeout) override
+    {
+        return backend->poll(pfds, nfds, timeout);
+    }
+
+    int link(DeviceBackend* const other) override
+    {
+        return backend->link(other);
+    }
+};
+
+// run a device as if driven by JACK, reporting device thread wakeups and CPU usage
+// optionally injects xruns once per second (after a few seconds of warm-up), reporting how long recovery takes
+static bool benchDevice(const char* const deviceID, const bool playback, const uint32_t seconds, const bool xruns)
+{
+    static constexpr const uint32_t kWarmupSeconds = 4;
+
+    static constexpr const uint16_t kBufferSize = 128;
+    static constexpr const uint32_t kSampleRate = 48000;
+
+    uint32_t sampleHint = 0;
+    DeviceAudio::HWStatus hwstatus = {};
+
+    DeviceBackend* const alsa = openDeviceBackend(deviceID, playback, kBufferSize, kSampleRate,
+                                                  2, 0, sampleHint, hwstatus);
+    XrunInjectingBackend* const backend = alsa != nullptr ? new XrunInjectingBackend(alsa, hwstatus) : nullptr;
+
+    DeviceAudio* const dev = backend != nullptr
+                           ? initDeviceAudio(backend, deviceID, playback, kBufferSize, kSampleRate, sampleHint, hwstatus)
+                           : nullptr;
+    if (dev == nullptr)
+    {
+        std::printf("failed to open %s\n", deviceID);
+        return false;
+    }
+
+    const uint8_t channels = dev->hwstatus.channels;
+    const uint32_t numCycles = seconds * kSampleRate / kBufferSize;
+    const long periodTime = 1000000000LL * kBufferSize / kSampleRate;
+
+    float** buffers = new float*[channels];
+    for (uint8_t c = 0; c < channels; ++c)
+    {
+        buffers[c] = new float[kBufferSize];
+        std::memset(buffers[c], 0, sizeof(float) * kBufferSize);
+    }
+
+    clockid_t cpuclock;
+    pthread_getcpuclockid(dev->thread, &cpuclock);
+
+    struct timespec cpustart, cpuend, ts;
+    clock_gettime(cpuclock, &cpustart);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    const uint32_t cyclesPerSecond = kSampleRate / kBufferSize;
+    uint32_t numXruns = 0, numRestarts = 0;
+    uint32_t maxRecoveryTime = 0;
+    uint64_t totalRecoveryTime = 0;
+
+    uint32_t cycle = 0;
+    for (; cycle < numCycles; ++cycle)
+    {
+        if (xruns && cycle >= kWarmupSeconds * cyclesPerSecond)
+        {
+            if (dev->xruns.count != numXruns)
+            {
+                numXruns = dev->xruns.count;
+                totalRecoveryTime += dev->xruns.recoveryTime;
+                maxRecoveryTime = std::max(maxRecoveryTime, dev->xruns.recoveryTime);
+            }
+
+            if (dev->hints & kDeviceInitializing)
+                ++numRestarts;
+
+            if (cycle % cyclesPerSecond == 0)
+                backend->injectXrun();
+        }
+
+        ts.tv_nsec += periodTime;
+        if (ts.tv_nsec >= 1000000000LL)
+        {
+            ++ts.tv_sec;
+            ts.tv_nsec -= 1000000000LL;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
+
+        if (! runDeviceAudio(dev, buffers, kBufferSize))
+            break;
+    }
+
+    const bool ok = cycle == numCycles;
+
+    if (ok)
+    {
+        clock_gettime(cpuclock, &cpuend);
+
+        const double cputime = (cpuend.tv_sec - cpustart.tv_sec) + (cpuend.tv_nsec - cpustart.tv_nsec) / 1e9;
+        const double walltime = static_cast<double>(numCycles) * kBufferSize / kSampleRate;
+
+        std::printf("%s | %s | %u cycles | %u wakeups, %.2f per cycle | cpu %.3f%%\n",
+                    deviceID, playback ? "playback" : "capture",
+                    numCycles, dev->numWakeups, static_cast<double>(dev->numWakeups) / numCycles,
+                    cputime / walltime * 100.0);
+
+        if (xruns)
+            std::printf("%u xruns | recovery avg %.2f ms, max %.2f ms | %u cycles with full restart\n",
+                        numXruns, numXruns != 0 ? totalRecoveryTime / 1000.0 / numXruns : 0.0,
+                        maxRecoveryTime / 1000.0, numRestarts);
+    }
+    else
+    {
+        std::printf("%s | device thread stopped after %u cycles\n", deviceID, cycle);
+    }
+
+    closeDeviceAudio(dev);
+
+    for (uint8_t c = 0; c < channels; ++c)
+        delete[] buffers[c];
+    delete[] buffers;
+
+    return ok;
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+// run a simulated device as if driven by JACK, all in virtual time
+// optionally injects xruns once per second (after a few seconds of warm-up)
+// optionally splits host cycles into smaller blocks of varying size, like some LV2 hosts do
+// device can run at a different nominal sample rate than the host, with the period duration kept the same
+// checks that the device never needs a full restart after startup and that clock drift is compensated
+// with adaptive latency and no xruns, also checks that capture latency goes down
+static bool runSimulatedDevice(const bool playback,
+                               const double clockOffset,
+                               const uint32_t deviceRate,
+                               const uint8_t channels,
+                               const uint32_t seconds,
+                               const bool xruns,
+                               const bool splitBlocks,
+                               const bool bench,
+                               const uint32_t sampleHint = kDeviceSample32)
+{
+    static constexpr const uint32_t kWarmupSeconds = 4;
+
+    static constexpr const uint16_t kBufferSize = 128;
+    static constexpr const uint32_t kSampleRate = 48000;
+
+    // maximum allowed clock drift estimation error at the end of the run
+    static constexpr const double kMaxError = 2e-6;
+
+    SimulatedDeviceBackend::Config config = {};
+    config.playback = playback;
+    config.sampleRate = deviceRate;
+    config.channels = channels;
+    config.periodSize = (kBufferSize * deviceRate + kSampleRate / 2) / kSampleRate;
+    config.periods = 3;
+    config.sampleHint = sampleHint;
+    config.clockOffset = clockOffset;
+    config.jitter = 2e-6;
+    config.seed = 1337;
+
+    SimulatedDeviceBackend* const sim = new SimulatedDeviceBackend(config);
+
+    DeviceAudio* const dev = initDeviceAudio(sim, "simulated", playback, kBufferSize, kSampleRate,
+                                             config.sampleHint, sim->getHWStatus());
+    if (dev == nullptr)
+    {
+        std::printf("failed to open simulated device\n");
+        return false;
+    }
+
+    const uint32_t numCycles = seconds * kSampleRate / kBufferSize;
+    const uint32_t cyclesPerSecond = kSampleRate / kBufferSize;
+    const uint32_t initialLatency = getDeviceAudioLatency(dev);
+
+    float** buffers = new float*[channels];
+    for (uint8_t c = 0; c < channels; ++c)
+    {
+        buffers[c] = new float[kBufferSize];
+        std::memset(buffers[c], 0, sizeof(float) * kBufferSize);
+    }
+
+    clockid_t cpuclock;
+    pthread_getcpuclockid(dev->thread, &cpuclock);
+
+    struct timespec cpustart, cpuend, wallstart, wallend;
+    clock_gettime(cpuclock, &cpustart);
+    clock_gettime(CLOCK_MONOTONIC, &wallstart);
+
+    uint32_t numInjected = 0, numRestarts = 0;
+    bool started = false;
+    bool ok = true;
+
+    uint32_t cycle = 0;
+    for (; cycle < numCycles; ++cycle)
+    {
+        if ((dev->hints & (kDeviceStarting|kDeviceBuffering)) == 0)
+            started = true;
+        else if (started && (dev->hints & kDeviceInitializing) != 0)
+            ++numRestarts;
+
+        if (xruns && cycle >= kWarmupSeconds * cyclesPerSecond && cycle % cyclesPerSecond == 0)
+        {
+            sim->injectXrun();
+            ++numInjected;
+        }
+
+        // split pattern repeats every 4 cycles: 128, 64+64, 32+96, 100+28
+        const uint16_t firstBlock = ! splitBlocks ? kBufferSize
+                                  : cycle % 4 == 1 ? 64
+                                  : cycle % 4 == 2 ? 32
+                                  : cycle % 4 == 3 ? 100
+                                  : kBufferSize;
+
+        for (uint16_t offset = 0, frames = firstBlock; offset < kBufferSize; offset += frames, frames = kBufferSize - offset)
+        {
+            if (! runDeviceAudio(dev, buffers, frames, static_cast<uint64_t>(sim->getTime() * 1e6)))
+                break;
+
+            sim->advance(static_cast<double>(frames) / kSampleRate);
+
+            if (! sim->waitIdle())
+            {
+                std::printf("simulated | device thread did not become idle at cycle %u\n", cycle);
+                ok = false;
+                break;
+            }
+        }
+
+        if (! ok || dev->thread == 0)
+            break;
+    }
+
+    clock_gettime(cpuclock, &cpuend);
+    clock_gettime(CLOCK_MONOTONIC, &wallend);
+
+    // resampling ratio also includes a small latency correction, so check the drift estimate itself
+    const double error = dev->clock.deviceFrameTime != 0.0
+                       ? dev->clock.host.getFrameTime() * kSampleRate / (dev->clock.deviceFrameTime * deviceRate)
+                         - (1.0 + clockOffset)
+                       : 1.0;
+
+    if (cycle != numCycles)
+    {
+        std::printf("simulated | device thread stopped after %u cycles\n", cycle);
+        ok = false;
+    }
+    else if (! started || numRestarts != 0)
+    {
+        std::printf("simulated | %s | %u cycles with full restart\n", started ? "started" : "never started", numRestarts);
+        ok = false;
+    }
+    else if (dev->xruns.count != sim->getNumXruns() || sim->getNumXruns() != numInjected)
+    {
+        std::printf("simulated | %u xruns injected, %u happened, %u recovered\n",
+                    numInjected, sim->getNumXruns(), dev->xruns.count);
+        ok = false;
+    }
+    else if (std::abs(error) > kMaxError)
+    {
+        std::printf("simulated | clock offset %.0f ppm, drift error %.3f ppm\n", clockOffset * 1e6, error * 1e6);
+        ok = false;
+    }
+    else if (getDeviceAudioAdaptiveLatency() > 0.f && ! playback && ! xruns
+             && getDeviceAudioMeasuredLatency(dev) >= initialLatency)
+    {
+        std::printf("simulated | adaptive latency did not go down, target %u, measured %u, initial %u\n",
+                    getDeviceAudioLatency(dev), getDeviceAudioMeasuredLatency(dev), initialLatency);
+        ok = false;
+    }
+
+    if (bench)
+    {
+        const double cputime = (cpuend.tv_sec - cpustart.tv_sec) + (cpuend.tv_nsec - cpustart.tv_nsec) / 1e9;
+        const double walltime = (wallend.tv_sec - wallstart.tv_sec) + (wallend.tv_nsec - wallstart.tv_nsec) / 1e9;
+        const double simtime = static_cast<double>(cycle) * kBufferSize / kSampleRate;
+
+        std::printf("simulated | %s | %u cycles | %.1fx realtime | %u wakeups, %.2f per cycle | cpu %.3f%% | drift error %.3f ppm\n",
+                    playback ? "playback" : "capture", cycle, simtime / walltime,
+                    dev->numWakeups, static_cast<double>(dev->numWakeups) / std::max(1u, cycle),
+                    cputime / simtime * 100.0, error * 1e6);
+        std::printf("simulated | latency %u frames initially, now %u target and %u measured\n",
+                    initialLatency, getDeviceAudioLatency(dev), getDeviceAudioMeasuredLatency(dev));
+    }
+
+    closeDeviceAudio(dev);
+
+    for (uint8_t c = 0; c < channels; ++c)
+        delete[] buffers[c];
+    delete[] buffers;
+
+    return ok;
+}
+
+// run simulated linked capture and playback streams in full-duplex mode, like runSimulatedDevice does for one of them
+// checks that a single thread serves both, that they recover from xruns together and share the capture drift estimate
+static bool runSimulatedDuplex(const double clockOffset,
+                               const uint32_t deviceRate,
+                               const uint32_t seconds,
+                               const bool xruns,
+                               const bool bench)
+{
+    static constexpr const uint32_t kWarmupSeconds = 4;
+
+    static constexpr const uint16_t kBufferSize = 128;
+    static constexpr const uint32_t kSampleRate = 48000;
+    static constexpr const uint8_t kChannels = 2;
+
+    // maximum allowed clock drift estimation error at the end of the run
+    static constexpr const double kMaxError = 2e-6;
+
+    SimulatedDeviceBackend::Config config = {};
+    config.sampleRate = deviceRate;
+    config.channels = kChannels;
+    config.periodSize = (kBufferSize * deviceRate + kSampleRate / 2) / kSampleRate;
+    config.periods = 3;
+    config.sampleHint = kDeviceSample32;
+    config.clockOffset = clockOffset;
+    config.jitter = 2e-6;
+    config.seed = 1337;
+
+    config.playback = false;
+    SimulatedDeviceBackend* const captureSim = new SimulatedDeviceBackend(config);
+
+    config.playback = true;
+    config.seed = 7331;
+    SimulatedDeviceBackend* const playbackSim = new SimulatedDeviceBackend(config);
+
+    DeviceAudio* const dev = initDeviceAudioDuplex(captureSim, playbackSim, "simulated", kBufferSize, kSampleRate,
+                                                   config.sampleHint, captureSim->getHWStatus(),
+                                                   config.sampleHint, playbackSim->getHWStatus());
+    if (dev == nullptr)
+    {
+        std::printf("failed to open simulated duplex device\n");
+        return false;
+    }
+
+    DeviceAudio* const playDev = dev->duplex;
+
+    const uint32_t numCycles = seconds * kSampleRate / kBufferSize;
+    const uint32_t cyclesPerSecond = kSampleRate / kBufferSize;
+
+    float** buffers = new float*[kChannels];
+    for (uint8_t c = 0; c < kChannels; ++c)
+    {
+        buffers[c] = new float[kBufferSize];
+        std::memset(buffers[c], 0, sizeof(float) * kBufferSize);
+    }
+
+    clockid_t cpuclock;
+    pthread_getcpuclockid(dev->thread, &cpuclock);
+
+    struct timespec cpustart, cpuend, wallstart, wallend;
+    clock_gettime(cpuclock, &cpustart);
+    clock_gettime(CLOCK_MONOTONIC, &wallstart);
+
+    // a single thread for both
+    const bool sameThread = playDev->thread == dev->thread;
+
+    uint32_t numInjected = 0, numRestarts = 0;
+    bool started = false;
+    bool ok = true;
+
+    uint32_t cycle = 0;
+    for (; cycle < numCycles; ++cycle)
+    {
+        if (((dev->hints | playDev->hints) & (kDeviceStarting|kDeviceBuffering)) == 0)
+            started = true;
+        else if (started && ((dev->hints | playDev->hints) & kDeviceInitializing) != 0)
+            ++numRestarts;
+
+        // linked streams stop together, the injected xrun counts on both
+        if (xruns && cycle >= kWarmupSeconds * cyclesPerSecond && cycle % cyclesPerSecond == 0)
+        {
+            captureSim->injectXrun();
+            ++numInjected;
+        }
+
+        const uint64_t cycleTime = static_cast<uint64_t>(captureSim->getTime() * 1e6);
+
+        // same order as a JACK client, reading capture before writing playback
+        if (! runDeviceAudio(dev, buffers, kBufferSize, cycleTime) ||
+            ! runDeviceAudio(playDev, buffers, kBufferSize, cycleTime))
+            break;
+
+        // moves both linked streams
+        captureSim->advance(static_cast<double>(kBufferSize) / kSampleRate);
+
+        // thread waits on both through the capture backend
+        if (! captureSim->waitIdle())
+        {
+            std::printf("simulated | duplex | device thread did not become idle at cycle %u\n", cycle);
+            ok = false;
+            break;
+        }
+    }
+
+    clock_gettime(cpuclock, &cpuend);
+    clock_gettime(CLOCK_MONOTONIC, &wallend);
+
+    const double error = dev->clock.deviceFrameTime != 0.0
+                       ? dev->clock.host.getFrameTime() * kSampleRate / (dev->clock.deviceFrameTime * deviceRate)
+                         - (1.0 + clockOffset)
+                       : 1.0;
+
+    if (! sameThread)
+    {
+        std::printf("simulated | duplex | playback is not served by the capture thread\n");
+        ok = false;
+    }
+    else if (cycle != numCycles)
+    {
+        std::printf("simulated | duplex | device thread stopped after %u cycles\n", cycle);
+        ok = false;
+    }
+    else if (! started || numRestarts != 0)
+    {
+        std::printf("simulated | duplex | %s | %u cycles with full restart\n",
+                    started ? "started" : "never started", numRestarts);
+        ok = false;
+    }
+    else if (captureSim->getNumXruns() != numInjected || playbackSim->getNumXruns() != numInjected
+             || dev->xruns.count != numInjected || playDev->xruns.count != numInjected)
+    {
+        std::printf("simulated | duplex | %u xruns injected, %u/%u happened, %u/%u recovered\n",
+                    numInjected, captureSim->getNumXruns(), playbackSim->getNumXruns(),
+                    dev->xruns.count, playDev->xruns.count);
+        ok = false;
+    }
+    // playback must use the capture estimate, without one of its own
+    else if (std::abs(error) > kMaxError || playDev->clock.deviceFrameTime != 0.0)
+    {
+        std::printf("simulated | duplex | clock offset %.0f ppm, drift error %.3f ppm\n", clockOffset * 1e6, error * 1e6);
+        ok = false;
+    }
+
+    if (bench)
+    {
+        const double cputime = (cpuend.tv_sec - cpustart.tv_sec) + (cpuend.tv_nsec - cpustart.tv_nsec) / 1e9;
+        const double walltime = (wallend.tv_sec - wallstart.tv_sec) + (wallend.tv_nsec - wallstart.tv_nsec) / 1e9;
+        const double simtime = static_cast<double>(cycle) * kBufferSize / kSampleRate;
+
+        std::printf("simulated | duplex | %u cycles | %.1fx realtime | %u wakeups, %.2f per cycle | cpu %.3f%% | drift error %.3f ppm\n",
+                    cycle, simtime / walltime,
+                    dev->numWakeups, static_cast<double>(dev->numWakeups) / std::max(1u, cycle),
+                    cputime / simtime * 100.0, error * 1e6);
+        std::printf("simulated | duplex | round-trip latency %u frames, %u measured\n",
+                    getDeviceAudioLatency(dev) + getDeviceAudioLatency(playDev),
+                    getDeviceAudioMeasuredLatency(dev) + getDeviceAudioMeasuredLatency(playDev));
+    }
+
+    closeDeviceAudio(dev);
+
+    for (uint8_t c = 0; c < kChannels; ++c)
+        delete[] buffers[c];
+    delete[] buffers;
+
+    return ok;
+}
+
+static bool testSimulatedDevice()
+{
+    bool ok = true;
+
+    for (const bool playback : { true, false })
+    {
+        for (const double clockOffset : { -300e-6, 0.0, 120e-6 })
+            ok &= runSimulatedDevice(playback, clockOffset, 48000, 2, 10, false, false, false);
+
+        ok &= runSimulatedDevice(playback, 80e-6, 48000, 2, 10, true, false, false);
+        ok &= runSimulatedDevice(playback, -50e-6, 48000, 2, 10, true, true, false);
+
+        // fixed-rate device, resampled to host rate
+        ok &= runSimulatedDevice(playback, 0.0, 44100, 2, 10, false, false, false);
+        ok &= runSimulatedDevice(playback, 150e-6, 44100, 2, 10, true, true, false);
+
+        // non-interleaved access, with and without conversion
+        ok &= runSimulatedDevice(playback, 60e-6, 48000, 4, 10, true, true, false,
+                                 kDeviceSampleFloat|kDeviceNonInterleaved);
+        ok &= runSimulatedDevice(playback, -90e-6, 48000, 3, 10, true, false, false,
+                                 kDeviceSample24LE3|kDeviceNonInterleaved);
+
+        // many channels split across worker threads
+        setDeviceAudioWorkerThreads(3);
+        ok &= runSimulatedDevice(playback, -120e-6, 44100, 16, 10, true, true, false);
+        setDeviceAudioWorkerThreads(0);
+    }
+
+    // adaptive capture latency, lowered while stable and still recovering from xruns without full restarts
+    setDeviceAudioAdaptiveLatency(1.f);
+    ok &= runSimulatedDevice(false, 70e-6, 48000, 2, 30, false, false, false);
+    ok &= runSimulatedDevice(false, -40e-6, 44100, 2, 30, true, true, false);
+    setDeviceAudioAdaptiveLatency(0.f);
+
+    // linked capture and playback served by a single thread
+    ok &= runSimulatedDuplex(-80e-6, 48000, 10, false, false);
+    ok &= runSimulatedDuplex(110e-6, 48000, 10, true, false);
+    ok &= runSimulatedDuplex(40e-6, 44100, 10, true, false);
+
+    std::printf("simulated: %s\n", ok ? "ok" : "FAIL");
+    return ok;
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+static void testSoundcards()
 {
     std::vector<DeviceID> inputs, outputs;
     enumerateSoundcards(inputs, outputs);
@@ -19,9 +1783,167 @@ int main()
                    props.bufsizes[0]);
         else
             printf("%s | %s | FAIL\n", device.id.c_str(), device.name.c_str());
+
+        for (const DeviceCapabilities* caps : { &props.capture, &props.playback })
+        {
+            if (caps->formats == 0)
+                continue;
+
+            printf("    %s | rates", caps == &props.capture ? "capture " : "playback");
+            for (const unsigned rate : caps->rates)
+                printf(" %u", rate);
+
+            printf(" | periods %u-%u of %lu-%lu | formats",
+                   caps->minPeriods, caps->maxPeriods, caps->minPeriodSize, caps->maxPeriodSize);
+            for (int format = 0; format <= SND_PCM_FORMAT_LAST; ++format)
+            {
+                if (caps->formats & (UINT64_C(1) << format))
+                    printf(" %s", snd_pcm_format_name(static_cast<snd_pcm_format_t>(format)));
+            }
+
+            printf(" | %s\n", caps->access & (1u << SND_PCM_ACCESS_MMAP_NONINTERLEAVED) ? "non-interleaved" : "interleaved");
+        }
+    }
+
+    cleanup();
+}
+
+// print the cost of enumerating soundcards and their properties, with and without cached results
+static void benchDiscovery()
+{
+    static constexpr const uint32_t kIterations = 20;
+
+    soundcardHotplugStart();
+
+    // cache is only used while changes are being watched
+    for (int i = 0; i < 100 && ! isSoundcardHotplugWatching(); ++i)
+        usleep(10000);
+
+    if (! isSoundcardHotplugWatching())
+        std::printf("discovery | soundcard hotplug not watching, results are never cached\n");
+
+    for (const bool cached : { false, true })
+    {
+        size_t devices = 0;
+        clearSoundcardCache();
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (uint32_t i = 0; i < kIterations; ++i)
+        {
+            if (! cached)
+                clearSoundcardCache();
+
+            std::vector<DeviceID> inputs, outputs;
+            enumerateSoundcards(inputs, outputs);
+
+            for (const DeviceID& device : outputs)
+            {
+                DeviceProperties props;
+                getDeviceProperties(device.id, true, true, 48000, props);
+            }
+
+            devices = inputs.size() + outputs.size();
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        const double us = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / 1e3;
+        std::printf("discovery | %s | %zu devices | %10.1f us per enumeration\n",
+                    cached ? "cached  " : "uncached", devices, us / kIterations);
     }
 
+    soundcardHotplugStop();
     cleanup();
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1 && std::strcmp(argv[1], "converters") == 0)
+        return testConverters() ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if (argc > 1 && std::strcmp(argv[1], "bench-converters") == 0)
+    {
+        benchConverters();
+        return EXIT_SUCCESS;
+    }
+
+    if (argc > 1 && std::strcmp(argv[1], "resampler") == 0)
+        return testResampler() ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if (argc > 1 && std::strcmp(argv[1], "bench-resampler") == 0)
+    {
+        benchResampler();
+        return EXIT_SUCCESS;
+    }
+
+    if (argc > 1 && std::strcmp(argv[1], "bench-quality") == 0)
+    {
+        benchResamplerQuality();
+        return EXIT_SUCCESS;
+    }
+
+    if (argc > 1 && std::strcmp(argv[1], "ringbuffer") == 0)
+        return testRingBuffer() ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if (argc > 1 && std::strcmp(argv[1], "dll") == 0)
+        return testDelayLockedLoop() ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if (argc > 1 && std::strcmp(argv[1], "log") == 0)
+        return testLog() ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if (argc > 1 && std::strcmp(argv[1], "hotplug") == 0)
+        return testHotplug() ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if (argc > 1 && std::strcmp(argv[1], "capabilities") == 0)
+        return testCapabilities() ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if (argc > 1 && std::strcmp(argv[1], "bench-discovery") == 0)
+    {
+        benchDiscovery();
+        return EXIT_SUCCESS;
+    }
+
+    if (argc > 1 && std::strcmp(argv[1], "simulated") == 0)
+        return testSimulatedDevice() ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    // bench-sim [playback|capture] [seconds] [ppm] [device-rate] [channels] [worker-threads] [adaptive-latency-ms]
+    if (argc > 1 && std::strcmp(argv[1], "bench-sim") == 0)
+    {
+        const bool playback = argc <= 2 || std::strcmp(argv[2], "capture") != 0;
+        const uint32_t seconds = argc > 3 ? std::atoi(argv[3]) : 60;
+        const double clockOffset = argc > 4 ? std::atof(argv[4]) * 1e-6 : 0.0;
+        const uint32_t deviceRate = argc > 5 ? std::atoi(argv[5]) : 48000;
+        const uint8_t channels = argc > 6 ? std::atoi(argv[6]) : 2;
+        if (argc > 7)
+            setDeviceAudioWorkerThreads(std::atoi(argv[7]));
+        if (argc > 8)
+            setDeviceAudioAdaptiveLatency(std::atof(argv[8]));
+        return runSimulatedDevice(playback, clockOffset, deviceRate, channels, seconds, true, false, true)
+               ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // bench-duplex [seconds] [ppm] [device-rate]
+    if (argc > 1 && std::strcmp(argv[1], "bench-duplex") == 0)
+    {
+        const uint32_t seconds = argc > 2 ? std::atoi(argv[2]) : 60;
+        const double clockOffset = argc > 3 ? std::atof(argv[3]) * 1e-6 : 0.0;
+        const uint32_t deviceRate = argc > 4 ? std::atoi(argv[4]) : 48000;
+        return runSimulatedDuplex(clockOffset, deviceRate, seconds, true, true) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // bench-device|bench-xrun <device> [playback|capture] [seconds]
+    if (argc > 2 && (std::strcmp(argv[1], "bench-device") == 0 || std::strcmp(argv[1], "bench-xrun") == 0))
+    {
+        const bool playback = argc <= 3 || std::strcmp(argv[3], "capture") != 0;
+        const uint32_t seconds = argc > 4 ? std::atoi(argv[4]) : 10;
+        const bool xruns = std::strcmp(argv[1], "bench-xrun") == 0;
+        return benchDevice(argv[2], playback, seconds, xruns) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
+    testSoundcards();
     return 0;
 }
@@ -25,9 +25,14 @@
 #include <math.h>
 
 #undef ENABLE_VEC4
+#undef ENABLE_VEC8
 #if defined(__SSE2_MATH__)
 # define ENABLE_VEC4
 # include <xmmintrin.h>
+# if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define ENABLE_VEC8
+#  include <immintrin.h>
+# endif
 #elif defined(__ARM_NEON) || defined(__ARM_NEON__)
 # define ENABLE_VEC4
 # include <arm_neon.h>
@@ -36,6 +41,213 @@
 #include "zita-resampler/vresampler.h"
 
 
+// Filter kernels, computing one output sample for all channels.
+// q1 and q2 point to the 2 table rows around the current phase, interpolated with a and b into c1 and c2.
+// p1 and p2 point to the input of the 1st channel, channels are di samples apart.
+
+typedef void (*Filter_func) (const float *q1, const float *q2, float a, float b, int hl,
+                             float *c1, float *c2, const float *p1, const float *p2,
+                             unsigned int di, unsigned int nchan, float **out_data, unsigned int outp_i);
+
+
+static void filter_scalar (const float *q1, const float *q2, float a, float b, int hl,
+                           float *c1, float *c2, const float *p1, const float *p2,
+                           unsigned int di, unsigned int nchan, float **out_data, unsigned int outp_i)
+{
+    int            i;
+    unsigned int   j;
+    float          s;
+    const float    *r1, *r2;
+
+    for (i = 0; i < hl; i++)
+    {
+        c1 [i] = a * q1 [i] + b * q1 [i + hl];
+        c2 [i] = a * q2 [i] + b * q2 [i - hl];
+    }
+    for (j = 0; j < nchan; j++)
+    {
+        r1 = p1 + j * di;
+        r2 = p2 + j * di;
+        s = 1e-30f;
+        for (i = 0; i < hl; i++)
+        {
+            r2--;
+            s += *r1 * c1 [i] + *r2 * c2 [i];
+            r1++;
+        }
+        out_data[j][outp_i] = s - 1e-30f;
+    }
+}
+
+
+#ifdef ENABLE_VEC4
+static void filter_vec4 (const float *q1, const float *q2, float a, float b, int hl,
+                         float *c1, float *c2, const float *p1, const float *p2,
+                         unsigned int di, unsigned int nchan, float **out_data, unsigned int outp_i)
+{
+    int            i;
+    unsigned int   j;
+    const float    *r1, *r2;
+
+   #if defined(__SSE2_MATH__)
+    __m128 C1, C2, Q1, Q2, S;
+    C1 = _mm_load1_ps (&a);
+    C2 = _mm_load1_ps (&b);
+    for (i = 0; i < hl; i += 4)
+    {
+        Q1 = _mm_load_ps (q1 + i);
+        Q2 = _mm_load_ps (q1 + i + hl);
+        S = _mm_add_ps (_mm_mul_ps (Q1, C1), _mm_mul_ps (Q2, C2));
+        _mm_store_ps (c1 + i, S);
+        Q1 = _mm_load_ps (q2 + i);
+        Q2 = _mm_load_ps (q2 + i - hl);
+        S = _mm_add_ps (_mm_mul_ps (Q1, C1), _mm_mul_ps (Q2, C2));
+        _mm_store_ps (c2 + i, S);
+    }
+    for (j = 0; j < nchan; j++)
+    {
+        r1 = p1 + j * di;
+        r2 = p2 + j * di;
+        S = _mm_setzero_ps ();
+        for (i = 0; i < hl; i += 4)
+        {
+            C1 = _mm_load_ps (c1 + i);
+            Q1 = _mm_loadu_ps (r1);
+            r2 -= 4;
+            S = _mm_add_ps (S, _mm_mul_ps (C1, Q1));
+            C2 = _mm_loadr_ps (c2 + i);
+            Q2 = _mm_loadu_ps (r2);
+            r1 += 4;
+            S = _mm_add_ps (S, _mm_mul_ps (C2, Q2));
+        }
+        out_data[j][outp_i] = S [0] + S [1] + S [2] + S [3];
+    }
+   #else
+    // ARM64 version by Nicolas Belin <nbelin@baylibre.com>
+    float32x4_t *C1 = (float32x4_t *)c1;
+    float32x4_t *C2 = (float32x4_t *)c2;
+    float32x4_t S, T;
+    for (i = 0; i < (hl>>2); i++)
+    {
+        T = vmulq_n_f32 (vld1q_f32 (q1 + hl), b);
+        C1 [i] = vmlaq_n_f32 (T, vld1q_f32 (q1), a);
+        T = vmulq_n_f32 (vld1q_f32 (q2 - hl), b);
+        C2 [i] = vmlaq_n_f32 (T, vld1q_f32 (q2), a);
+        q2 += 4;
+        q1 += 4;
+    }
+    for (j = 0; j < nchan; j++)
+    {
+        r1 = p1 + j * di;
+        r2 = p2 + j * di - 4;
+        T = vrev64q_f32 (vld1q_f32 (r2));
+        S = vmulq_f32 (vextq_f32 (T, T, 2), C2 [0]);
+        S = vmlaq_f32 (S, vld1q_f32 (r1), C1 [0]);
+        for (i = 1; i < (hl>>2); i++)
+        {
+            r2 -= 4;
+            r1 += 4;
+            T = vrev64q_f32 (vld1q_f32 (r2));
+            S = vmlaq_f32 (S, vextq_f32 (T, T, 2), C2 [i]);
+            S = vmlaq_f32 (S, vld1q_f32 (r1), C1 [i]);
+        }
+        out_data[j][outp_i] = S [0] + S [1] + S [2] + S [3];
+    }
+   #endif
+}
+#endif
+
+
+#ifdef ENABLE_VEC8
+// AVX2 + FMA, 8 taps at a time, with a 4 tap tail as hl is only padded to a multiple of 4.
+// Table rows are not 32-byte aligned for every hl, c1 and c2 always are.
+__attribute__((target("avx2,fma")))
+static void filter_vec8 (const float *q1, const float *q2, float a, float b, int hl,
+                         float *c1, float *c2, const float *p1, const float *p2,
+                         unsigned int di, unsigned int nchan, float **out_data, unsigned int outp_i)
+{
+    int            i;
+    unsigned int   j;
+    const float    *r1, *r2;
+
+    const __m256i R = _mm256_set_epi32 (0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256 A = _mm256_set1_ps (a);
+    const __m256 B = _mm256_set1_ps (b);
+    const int hl8 = hl & ~7;
+
+    for (i = 0; i < hl8; i += 8)
+    {
+        _mm256_store_ps (c1 + i, _mm256_fmadd_ps (_mm256_loadu_ps (q1 + i), A,
+                                                  _mm256_mul_ps (_mm256_loadu_ps (q1 + i + hl), B)));
+        _mm256_store_ps (c2 + i, _mm256_fmadd_ps (_mm256_loadu_ps (q2 + i), A,
+                                                  _mm256_mul_ps (_mm256_loadu_ps (q2 + i - hl), B)));
+    }
+    if (i < hl)
+    {
+        _mm_store_ps (c1 + i, _mm_fmadd_ps (_mm_loadu_ps (q1 + i), _mm256_castps256_ps128 (A),
+                                            _mm_mul_ps (_mm_loadu_ps (q1 + i + hl), _mm256_castps256_ps128 (B))));
+        _mm_store_ps (c2 + i, _mm_fmadd_ps (_mm_loadu_ps (q2 + i), _mm256_castps256_ps128 (A),
+                                            _mm_mul_ps (_mm_loadu_ps (q2 + i - hl), _mm256_castps256_ps128 (B))));
+    }
+
+    for (j = 0; j < nchan; j++)
+    {
+        r1 = p1 + j * di;
+        r2 = p2 + j * di;
+        __m256 S = _mm256_setzero_ps ();
+        for (i = 0; i < hl8; i += 8)
+        {
+            r2 -= 8;
+            S = _mm256_fmadd_ps (_mm256_load_ps (c1 + i), _mm256_loadu_ps (r1), S);
+            S = _mm256_fmadd_ps (_mm256_permutevar8x32_ps (_mm256_load_ps (c2 + i), R), _mm256_loadu_ps (r2), S);
+            r1 += 8;
+        }
+        __m128 T = _mm_add_ps (_mm256_castps256_ps128 (S), _mm256_extractf128_ps (S, 1));
+        if (i < hl)
+        {
+            r2 -= 4;
+            T = _mm_fmadd_ps (_mm_load_ps (c1 + i), _mm_loadu_ps (r1), T);
+            T = _mm_fmadd_ps (_mm_loadr_ps (c2 + i), _mm_loadu_ps (r2), T);
+        }
+        T = _mm_add_ps (T, _mm_movehl_ps (T, T));
+        T = _mm_add_ss (T, _mm_shuffle_ps (T, T, 1));
+        out_data[j][outp_i] = _mm_cvtss_f32 (T);
+    }
+}
+#endif
+
+
+static Filter_func get_filter (int kernel)
+{
+    switch (kernel)
+    {
+    case VResampler::KERNEL_AUTO:
+       #ifdef ENABLE_VEC8
+        __builtin_cpu_init ();
+        if (__builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("fma")) return filter_vec8;
+       #endif
+       #ifdef ENABLE_VEC4
+        return filter_vec4;
+       #else
+        return filter_scalar;
+       #endif
+    case VResampler::KERNEL_SCALAR:
+        return filter_scalar;
+   #ifdef ENABLE_VEC4
+    case VResampler::KERNEL_VEC4:
+        return filter_vec4;
+   #endif
+   #ifdef ENABLE_VEC8
+    case VResampler::KERNEL_VEC8:
+        __builtin_cpu_init ();
+        if (__builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("fma")) return filter_vec8;
+        break;
+   #endif
+    }
+    return 0;
+}
+
+
 VResampler::VResampler (void) noexcept :
     _table (0),
     _nchan (0),
@@ -43,6 +255,8 @@ VResampler::VResampler (void) noexcept :
     _c1 (0),
     _c2 (0)
 {
+    static const Filter_func filter = get_filter (KERNEL_AUTO);
+    _filter = (void *) filter;
     reset ();
 }
 
@@ -95,9 +309,9 @@ bool VResampler::setup (double       ratio,
         _table = T;
         n = nchan * (2 * hl + mi);
        #ifdef ENABLE_VEC4
-        posix_memalign ((void **)(&_buff), 16, n * sizeof (float));
-        posix_memalign ((void **)(&_c1), 16, hl * sizeof (float));
-        posix_memalign ((void **)(&_c2), 16, hl * sizeof (float));
+        posix_memalign ((void **)(&_buff), 32, n * sizeof (float));
+        posix_memalign ((void **)(&_c1), 32, hl * sizeof (float));
+        posix_memalign ((void **)(&_c2), 32, hl * sizeof (float));
        #else
         _buff  = new float [n];
         _c1 = new float [hl];
@@ -140,6 +354,15 @@ void VResampler::clear (void)
 }
 
 
+bool VResampler::set_kernel (int kernel)
+{
+    const Filter_func filter = get_filter (kernel);
+    if (!filter) return false;
+    _filter = (void *) filter;
+    return true;
+}
+
+
 void VResampler::set_phase (double p)
 {
     if (!_table) return;
@@ -200,13 +423,16 @@ bool VResampler::reset (void) noexcept
 
 bool VResampler::process (void)
 {
-    int            nr, np, hl, nz, di, i, n;
+    int            nr, np, hl, nz, di, n;
     unsigned int   in, j, inp_i, outp_i;
     double         ph, dp, dd;
     float          a, b, *p1, *p2, *q1, *q2;
+    Filter_func    filter;
 
     if (!_table) return false;
 
+    filter = (Filter_func) _filter;
+
     hl = _table->_hl;
     np = _table->_np;
     in = _index;
@@ -241,91 +467,7 @@ bool VResampler::process (void)
             q1 = _table->_ctab + hl * n;
             q2 = _table->_ctab + hl * (np - n);
 
-           #if defined(__SSE2_MATH__)
-            __m128 C1, C2, Q1, Q2, S;
-            C1 = _mm_load1_ps (&a);
-            C2 = _mm_load1_ps (&b);
-            for (i = 0; i < hl; i += 4)
-            {
-                Q1 = _mm_load_ps (q1 + i);
-                Q2 = _mm_load_ps (q1 + i + hl);
-                S = _mm_add_ps (_mm_mul_ps (Q1, C1), _mm_mul_ps (Q2, C2));
-                _mm_store_ps (_c1 + i, S);
-                Q1 = _mm_load_ps (q2 + i);
-                Q2 = _mm_load_ps (q2 + i - hl);
-                S = _mm_add_ps (_mm_mul_ps (Q1, C1), _mm_mul_ps (Q2, C2));
-                _mm_store_ps (_c2 + i, S);
-            }
-            for (j = 0; j < _nchan; j++)
-            {
-                q1 = p1 + j * di;
-                q2 = p2 + j * di;
-                S = _mm_setzero_ps ();
-                for (i = 0; i < hl; i += 4)
-                {
-                    C1 = _mm_load_ps (_c1 + i);
-                    Q1 = _mm_loadu_ps (q1);
-                    q2 -= 4;
-                    S = _mm_add_ps (S, _mm_mul_ps (C1, Q1));
-                    C2 = _mm_loadr_ps (_c2 + i);
-                    Q2 = _mm_loadu_ps (q2);
-                    q1 += 4;
-                    S = _mm_add_ps (S, _mm_mul_ps (C2, Q2));
-                }
-                out_data[j][outp_i] = S [0] + S [1] + S [2] + S [3];
-            }
-           #elif defined(__ARM_NEON) || defined(__ARM_NEON__)
-            // ARM64 version by Nicolas Belin <nbelin@baylibre.com>
-            float32x4_t *C1 = (float32x4_t *)_c1;
-            float32x4_t *C2 = (float32x4_t *)_c2;
-            float32x4_t S, T;
-            for (i = 0; i < (hl>>2); i++)
-            {
-                T = vmulq_n_f32 (vld1q_f32 (q1 + hl), b);
-                C1 [i] = vmlaq_n_f32 (T, vld1q_f32 (q1), a);
-                T = vmulq_n_f32 (vld1q_f32 (q2 - hl), b);
-                C2 [i] = vmlaq_n_f32 (T, vld1q_f32 (q2), a);
-                q2 += 4;
-                q1 += 4;
-            }
-            for (j = 0; j < _nchan; j++)
-            {
-                q1 = p1 + j * di;
-                q2 = p2 + j * di - 4;
-                T = vrev64q_f32 (vld1q_f32 (q2));
-                S = vmulq_f32 (vextq_f32 (T, T, 2), C2 [0]);
-                S = vmlaq_f32 (S, vld1q_f32 (q1), C1 [0]);
-                for (i = 1; i < (hl>>2); i++)
-                {
-                    q2 -= 4;
-                    q1 += 4;
-                    T = vrev64q_f32 (vld1q_f32 (q2));
-                    S = vmlaq_f32 (S, vextq_f32 (T, T, 2), C2 [i]);
-                    S = vmlaq_f32 (S, vld1q_f32 (q1), C1 [i]);
-                }
-                out_data[j][outp_i] = S [0] + S [1] + S [2] + S [3];
-            }
-           #else
-            float s;
-            for (i = 0; i < hl; i++)
-            {
-                _c1 [i] = a * q1 [i] + b * q1 [i + hl];
-                _c2 [i] = a * q2 [i] + b * q2 [i - hl];
-            }
-            for (j = 0; j < _nchan; j++)
-            {
-                q1 = p1 + j * di;
-                q2 = p2 + j * di;
-                s = 1e-30f;
-                for (i = 0; i < hl; i++)
-                {
-                    q2--;
-                    s += *q1 * _c1 [i] + *q2 * _c2 [i];
-                    q1++;
-                }
-                out_data[j][outp_i] = s - 1e-30f;
-            }
-           #endif
+            filter (q1, q2, a, b, hl, _c1, _c2, p1, p2, di, _nchan, out_data, outp_i);
         }
         else
         {
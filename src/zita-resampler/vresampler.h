@@ -30,6 +30,8 @@ class VResampler
 {
 public:
 
+    enum { KERNEL_AUTO, KERNEL_SCALAR, KERNEL_VEC4, KERNEL_VEC8 };
+
     VResampler (void) noexcept;
     ~VResampler (void);
 
@@ -53,6 +55,10 @@ public:
     void set_rrfilt (double t);
     void set_rratio (double r);
 
+    // force a specific filter kernel, for testing and benchmarks
+    // returns false if not available on this build or CPU
+    bool set_kernel (int kernel);
+
     unsigned int         inp_count;
     unsigned int         out_count;
     const float *const  *inp_data;
@@ -76,7 +82,8 @@ private:
     float               *_buff;
     float               *_c1;
     float               *_c2;
-    void                *_dummy [8];
+    void                *_filter;
+    void                *_dummy [7];
 };
 
 